@@ -0,0 +1,860 @@
+/******************************************************************************
+ * Copyright (c) 2013 SEOmoz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#ifndef AWSCPP__ASYNC_HPP
+#define AWSCPP__ASYNC_HPP
+
+/******************************************************************************
+ * Requests as C++20 coroutines, so that code making many requests at once can
+ * still be written in a straight line:
+ *
+ *     AWS::Async::Task<bool> copy(const AWS::S3::Connection& s3) {
+ *         std::string data;
+ *         if (!co_await s3.getAsync("bucket", "/from", data)) {
+ *             co_return false;
+ *         }
+ *         co_return co_await s3.putAsync("bucket", "/to", data);
+ *     }
+ *
+ *     bool copied = AWS::Async::wait(copy(s3));
+ *
+ * Tasks don't start until they're awaited, and `all` runs many of them at
+ * once. Requests are made by a Reactor, an event loop around epoll and
+ * curl_multi_socket_action on a thread of its own, which can keep thousands
+ * of transfers in flight. A coroutine that awaits a request is resumed on the
+ * reactor's thread, so what it does in the meantime shouldn't block. Retries
+ * follow the connection's retry policy, waiting out their backoff on the
+ * reactor too. Each request may be given a deadline, after which it fails,
+ * and a std::stop_token with which to cancel it.
+ *
+ * This needs Linux and C++20, and AWSCPP_ASYNC is defined where it's
+ * available.
+ *****************************************************************************/
+
+/* Internal utilities */
+#include "util.hpp"
+#include "pool.hpp"
+
+#if defined(__linux__) && defined(__cpp_impl_coroutine)
+#define AWSCPP_ASYNC 1
+
+/* Standard includes */
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <stdint.h>
+#include <stop_token>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/* For the event loop */
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+namespace AWS {
+    namespace Async {
+        typedef std::chrono::steady_clock Clock;
+
+        class Reactor;
+
+        /* How a single request should be made */
+        struct Options {
+            Options()
+                :stop()
+                ,deadline(Clock::time_point::max())
+                ,retries(5)
+                ,reactor(NULL) {}
+
+            Options(const Options& other)
+                :stop(other.stop)
+                ,deadline(other.deadline)
+                ,retries(other.retries)
+                ,reactor(other.reactor) {}
+
+            const Options& operator=(const Options& other) {
+                stop = other.stop;
+                deadline = other.deadline;
+                retries = other.retries;
+                reactor = other.reactor;
+                return *this;
+            }
+
+            /* Cancels the request, including any retries */
+            std::stop_token   stop;
+            /* When it fails, if it hasn't finished */
+            Clock::time_point deadline;
+            std::size_t       retries;
+            /* The reactor to make it on, or else the shared one */
+            Reactor*          reactor;
+        };
+
+        /* An event loop that makes requests with curl's multi socket
+         * interface, waiting on their sockets with epoll. Requests may be
+         * started and cancelled from any thread */
+        class Reactor {
+        public:
+            /* Invoked on the reactor's thread when something completes with
+             * its response code, or -1 if there was a curl error or it was
+             * cancelled. Timers complete with 0 */
+            typedef std::function<void(long)> Done;
+
+            Reactor();
+
+            /* Waits for everything outstanding to complete */
+            ~Reactor();
+
+            /* An id for something to be started, by which it may then be
+             * cancelled, even before it's started */
+            uint64_t reserve() { return ++ids; }
+
+            /* Make a request prepared on a connection, which must outlive it.
+             * If a stop has been requested, it completes right away. If it's
+             * not done by `deadline`, including any time it waits on the
+             * limiter to start, it fails */
+            void perform(uint64_t id, AWS::Curl::Connection& connection,
+                const Done& done, const std::stop_token& stop,
+                const Clock::time_point& deadline=Clock::time_point::max());
+
+            /* Complete after `seconds` */
+            void after(uint64_t id, double seconds, const Done& done,
+                const std::stop_token& stop);
+
+            /* Complete something early with -1, if it hasn't completed */
+            void cancel(uint64_t id);
+
+            /* How many things have been started but not completed */
+            std::size_t outstanding();
+
+            /* The reactor used when none is provided */
+            static Reactor& shared();
+
+            /* These are for use by curl, and are not meant to be used */
+            static int socket_(CURL* handle, curl_socket_t socket, int what,
+                void* reactor, void* socketp);
+            static int timer_(CURLM* multi, long timeout, void* reactor);
+        private:
+            /* A request or timer that is waiting or in flight */
+            struct Operation {
+                Operation(uint64_t id, AWS::Curl::Connection* connection,
+                    const Done& done, const std::stop_token& stop,
+                    const Clock::time_point& deadline)
+                    :id(id), connection(connection), done(done), stop(stop)
+                    ,deadline(deadline) {}
+
+                uint64_t               id;
+                /* NULL for timers */
+                AWS::Curl::Connection* connection;
+                Done                   done;
+                std::stop_token        stop;
+                Clock::time_point      deadline;
+            private:
+                /* Private, unimplemented to prevent use */
+                Operation(const Operation& other);
+                const Operation& operator=(const Operation& other);
+            };
+
+            typedef std::multimap<Clock::time_point, Operation*> Timers;
+
+            /* Hand something to the event loop */
+            void submit_(Operation* operation, const Clock::time_point& when);
+
+            /* The event loop itself */
+            void run_();
+
+            /* Take what's been submitted and cancelled. Only the event loop
+             * calls this, and the mutex must not be held */
+            void drain_();
+
+            /* Add a request to the multi handle, unless the connection's
+             * limiter says it has to wait */
+            void start_(Operation* operation);
+
+            /* Deal with any completed transfers */
+            void finish_();
+
+            /* Forget an operation and invoke its callback */
+            void complete_(Operation* operation, long response);
+
+            CURLM*                         multi;
+            int                            epoll;
+            int                            wakeup;
+            std::atomic<uint64_t>          ids;
+            std::mutex                     mutex;
+            std::vector<std::pair<Clock::time_point, Operation*> > incoming;
+            std::vector<uint64_t>          cancels;
+            std::size_t                    count;
+            bool                           stopping;
+            std::thread                    thread;
+            /* Only the event loop touches these */
+            std::map<uint64_t, Operation*> operations;
+            std::map<CURL*, Operation*>    active;
+            Timers                         timers;
+            /* When curl next wants to hear about a timeout, if it does */
+            std::optional<Clock::time_point> due;
+
+            /* Private, unimplemented to prevent use */
+            Reactor(const Reactor& other);
+            const Reactor& operator=(const Reactor& other);
+        };
+
+        /* What a task's promise keeps of its result */
+        template <typename T>
+        struct Result_ {
+            Result_(): value() {}
+
+            void return_value(T result) { value = std::move(result); }
+            T take() { return std::move(*value); }
+
+            std::optional<T> value;
+        };
+
+        template <>
+        struct Result_<void> {
+            void return_void() {}
+            void take() {}
+        };
+
+        /* A coroutine that produces a T. It starts when it's awaited, and
+         * resumes whoever awaited it when it finishes */
+        template <typename T>
+        class Task {
+        public:
+            struct promise_type: public Result_<T> {
+                promise_type(): Result_<T>(), error(), continuation() {}
+
+                /* Hands control back to whoever awaited the task */
+                struct Final {
+                    bool await_ready() noexcept { return false; }
+                    std::coroutine_handle<> await_suspend(
+                        std::coroutine_handle<promise_type> handle) noexcept {
+                        std::coroutine_handle<> next(
+                            handle.promise().continuation);
+                        return next ? next : std::noop_coroutine();
+                    }
+                    void await_resume() noexcept {}
+                };
+
+                Task get_return_object() {
+                    return Task(std::coroutine_handle<promise_type>::
+                        from_promise(*this));
+                }
+                std::suspend_always initial_suspend() noexcept { return {}; }
+                Final final_suspend() noexcept { return Final(); }
+                void unhandled_exception() {
+                    error = std::current_exception();
+                }
+
+                std::exception_ptr      error;
+                std::coroutine_handle<> continuation;
+            };
+
+            Task(Task&& other) noexcept: handle(other.handle) {
+                other.handle = nullptr;
+            }
+
+            ~Task() {
+                if (handle) {
+                    handle.destroy();
+                }
+            }
+
+            /* Awaiting a task runs it */
+            bool await_ready() const noexcept { return false; }
+            std::coroutine_handle<> await_suspend(
+                std::coroutine_handle<> awaiting) noexcept {
+                handle.promise().continuation = awaiting;
+                return handle;
+            }
+            T await_resume() {
+                if (handle.promise().error) {
+                    std::rethrow_exception(handle.promise().error);
+                }
+                return handle.promise().take();
+            }
+        private:
+            explicit Task(std::coroutine_handle<promise_type> handle)
+                :handle(handle) {}
+
+            std::coroutine_handle<promise_type> handle;
+
+            /* Private, unimplemented to prevent use */
+            Task(const Task& other);
+            const Task& operator=(const Task& other);
+        };
+
+        /* A coroutine that starts right away and that nobody awaits */
+        struct Detached_ {
+            struct promise_type {
+                Detached_ get_return_object() { return Detached_(); }
+                std::suspend_never initial_suspend() noexcept { return {}; }
+                std::suspend_never final_suspend() noexcept { return {}; }
+                void return_void() {}
+                void unhandled_exception() { std::terminate(); }
+            };
+        };
+
+        /* Run a task, blocking until it's done, and return its result */
+        template <typename T>
+        T wait(Task<T> task);
+
+        /* Run many tasks at once, and produce their results in order. If any
+         * of them throws, the first exception is rethrown once they're all
+         * done */
+        template <typename T>
+        Task<std::vector<T> > all(std::vector<Task<T> > tasks);
+
+        /* Await a prepared request, producing its response code, or -1 if
+         * there was a curl error, it was cancelled or its deadline passed */
+        class Perform {
+        public:
+            Perform(AWS::Curl::Connection& connection, const Options& options);
+
+            bool await_ready();
+            void await_suspend(std::coroutine_handle<> awaiting);
+            long await_resume();
+        private:
+            struct Cancel {
+                void operator()() { reactor->cancel(id); }
+                Reactor* reactor;
+                uint64_t id;
+            };
+
+            Reactor&                                   reactor;
+            AWS::Curl::Connection&                     connection;
+            Options                                    options;
+            long                                       response;
+            std::optional<std::stop_callback<Cancel> > stopping;
+        };
+
+        /* Await a number of seconds, producing 0, or -1 if cancelled or if
+         * the deadline would pass first */
+        class Sleep {
+        public:
+            Sleep(double seconds, const Options& options);
+
+            bool await_ready();
+            void await_suspend(std::coroutine_handle<> awaiting);
+            long await_resume();
+        private:
+            struct Cancel {
+                void operator()() { reactor->cancel(id); }
+                Reactor* reactor;
+                uint64_t id;
+            };
+
+            Reactor&                                   reactor;
+            double                                     seconds;
+            Options                                    options;
+            long                                       response;
+            std::optional<std::stop_callback<Cancel> > stopping;
+        };
+    }
+}
+
+/******************************************************************************
+ * Implementation of Reactor
+ *****************************************************************************/
+inline AWS::Async::Reactor::Reactor()
+    :multi(curl_multi_init())
+    ,epoll(epoll_create1(EPOLL_CLOEXEC))
+    ,wakeup(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))
+    ,ids(0)
+    ,mutex()
+    ,incoming()
+    ,cancels()
+    ,count(0)
+    ,stopping(false)
+    ,thread()
+    ,operations()
+    ,active()
+    ,timers()
+    ,due() {
+    curl_multi_setopt(multi, CURLMOPT_SOCKETFUNCTION, Reactor::socket_);
+    curl_multi_setopt(multi, CURLMOPT_SOCKETDATA, this);
+    curl_multi_setopt(multi, CURLMOPT_TIMERFUNCTION, Reactor::timer_);
+    curl_multi_setopt(multi, CURLMOPT_TIMERDATA, this);
+    /* Operations on connections that negotiated HTTP/2 share them */
+    curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = wakeup;
+    epoll_ctl(epoll, EPOLL_CTL_ADD, wakeup, &event);
+}
+
+inline AWS::Async::Reactor::~Reactor() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    uint64_t one = 1;
+    if (write(wakeup, &one, sizeof(one)) < 0) {}
+    if (thread.joinable()) {
+        thread.join();
+    }
+    curl_multi_cleanup(multi);
+    close(wakeup);
+    close(epoll);
+}
+
+inline void AWS::Async::Reactor::perform(uint64_t id,
+    AWS::Curl::Connection& connection, const Done& done,
+    const std::stop_token& stop, const Clock::time_point& deadline) {
+    submit_(new Operation(id, &connection, done, stop, deadline),
+        Clock::now());
+}
+
+inline void AWS::Async::Reactor::after(uint64_t id, double seconds,
+    const Done& done, const std::stop_token& stop) {
+    submit_(new Operation(id, NULL, done, stop, Clock::time_point::max()),
+        Clock::now() +
+        std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(seconds)));
+}
+
+inline void AWS::Async::Reactor::cancel(uint64_t id) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        cancels.push_back(id);
+    }
+    uint64_t one = 1;
+    if (write(wakeup, &one, sizeof(one)) < 0) {}
+}
+
+inline std::size_t AWS::Async::Reactor::outstanding() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return count;
+}
+
+inline AWS::Async::Reactor& AWS::Async::Reactor::shared() {
+    static Reactor reactor;
+    return reactor;
+}
+
+inline void AWS::Async::Reactor::submit_(Operation* operation,
+    const Clock::time_point& when) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        incoming.push_back(std::make_pair(when, operation));
+        ++count;
+        /* The event loop is started the first time it's needed */
+        if (!thread.joinable()) {
+            thread = std::thread(&Reactor::run_, this);
+        }
+    }
+    uint64_t one = 1;
+    if (write(wakeup, &one, sizeof(one)) < 0) {}
+}
+
+inline int AWS::Async::Reactor::socket_(CURL* handle, curl_socket_t socket,
+    int what, void* reactor, void* socketp) {
+    Reactor* self = reinterpret_cast<Reactor*>(reactor);
+    if (what == CURL_POLL_REMOVE) {
+        epoll_ctl(self->epoll, EPOLL_CTL_DEL, socket, NULL);
+        return 0;
+    }
+    struct epoll_event event;
+    event.events = ((what & CURL_POLL_IN) ? EPOLLIN : 0) |
+        ((what & CURL_POLL_OUT) ? EPOLLOUT : 0);
+    event.data.fd = socket;
+    if (epoll_ctl(self->epoll, EPOLL_CTL_MOD, socket, &event) != 0) {
+        epoll_ctl(self->epoll, EPOLL_CTL_ADD, socket, &event);
+    }
+    return 0;
+}
+
+inline int AWS::Async::Reactor::timer_(CURLM* multi, long timeout,
+    void* reactor) {
+    Reactor* self = reinterpret_cast<Reactor*>(reactor);
+    if (timeout < 0) {
+        self->due.reset();
+    } else {
+        self->due = Clock::now() + std::chrono::milliseconds(timeout);
+    }
+    return 0;
+}
+
+inline void AWS::Async::Reactor::drain_() {
+    std::vector<std::pair<Clock::time_point, Operation*> > started;
+    std::vector<uint64_t> cancelled;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        started.swap(incoming);
+        cancelled.swap(cancels);
+    }
+
+    /* Requests are only made once they're due, which is right away unless
+     * the limiter put them off */
+    for (std::size_t i = 0; i < started.size(); ++i) {
+        operations[started[i].second->id] = started[i].second;
+        timers.insert(started[i]);
+    }
+
+    for (std::size_t i = 0; i < cancelled.size(); ++i) {
+        std::map<uint64_t, Operation*>::iterator it(
+            operations.find(cancelled[i]));
+        if (it == operations.end()) {
+            continue;
+        }
+        Operation* operation = it->second;
+        AWS::Curl::Connection* connection = operation->connection;
+        if (connection && active.erase(connection->handle())) {
+            curl_multi_remove_handle(multi, connection->handle());
+        } else {
+            Timers::iterator timer(timers.begin());
+            while (timer != timers.end() && timer->second != operation) {
+                ++timer;
+            }
+            if (timer != timers.end()) {
+                timers.erase(timer);
+            }
+        }
+        if (connection) {
+            connection->complete(CURLE_ABORTED_BY_CALLBACK);
+        }
+        complete_(operation, -1);
+    }
+}
+
+inline void AWS::Async::Reactor::start_(Operation* operation) {
+    if (operation->stop.stop_requested()) {
+        if (operation->connection) {
+            operation->connection->complete(CURLE_ABORTED_BY_CALLBACK);
+        }
+        complete_(operation, -1);
+        return;
+    }
+    if (!operation->connection) {
+        complete_(operation, 0);
+        return;
+    }
+
+    /* The deadline counts from when it was submitted, so time spent waiting
+     * on the limiter counts against it, too */
+    Clock::time_point now = Clock::now();
+    if (operation->deadline <= now) {
+        operation->connection->complete(CURLE_OPERATION_TIMEDOUT);
+        complete_(operation, -1);
+        return;
+    }
+    double wait = operation->connection->admit();
+    if (wait > 0) {
+        timers.insert(std::make_pair(std::min(operation->deadline, now +
+            std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double>(wait))), operation));
+        return;
+    }
+
+    /* Curl enforces whatever's left of it once the request is under way */
+    long left = 0;
+    if (operation->deadline != Clock::time_point::max()) {
+        left = std::max(1L, static_cast<long>(std::chrono::duration_cast<
+            std::chrono::milliseconds>(operation->deadline - now).count()));
+    }
+    CURL* handle = operation->connection->handle();
+    curl_easy_setopt(handle, CURLOPT_TIMEOUT_MS, left);
+    active[handle] = operation;
+    curl_multi_add_handle(multi, handle);
+}
+
+inline void AWS::Async::Reactor::finish_() {
+    int queued = 0;
+    CURLMsg* message = NULL;
+    while ((message = curl_multi_info_read(multi, &queued)) != NULL) {
+        if (message->msg != CURLMSG_DONE) {
+            continue;
+        }
+        CURL* handle = message->easy_handle;
+        CURLcode result = message->data.result;
+        curl_multi_remove_handle(multi, handle);
+
+        std::map<CURL*, Operation*>::iterator it(active.find(handle));
+        Operation* operation = it->second;
+        active.erase(it);
+        operation->connection->complete(result);
+        complete_(operation, operation->connection->stats().response);
+    }
+}
+
+inline void AWS::Async::Reactor::complete_(Operation* operation,
+    long response) {
+    operations.erase(operation->id);
+    Done done;
+    done.swap(operation->done);
+    delete operation;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        --count;
+    }
+    done(response);
+}
+
+inline void AWS::Async::Reactor::run_() {
+    int running = 0;
+    struct epoll_event events[64];
+    while (true) {
+        drain_();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (stopping && !count) {
+                return;
+            }
+        }
+
+        /* Wait on sockets until curl or the next timer wants attention */
+        Clock::time_point now = Clock::now();
+        Clock::time_point until = now + std::chrono::seconds(1);
+        if (due) {
+            until = std::min(until, *due);
+        }
+        if (!timers.empty()) {
+            until = std::min(until, timers.begin()->first);
+        }
+        /* And until transfers the limiter paused are due to carry on */
+        std::map<CURL*, Operation*>::iterator it(active.begin());
+        for (; it != active.end(); ++it) {
+            double wait = it->second->connection->resume();
+            if (wait > 0) {
+                until = std::min(until, now +
+                    std::chrono::duration_cast<Clock::duration>(
+                        std::chrono::duration<double>(wait)));
+            }
+        }
+        int timeout = static_cast<int>(std::max(static_cast<long long>(0),
+            static_cast<long long>(std::chrono::duration_cast<
+                std::chrono::microseconds>(until - now).count() + 999) / 1000));
+        int ready = epoll_wait(epoll, events, 64, timeout);
+        for (int i = 0; i < ready; ++i) {
+            if (events[i].data.fd == wakeup) {
+                uint64_t value = 0;
+                if (read(wakeup, &value, sizeof(value)) < 0) {}
+                continue;
+            }
+            int flags = 0;
+            if (events[i].events & EPOLLIN) {
+                flags |= CURL_CSELECT_IN;
+            }
+            if (events[i].events & EPOLLOUT) {
+                flags |= CURL_CSELECT_OUT;
+            }
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                flags |= CURL_CSELECT_ERR;
+            }
+            curl_multi_socket_action(multi, events[i].data.fd, flags,
+                &running);
+        }
+
+        now = Clock::now();
+        if (due && *due <= now) {
+            due.reset();
+            curl_multi_socket_action(multi, CURL_SOCKET_TIMEOUT, 0, &running);
+        }
+        finish_();
+
+        /* Timers, and requests the limiter put off, that are due */
+        while (!timers.empty() && timers.begin()->first <= now) {
+            Operation* operation = timers.begin()->second;
+            timers.erase(timers.begin());
+            start_(operation);
+        }
+    }
+}
+
+/******************************************************************************
+ * Implementation of Perform and Sleep
+ *****************************************************************************/
+inline AWS::Async::Perform::Perform(AWS::Curl::Connection& connection,
+    const Options& options)
+    :reactor(options.reactor ? *options.reactor : Reactor::shared())
+    ,connection(connection)
+    ,options(options)
+    ,response(-1)
+    ,stopping() {}
+
+inline bool AWS::Async::Perform::await_ready() {
+    return options.stop.stop_requested() || options.deadline <= Clock::now();
+}
+
+inline void AWS::Async::Perform::await_suspend(
+    std::coroutine_handle<> awaiting) {
+    uint64_t id = reactor.reserve();
+    Cancel cancel = { &reactor, id };
+    stopping.emplace(options.stop, cancel);
+    /* This may be resumed before perform even returns */
+    reactor.perform(id, connection, [this, awaiting](long response) {
+        this->response = response;
+        awaiting.resume();
+    }, options.stop, options.deadline);
+}
+
+inline long AWS::Async::Perform::await_resume() {
+    stopping.reset();
+    return response;
+}
+
+inline AWS::Async::Sleep::Sleep(double seconds, const Options& options)
+    :reactor(options.reactor ? *options.reactor : Reactor::shared())
+    ,seconds(seconds)
+    ,options(options)
+    ,response(-1)
+    ,stopping() {}
+
+inline bool AWS::Async::Sleep::await_ready() {
+    return options.stop.stop_requested() ||
+        (options.deadline != Clock::time_point::max() &&
+            Clock::now() + std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double>(seconds)) >= options.deadline);
+}
+
+inline void AWS::Async::Sleep::await_suspend(
+    std::coroutine_handle<> awaiting) {
+    uint64_t id = reactor.reserve();
+    Cancel cancel = { &reactor, id };
+    stopping.emplace(options.stop, cancel);
+    reactor.after(id, seconds, [this, awaiting](long response) {
+        this->response = response;
+        awaiting.resume();
+    }, options.stop);
+}
+
+inline long AWS::Async::Sleep::await_resume() {
+    stopping.reset();
+    return response;
+}
+
+/******************************************************************************
+ * Implementation of wait and all
+ *****************************************************************************/
+namespace AWS {
+    namespace Async {
+        /* Run a task on its own, then say so under a lock */
+        template <typename T, typename Finish>
+        Detached_ run_(Task<T>& task, std::optional<T>& result,
+            std::exception_ptr& error, Finish finish) {
+            try {
+                result.emplace(co_await task);
+            } catch (...) {
+                error = std::current_exception();
+            }
+            finish();
+        }
+
+        template <typename Finish>
+        Detached_ run_(Task<void>& task, std::optional<bool>& result,
+            std::exception_ptr& error, Finish finish) {
+            try {
+                co_await task;
+                result.emplace(true);
+            } catch (...) {
+                error = std::current_exception();
+            }
+            finish();
+        }
+
+        /* Wait on many running tasks, resuming whoever awaits this once
+         * they're all done */
+        template <typename T>
+        struct Gather_ {
+            Gather_(std::vector<Task<T> >& tasks)
+                :tasks(tasks)
+                ,results(tasks.size())
+                ,errors(tasks.size())
+                ,remaining(tasks.size() + 1) {}
+
+            bool await_ready() const noexcept { return tasks.empty(); }
+            bool await_suspend(std::coroutine_handle<> awaiting) {
+                for (std::size_t i = 0; i < tasks.size(); ++i) {
+                    run_(tasks[i], results[i], errors[i], [this, awaiting]() {
+                        if (--remaining == 0) {
+                            awaiting.resume();
+                        }
+                    });
+                }
+                /* If they all finished already, there's nothing to wait on */
+                return --remaining > 0;
+            }
+            void await_resume() {}
+
+            std::vector<Task<T> >&          tasks;
+            std::vector<std::optional<T> >  results;
+            std::vector<std::exception_ptr> errors;
+            std::atomic<std::size_t>        remaining;
+        };
+    }
+}
+
+template <typename T>
+inline T AWS::Async::wait(Task<T> task) {
+    typedef typename std::conditional<std::is_void<T>::value, bool, T>::type
+        Value;
+    std::mutex mutex;
+    std::condition_variable finished;
+    bool done = false;
+    std::optional<Value> result;
+    std::exception_ptr error;
+    run_(task, result, error, [&]() {
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+        finished.notify_all();
+    });
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!done) {
+        finished.wait(lock);
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    if constexpr (!std::is_void<T>::value) {
+        return std::move(*result);
+    }
+}
+
+template <typename T>
+inline AWS::Async::Task<std::vector<T> > AWS::Async::all(
+    std::vector<Task<T> > tasks) {
+    Gather_<T> gather(tasks);
+    co_await gather;
+    std::vector<T> results;
+    results.reserve(tasks.size());
+    for (std::size_t i = 0; i < tasks.size(); ++i) {
+        if (gather.errors[i]) {
+            std::rethrow_exception(gather.errors[i]);
+        }
+        results.push_back(std::move(*gather.results[i]));
+    }
+    co_return results;
+}
+
+#endif
+
+#endif
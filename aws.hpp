@@ -28,4 +28,7 @@
  *****************************************************************************/
 
 #include "s3.hpp"
+#include "lister.hpp"
+#include "cache.hpp"
+#include "sync.hpp"
  
\ No newline at end of file
@@ -0,0 +1,453 @@
+/******************************************************************************
+ * Copyright (c) 2013 SEOmoz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#ifndef AWSCPP__BASE64_HPP
+#define AWSCPP__BASE64_HPP
+
+/******************************************************************************
+ * Base64 encoding and decoding, into buffers the caller provides. On x86, the
+ * bulk of the work is done 12 or 24 bytes at a time with SSSE3 or AVX2,
+ * whichever the CPU supports (checked once, at runtime). Everywhere else, and
+ * for whatever's left over at the end, there's a plain table-driven version.
+ *
+ *     char out[AWS::Base64::encoded(sizeof(digest))];
+ *     std::size_t size = AWS::Base64::encode(digest, sizeof(digest), out);
+ *
+ * Decoding is strict: padding is required, and anything that isn't part of
+ * the alphabet (including whitespace) is an error.
+ *****************************************************************************/
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #define AWSCPP_BASE64_X86
+    #include <immintrin.h>
+#endif
+
+/* Standard includes */
+#include <cstring>
+#include <string>
+
+namespace AWS {
+    namespace Base64 {
+        /* What decoding returns when its input isn't valid base64 */
+        static const std::size_t invalid = static_cast<std::size_t>(-1);
+
+        /* How much room encoding `size` bytes takes */
+        inline std::size_t encoded(std::size_t size) {
+            return 4 * ((size + 2) / 3);
+        }
+
+        /* How much room decoding `size` characters may take. The vectorized
+         * decoders need all of it, even if the input is padded */
+        inline std::size_t decoded(std::size_t size) { return 3 * (size / 4); }
+
+        /* Encode `size` bytes into `out`, returning how many characters were
+         * written. `out` must have room for encoded(size) */
+        std::size_t encode(const unsigned char* in, std::size_t size, char* out);
+
+        /* Decode `size` characters into `out`, returning how many bytes were
+         * written, or `invalid`. `out` must have room for decoded(size) */
+        std::size_t decode(const char* in, std::size_t size,
+            unsigned char* out);
+
+        /* Conveniences for strings */
+        std::string encode(const std::string& in);
+        bool decode(const std::string& in, std::string& out);
+
+        /* The implementations to choose between, which are exposed so that
+         * they may be compared with one another */
+        std::size_t encodeScalar(const unsigned char* in, std::size_t size,
+            char* out);
+        std::size_t decodeScalar(const char* in, std::size_t size,
+            unsigned char* out);
+#ifdef AWSCPP_BASE64_X86
+        std::size_t encodeSsse3(const unsigned char* in, std::size_t size,
+            char* out);
+        std::size_t decodeSsse3(const char* in, std::size_t size,
+            unsigned char* out);
+        std::size_t encodeAvx2(const unsigned char* in, std::size_t size,
+            char* out);
+        std::size_t decodeAvx2(const char* in, std::size_t size,
+            unsigned char* out);
+#endif
+
+        /* The name of the implementation this CPU uses */
+        const char* implementation();
+
+        static const char alphabet[] =
+            "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    }
+}
+
+/******************************************************************************
+ * Implementations
+ *****************************************************************************/
+inline std::size_t AWS::Base64::encodeScalar(const unsigned char* in,
+    std::size_t size, char* out) {
+    char* start = out;
+    std::size_t i = 0;
+    for (; i + 3 <= size; i += 3) {
+        unsigned int bits = (in[i] << 16) | (in[i + 1] << 8) | in[i + 2];
+        *out++ = alphabet[(bits >> 18) & 0x3f];
+        *out++ = alphabet[(bits >> 12) & 0x3f];
+        *out++ = alphabet[(bits >> 6) & 0x3f];
+        *out++ = alphabet[bits & 0x3f];
+    }
+
+    /* And the padded tail */
+    if (i < size) {
+        unsigned int bits = in[i] << 16;
+        if (i + 1 < size) {
+            bits |= in[i + 1] << 8;
+        }
+        *out++ = alphabet[(bits >> 18) & 0x3f];
+        *out++ = alphabet[(bits >> 12) & 0x3f];
+        *out++ = (i + 1 < size) ? alphabet[(bits >> 6) & 0x3f] : '=';
+        *out++ = '=';
+    }
+    return out - start;
+}
+
+inline std::size_t AWS::Base64::decodeScalar(const char* in, std::size_t size,
+    unsigned char* out) {
+    /* The value of each character, or 0xff if it's not in the alphabet */
+    struct Table {
+        Table(): values() {
+            std::memset(values, 0xff, sizeof(values));
+            for (unsigned char i = 0; i < 64; ++i) {
+                values[static_cast<unsigned char>(alphabet[i])] = i;
+            }
+        }
+        unsigned char values[256];
+    };
+    static const Table table;
+
+    if (size % 4) {
+        return invalid;
+    }
+
+    unsigned char* start = out;
+    for (std::size_t i = 0; i < size; i += 4) {
+        const unsigned char* quad = reinterpret_cast<const unsigned char*>(
+            in + i);
+        /* Padding may only come at the very end */
+        std::size_t padding = 0;
+        if (i + 4 == size) {
+            padding = (quad[3] == '=') + (quad[3] == '=' && quad[2] == '=');
+        }
+
+        unsigned char a = table.values[quad[0]];
+        unsigned char b = table.values[quad[1]];
+        unsigned char c = (padding > 1) ? 0 : table.values[quad[2]];
+        unsigned char d = (padding > 0) ? 0 : table.values[quad[3]];
+        if ((a | b | c | d) & 0xc0) {
+            return invalid;
+        }
+
+        unsigned int bits = (a << 18) | (b << 12) | (c << 6) | d;
+        *out++ = (bits >> 16) & 0xff;
+        if (padding < 2) {
+            *out++ = (bits >> 8) & 0xff;
+        }
+        if (padding < 1) {
+            *out++ = bits & 0xff;
+        }
+    }
+    return out - start;
+}
+
+#ifdef AWSCPP_BASE64_X86
+/* These follow Wojciech Muła's and Daniel Lemire's vectorized base64, which
+ * turn each 3 bytes into 4 6-bit indices with shuffles and multiplies, and
+ * then turn the indices into characters by adding an offset looked up by
+ * range. Decoding does the reverse, validating as it goes */
+namespace AWS {
+    namespace Base64 {
+        __attribute__((target("ssse3")))
+        inline __m128i encodeBlock_(__m128i in);
+
+        /* Returns false if there's anything that's not in the alphabet */
+        __attribute__((target("ssse3")))
+        inline bool decodeBlock_(__m128i in, __m128i& out);
+    }
+}
+
+__attribute__((target("ssse3")))
+inline __m128i AWS::Base64::encodeBlock_(__m128i in) {
+    in = _mm_shuffle_epi8(in, _mm_set_epi8(
+        10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+    __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+    __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+    __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    __m128i indices = _mm_or_si128(t1, t3);
+
+    __m128i result = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+    __m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+    result = _mm_or_si128(result, _mm_and_si128(less, _mm_set1_epi8(13)));
+    const __m128i shift = _mm_setr_epi8(
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+        '/' - 63, 'A', 0, 0);
+    result = _mm_shuffle_epi8(shift, result);
+    return _mm_add_epi8(result, indices);
+}
+
+__attribute__((target("ssse3")))
+inline bool AWS::Base64::decodeBlock_(__m128i in, __m128i& out) {
+    const __m128i lo_lookup = _mm_setr_epi8(
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+    const __m128i hi_lookup = _mm_setr_epi8(
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m128i roll_lookup = _mm_setr_epi8(
+        0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i mask = _mm_set1_epi8(0x2f);
+
+    __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(in, 4), mask);
+    __m128i lo_nibbles = _mm_and_si128(in, mask);
+    __m128i hi = _mm_shuffle_epi8(hi_lookup, hi_nibbles);
+    __m128i lo = _mm_shuffle_epi8(lo_lookup, lo_nibbles);
+    if (_mm_movemask_epi8(_mm_cmpgt_epi8(
+        _mm_and_si128(lo, hi), _mm_setzero_si128()))) {
+        return false;
+    }
+
+    __m128i slashes = _mm_cmpeq_epi8(in, mask);
+    __m128i roll = _mm_shuffle_epi8(roll_lookup,
+        _mm_add_epi8(slashes, hi_nibbles));
+    in = _mm_add_epi8(in, roll);
+
+    /* Pack each 4 6-bit values into 3 bytes */
+    __m128i merged = _mm_maddubs_epi16(in, _mm_set1_epi32(0x01400140));
+    merged = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+    out = _mm_shuffle_epi8(merged, _mm_setr_epi8(
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+    return true;
+}
+
+__attribute__((target("ssse3")))
+inline std::size_t AWS::Base64::encodeSsse3(const unsigned char* in,
+    std::size_t size, char* out) {
+    /* Each step reads 16 bytes, but only uses 12 of them */
+    std::size_t i = 0;
+    char* start = out;
+    for (; i + 16 <= size; i += 12, out += 16) {
+        __m128i block = _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(in + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out),
+            encodeBlock_(block));
+    }
+    return (out - start) + encodeScalar(in + i, size - i, out);
+}
+
+__attribute__((target("ssse3")))
+inline std::size_t AWS::Base64::decodeSsse3(const char* in, std::size_t size,
+    unsigned char* out) {
+    /* Each step writes 16 bytes, but only 12 of them are meaningful, so
+     * there must be more to come for there to be room */
+    std::size_t i = 0;
+    unsigned char* start = out;
+    for (; i + 24 <= size; i += 16, out += 12) {
+        __m128i block = _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(in + i));
+        __m128i result;
+        if (!decodeBlock_(block, result)) {
+            break;
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out), result);
+    }
+
+    std::size_t rest = decodeScalar(in + i, size - i, out);
+    return (rest == invalid) ? invalid : (out - start) + rest;
+}
+
+__attribute__((target("avx2")))
+inline std::size_t AWS::Base64::encodeAvx2(const unsigned char* in,
+    std::size_t size, char* out) {
+    /* The same as with SSSE3, but with 12 bytes in each half */
+    const __m256i shuffle = _mm256_setr_epi8(
+        1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+        1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+    const __m256i shift = _mm256_setr_epi8(
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+        '/' - 63, 'A', 0, 0,
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+        '/' - 63, 'A', 0, 0);
+
+    std::size_t i = 0;
+    char* start = out;
+    for (; i + 28 <= size; i += 24, out += 32) {
+        __m256i block = _mm256_inserti128_si256(_mm256_castsi128_si256(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i))),
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + 12)), 1);
+        block = _mm256_shuffle_epi8(block, shuffle);
+        __m256i t0 = _mm256_and_si256(block, _mm256_set1_epi32(0x0fc0fc00));
+        __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+        __m256i t2 = _mm256_and_si256(block, _mm256_set1_epi32(0x003f03f0));
+        __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+        __m256i indices = _mm256_or_si256(t1, t3);
+
+        __m256i result = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+        __m256i less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+        result = _mm256_or_si256(result,
+            _mm256_and_si256(less, _mm256_set1_epi8(13)));
+        result = _mm256_add_epi8(_mm256_shuffle_epi8(shift, result), indices);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), result);
+    }
+    return (out - start) + encodeSsse3(in + i, size - i, out);
+}
+
+__attribute__((target("avx2")))
+inline std::size_t AWS::Base64::decodeAvx2(const char* in, std::size_t size,
+    unsigned char* out) {
+    const __m256i lo_lookup = _mm256_setr_epi8(
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+    const __m256i hi_lookup = _mm256_setr_epi8(
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i roll_lookup = _mm256_setr_epi8(
+        0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i pack = _mm256_setr_epi8(
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    const __m256i mask = _mm256_set1_epi8(0x2f);
+
+    /* Each step writes 32 bytes, of which 24 are meaningful */
+    std::size_t i = 0;
+    unsigned char* start = out;
+    for (; i + 45 <= size; i += 32, out += 24) {
+        __m256i block = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i*>(in + i));
+        __m256i hi_nibbles = _mm256_and_si256(
+            _mm256_srli_epi32(block, 4), mask);
+        __m256i lo_nibbles = _mm256_and_si256(block, mask);
+        __m256i hi = _mm256_shuffle_epi8(hi_lookup, hi_nibbles);
+        __m256i lo = _mm256_shuffle_epi8(lo_lookup, lo_nibbles);
+        if (!_mm256_testz_si256(lo, hi)) {
+            break;
+        }
+
+        __m256i slashes = _mm256_cmpeq_epi8(block, mask);
+        __m256i roll = _mm256_shuffle_epi8(roll_lookup,
+            _mm256_add_epi8(slashes, hi_nibbles));
+        block = _mm256_add_epi8(block, roll);
+
+        __m256i merged = _mm256_maddubs_epi16(block,
+            _mm256_set1_epi32(0x01400140));
+        merged = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+        merged = _mm256_shuffle_epi8(merged, pack);
+        merged = _mm256_permutevar8x32_epi32(merged,
+            _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), merged);
+    }
+
+    std::size_t rest = decodeSsse3(in + i, size - i, out);
+    return (rest == invalid) ? invalid : (out - start) + rest;
+}
+#endif
+
+namespace AWS {
+    namespace Base64 {
+        typedef std::size_t (*Encoder)(const unsigned char*, std::size_t,
+            char*);
+        typedef std::size_t (*Decoder)(const char*, std::size_t,
+            unsigned char*);
+
+        /* The best of the implementations this CPU supports */
+        struct Dispatch {
+            Dispatch(): encoder(encodeScalar), decoder(decodeScalar),
+                name("scalar") {
+#ifdef AWSCPP_BASE64_X86
+                __builtin_cpu_init();
+                if (__builtin_cpu_supports("avx2")) {
+                    encoder = encodeAvx2;
+                    decoder = decodeAvx2;
+                    name = "avx2";
+                } else if (__builtin_cpu_supports("ssse3")) {
+                    encoder = encodeSsse3;
+                    decoder = decodeSsse3;
+                    name = "ssse3";
+                }
+#endif
+            }
+
+            static const Dispatch& get() {
+                static const Dispatch dispatch;
+                return dispatch;
+            }
+
+            Encoder     encoder;
+            Decoder     decoder;
+            const char* name;
+        };
+    }
+}
+
+inline std::size_t AWS::Base64::encode(const unsigned char* in,
+    std::size_t size, char* out) {
+    return Dispatch::get().encoder(in, size, out);
+}
+
+inline std::size_t AWS::Base64::decode(const char* in, std::size_t size,
+    unsigned char* out) {
+    return Dispatch::get().decoder(in, size, out);
+}
+
+inline std::string AWS::Base64::encode(const std::string& in) {
+    std::string result(encoded(in.size()), '\0');
+    if (!in.empty()) {
+        encode(reinterpret_cast<const unsigned char*>(in.data()), in.size(),
+            &result[0]);
+    }
+    return result;
+}
+
+inline bool AWS::Base64::decode(const std::string& in, std::string& out) {
+    out.resize(decoded(in.size()));
+    if (in.empty()) {
+        return true;
+    }
+    std::size_t size = decode(in.data(), in.size(),
+        reinterpret_cast<unsigned char*>(&out[0]));
+    if (size == invalid) {
+        out.clear();
+        return false;
+    }
+    out.resize(size);
+    return true;
+}
+
+inline const char* AWS::Base64::implementation() {
+    return Dispatch::get().name;
+}
+
+#endif
@@ -0,0 +1,614 @@
+/******************************************************************************
+ * Copyright (c) 2013 SEOmoz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#ifndef AWSCPP__CACHE_HPP
+#define AWSCPP__CACHE_HPP
+
+/******************************************************************************
+ * Caching objects on local disk, for objects that are read over and over by
+ * many processes on a host. Each object is kept in a file of its own, named
+ * for its bucket and key, and written to a temporary file first and renamed
+ * into place, so that other processes sharing the directory only ever see a
+ * whole object or none at all. What S3 said about the object (its ETag and
+ * last modified time) follows the contents in the same file.
+ *
+ * Objects are handed out mapped into memory, and stay readable for as long as
+ * they're held, even if they're replaced or evicted in the meantime:
+ *
+ *     AWS::Cache::Disk cache(s3, "/var/cache/objects", 1 << 30);
+ *     std::shared_ptr<const AWS::Cache::Mapped> object(
+ *         cache.get("bucket", "/reference/data"));
+ *     if (object) {
+ *         use(object->data(), object->size());
+ *     }
+ *
+ * A cached object is checked with S3 before it's used, with If-None-Match and
+ * If-Modified-Since, unless it was last checked within `ttl` seconds. Once
+ * the cache holds more than `capacity` bytes, the objects that were used
+ * longest ago are evicted. Files record when they were last used in their
+ * access time (set explicitly, so it doesn't matter how the disk is mounted),
+ * and when they were last checked in their modification time.
+ *
+ * Objects that many threads in one process want at once, like configuration,
+ * can instead be kept in memory. A Memory cache is split into shards, each
+ * with its own lock, and when several threads miss on the same object at the
+ * same time, only one of them fetches it and the rest wait for its result:
+ *
+ *     AWS::Cache::Memory cache(s3, 256 * 1024 * 1024, 60);
+ *     std::shared_ptr<const std::string> config(
+ *         cache.get("bucket", "/config.json"));
+ *****************************************************************************/
+
+#include "s3.hpp"
+
+#include <apathy/path.hpp>
+
+/* Standard includes */
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <exception>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/* For files */
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace AWS {
+    namespace Cache {
+        typedef apathy::Path Path;
+
+        /* An object in the disk cache, mapped into memory */
+        class Mapped {
+        public:
+            /* Map a file written by the cache */
+            explicit Mapped(const Path& path);
+
+            /* Whether the file was mapped, and was written by the cache */
+            bool good() const { return valid; }
+
+            /* The contents of the object */
+            const char* data() const { return mapping.data(); }
+            std::size_t size() const { return entry.size; }
+            AWS::Curl::Span span() const { return mapping.span(0, entry.size); }
+
+            /* Where it came from, and what S3 said about it */
+            std::string     bucket;
+            AWS::S3::Entry  entry;
+        private:
+            AWS::Curl::Mapping mapping;
+            bool               valid;
+
+            /* Read `size` bytes of the footer followed by a newline, or with
+             * no size, a whole line. Returns false if it runs out */
+            bool read_(std::size_t& position, std::size_t end,
+                std::string& out, std::size_t size=std::string::npos) const;
+
+            /* Private, unimplemented to prevent use */
+            Mapped(const Mapped& other);
+            const Mapped& operator=(const Mapped& other);
+        };
+
+        class Disk {
+        public:
+            /* Cache objects fetched through `connection` in `directory`,
+             * which is made if need be, and which the cache should have to
+             * itself. Objects are checked with S3 if they haven't been for
+             * `ttl` seconds */
+            Disk(const AWS::S3::Connection& connection, const Path& directory,
+                std::size_t capacity=1024 * 1024 * 1024, double ttl=0);
+
+            /* Get an object, from the cache if it's there and current, and
+             * otherwise from S3. Returns NULL if it couldn't be fetched */
+            std::shared_ptr<const Mapped> get(const std::string& bucket,
+                const Path& object, std::size_t retries=5);
+
+            /* Remove an object from the cache */
+            void erase(const std::string& bucket, const Path& object);
+
+            /* Remove every object from the cache */
+            void clear();
+
+            /* Evict the objects that were used longest ago, until the cache
+             * fits in its capacity, and clean up anything left behind by
+             * processes that died partway through writing an object. This
+             * happens whenever an object is added. Returns the bytes used */
+            std::size_t trim();
+
+            /* Gets served without a request, after a request saying the
+             * object hadn't changed, and by downloading the object */
+            std::atomic<std::size_t> hits;
+            std::atomic<std::size_t> revalidated;
+            std::atomic<std::size_t> misses;
+        private:
+            AWS::S3::Connection connection;
+            Path                directory;
+            std::size_t         capacity;
+            double              ttl;
+
+            /* Private, unimplemented to prevent use */
+            Disk(const Disk& other);
+            const Disk& operator=(const Disk& other);
+
+            /* Where an object is kept */
+            std::string path_(const std::string& bucket,
+                const std::string& key) const;
+
+            /* Mark a file as used just now, and maybe as checked, too */
+            static void touch_(const std::string& path, bool checked);
+
+            /* The key of an object, without its leading '/' */
+            static std::string key_(const Path& object);
+
+            /* Marks a file as one of ours, along with its format */
+            static const char* magic() { return "awscpp-cache 2"; }
+
+            friend class Mapped;
+            friend class Memory;
+        };
+
+        class Memory {
+        public:
+            /* The contents of an object, shared by everyone who asked */
+            typedef std::shared_ptr<const std::string> Value;
+
+            /* Cache up to `capacity` bytes of objects fetched through
+             * `connection`, each for up to `ttl` seconds (or until evicted,
+             * if zero), in `shards` separately-locked pieces */
+            Memory(const AWS::S3::Connection& connection,
+                std::size_t capacity=256 * 1024 * 1024, double ttl=0,
+                std::size_t shards=16);
+
+            /* Get an object, from the cache if it's there, and otherwise from
+             * S3, waiting on any other thread already fetching it. Returns
+             * NULL if it couldn't be fetched */
+            Value get(const std::string& bucket, const Path& object,
+                std::size_t retries=5);
+
+            /* Remove an object from the cache. Anyone fetching it at the time
+             * still gets it */
+            void erase(const std::string& bucket, const Path& object);
+
+            /* Remove every object from the cache */
+            void clear();
+
+            /* The bytes of objects held */
+            std::size_t size() const;
+
+            /* Gets served from the cache, by waiting on another thread's
+             * fetch, and by fetching the object */
+            std::atomic<std::size_t> hits;
+            std::atomic<std::size_t> coalesced;
+            std::atomic<std::size_t> misses;
+        private:
+            typedef AWS::S3::Retry::Clock Clock;
+
+            /* An object held, in order of use */
+            struct Item {
+                std::string       key;
+                Value             value;
+                Clock::time_point fetched;
+            };
+            typedef std::list<Item> Items;
+
+            struct Shard {
+                Shard(): mutex(), items(), index(), pending(), bytes(0) {}
+
+                std::mutex                                             mutex;
+                /* Most recently used first */
+                Items                                                  items;
+                std::unordered_map<std::string, Items::iterator>       index;
+                /* Objects being fetched, by whoever missed first */
+                std::unordered_map<std::string, std::shared_future<Value> >
+                                                                       pending;
+                std::size_t                                            bytes;
+            };
+
+            AWS::S3::Connection                  connection;
+            std::size_t                          capacity;
+            double                               ttl;
+            std::vector<std::unique_ptr<Shard> > shards;
+
+            /* Private, unimplemented to prevent use */
+            Memory(const Memory& other);
+            const Memory& operator=(const Memory& other);
+
+            /* The shard an object belongs in */
+            Shard& shard_(const std::string& key);
+
+            /* Drop an item from a shard, with its lock held */
+            static void erase_(Shard& shard, Items::iterator it);
+        };
+    }
+}
+
+/******************************************************************************
+ * Implementation of Mapped
+ *****************************************************************************/
+inline AWS::Cache::Mapped::Mapped(const Path& path)
+    :bucket()
+    ,entry()
+    ,mapping(path)
+    ,valid(false) {
+    /* The contents are followed by lines about the object, and then the
+     * length of those lines as 15 digits and a newline. Keys may have
+     * newlines of their own, so the key is preceded by its length */
+    static const std::size_t footer = 16;
+    std::size_t size = mapping.size();
+    std::size_t length = 0;
+    if (!mapping.good() || size < footer ||
+        mapping.data()[size - 1] != '\n' ||
+        !AWS::Curl::Headers::number(mapping.data() + size - footer,
+            footer - 1, length) || length + footer > size) {
+        return;
+    }
+
+    std::size_t start = size - footer - length;
+    std::size_t end = size - footer;
+    std::size_t position = start;
+    std::string magic;
+    std::string count;
+    std::size_t key_size = 0;
+    if (!read_(position, end, magic) || magic != Disk::magic() ||
+        !read_(position, end, bucket) || !read_(position, end, count) ||
+        !AWS::Curl::Headers::number(count.data(), count.size(), key_size) ||
+        !read_(position, end, entry.key, key_size) ||
+        !read_(position, end, entry.etag) ||
+        !read_(position, end, entry.modified) || position != end) {
+        return;
+    }
+    entry.size = start;
+    valid = true;
+}
+
+inline bool AWS::Cache::Mapped::read_(std::size_t& position, std::size_t end,
+    std::string& out, std::size_t size) const {
+    const char* data = mapping.data();
+    if (size == std::string::npos) {
+        const char* found = static_cast<const char*>(
+            std::memchr(data + position, '\n', end - position));
+        if (!found) {
+            return false;
+        }
+        size = found - (data + position);
+    } else if (size >= end - position || data[position + size] != '\n') {
+        return false;
+    }
+    out.assign(data + position, size);
+    position += size + 1;
+    return true;
+}
+
+/******************************************************************************
+ * Implementation of Disk
+ *****************************************************************************/
+inline AWS::Cache::Disk::Disk(const AWS::S3::Connection& connection,
+    const Path& directory, std::size_t capacity, double ttl)
+    :hits(0)
+    ,revalidated(0)
+    ,misses(0)
+    ,connection(connection)
+    ,directory(directory)
+    ,capacity(capacity)
+    ,ttl(ttl) {
+    Path::makedirs(directory);
+}
+
+inline std::shared_ptr<const AWS::Cache::Mapped> AWS::Cache::Disk::get(
+    const std::string& bucket, const Path& object, std::size_t retries) {
+    std::string key(key_(object));
+    std::string path(path_(bucket, key));
+    std::shared_ptr<const Mapped> cached(new Mapped(path));
+    if (!cached->good() || cached->bucket != bucket ||
+        cached->entry.key != key) {
+        cached.reset();
+    }
+
+    /* Within its TTL, an object is used without asking */
+    struct stat info;
+    if (cached && ttl > 0 && stat(path.c_str(), &info) == 0 &&
+        std::difftime(std::time(NULL), info.st_mtime) < ttl) {
+        touch_(path, false);
+        ++hits;
+        return cached;
+    }
+
+    /* Whatever's downloaded goes in a file alongside, until it's whole.
+     * Like any other file, it's readable by others unless the umask says
+     * otherwise, so that a directory can be shared */
+    std::string name;
+    int fd = AWS::Curl::temporary(directory.string() + "/.tmp", name);
+    if (fd < 0) {
+        std::cerr << "Failed to make a file in " << directory.string()
+                  << std::endl;
+        return std::shared_ptr<const Mapped>();
+    }
+    AWS::S3::Entry entry(cached ? cached->entry : AWS::S3::Entry());
+    AWS::Curl::Positional sink(fd, 0);
+    long response = connection.getIfChanged(bucket, object, sink, entry,
+        retries);
+    if (response == 304 && cached) {
+        close(fd);
+        unlink(name.c_str());
+        touch_(path, true);
+        ++revalidated;
+        return cached;
+    }
+
+    /* What we know about the object follows it */
+    bool written = false;
+    if (response == 200) {
+        std::string lines(std::string(magic()) + "\n" + bucket + "\n" +
+            std::to_string(key.size()) + "\n" + key + "\n" + entry.etag +
+            "\n" + entry.modified + "\n");
+        char footer[32];
+        std::snprintf(footer, sizeof(footer), "%015zu\n", lines.size());
+        lines += footer;
+        written = ftruncate(fd, sink.offset) == 0 &&
+            pwrite(fd, lines.data(), lines.size(), sink.offset) ==
+                static_cast<ssize_t>(lines.size());
+    }
+    close(fd);
+
+    /* It's mapped before it's moved into place, so that it's the one we
+     * get, no matter what other processes are doing */
+    std::shared_ptr<const Mapped> fetched(new Mapped(name));
+    if (!written || !fetched->good() || rename(name.c_str(), path.c_str())) {
+        unlink(name.c_str());
+        return std::shared_ptr<const Mapped>();
+    }
+    ++misses;
+    trim();
+    return fetched;
+}
+
+inline void AWS::Cache::Disk::erase(const std::string& bucket,
+    const Path& object) {
+    unlink(path_(bucket, key_(object)).c_str());
+}
+
+inline void AWS::Cache::Disk::clear() {
+    DIR* dir = opendir(directory.string().c_str());
+    if (!dir) {
+        return;
+    }
+    for (struct dirent* it = readdir(dir); it; it = readdir(dir)) {
+        std::string path(directory.string() + "/" + it->d_name);
+        struct stat info;
+        if (lstat(path.c_str(), &info) == 0 && S_ISREG(info.st_mode)) {
+            unlink(path.c_str());
+        }
+    }
+    closedir(dir);
+}
+
+inline std::size_t AWS::Cache::Disk::trim() {
+    DIR* dir = opendir(directory.string().c_str());
+    if (!dir) {
+        return 0;
+    }
+
+    /* Files by when they were last used */
+    typedef std::pair<std::pair<std::time_t, long>, std::string> Used;
+    std::vector<Used> files;
+    std::vector<std::size_t> sizes;
+    std::size_t total = 0;
+    std::time_t now = std::time(NULL);
+    for (struct dirent* it = readdir(dir); it; it = readdir(dir)) {
+        std::string name(it->d_name);
+        std::string path(directory.string() + "/" + name);
+        struct stat info;
+        if (lstat(path.c_str(), &info) != 0 || !S_ISREG(info.st_mode)) {
+            continue;
+        }
+        if (name.compare(0, 4, ".tmp") == 0) {
+            /* Nobody takes an hour to write a file and lives */
+            if (std::difftime(now, info.st_mtime) > 3600) {
+                unlink(path.c_str());
+            }
+            continue;
+        }
+        files.push_back(Used(std::make_pair(info.st_atim.tv_sec,
+            info.st_atim.tv_nsec), path));
+        total += info.st_size;
+    }
+    closedir(dir);
+    if (total <= capacity) {
+        return total;
+    }
+
+    std::sort(files.begin(), files.end());
+    std::vector<Used>::const_iterator it(files.begin());
+    for (; it != files.end() && total > capacity; ++it) {
+        struct stat info;
+        if (lstat(it->second.c_str(), &info) == 0 &&
+            unlink(it->second.c_str()) == 0) {
+            total -= std::min(total, static_cast<std::size_t>(info.st_size));
+        }
+    }
+    return total;
+}
+
+inline std::string AWS::Cache::Disk::path_(const std::string& bucket,
+    const std::string& key) const {
+    AWS::Checksum::Md5 md5;
+    md5.update(bucket.data(), bucket.size());
+    md5.update("", 1);
+    md5.update(key.data(), key.size());
+    return directory.string() + "/" + md5.hex();
+}
+
+inline void AWS::Cache::Disk::touch_(const std::string& path, bool checked) {
+    struct timespec times[2];
+    times[0].tv_sec = times[1].tv_sec = 0;
+    times[0].tv_nsec = UTIME_NOW;
+    times[1].tv_nsec = checked ? UTIME_NOW : UTIME_OMIT;
+    utimensat(AT_FDCWD, path.c_str(), times, 0);
+}
+
+inline std::string AWS::Cache::Disk::key_(const Path& object) {
+    const std::string& key(object.string());
+    return key.substr(std::min(key.find_first_not_of('/'), key.size()));
+}
+
+/******************************************************************************
+ * Implementation of Memory
+ *****************************************************************************/
+inline AWS::Cache::Memory::Memory(const AWS::S3::Connection& connection,
+    std::size_t capacity, double ttl, std::size_t shards)
+    :hits(0)
+    ,coalesced(0)
+    ,misses(0)
+    ,connection(connection)
+    ,capacity(capacity)
+    ,ttl(ttl)
+    ,shards() {
+    for (std::size_t i = 0; i < std::max(shards, std::size_t(1)); ++i) {
+        this->shards.push_back(std::unique_ptr<Shard>(new Shard()));
+    }
+}
+
+inline AWS::Cache::Memory::Value AWS::Cache::Memory::get(
+    const std::string& bucket, const Path& object, std::size_t retries) {
+    std::string key(bucket + '\0' + Disk::key_(object));
+    Shard& shard(shard_(key));
+    std::promise<Value> promise;
+    {
+        std::unique_lock<std::mutex> lock(shard.mutex);
+        std::unordered_map<std::string, Items::iterator>::iterator found(
+            shard.index.find(key));
+        if (found != shard.index.end()) {
+            Items::iterator it(found->second);
+            if (ttl <= 0 || std::chrono::duration<double>(
+                Clock::now() - it->fetched).count() < ttl) {
+                shard.items.splice(shard.items.begin(), shard.items, it);
+                ++hits;
+                return it->value;
+            }
+            erase_(shard, it);
+        }
+
+        /* Someone else is already fetching it */
+        std::unordered_map<std::string, std::shared_future<Value> >::iterator
+            pending(shard.pending.find(key));
+        if (pending != shard.pending.end()) {
+            std::shared_future<Value> future(pending->second);
+            lock.unlock();
+            ++coalesced;
+            return future.get();
+        }
+        shard.pending[key] = promise.get_future().share();
+    }
+
+    /* Fetched without the lock, so that other objects in the shard can be
+     * had in the meantime. If it throws, whoever's waiting gets the same
+     * error, and the next to ask tries again */
+    ++misses;
+    std::string data;
+    Value value;
+    try {
+        if (connection.get(bucket, object, data, retries)) {
+            value = std::make_shared<const std::string>(std::move(data));
+        }
+    } catch (...) {
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.pending.erase(key);
+        }
+        promise.set_exception(std::current_exception());
+        throw;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.pending.erase(key);
+        /* Anything bigger than a shard is handed out, but not kept */
+        std::size_t limit = capacity / shards.size();
+        if (value && value->size() <= limit) {
+            Item item = { key, value, Clock::now() };
+            shard.items.push_front(item);
+            shard.index[key] = shard.items.begin();
+            shard.bytes += value->size();
+            while (shard.bytes > limit) {
+                erase_(shard, --shard.items.end());
+            }
+        }
+    }
+    promise.set_value(value);
+    return value;
+}
+
+inline void AWS::Cache::Memory::erase(const std::string& bucket,
+    const Path& object) {
+    std::string key(bucket + '\0' + Disk::key_(object));
+    Shard& shard(shard_(key));
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    std::unordered_map<std::string, Items::iterator>::iterator found(
+        shard.index.find(key));
+    if (found != shard.index.end()) {
+        erase_(shard, found->second);
+    }
+}
+
+inline void AWS::Cache::Memory::clear() {
+    for (std::size_t i = 0; i < shards.size(); ++i) {
+        std::lock_guard<std::mutex> lock(shards[i]->mutex);
+        shards[i]->items.clear();
+        shards[i]->index.clear();
+        shards[i]->bytes = 0;
+    }
+}
+
+inline std::size_t AWS::Cache::Memory::size() const {
+    std::size_t total = 0;
+    for (std::size_t i = 0; i < shards.size(); ++i) {
+        std::lock_guard<std::mutex> lock(shards[i]->mutex);
+        total += shards[i]->bytes;
+    }
+    return total;
+}
+
+inline AWS::Cache::Memory::Shard& AWS::Cache::Memory::shard_(
+    const std::string& key) {
+    return *shards[std::hash<std::string>()(key) % shards.size()];
+}
+
+inline void AWS::Cache::Memory::erase_(Shard& shard, Items::iterator it) {
+    shard.bytes -= it->value->size();
+    shard.index.erase(it->key);
+    shard.items.erase(it);
+}
+
+#endif
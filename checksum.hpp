@@ -0,0 +1,560 @@
+/******************************************************************************
+ * Copyright (c) 2013 SEOmoz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#ifndef AWSCPP__CHECKSUM_HPP
+#define AWSCPP__CHECKSUM_HPP
+
+/******************************************************************************
+ * Checksums to make sure that what arrived is what was sent. They're computed
+ * as data passes through curl's callbacks, by wrapping a sink or a source:
+ *
+ *     AWS::Checksum::Crc32c crc;
+ *     AWS::Checksum::Hashed<std::string, AWS::Checksum::Crc32c> hashed(
+ *         contents, crc);
+ *
+ * CRC32C uses the SSE4.2 crc32 instruction when it's available, running three
+ * streams at once and stitching them together with PCLMUL, so that it costs
+ * next to nothing per byte. Otherwise, it's computed eight bytes at a time
+ * with tables.
+ *****************************************************************************/
+
+#include "sink.hpp"
+#include "source.hpp"
+#include "base64.hpp"
+#include "headers.hpp"
+
+#if defined(__APPLE__) && defined(__MACH__)
+    #include <CommonCrypto/CommonDigest.h>
+#else
+    #include <openssl/evp.h>
+#endif
+
+#if defined(__GNUC__) && defined(__x86_64__)
+    #define AWSCPP_CRC32C_X86
+    #include <immintrin.h>
+#endif
+
+/* Standard includes */
+#include <algorithm>
+#include <cstring>
+#include <stdint.h>
+#include <string>
+
+namespace AWS {
+    namespace Checksum {
+        /* Which checksum, if any, to compute */
+        enum Algorithm {
+            None,
+            MD5,
+            CRC32C
+        };
+
+        /* CRC32C (Castagnoli), as S3's x-amz-checksum-crc32c */
+        class Crc32c {
+        public:
+            Crc32c(): crc(0) {}
+
+            void update(const char* data, std::size_t size) {
+                crc = extend(crc, data, size);
+            }
+
+            void reset() { crc = 0; }
+
+            uint32_t value() const { return crc; }
+
+            /* The base64 of the big-endian checksum, as S3 sends it */
+            std::string base64() const;
+
+            /* Extend a CRC with more data, with the best implementation this
+             * CPU supports */
+            static uint32_t extend(uint32_t crc, const char* data,
+                std::size_t size);
+
+            /* The implementations to choose between */
+            static uint32_t extendTable(uint32_t crc, const char* data,
+                std::size_t size);
+#ifdef AWSCPP_CRC32C_X86
+            static uint32_t extendSse42(uint32_t crc, const char* data,
+                std::size_t size);
+            static uint32_t extendPclmul(uint32_t crc, const char* data,
+                std::size_t size);
+#endif
+
+            /* The name of the implementation this CPU uses */
+            static const char* implementation();
+
+            /* Multiply polynomials modulo the CRC32C polynomial, in its
+             * reflected form, and raise x to a power */
+            static uint32_t multiply(uint32_t a, uint32_t b);
+            static uint32_t power(uint64_t exponent);
+        private:
+            uint32_t crc;
+        };
+
+        /* MD5, as S3's Content-MD5 and the ETag of most objects */
+        class Md5 {
+        public:
+            static const std::size_t length = 16;
+
+            Md5();
+            ~Md5();
+
+            void update(const char* data, std::size_t size);
+            void reset();
+
+            /* The digest of everything so far, which may be updated after */
+            void digest(unsigned char out[length]) const;
+
+            /* The digest as Content-MD5 (base64) or as an ETag (hex) */
+            std::string base64() const;
+            std::string hex() const;
+        private:
+#if defined(__APPLE__) && defined(__MACH__)
+            CC_MD5_CTX context;
+#else
+            EVP_MD_CTX* context;
+#endif
+
+            /* Private, unimplemented to prevent use */
+            Md5(const Md5& other);
+            const Md5& operator=(const Md5& other);
+        };
+
+        /* Whichever checksum was chosen at runtime */
+        class Digest {
+        public:
+            explicit Digest(Algorithm algorithm=None)
+                :algorithm(algorithm), md5(), crc32c() {}
+
+            void update(const char* data, std::size_t size);
+            void reset() { md5.reset(); crc32c.reset(); }
+
+            /* Whether the data matches what the response said it should be,
+             * given its ETag and x-amz-checksum-crc32c. The checksum is
+             * preferred when there is one, since the CRC32C is kept either
+             * way. If there's nothing to compare against, it's taken to
+             * match. Multipart ETags aren't the MD5 of the object, and so
+             * they're ignored, as is any ETag that isn't `plain` */
+            bool matches(const std::string& etag, const std::string& crc,
+                bool plain=true) const;
+
+            /* Whether a response's ETag may be the MD5 of its body, which it
+             * never is for objects encrypted with SSE-KMS or SSE-C */
+            static bool plainEtag(const AWS::Curl::Headers& headers);
+
+            Algorithm algorithm;
+            Md5       md5;
+            Crc32c    crc32c;
+        };
+
+        /* Wraps a sink or source, hashing everything that goes through it.
+         * Rewinding it resets the hash */
+        template <typename T, typename H>
+        struct Hashed {
+            Hashed(T& inner, H& hash): inner(inner), hash(hash) {}
+
+            T& inner;
+            H& hash;
+        private:
+            /* Private, unimplemented to prevent use */
+            const Hashed& operator=(const Hashed& other);
+        };
+
+        /* Read all of a source to hash it, and then rewind it */
+        template <typename T, typename H>
+        void hashAll(T& source, H& hash);
+    }
+
+    namespace Curl {
+        template <typename T, typename H>
+        struct Sink<AWS::Checksum::Hashed<T, H> > {
+            typedef typename Sink<T>::Position Position;
+
+            static std::size_t write(AWS::Checksum::Hashed<T, H>& sink,
+                const char* data, std::size_t size) {
+                std::size_t written = Sink<T>::write(sink.inner, data, size);
+                sink.hash.update(data, written);
+                return written;
+            }
+
+            static Position tell(AWS::Checksum::Hashed<T, H>& sink) {
+                return Sink<T>::tell(sink.inner);
+            }
+
+            static void seek(AWS::Checksum::Hashed<T, H>& sink,
+                const Position& position) {
+                sink.hash.reset();
+                Sink<T>::seek(sink.inner, position);
+            }
+
+            static void flush(AWS::Checksum::Hashed<T, H>& sink) {
+                Sink<T>::flush(sink.inner);
+            }
+        };
+
+        template <typename T, typename H>
+        struct Source<AWS::Checksum::Hashed<T, H> > {
+            typedef typename Source<T>::Position Position;
+
+            static std::size_t read(AWS::Checksum::Hashed<T, H>& source,
+                char* data, std::size_t size) {
+                std::size_t count = Source<T>::read(source.inner, data, size);
+                source.hash.update(data, count);
+                return count;
+            }
+
+            static Position tell(AWS::Checksum::Hashed<T, H>& source) {
+                return Source<T>::tell(source.inner);
+            }
+
+            static void seek(AWS::Checksum::Hashed<T, H>& source,
+                const Position& position) {
+                source.hash.reset();
+                Source<T>::seek(source.inner, position);
+            }
+
+            static std::size_t remaining(AWS::Checksum::Hashed<T, H>& source) {
+                return Source<T>::remaining(source.inner);
+            }
+        };
+    }
+}
+
+/******************************************************************************
+ * Implementations
+ *****************************************************************************/
+namespace AWS {
+    namespace Checksum {
+        /* The reflected CRC32C polynomial */
+        static const uint32_t castagnoli = 0x82f63b78;
+
+        /* Tables to process eight bytes at a time */
+        struct Tables {
+            Tables(): values() {
+                for (uint32_t i = 0; i < 256; ++i) {
+                    uint32_t crc = i;
+                    for (int bit = 0; bit < 8; ++bit) {
+                        crc = (crc & 1) ? (crc >> 1) ^ castagnoli : crc >> 1;
+                    }
+                    values[0][i] = crc;
+                }
+                for (uint32_t i = 0; i < 256; ++i) {
+                    for (int t = 1; t < 8; ++t) {
+                        values[t][i] = (values[t - 1][i] >> 8) ^
+                            values[0][values[t - 1][i] & 0xff];
+                    }
+                }
+            }
+
+            static const Tables& get() {
+                static const Tables tables;
+                return tables;
+            }
+
+            uint32_t values[8][256];
+        };
+    }
+}
+
+inline uint32_t AWS::Checksum::Crc32c::extendTable(uint32_t crc,
+    const char* data, std::size_t size) {
+    const uint32_t (*t)[256] = Tables::get().values;
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+    crc = ~crc;
+    for (; size >= 8; size -= 8, bytes += 8) {
+        uint32_t low = crc ^ (bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) |
+            (static_cast<uint32_t>(bytes[3]) << 24));
+        crc = t[7][low & 0xff] ^ t[6][(low >> 8) & 0xff] ^
+            t[5][(low >> 16) & 0xff] ^ t[4][low >> 24] ^
+            t[3][bytes[4]] ^ t[2][bytes[5]] ^ t[1][bytes[6]] ^ t[0][bytes[7]];
+    }
+    for (; size; --size, ++bytes) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *bytes) & 0xff];
+    }
+    return ~crc;
+}
+
+inline uint32_t AWS::Checksum::Crc32c::multiply(uint32_t a, uint32_t b) {
+    /* The highest bit is the constant term */
+    uint32_t product = 0;
+    for (int i = 0; i < 32; ++i, a <<= 1) {
+        if (a & 0x80000000) {
+            product ^= b;
+        }
+        b = (b & 1) ? (b >> 1) ^ castagnoli : b >> 1;
+    }
+    return product;
+}
+
+inline uint32_t AWS::Checksum::Crc32c::power(uint64_t exponent) {
+    uint32_t result = 0x80000000;
+    uint32_t base = 0x40000000;
+    for (; exponent; exponent >>= 1, base = multiply(base, base)) {
+        if (exponent & 1) {
+            result = multiply(result, base);
+        }
+    }
+    return result;
+}
+
+#ifdef AWSCPP_CRC32C_X86
+__attribute__((target("sse4.2")))
+inline uint32_t AWS::Checksum::Crc32c::extendSse42(uint32_t crc,
+    const char* data, std::size_t size) {
+    uint64_t value = ~crc;
+    for (; size >= 8; size -= 8, data += 8) {
+        uint64_t word;
+        std::memcpy(&word, data, sizeof(word));
+        value = _mm_crc32_u64(value, word);
+    }
+    uint32_t result = static_cast<uint32_t>(value);
+    for (; size; --size, ++data) {
+        result = _mm_crc32_u8(result, static_cast<unsigned char>(*data));
+    }
+    return ~result;
+}
+
+namespace AWS {
+    namespace Checksum {
+        /* Each of the three streams covers this many bytes at a time */
+        static const std::size_t stream_size = 4096;
+
+        /* The constants to shift a CRC past one or two streams. Carryless
+         * multiplication of reflected values leaves the product shifted by
+         * one, and the crc32 instruction used to reduce it multiplies by
+         * x^32, so these are x^(8n - 33) */
+        struct Shifts {
+            Shifts()
+                :one(Crc32c::power(8 * stream_size - 33))
+                ,two(Crc32c::power(16 * stream_size - 33)) {}
+
+            static const Shifts& get() {
+                static const Shifts shifts;
+                return shifts;
+            }
+
+            uint32_t one;
+            uint32_t two;
+        };
+
+        /* Multiply a CRC by a shift constant, reducing it back to 32 bits */
+        __attribute__((target("sse4.2,pclmul")))
+        inline uint32_t shift_(uint32_t crc, uint32_t constant) {
+            __m128i product = _mm_clmulepi64_si128(
+                _mm_cvtsi32_si128(crc), _mm_cvtsi32_si128(constant), 0);
+            return static_cast<uint32_t>(
+                _mm_crc32_u64(0, _mm_cvtsi128_si64(product)));
+        }
+    }
+}
+
+__attribute__((target("sse4.2,pclmul")))
+inline uint32_t AWS::Checksum::Crc32c::extendPclmul(uint32_t crc,
+    const char* data, std::size_t size) {
+    /* Three independent streams keep the crc32 instruction's pipeline full,
+     * and then the first two are shifted past the ones that follow */
+    const Shifts& shifts(Shifts::get());
+    uint32_t value = ~crc;
+    for (; size >= 3 * stream_size; size -= 3 * stream_size) {
+        uint64_t a = value;
+        uint64_t b = 0;
+        uint64_t c = 0;
+        const char* end = data + stream_size;
+        for (; data < end; data += 8) {
+            uint64_t words[3];
+            std::memcpy(&words[0], data, 8);
+            std::memcpy(&words[1], data + stream_size, 8);
+            std::memcpy(&words[2], data + 2 * stream_size, 8);
+            a = _mm_crc32_u64(a, words[0]);
+            b = _mm_crc32_u64(b, words[1]);
+            c = _mm_crc32_u64(c, words[2]);
+        }
+        data += 2 * stream_size;
+        value = shift_(static_cast<uint32_t>(a), shifts.two) ^
+            shift_(static_cast<uint32_t>(b), shifts.one) ^
+            static_cast<uint32_t>(c);
+    }
+    return extendSse42(~value, data, size);
+}
+#endif
+
+namespace AWS {
+    namespace Checksum {
+        typedef uint32_t (*Extender)(uint32_t, const char*, std::size_t);
+
+        struct Dispatch {
+            Dispatch(): extend(Crc32c::extendTable), name("table") {
+#ifdef AWSCPP_CRC32C_X86
+                __builtin_cpu_init();
+                if (__builtin_cpu_supports("sse4.2")) {
+                    extend = Crc32c::extendSse42;
+                    name = "sse4.2";
+                    if (__builtin_cpu_supports("pclmul")) {
+                        extend = Crc32c::extendPclmul;
+                        name = "pclmul";
+                    }
+                }
+#endif
+            }
+
+            static const Dispatch& get() {
+                static const Dispatch dispatch;
+                return dispatch;
+            }
+
+            Extender    extend;
+            const char* name;
+        };
+    }
+}
+
+inline uint32_t AWS::Checksum::Crc32c::extend(uint32_t crc, const char* data,
+    std::size_t size) {
+    return Dispatch::get().extend(crc, data, size);
+}
+
+inline const char* AWS::Checksum::Crc32c::implementation() {
+    return Dispatch::get().name;
+}
+
+inline std::string AWS::Checksum::Crc32c::base64() const {
+    unsigned char bytes[4] = {
+        static_cast<unsigned char>(crc >> 24),
+        static_cast<unsigned char>(crc >> 16),
+        static_cast<unsigned char>(crc >> 8),
+        static_cast<unsigned char>(crc) };
+    char out[8];
+    AWS::Base64::encode(bytes, sizeof(bytes), out);
+    return std::string(out, sizeof(out));
+}
+
+#if defined(__APPLE__) && defined(__MACH__)
+inline AWS::Checksum::Md5::Md5(): context() { reset(); }
+
+inline AWS::Checksum::Md5::~Md5() {}
+
+inline void AWS::Checksum::Md5::update(const char* data, std::size_t size) {
+    CC_MD5_Update(&context, data, static_cast<CC_LONG>(size));
+}
+
+inline void AWS::Checksum::Md5::reset() { CC_MD5_Init(&context); }
+
+inline void AWS::Checksum::Md5::digest(unsigned char out[length]) const {
+    CC_MD5_CTX copy(context);
+    CC_MD5_Final(out, &copy);
+}
+#else
+inline AWS::Checksum::Md5::Md5(): context(EVP_MD_CTX_new()) { reset(); }
+
+inline AWS::Checksum::Md5::~Md5() { EVP_MD_CTX_free(context); }
+
+inline void AWS::Checksum::Md5::update(const char* data, std::size_t size) {
+    EVP_DigestUpdate(context, data, size);
+}
+
+inline void AWS::Checksum::Md5::reset() {
+    EVP_DigestInit_ex(context, EVP_md5(), NULL);
+}
+
+inline void AWS::Checksum::Md5::digest(unsigned char out[length]) const {
+    EVP_MD_CTX* copy = EVP_MD_CTX_new();
+    EVP_MD_CTX_copy_ex(copy, context);
+    EVP_DigestFinal_ex(copy, out, NULL);
+    EVP_MD_CTX_free(copy);
+}
+#endif
+
+inline std::string AWS::Checksum::Md5::base64() const {
+    unsigned char bytes[length];
+    digest(bytes);
+    char out[24];
+    AWS::Base64::encode(bytes, sizeof(bytes), out);
+    return std::string(out, sizeof(out));
+}
+
+inline std::string AWS::Checksum::Md5::hex() const {
+    static const char digits[] = "0123456789abcdef";
+    unsigned char bytes[length];
+    digest(bytes);
+    std::string result(2 * length, '0');
+    for (std::size_t i = 0; i < length; ++i) {
+        result[2 * i] = digits[bytes[i] >> 4];
+        result[2 * i + 1] = digits[bytes[i] & 0x0f];
+    }
+    return result;
+}
+
+inline void AWS::Checksum::Digest::update(const char* data, std::size_t size) {
+    switch (algorithm) {
+        case MD5:
+            md5.update(data, size);
+            crc32c.update(data, size);
+            break;
+        case CRC32C:
+            crc32c.update(data, size);
+            break;
+        default:
+            break;
+    }
+}
+
+inline bool AWS::Checksum::Digest::matches(const std::string& etag,
+    const std::string& crc, bool plain) const {
+    /* The checksum of a multipart upload is of its parts' checksums, like
+     * `...==-3`, and so can't be checked against the whole */
+    if (algorithm != None && !crc.empty() &&
+        crc.find('-') == std::string::npos) {
+        return crc == crc32c.base64();
+    }
+    if (algorithm == MD5 && plain) {
+        std::string tag(etag);
+        tag.erase(std::remove(tag.begin(), tag.end(), '"'), tag.end());
+        if (tag.size() != 2 * Md5::length) {
+            return true;
+        }
+        std::transform(tag.begin(), tag.end(), tag.begin(), ::tolower);
+        return tag == md5.hex();
+    }
+    return true;
+}
+
+inline bool AWS::Checksum::Digest::plainEtag(
+    const AWS::Curl::Headers& headers) {
+    std::string encryption(headers.get("x-amz-server-side-encryption"));
+    return encryption.compare(0, 7, "aws:kms") != 0 &&
+        headers.get("x-amz-server-side-encryption-customer-algorithm").empty();
+}
+
+template <typename T, typename H>
+inline void AWS::Checksum::hashAll(T& source, H& hash) {
+    typedef AWS::Curl::Source<T> Source;
+    typename Source::Position position = Source::tell(source);
+    char buffer[64 * 1024];
+    for (std::size_t count; (count = Source::read(source, buffer,
+        sizeof(buffer)));) {
+        hash.update(buffer, count);
+    }
+    Source::seek(source, position);
+}
+
+#endif
@@ -0,0 +1,435 @@
+/******************************************************************************
+ * Copyright (c) 2013 SEOmoz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#ifndef AWSCPP__COMPRESS_HPP
+#define AWSCPP__COMPRESS_HPP
+
+/******************************************************************************
+ * Transforms that compress and decompress data as it's transferred. The
+ * decompressing transforms are sinks that wrap another sink, so that a GET
+ * decompresses incrementally, right in curl's write callback. They can be
+ * chained, and can feed any other kind of sink:
+ *
+ *     std::ofstream out("local/path");
+ *     AWS::Curl::Inflate<std::ofstream> inflate(out);
+ *     s3.get("bucket", "/logs.gz", inflate);
+ *
+ * The compressing transforms are sources that wrap another source. Since the
+ * compressed size isn't known ahead of time, they're sent with chunked
+ * encoding, by providing AWS::Curl::unknown as the size. Note that S3 itself
+ * requires a content length, so for S3 you'll want to compress to memory.
+ *
+ * Gzip and deflate are always available. Zstandard is available when built
+ * with AWSCPP_WITH_ZSTD defined, and linked against libzstd.
+ *****************************************************************************/
+
+/* Where data comes from and goes to */
+#include "sink.hpp"
+#include "source.hpp"
+
+/* For aborting reads */
+#include <curl/curl.h>
+
+/* The compression libraries */
+#include <zlib.h>
+#ifdef AWSCPP_WITH_ZSTD
+    #include <zstd.h>
+#endif
+
+/* Standard includes */
+#include <string>
+
+namespace AWS {
+    namespace Curl {
+        /* The size to use for a source whose size isn't known ahead of time */
+        static const std::size_t unknown = static_cast<std::size_t>(-1);
+
+        /* How much data transforms hold on to between their input and their
+         * output */
+        static const std::size_t transform_buffer = 64 * 1024;
+
+        /* Decompress gzip or zlib data (or raw deflate data) and write it to
+         * another sink. Concatenated gzip members are all decompressed */
+        template <typename T>
+        struct Inflate {
+            /* These are zlib's window bits for each format */
+            enum Format {
+                Auto = 15 + 32,
+                Raw  = -15
+            };
+
+            explicit Inflate(T& sink, Format format=Auto);
+            ~Inflate() { inflateEnd(&stream); }
+
+            /* Decompress data, writing all that we can to the sink */
+            std::size_t write(const char* data, std::size_t size);
+
+            /* Start over from the beginning of a new stream */
+            void reset();
+
+            /* Whether or not the data has all been valid so far */
+            bool good() const { return !failed; }
+
+            /* Whether or not we've seen the end of the compressed stream */
+            bool done() const { return finished; }
+
+            T& sink;
+        private:
+            z_stream stream;
+            bool     failed;
+            bool     finished;
+            char     buffer[transform_buffer];
+
+            /* Private, unimplemented to prevent use */
+            Inflate(const Inflate& other);
+            const Inflate& operator=(const Inflate& other);
+        };
+
+        /* Gzip data read from another source */
+        template <typename T>
+        struct Deflate {
+            explicit Deflate(T& source, int level=Z_DEFAULT_COMPRESSION);
+            ~Deflate() { deflateEnd(&stream); }
+
+            /* Read compressed data into the provided buffer */
+            std::size_t read(char* data, std::size_t size);
+
+            /* Start over, assuming the source has been rewound */
+            void reset();
+
+            T& source;
+        private:
+            z_stream stream;
+            bool     exhausted;
+            bool     finished;
+            char     buffer[transform_buffer];
+
+            /* Private, unimplemented to prevent use */
+            Deflate(const Deflate& other);
+            const Deflate& operator=(const Deflate& other);
+        };
+
+        template <typename T>
+        struct Sink<Inflate<T> > {
+            typedef typename Sink<T>::Position Position;
+
+            static std::size_t write(Inflate<T>& sink, const char* data,
+                std::size_t size) {
+                return sink.write(data, size);
+            }
+
+            static Position tell(Inflate<T>& sink) {
+                return Sink<T>::tell(sink.sink);
+            }
+
+            /* Going back can only mean going back to the start */
+            static void seek(Inflate<T>& sink, const Position& position) {
+                sink.reset();
+                Sink<T>::seek(sink.sink, position);
+            }
+
+            static void flush(Inflate<T>& sink) { Sink<T>::flush(sink.sink); }
+        };
+
+        template <typename T>
+        struct Source<Deflate<T> > {
+            typedef typename Source<T>::Position Position;
+
+            static std::size_t read(Deflate<T>& source, char* data,
+                std::size_t size) {
+                return source.read(data, size);
+            }
+
+            static Position tell(Deflate<T>& source) {
+                return Source<T>::tell(source.source);
+            }
+
+            static void seek(Deflate<T>& source, const Position& position) {
+                Source<T>::seek(source.source, position);
+                source.reset();
+            }
+
+            static std::size_t remaining(Deflate<T>& source) {
+                return unknown;
+            }
+        };
+
+#ifdef AWSCPP_WITH_ZSTD
+        /* Decompress zstandard data and write it to another sink */
+        template <typename T>
+        struct ZstdDecompress {
+            explicit ZstdDecompress(T& sink)
+                :sink(sink), context(ZSTD_createDCtx()), failed(false),
+                 buffer() {}
+            ~ZstdDecompress() { ZSTD_freeDCtx(context); }
+
+            std::size_t write(const char* data, std::size_t size);
+
+            void reset() {
+                ZSTD_DCtx_reset(context, ZSTD_reset_session_only);
+                failed = false;
+            }
+
+            bool good() const { return !failed; }
+
+            T& sink;
+        private:
+            ZSTD_DCtx* context;
+            bool       failed;
+            char       buffer[transform_buffer];
+
+            /* Private, unimplemented to prevent use */
+            ZstdDecompress(const ZstdDecompress& other);
+            const ZstdDecompress& operator=(const ZstdDecompress& other);
+        };
+
+        /* Compress data read from another source with zstandard */
+        template <typename T>
+        struct ZstdCompress {
+            explicit ZstdCompress(T& source, int level=3)
+                :source(source), context(ZSTD_createCCtx()), input(),
+                 exhausted(false), finished(false), buffer() {
+                ZSTD_CCtx_setParameter(context, ZSTD_c_compressionLevel, level);
+            }
+            ~ZstdCompress() { ZSTD_freeCCtx(context); }
+
+            std::size_t read(char* data, std::size_t size);
+
+            void reset() {
+                ZSTD_CCtx_reset(context, ZSTD_reset_session_only);
+                input.src = buffer;
+                input.size = input.pos = 0;
+                exhausted = finished = false;
+            }
+
+            T& source;
+        private:
+            ZSTD_CCtx*     context;
+            ZSTD_inBuffer  input;
+            bool           exhausted;
+            bool           finished;
+            char           buffer[transform_buffer];
+
+            /* Private, unimplemented to prevent use */
+            ZstdCompress(const ZstdCompress& other);
+            const ZstdCompress& operator=(const ZstdCompress& other);
+        };
+
+        template <typename T>
+        struct Sink<ZstdDecompress<T> > {
+            typedef typename Sink<T>::Position Position;
+
+            static std::size_t write(ZstdDecompress<T>& sink,
+                const char* data, std::size_t size) {
+                return sink.write(data, size);
+            }
+
+            static Position tell(ZstdDecompress<T>& sink) {
+                return Sink<T>::tell(sink.sink);
+            }
+
+            static void seek(ZstdDecompress<T>& sink,
+                const Position& position) {
+                sink.reset();
+                Sink<T>::seek(sink.sink, position);
+            }
+
+            static void flush(ZstdDecompress<T>& sink) {
+                Sink<T>::flush(sink.sink);
+            }
+        };
+
+        template <typename T>
+        struct Source<ZstdCompress<T> > {
+            typedef typename Source<T>::Position Position;
+
+            static std::size_t read(ZstdCompress<T>& source, char* data,
+                std::size_t size) {
+                return source.read(data, size);
+            }
+
+            static Position tell(ZstdCompress<T>& source) {
+                return Source<T>::tell(source.source);
+            }
+
+            static void seek(ZstdCompress<T>& source,
+                const Position& position) {
+                Source<T>::seek(source.source, position);
+                source.reset();
+            }
+
+            static std::size_t remaining(ZstdCompress<T>& source) {
+                return unknown;
+            }
+        };
+#endif
+    }
+}
+
+/******************************************************************************
+ * Implementations
+ *****************************************************************************/
+template <typename T>
+inline AWS::Curl::Inflate<T>::Inflate(T& sink, Format format)
+    :sink(sink), stream(), failed(false), finished(false), buffer() {
+    failed = inflateInit2(&stream, format) != Z_OK;
+}
+
+template <typename T>
+inline void AWS::Curl::Inflate<T>::reset() {
+    failed = inflateReset(&stream) != Z_OK;
+    finished = false;
+}
+
+template <typename T>
+inline std::size_t AWS::Curl::Inflate<T>::write(const char* data,
+    std::size_t size) {
+    if (failed) {
+        return 0;
+    }
+
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    stream.avail_in = size;
+    stream.avail_out = 1;
+    /* A full buffer may mean there's more output still pending */
+    while (stream.avail_in || !stream.avail_out) {
+        /* Another gzip member may follow the end of the last one */
+        if (finished) {
+            if (inflateReset(&stream) != Z_OK) {
+                failed = true;
+                return 0;
+            }
+            finished = false;
+        }
+
+        stream.next_out = reinterpret_cast<Bytef*>(buffer);
+        stream.avail_out = sizeof(buffer);
+        int result = inflate(&stream, Z_NO_FLUSH);
+        if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR) {
+            failed = true;
+            return 0;
+        }
+        finished = (result == Z_STREAM_END);
+
+        /* Anything the sink doesn't take aborts the transfer */
+        std::size_t produced = sizeof(buffer) - stream.avail_out;
+        if (produced &&
+            Sink<T>::write(sink, buffer, produced) != produced) {
+            failed = true;
+            return 0;
+        }
+        if (!produced && (finished || result == Z_BUF_ERROR)) {
+            break;
+        }
+    }
+    return size;
+}
+
+template <typename T>
+inline AWS::Curl::Deflate<T>::Deflate(T& source, int level)
+    :source(source), stream(), exhausted(false), finished(false), buffer() {
+    /* 16 more window bits makes it gzip */
+    deflateInit2(&stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+}
+
+template <typename T>
+inline void AWS::Curl::Deflate<T>::reset() {
+    deflateReset(&stream);
+    stream.avail_in = 0;
+    exhausted = finished = false;
+}
+
+template <typename T>
+inline std::size_t AWS::Curl::Deflate<T>::read(char* data, std::size_t size) {
+    stream.next_out = reinterpret_cast<Bytef*>(data);
+    stream.avail_out = size;
+    while (stream.avail_out && !finished) {
+        if (!stream.avail_in && !exhausted) {
+            std::size_t count = Source<T>::read(source, buffer, sizeof(buffer));
+            exhausted = (count == 0);
+            stream.next_in = reinterpret_cast<Bytef*>(buffer);
+            stream.avail_in = count;
+        }
+        int result = deflate(&stream, exhausted ? Z_FINISH : Z_NO_FLUSH);
+        if (result == Z_STREAM_END) {
+            finished = true;
+        } else if (result != Z_OK && result != Z_BUF_ERROR) {
+            return CURL_READFUNC_ABORT;
+        }
+    }
+    return size - stream.avail_out;
+}
+
+#ifdef AWSCPP_WITH_ZSTD
+template <typename T>
+inline std::size_t AWS::Curl::ZstdDecompress<T>::write(const char* data,
+    std::size_t size) {
+    if (failed) {
+        return 0;
+    }
+
+    ZSTD_inBuffer input = { data, size, 0 };
+    ZSTD_outBuffer output = { buffer, sizeof(buffer), 0 };
+    /* A full buffer may mean there's more output still pending */
+    while (input.pos < input.size || output.pos == output.size) {
+        output.pos = 0;
+        std::size_t result = ZSTD_decompressStream(context, &output, &input);
+        if (ZSTD_isError(result)) {
+            failed = true;
+            return 0;
+        }
+        if (output.pos &&
+            Sink<T>::write(sink, buffer, output.pos) != output.pos) {
+            failed = true;
+            return 0;
+        }
+        if (!output.pos) {
+            break;
+        }
+    }
+    return size;
+}
+
+template <typename T>
+inline std::size_t AWS::Curl::ZstdCompress<T>::read(char* data,
+    std::size_t size) {
+    ZSTD_outBuffer output = { data, size, 0 };
+    while (output.pos < output.size && !finished) {
+        if (input.pos == input.size && !exhausted) {
+            input.src = buffer;
+            input.size = Source<T>::read(source, buffer, sizeof(buffer));
+            input.pos = 0;
+            exhausted = (input.size == 0);
+        }
+        std::size_t result = ZSTD_compressStream2(context, &output, &input,
+            exhausted ? ZSTD_e_end : ZSTD_e_continue);
+        if (ZSTD_isError(result)) {
+            return CURL_READFUNC_ABORT;
+        }
+        finished = exhausted && (result == 0);
+    }
+    return output.pos;
+}
+#endif
+
+#endif
@@ -0,0 +1,479 @@
+/******************************************************************************
+ * Copyright (c) 2013 SEOmoz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#ifndef AWSCPP__HEADERS_HPP
+#define AWSCPP__HEADERS_HPP
+
+/******************************************************************************
+ * Headers are kept flat, in the order they were added, with all their keys
+ * and values packed into one buffer. A typical request's headers fit in
+ * storage kept inline, and once cleared that storage is reused, so adding
+ * headers to a connection that's reused doesn't allocate.
+ *
+ * Keys are case-insensitive, as they are in HTTP. A key may appear more than
+ * once, and the old way of adding headers still works:
+ *
+ *     headers["x-amz-meta-foo"].push_back("bar");
+ *
+ * Looking up a key among a handful of headers is just a scan, but with more
+ * than that, an index of the keys in order is built the first time one is
+ * looked up, and kept until the headers change. The headers S3 responds with
+ * can be read as what they are, without copying them out as strings first:
+ *
+ *     std::size_t length = 0;
+ *     if (curl.responseHeaders().contentLength(length)) { ... }
+ *****************************************************************************/
+
+/* Standard includes */
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+
+namespace AWS {
+    namespace Curl {
+        /* A vector of plain old data that keeps its first N items inline,
+         * only moving to the heap if it has to. Clearing it keeps whatever
+         * room it's grown to */
+        template <typename T, std::size_t N>
+        class Small {
+        public:
+            Small(): count(0), heap(), local() {}
+
+            T* data() { return heap.empty() ? local : &heap[0]; }
+            const T* data() const { return heap.empty() ? local : &heap[0]; }
+
+            std::size_t size() const { return count; }
+            bool empty() const { return count == 0; }
+            void clear() { count = 0; }
+
+            T& operator[](std::size_t index) { return data()[index]; }
+            const T& operator[](std::size_t index) const {
+                return data()[index];
+            }
+
+            /* Append some items */
+            void append(const T* items, std::size_t size) {
+                reserve(count + size);
+                std::copy(items, items + size, data() + count);
+                count += size;
+            }
+
+            void push_back(const T& item) { append(&item, 1); }
+
+            /* Change the number of items, leaving any new ones as they are */
+            void resize(std::size_t size) {
+                reserve(size);
+                count = size;
+            }
+
+            /* Remove the item at an index, keeping the rest in order */
+            void erase(std::size_t index) {
+                std::copy(data() + index + 1, data() + count, data() + index);
+                --count;
+            }
+
+            /* Make sure there's room for at least `size` items */
+            void reserve(std::size_t size);
+        private:
+            std::size_t    count;
+            std::vector<T> heap;
+            T              local[N];
+        };
+
+        class Headers {
+        public:
+            /* A key and its value. These point into the headers' storage,
+             * and so only last until more headers are added */
+            struct Field {
+                const char* key;
+                std::size_t key_size;
+                const char* value;
+                std::size_t value_size;
+
+                std::string name() const { return std::string(key, key_size); }
+                std::string text() const {
+                    return std::string(value, value_size);
+                }
+            };
+
+            /* What `headers[key]` returns, so that `push_back` adds a value */
+            class Values {
+            public:
+                Values(Headers& headers, const std::string& key)
+                    :headers(headers), key(key) {}
+
+                void push_back(const std::string& value) {
+                    headers.add(key, value);
+                }
+            private:
+                Headers&           headers;
+                const std::string& key;
+            };
+
+            Headers(): storage(), fields(), index(), indexed(false) {}
+
+            /* Add a value for a key */
+            void add(const char* key, std::size_t key_size, const char* value,
+                std::size_t value_size);
+            void add(const std::string& key, const std::string& value) {
+                add(key.data(), key.size(), value.data(), value.size());
+            }
+
+            Values operator[](const std::string& key) {
+                return Values(*this, key);
+            }
+
+            /* The number of fields, counting each value separately */
+            std::size_t size() const { return fields.size(); }
+            bool empty() const { return fields.empty(); }
+
+            /* The field at an index, in the order they were added */
+            Field at(std::size_t index) const;
+
+            /* Find the first value for a key. Returns false if there's none */
+            bool find(const char* key, std::size_t size, Field& field) const;
+            bool find(const std::string& key, Field& field) const {
+                return find(key.data(), key.size(), field);
+            }
+
+            /* The first value for a key, or an empty string */
+            std::string get(const std::string& key) const;
+
+            /* Fill `indices` with the indices of the fields ordered by key.
+             * The values for a key stay in the order they were added */
+            void sorted(std::vector<std::size_t>& indices) const;
+
+            /* Remove every value for a key */
+            void erase(const std::string& key);
+
+            /* Remove everything, but keep the storage for reuse */
+            void clear() {
+                storage.clear();
+                fields.clear();
+                indexed = false;
+            }
+
+            /* The headers S3 responds with, parsed without copying them. Each
+             * returns false (or an empty string, or 0) if the header is
+             * missing or malformed */
+            bool contentLength(std::size_t& length) const;
+            /* `total` is `unknown` if the server doesn't know it */
+            bool contentRange(std::size_t& first, std::size_t& last,
+                std::size_t& total) const;
+            std::string etag() const { return get("ETag"); }
+            std::time_t lastModified() const { return date("Last-Modified"); }
+
+            /* Any header that's a HTTP date, as seconds since the epoch */
+            std::time_t date(const std::string& key) const;
+            std::string requestId() const { return get("x-amz-request-id"); }
+
+            static const std::size_t unknown = static_cast<std::size_t>(-1);
+
+            /* Case-insensitive comparisons of keys */
+            static bool equal(const char* a, std::size_t a_size,
+                const char* b, std::size_t b_size);
+            static bool less(const char* a, std::size_t a_size,
+                const char* b, std::size_t b_size);
+
+            /* Parse a decimal number that's the whole of some text */
+            static bool number(const char* data, std::size_t size,
+                std::size_t& out);
+        private:
+            /* Where a field's key and value are in storage */
+            struct Entry {
+                std::size_t key;
+                std::size_t key_size;
+                std::size_t value;
+                std::size_t value_size;
+            };
+
+            /* Keys are ASCII, whatever the locale */
+            static int lower_(char c) {
+                unsigned char u = static_cast<unsigned char>(c);
+                return (u >= 'A' && u <= 'Z') ? u + ('a' - 'A') : u;
+            }
+
+            /* How the index is ordered: by the length of keys first, which
+             * settles most comparisons without looking at them */
+            static bool before_(const char* a, std::size_t a_size,
+                const char* b, std::size_t b_size) {
+                return (a_size != b_size) ? a_size < b_size :
+                    less(a, a_size, b, b_size);
+            }
+
+            Small<char, 1024> storage;
+            Small<Entry, 16>  fields;
+            /* The fields in order by key, built when it's first needed */
+            mutable Small<std::size_t, 16> index;
+            mutable bool                   indexed;
+        };
+    }
+}
+
+/******************************************************************************
+ * Implementations
+ *****************************************************************************/
+template <typename T, std::size_t N>
+inline void AWS::Curl::Small<T, N>::reserve(std::size_t size) {
+    std::size_t capacity = heap.empty() ? N : heap.size();
+    if (size <= capacity) {
+        return;
+    }
+
+    /* Move everything into a bigger heap buffer */
+    std::vector<T> bigger(std::max(size, 2 * capacity));
+    std::copy(data(), data() + count, bigger.begin());
+    heap.swap(bigger);
+}
+
+inline void AWS::Curl::Headers::add(const char* key, std::size_t key_size,
+    const char* value, std::size_t value_size) {
+    Entry entry = {
+        storage.size(), key_size, storage.size() + key_size, value_size };
+    storage.reserve(storage.size() + key_size + value_size);
+    storage.append(key, key_size);
+    storage.append(value, value_size);
+    fields.push_back(entry);
+    indexed = false;
+}
+
+inline AWS::Curl::Headers::Field AWS::Curl::Headers::at(
+    std::size_t index) const {
+    const Entry& entry(fields[index]);
+    Field field = {
+        storage.data() + entry.key, entry.key_size,
+        storage.data() + entry.value, entry.value_size };
+    return field;
+}
+
+inline bool AWS::Curl::Headers::find(const char* key, std::size_t size,
+    Field& field) const {
+    /* Scanning a few fields is quicker than searching an index */
+    if (fields.size() <= 16) {
+        for (std::size_t i = 0; i < fields.size(); ++i) {
+            const Entry& entry(fields[i]);
+            if (equal(storage.data() + entry.key, entry.key_size, key, size)) {
+                field = at(i);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    const char* data = storage.data();
+    if (!indexed) {
+        /* Like sorted, the values for a key stay in the order they were
+         * added, so that the first is found first */
+        index.resize(fields.size());
+        for (std::size_t i = 0; i < fields.size(); ++i) {
+            std::size_t j = i;
+            for (; j > 0; --j) {
+                const Entry& previous(fields[index[j - 1]]);
+                if (!before_(data + fields[i].key, fields[i].key_size,
+                    data + previous.key, previous.key_size)) {
+                    break;
+                }
+                index[j] = index[j - 1];
+            }
+            index[j] = i;
+        }
+        indexed = true;
+    }
+    /* The first field for a key is the first that isn't before it */
+    const std::size_t* indices = index.data();
+    const Entry* entries = fields.data();
+    std::size_t low = 0;
+    std::size_t high = index.size();
+    while (low < high) {
+        std::size_t middle = (low + high) / 2;
+        const Entry& entry(entries[indices[middle]]);
+        if (before_(data + entry.key, entry.key_size, key, size)) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    if (low == index.size()) {
+        return false;
+    }
+    const Entry& entry(entries[indices[low]]);
+    if (!equal(data + entry.key, entry.key_size, key, size)) {
+        return false;
+    }
+    field = at(indices[low]);
+    return true;
+}
+
+inline std::string AWS::Curl::Headers::get(const std::string& key) const {
+    Field field;
+    return find(key, field) ? field.text() : std::string();
+}
+
+inline void AWS::Curl::Headers::sorted(
+    std::vector<std::size_t>& indices) const {
+    /* There are only ever a handful of headers, and an insertion sort is
+     * stable without needing any scratch space */
+    indices.resize(fields.size());
+    for (std::size_t i = 0; i < fields.size(); ++i) {
+        std::size_t j = i;
+        for (; j > 0; --j) {
+            const Entry& previous(fields[indices[j - 1]]);
+            if (!less(storage.data() + fields[i].key, fields[i].key_size,
+                storage.data() + previous.key, previous.key_size)) {
+                break;
+            }
+            indices[j] = indices[j - 1];
+        }
+        indices[j] = i;
+    }
+}
+
+inline void AWS::Curl::Headers::erase(const std::string& key) {
+    /* What the fields pointed to is left in storage until it's cleared */
+    for (std::size_t i = fields.size(); i-- > 0;) {
+        const Entry& entry(fields[i]);
+        if (equal(storage.data() + entry.key, entry.key_size,
+            key.data(), key.size())) {
+            fields.erase(i);
+        }
+    }
+    indexed = false;
+}
+
+inline bool AWS::Curl::Headers::contentLength(std::size_t& length) const {
+    Field field;
+    return find("Content-Length", 14, field) &&
+        number(field.value, field.value_size, length);
+}
+
+inline bool AWS::Curl::Headers::contentRange(std::size_t& first,
+    std::size_t& last, std::size_t& total) const {
+    /* Like "bytes 0-99/1234", or with a "*" for an unknown total */
+    Field field;
+    if (!find("Content-Range", 13, field) || field.value_size < 6 ||
+        std::memcmp(field.value, "bytes ", 6) != 0) {
+        return false;
+    }
+    const char* start = field.value + 6;
+    const char* end = field.value + field.value_size;
+    const char* dash = std::find(start, end, '-');
+    const char* slash = std::find(dash, end, '/');
+    if (dash == end || slash == end ||
+        !number(start, dash - start, first) ||
+        !number(dash + 1, slash - dash - 1, last) || last < first) {
+        return false;
+    }
+    if (end - slash == 2 && slash[1] == '*') {
+        total = unknown;
+        return true;
+    }
+    return number(slash + 1, end - slash - 1, total) && last < total;
+}
+
+inline std::time_t AWS::Curl::Headers::date(const std::string& key) const {
+    /* Always like "Wed, 12 Oct 2009 17:50:00 GMT" */
+    Field field;
+    if (!find(key, field) || field.value_size != 29 ||
+        std::memcmp(field.value + 26, "GMT", 3) != 0) {
+        return 0;
+    }
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    const char* month = std::search(months, months + 36, field.value + 8,
+        field.value + 11);
+    std::size_t day = 0, year = 0, hour = 0, minute = 0, second = 0;
+    if (month == months + 36 || (month - months) % 3 != 0 ||
+        !number(field.value + 5, 2, day) ||
+        !number(field.value + 12, 4, year) ||
+        !number(field.value + 17, 2, hour) ||
+        !number(field.value + 20, 2, minute) ||
+        !number(field.value + 23, 2, second) || year < 1970) {
+        return 0;
+    }
+
+    /* Days since the epoch, counting years from March so that leap days
+     * come last (see Howard Hinnant's days_from_civil) */
+    long m = (month - months) / 3 + 1;
+    long y = static_cast<long>(year) - (m <= 2);
+    long era = y / 400;
+    long yoe = y - era * 400;
+    long doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 +
+        static_cast<long>(day) - 1;
+    long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    long days = era * 146097 + doe - 719468;
+    return static_cast<std::time_t>(
+        ((days * 24 + static_cast<long>(hour)) * 60 +
+        static_cast<long>(minute)) * 60 + static_cast<long>(second));
+}
+
+inline bool AWS::Curl::Headers::number(const char* data, std::size_t size,
+    std::size_t& out) {
+    if (size == 0 || size > 19) {
+        return false;
+    }
+    std::size_t result = 0;
+    for (std::size_t i = 0; i < size; ++i) {
+        if (data[i] < '0' || data[i] > '9') {
+            return false;
+        }
+        result = result * 10 + (data[i] - '0');
+    }
+    out = result;
+    return true;
+}
+
+inline bool AWS::Curl::Headers::equal(const char* a, std::size_t a_size,
+    const char* b, std::size_t b_size) {
+    if (a_size != b_size) {
+        return false;
+    }
+    /* Keys are usually spelled the same way */
+    if (std::memcmp(a, b, a_size) == 0) {
+        return true;
+    }
+    for (std::size_t i = 0; i < a_size; ++i) {
+        if (a[i] != b[i] && lower_(a[i]) != lower_(b[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+inline bool AWS::Curl::Headers::less(const char* a, std::size_t a_size,
+    const char* b, std::size_t b_size) {
+    std::size_t size = std::min(a_size, b_size);
+    for (std::size_t i = 0; i < size; ++i) {
+        if (a[i] == b[i]) {
+            continue;
+        }
+        int x = lower_(a[i]);
+        int y = lower_(b[i]);
+        if (x != y) {
+            return x < y;
+        }
+    }
+    return a_size < b_size;
+}
+
+#endif
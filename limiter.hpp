@@ -0,0 +1,338 @@
+/******************************************************************************
+ * Copyright (c) 2013 SEOmoz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#ifndef AWSCPP__LIMITER_HPP
+#define AWSCPP__LIMITER_HPP
+
+/******************************************************************************
+ * Flow control shared by every request in a process. A Limiter keeps two
+ * token buckets, one for the bytes sent and received and one for requests,
+ * so that a busy process doesn't saturate the network or S3. It also limits
+ * how many requests may be in flight to each part of S3 at once, and adapts
+ * that limit to how S3 responds: the limit is halved when S3 says to slow
+ * down (with a 503), and grows by one for each limit's worth of requests that
+ * succeed, like TCP's congestion window.
+ *
+ * Requests are grouped by bucket, or with a `depth`, by the bucket and that
+ * many parts of the key, so that prefixes S3 has split onto their own
+ * partitions get windows of their own. Windows that have sat idle for a
+ * minute are forgotten. A limiter is attached to a pool, and so to every
+ * connection made from it:
+ *
+ *     // 100MB/s, 3500 requests/s, and at most 64 at once to each bucket
+ *     std::shared_ptr<AWS::Curl::Limiter> limiter(
+ *         new AWS::Curl::Limiter(100e6, 3500, 64));
+ *     s3.setLimiter(limiter);
+ *
+ * Requests made on an event loop (see multi.hpp) that can't be made yet are
+ * put off, and transfers waiting on bytes are paused until they're due, so
+ * that the loop's other transfers and timers carry on in the meantime. Curl
+ * gives up on transfers that go slower than 1KB/s for 30 seconds, so the byte
+ * rate should leave at least that much for each concurrent transfer.
+ *****************************************************************************/
+
+/* Standard includes */
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace AWS {
+    namespace Curl {
+        /* A token bucket that refills at `rate` tokens a second, up to
+         * `burst` seconds' worth. Tokens may be taken before they're there,
+         * leaving the bucket in debt, and the taker waits for it to be paid
+         * off. That way, those waiting are served in the order they came */
+        class Bucket {
+        public:
+            typedef std::chrono::steady_clock Clock;
+
+            /* A rate of zero is no limit at all */
+            Bucket(double rate=0, double burst=1);
+
+            /* Take tokens, returning how many seconds to wait before using
+             * them */
+            double take(double count);
+
+            double rate() const { return per; }
+        private:
+            std::mutex        mutex;
+            double            per;
+            double            most;
+            double            tokens;
+            Clock::time_point last;
+
+            /* Private, unimplemented to prevent use */
+            Bucket(const Bucket& other);
+            const Bucket& operator=(const Bucket& other);
+        };
+
+        class Limiter {
+        public:
+            typedef Bucket::Clock Clock;
+
+            /* Limit traffic to `bytes` a second and `requests` a second, each
+             * with up to `burst` seconds' worth at once, and the requests in
+             * flight to each part of S3 to `concurrency`, never backing off
+             * below `least`. Zero for any of these is no limit. The parts of
+             * S3 are buckets, or the first `depth` parts of keys in them */
+            Limiter(double bytes=0, double requests=0,
+                std::size_t concurrency=0, std::size_t least=1,
+                double burst=1, std::size_t depth=0);
+
+            /* Take tokens for bytes, or for a request, returning how many
+             * seconds to wait before sending them, or making it */
+            double transfer(std::size_t count) { return bytes.take(count); }
+            double request() { return requests.take(1); }
+
+            /* Whether a request to `key` may start now, and if so, take a
+             * slot for it */
+            bool admit(const std::string& key);
+
+            /* Block until a request to `key` might be admitted, for those
+             * with nothing better to do. It may still not be, if another
+             * takes the slot first */
+            void wait(const std::string& key);
+
+            /* Give back the slot of a request that started at `started`, and
+             * adjust the limit for its key by how it went */
+            void leave(const std::string& key, long response,
+                const Clock::time_point& started);
+
+            /* How many requests may be in flight for a key */
+            double limit(const std::string& key);
+
+            /* Whether bytes are limited at all */
+            bool limitsBytes() const { return bytes.rate() > 0; }
+
+            /* The key of a url, given the url of its bucket (see
+             * Connection::setBucket), which is all of it up to the key: that
+             * and the first `depth` parts of the key. Without a bucket, it's
+             * the url's scheme and host */
+            static std::string key(const std::string& url,
+                const std::string& bucket="", std::size_t depth=0);
+
+            /* How many parts of keys requests are grouped by */
+            std::size_t depth() const { return parts; }
+
+            /* How many windows are kept */
+            std::size_t size();
+
+            /* How long a window may sit with nothing in flight before it's
+             * forgotten, in seconds */
+            static const int idle = 60;
+
+            /* Whether a response means S3 wants fewer requests */
+            static bool throttled(long response) {
+                return response == 503 || response == 429;
+            }
+        private:
+            /* How many requests to a key may be in flight, and are */
+            struct Window {
+                Window(double limit)
+                    :limit(limit), inflight(0), decreased(), left() {}
+
+                double            limit;
+                std::size_t       inflight;
+                /* Requests that started before the last decrease were part
+                 * of what prompted it, and don't decrease it again */
+                Clock::time_point decreased;
+                /* When a request last left */
+                Clock::time_point left;
+            };
+
+            Bucket                          bytes;
+            Bucket                          requests;
+            std::size_t                     most;
+            std::size_t                     least;
+            std::size_t                     parts;
+            std::mutex                      mutex;
+            /* Signalled whenever a slot is given back */
+            std::condition_variable         left;
+            std::map<std::string, Window>   windows;
+            Clock::time_point               swept;
+
+            /* Private, unimplemented to prevent use */
+            Limiter(const Limiter& other);
+            const Limiter& operator=(const Limiter& other);
+
+            /* The window for a key. The mutex must be held */
+            Window& window_(const std::string& key);
+
+            /* Forget windows that have been idle for long enough, at most
+             * once in that long. The mutex must be held */
+            void sweep_(const Clock::time_point& now);
+        };
+    }
+}
+
+/******************************************************************************
+ * Implementation of Bucket
+ *****************************************************************************/
+inline AWS::Curl::Bucket::Bucket(double rate, double burst)
+    :mutex()
+    ,per(rate)
+    ,most(rate * burst)
+    ,tokens(rate * burst)
+    ,last(Clock::now()) {}
+
+inline double AWS::Curl::Bucket::take(double count) {
+    if (per <= 0) {
+        return 0;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    Clock::time_point now = Clock::now();
+    double elapsed = std::chrono::duration<double>(now - last).count();
+    last = now;
+    tokens = std::min(most, tokens + elapsed * per) - count;
+    return tokens < 0 ? -tokens / per : 0;
+}
+
+/******************************************************************************
+ * Implementation of Limiter
+ *****************************************************************************/
+inline AWS::Curl::Limiter::Limiter(double bytes, double requests,
+    std::size_t concurrency, std::size_t least, double burst,
+    std::size_t depth)
+    :bytes(bytes, burst)
+    ,requests(requests, burst)
+    ,most(concurrency)
+    ,least(std::max(std::min(least, concurrency), std::size_t(1)))
+    ,parts(depth)
+    ,mutex()
+    ,left()
+    ,windows()
+    ,swept(Clock::now()) {}
+
+inline bool AWS::Curl::Limiter::admit(const std::string& key) {
+    if (!most) {
+        return true;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    Window& window(window_(key));
+    if (window.inflight + 1 > window.limit) {
+        return false;
+    }
+    ++window.inflight;
+    return true;
+}
+
+inline void AWS::Curl::Limiter::wait(const std::string& key) {
+    if (!most) {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    while (window_(key).inflight + 1 > window_(key).limit) {
+        left.wait(lock);
+    }
+}
+
+inline void AWS::Curl::Limiter::leave(const std::string& key, long response,
+    const Clock::time_point& started) {
+    if (!most) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    left.notify_all();
+    Window& window(window_(key));
+    window.inflight -= std::min(window.inflight, std::size_t(1));
+    window.left = Clock::now();
+    if (throttled(response)) {
+        if (started >= window.decreased) {
+            window.limit = std::max(static_cast<double>(least),
+                window.limit / 2);
+            window.decreased = Clock::now();
+        }
+    } else if (response > 0) {
+        window.limit = std::min(static_cast<double>(most),
+            window.limit + 1 / window.limit);
+    }
+    sweep_(window.left);
+}
+
+inline double AWS::Curl::Limiter::limit(const std::string& key) {
+    if (!most) {
+        return 0;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    return window_(key).limit;
+}
+
+inline std::size_t AWS::Curl::Limiter::size() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return windows.size();
+}
+
+inline std::string AWS::Curl::Limiter::key(const std::string& url,
+    const std::string& bucket, std::size_t depth) {
+    std::size_t end = 0;
+    if (!bucket.empty() && url.compare(0, bucket.size(), bucket) == 0) {
+        end = bucket.size();
+    } else {
+        std::size_t scheme = url.find("://");
+        end = url.find_first_of("/?",
+            (scheme == std::string::npos) ? 0 : scheme + 3);
+        end = (end == std::string::npos) ? url.size() : end;
+    }
+
+    /* The key follows a '/', and each part of it ends with one */
+    for (std::size_t i = 0; i < depth && end < url.size() &&
+        url[end] == '/'; ++i) {
+        std::size_t next = url.find_first_of("/?", end + 1);
+        if (next == std::string::npos || url[next] != '/') {
+            break;
+        }
+        end = next;
+    }
+    return url.substr(0, end);
+}
+
+inline AWS::Curl::Limiter::Window& AWS::Curl::Limiter::window_(
+    const std::string& key) {
+    std::map<std::string, Window>::iterator it(windows.find(key));
+    if (it == windows.end()) {
+        it = windows.insert(std::make_pair(key,
+            Window(static_cast<double>(most)))).first;
+    }
+    return it->second;
+}
+
+inline void AWS::Curl::Limiter::sweep_(const Clock::time_point& now) {
+    if (now - swept < std::chrono::seconds(idle)) {
+        return;
+    }
+    swept = now;
+    std::map<std::string, Window>::iterator it(windows.begin());
+    while (it != windows.end()) {
+        if (!it->second.inflight &&
+            now - it->second.left >= std::chrono::seconds(idle)) {
+            windows.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+}
+
+#endif
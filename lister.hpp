@@ -0,0 +1,496 @@
+/******************************************************************************
+ * Copyright (c) 2013 SEOmoz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#ifndef AWSCPP__LISTER_HPP
+#define AWSCPP__LISTER_HPP
+
+/******************************************************************************
+ * Listing a huge bucket in parallel. A single listing is a chain of requests,
+ * each waiting on the token from the one before, which makes enumerating
+ * hundreds of millions of keys take hours. A Lister instead splits the
+ * keyspace into shards, either by the prefixes found up to a delimiter or by
+ * ranges of characters, and runs a cursor over each of them at once. Whenever
+ * a cursor is idle while a shard still has pages left, what's left of that
+ * shard is split again, so that a hot prefix ends up spread over every cursor.
+ *
+ * Keys are handed out through a bounded queue, in whatever order they arrive,
+ * or in the order of the keyspace if asked for:
+ *
+ *     AWS::S3::Lister lister(s3, "bucket", "some/prefix/", 64);
+ *     AWS::S3::Entry entry;
+ *     while (lister.next(entry)) {
+ *         ...
+ *     }
+ *     if (!lister.good()) {
+ *         ...
+ *     }
+ *****************************************************************************/
+
+#include "s3.hpp"
+
+/* Standard includes */
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace AWS {
+    namespace S3 {
+        class Lister {
+        public:
+            /* List the keys in a bucket that begin with `prefix`, with up to
+             * `concurrency` cursors, each fetching `page` keys at a time. At
+             * most `capacity` keys are held waiting for `next`, after which
+             * the cursors wait. With a delimiter, the prefixes up to it are
+             * found first (serially) and each is listed as its own shard,
+             * though keys are never rolled up */
+            Lister(const Connection& connection, const std::string& bucket,
+                const std::string& prefix="", std::size_t concurrency=16,
+                bool ordered=false, const std::string& delimiter="",
+                std::size_t capacity=10000, std::size_t page=1000,
+                std::size_t retries=5);
+
+            /* Stops any cursors that are still going */
+            ~Lister();
+
+            /* Wait for the next key. Returns false once every key has been
+             * listed, or as soon as a page couldn't be fetched. This should
+             * only be called from one thread at a time */
+            bool next(Entry& entry);
+
+            /* Whether every page so far has been fetched */
+            bool good() const;
+
+            /* How many shards the keyspace has been split into so far */
+            std::size_t shards() const;
+
+            /* Up to `count` - 1 keys that split the keys beginning with
+             * `prefix`, after `after` and up to `until` (or to the end, if
+             * it's empty), into ranges of about the same size, at least if
+             * keys were spread evenly. Keys are taken to be printable ASCII,
+             * and anything else sorts at the ends of the range */
+            static std::vector<std::string> split(const std::string& prefix,
+                const std::string& after, const std::string& until,
+                std::size_t count);
+
+        private:
+            /* Private and unimplemented */
+            Lister(const Lister& other);
+            Lister& operator=(const Lister& other);
+
+            /* A range of the keyspace, of the keys after `after` and up to
+             * `until`, or to the end if it's empty. Cursors update `after`
+             * as they go */
+            struct Shard {
+                Shard(const std::string& prefix, const std::string& after,
+                    const std::string& until)
+                    :prefix(prefix)
+                    ,after(after)
+                    ,until(until)
+                    ,token()
+                    ,entries()
+                    ,started(false)
+                    ,done(false) {}
+
+                std::string       prefix;
+                std::string       after;
+                std::string       until;
+                std::string       token;
+                /* Keys waiting to be handed out, when they're ordered */
+                std::deque<Entry> entries;
+                bool              started;
+                bool              done;
+            };
+
+            typedef std::list<std::shared_ptr<Shard> > Shards;
+
+            Connection              connection;
+            std::string             bucket;
+            std::size_t             capacity;
+            std::size_t             size;
+            std::size_t             retries;
+            bool                    ordered;
+
+            /* Guards everything below */
+            mutable std::mutex      mutex;
+            /* Signalled when there's a shard to list, or nothing left */
+            std::condition_variable work;
+            /* Signalled when there's a key to hand out, or nothing left */
+            std::condition_variable ready;
+            /* Signalled when there's room for more keys */
+            std::condition_variable space;
+
+            /* Shards in the order of the keyspace. Those that are finished
+             * are dropped once their keys have been handed out */
+            Shards                  order;
+            /* Keys waiting to be handed out, when they're not ordered */
+            std::deque<Entry>       entries;
+            std::size_t             buffered;
+            std::size_t             idle;
+            std::size_t             unfinished;
+            std::size_t             created;
+            bool                    failed;
+            bool                    stopping;
+            std::vector<std::thread> workers;
+
+            /* Take shards and list them, until there are none left */
+            void work_();
+
+            /* List a shard to its end, page by page */
+            void list_(std::unique_lock<std::mutex>& lock,
+                const std::shared_ptr<Shard>& shard,
+                const std::shared_ptr<Page>& page);
+
+            /* Hand what's left of a shard to the idle cursors */
+            void split_(const std::shared_ptr<Shard>& shard);
+
+            /* Mark a shard as done */
+            void finish_(const std::shared_ptr<Shard>& shard);
+
+            /* The first shard that no cursor has taken yet, if any */
+            std::shared_ptr<Shard> queued_() const;
+
+            /* Whether this is the first shard with keys left to hand out */
+            bool head_(const std::shared_ptr<Shard>& shard) const;
+        };
+    }
+}
+
+/******************************************************************************
+ * Implementation of Lister
+ *****************************************************************************/
+inline AWS::S3::Lister::Lister(const Connection& connection,
+    const std::string& bucket, const std::string& prefix,
+    std::size_t concurrency, bool ordered, const std::string& delimiter,
+    std::size_t capacity, std::size_t page, std::size_t retries)
+    :connection(connection)
+    ,bucket(bucket)
+    ,capacity(std::max(capacity, std::size_t(1)))
+    ,size(page)
+    ,retries(retries)
+    ,ordered(ordered)
+    ,mutex()
+    ,work()
+    ,ready()
+    ,space()
+    ,order()
+    ,entries()
+    ,buffered(0)
+    ,idle(0)
+    ,unfinished(0)
+    ,created(0)
+    ,failed(false)
+    ,stopping(false)
+    ,workers() {
+    concurrency = std::max(concurrency, std::size_t(1));
+    if (delimiter.empty()) {
+        std::vector<std::string> points(split(prefix, "", "", concurrency));
+        std::string after;
+        for (std::size_t i = 0; i <= points.size(); ++i) {
+            std::string until(i < points.size() ? points[i] : "");
+            order.push_back(std::make_shared<Shard>(prefix, after, until));
+            after = until;
+        }
+        unfinished = created = order.size();
+    } else {
+        /* Pages have keys and prefixes apart, so they're put back in order */
+        std::vector<Entry> found;
+        failed = !connection.list(bucket, [&](const Entry& entry) {
+            found.push_back(entry);
+            return true;
+        }, prefix, delimiter, page, retries);
+        std::sort(found.begin(), found.end(),
+            [](const Entry& a, const Entry& b) { return a.key < b.key; });
+
+        /* Each prefix is a shard, and runs of keys between them are shards
+         * that are already done */
+        std::vector<Entry>::iterator it(found.begin());
+        for (; it != found.end(); ++it) {
+            if (it->prefix) {
+                order.push_back(std::make_shared<Shard>(it->key, "", ""));
+                ++unfinished;
+                ++created;
+                continue;
+            }
+            ++buffered;
+            if (!ordered) {
+                entries.push_back(std::move(*it));
+                continue;
+            }
+            if (order.empty() || !order.back()->done) {
+                order.push_back(std::make_shared<Shard>(prefix, "", ""));
+                order.back()->started = order.back()->done = true;
+                ++created;
+            }
+            order.back()->entries.push_back(std::move(*it));
+        }
+    }
+
+    for (std::size_t i = 0; i < concurrency; ++i) {
+        workers.push_back(std::thread(&Lister::work_, this));
+    }
+}
+
+inline AWS::S3::Lister::~Lister() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    work.notify_all();
+    space.notify_all();
+    ready.notify_all();
+    std::vector<std::thread>::iterator it(workers.begin());
+    for (; it != workers.end(); ++it) {
+        it->join();
+    }
+}
+
+inline bool AWS::S3::Lister::next(Entry& entry) {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!failed) {
+        if (ordered) {
+            /* Shards that are done and drained make way for the next */
+            bool moved = false;
+            while (!order.empty() && order.front()->done &&
+                order.front()->entries.empty()) {
+                order.pop_front();
+                moved = true;
+            }
+            if (moved) {
+                space.notify_all();
+            }
+            if (order.empty()) {
+                return false;
+            }
+            std::deque<Entry>& head(order.front()->entries);
+            if (!head.empty()) {
+                entry = std::move(head.front());
+                head.pop_front();
+                if (buffered-- == capacity) {
+                    space.notify_all();
+                }
+                return true;
+            }
+        } else {
+            if (!entries.empty()) {
+                entry = std::move(entries.front());
+                entries.pop_front();
+                if (buffered-- == capacity) {
+                    space.notify_all();
+                }
+                return true;
+            }
+            if (!unfinished) {
+                return false;
+            }
+        }
+        ready.wait(lock);
+    }
+    return false;
+}
+
+inline bool AWS::S3::Lister::good() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return !failed;
+}
+
+inline std::size_t AWS::S3::Lister::shards() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return created;
+}
+
+inline std::vector<std::string> AWS::S3::Lister::split(
+    const std::string& prefix, const std::string& after,
+    const std::string& until, std::size_t count) {
+    /* Keys are read as numbers in base 95 (the printable characters), to a
+     * few places past where the ends of the range first differ */
+    static const std::size_t places = 6;
+    static const int base = '~' - ' ' + 1;
+    std::string low(std::max(after, prefix));
+    std::string high(until.empty() ? prefix + std::string(places, '~') : until);
+    std::vector<std::string> points;
+    if (count < 2 || low >= high) {
+        return points;
+    }
+    std::size_t common = 0;
+    while (common < low.size() && common < high.size() &&
+        low[common] == high[common]) {
+        ++common;
+    }
+
+    uint64_t bounds[2] = { 0, 0 };
+    const std::string* keys[2] = { &low, &high };
+    for (std::size_t i = 0; i < 2; ++i) {
+        for (std::size_t place = 0; place < places; ++place) {
+            std::size_t index = common + place;
+            int digit = 0;
+            if (index < keys[i]->size()) {
+                digit = static_cast<unsigned char>((*keys[i])[index]) - ' ';
+                digit = std::min(std::max(digit, 0), base - 1);
+            }
+            bounds[i] = bounds[i] * base + digit;
+        }
+    }
+
+    for (std::size_t i = 1; i < count; ++i) {
+        uint64_t value = bounds[0] + (bounds[1] - bounds[0]) * i / count;
+        std::string point(places, ' ');
+        for (std::size_t place = places; place > 0; --place) {
+            point[place - 1] = static_cast<char>(' ' + value % base);
+            value /= base;
+        }
+        point.erase(point.find_last_not_of(' ') + 1);
+        point = high.substr(0, common) + point;
+        /* Whatever didn't fit in the range is left out */
+        if (point > after && (until.empty() || point < until) &&
+            (points.empty() || point > points.back())) {
+            points.push_back(point);
+        }
+    }
+    return points;
+}
+
+inline void AWS::S3::Lister::work_() {
+    std::shared_ptr<Page> page(new Page());
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        std::shared_ptr<Shard> shard(queued_());
+        if (!shard) {
+            if (stopping || failed || !unfinished) {
+                return;
+            }
+            ++idle;
+            work.wait(lock);
+            --idle;
+            continue;
+        }
+        shard->started = true;
+        list_(lock, shard, page);
+    }
+}
+
+inline void AWS::S3::Lister::list_(std::unique_lock<std::mutex>& lock,
+    const std::shared_ptr<Shard>& shard, const std::shared_ptr<Page>& page) {
+    while (true) {
+        std::string query(Connection::listQuery(shard->prefix, "", size,
+            shard->after, shard->token));
+        lock.unlock();
+        bool fetched = connection.listPage(bucket, query, page, retries).get();
+        lock.lock();
+        if (!fetched) {
+            failed = true;
+            work.notify_all();
+            ready.notify_all();
+            space.notify_all();
+            return;
+        }
+
+        bool more = page->truncated && !page->token.empty();
+        std::vector<Entry>::iterator it(page->entries.begin());
+        for (; it != page->entries.end(); ++it) {
+            if (!shard->until.empty() && it->key > shard->until) {
+                more = false;
+                break;
+            }
+            /* The first shard never waits, or it could wait forever */
+            while (buffered >= capacity && !stopping && !failed &&
+                !(ordered && head_(shard))) {
+                space.wait(lock);
+            }
+            if (stopping || failed) {
+                return;
+            }
+            shard->after = it->key;
+            (ordered ? shard->entries : entries).push_back(std::move(*it));
+            ++buffered;
+            ready.notify_one();
+        }
+        if (!more) {
+            finish_(shard);
+            return;
+        }
+        shard->token = page->token;
+
+        /* Cursors with nothing to do take what's left of this shard */
+        if (idle && !queued_()) {
+            split_(shard);
+        }
+    }
+}
+
+inline void AWS::S3::Lister::split_(const std::shared_ptr<Shard>& shard) {
+    std::vector<std::string> points(
+        split(shard->prefix, shard->after, shard->until, idle + 1));
+    if (points.empty()) {
+        return;
+    }
+    Shards::iterator position(std::find(order.begin(), order.end(), shard));
+    ++position;
+    for (std::size_t i = 0; i < points.size(); ++i) {
+        std::string until(i + 1 < points.size() ? points[i + 1] : shard->until);
+        order.insert(position,
+            std::make_shared<Shard>(shard->prefix, points[i], until));
+    }
+    shard->until = points.front();
+    unfinished += points.size();
+    created += points.size();
+    work.notify_all();
+}
+
+inline void AWS::S3::Lister::finish_(const std::shared_ptr<Shard>& shard) {
+    shard->done = true;
+    if (!ordered) {
+        order.remove(shard);
+    }
+    if (!--unfinished) {
+        work.notify_all();
+    }
+    ready.notify_all();
+}
+
+inline std::shared_ptr<AWS::S3::Lister::Shard>
+AWS::S3::Lister::queued_() const {
+    Shards::const_iterator it(order.begin());
+    for (; it != order.end(); ++it) {
+        if (!(*it)->started) {
+            return *it;
+        }
+    }
+    return std::shared_ptr<Shard>();
+}
+
+inline bool AWS::S3::Lister::head_(const std::shared_ptr<Shard>& shard) const {
+    Shards::const_iterator it(order.begin());
+    while (it != order.end() && (*it)->done && (*it)->entries.empty()) {
+        ++it;
+    }
+    return it != order.end() && *it == shard;
+}
+
+#endif
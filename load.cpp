@@ -0,0 +1,330 @@
+/******************************************************************************
+ * Copyright (c) 2013 SEOmoz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+/******************************************************************************
+ * A load generator. It runs the client's transfers against the loopback
+ * server (see loopback.hpp), sweeping object sizes and concurrency, and
+ * reports the throughput and latency percentiles of each:
+ *
+ *     ./load [--json] [--seconds N] [--ops get,put,download,upload]
+ *            [--sizes 1024,1048576] [--concurrency 1,8] [--part BYTES]
+ *            [--latency SECONDS] [--errors P] [--truncate P] [--v4]
+ *            [--metrics] [--tls] [--http2] [--fresh] [--no-sessions]
+ *
+ * The server can be made to misbehave with --latency, --errors and
+ * --truncate (see AWS::Loopback::Faults), to see what retries cost. With
+ * --metrics, a breakdown of every request's timings follows each result (see
+ * metrics.hpp).
+ *
+ * With --tls, it's all done over HTTPS, and each result says how many TLS
+ * handshakes were made and how many of those resumed a session. --http2,
+ * --fresh and --no-sessions set the same options of the transport (see
+ * AWS::Curl::Transport), so that, for instance, what resumption saves shows
+ * in the difference between `--tls --fresh` and `--tls --fresh
+ * --no-sessions`. With --http2, the server speaks it too.
+ *****************************************************************************/
+
+#include "aws.hpp"
+#include "loopback.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* How the load was asked to run */
+struct Options {
+    Options()
+        :json(false)
+        ,v4(false)
+        ,metrics(false)
+        ,tls(false)
+        ,transport()
+        ,seconds(2)
+        ,part(1024 * 1024)
+        ,ops()
+        ,sizes()
+        ,concurrency()
+        ,faults() {}
+
+    bool                     json;
+    bool                     v4;
+    bool                     metrics;
+    bool                     tls;
+    AWS::Curl::Transport     transport;
+    double                   seconds;
+    std::size_t              part;
+    std::vector<std::string> ops;
+    std::vector<std::size_t> sizes;
+    std::vector<std::size_t> concurrency;
+    AWS::Loopback::Faults    faults;
+};
+
+/* Split a comma-separated list */
+std::vector<std::string> split(const std::string& list) {
+    std::vector<std::string> result;
+    boost::split(result, list, boost::is_any_of(","));
+    return result;
+}
+
+std::vector<std::size_t> numbers(const std::string& list) {
+    std::vector<std::string> parts(split(list));
+    std::vector<std::size_t> result;
+    for (std::size_t i = 0; i < parts.size(); ++i) {
+        result.push_back(std::strtoull(parts[i].c_str(), NULL, 10));
+    }
+    return result;
+}
+
+/* The latency at a quantile of sorted latencies */
+double percentile(const std::vector<double>& sorted, double quantile) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    std::size_t index = static_cast<std::size_t>(quantile * sorted.size());
+    return sorted[std::min(index, sorted.size() - 1)];
+}
+
+/* Run `concurrency` threads doing an operation over and over for as long as
+ * we were asked to, and report on it */
+void run(const Options& options, const AWS::Loopback::Server& server,
+    const std::string& op, std::size_t size, std::size_t concurrency,
+    const std::function<bool(std::size_t)>& operation) {
+    typedef std::chrono::steady_clock Clock;
+    std::size_t handshakes = server.handshakes();
+    std::size_t resumed = server.resumed();
+    Clock::time_point start = Clock::now();
+    Clock::time_point deadline = start +
+        std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(options.seconds));
+
+    std::vector<std::vector<double> > latencies(concurrency);
+    std::atomic<std::size_t> errors(0);
+    std::vector<std::thread> threads;
+    for (std::size_t i = 0; i < concurrency; ++i) {
+        threads.push_back(std::thread([&, i]() {
+            while (Clock::now() < deadline) {
+                Clock::time_point begun = Clock::now();
+                if (!operation(i)) {
+                    ++errors;
+                }
+                latencies[i].push_back(std::chrono::duration<double>(
+                    Clock::now() - begun).count() * 1e3);
+            }
+        }));
+    }
+    for (std::size_t i = 0; i < threads.size(); ++i) {
+        threads[i].join();
+    }
+    double elapsed = std::chrono::duration<double>(
+        Clock::now() - start).count();
+
+    std::vector<double> all;
+    for (std::size_t i = 0; i < latencies.size(); ++i) {
+        all.insert(all.end(), latencies[i].begin(), latencies[i].end());
+    }
+    std::sort(all.begin(), all.end());
+    double rate = all.size() / elapsed;
+    double throughput = rate * size / 1e6;
+    double p50 = percentile(all, 0.5);
+    double p99 = percentile(all, 0.99);
+    double p999 = percentile(all, 0.999);
+    handshakes = server.handshakes() - handshakes;
+    resumed = server.resumed() - resumed;
+    if (options.json) {
+        std::printf("{\"op\": \"%s\", \"size\": %zu, \"concurrency\": %zu, "
+            "\"ops\": %zu, \"errors\": %zu, \"ops_per_s\": %.1f, "
+            "\"mb_per_s\": %.1f, \"p50_ms\": %.3f, \"p99_ms\": %.3f, "
+            "\"p999_ms\": %.3f", op.c_str(), size, concurrency, all.size(),
+            static_cast<std::size_t>(errors), rate, throughput, p50, p99, p999);
+        if (options.tls) {
+            std::printf(", \"handshakes\": %zu, \"resumed\": %zu",
+                handshakes, resumed);
+        }
+        std::printf("}\n");
+    } else {
+        std::printf("%-8s %10zu %4zu %8zu %6zu %10.1f %9.1f %9.3f %9.3f %9.3f",
+            op.c_str(), size, concurrency, all.size(),
+            static_cast<std::size_t>(errors), rate, throughput, p50, p99, p999);
+        if (options.tls) {
+            std::printf(" %10zu %8zu", handshakes, resumed);
+        }
+        std::printf("\n");
+    }
+    std::fflush(stdout);
+}
+
+int main(int argc, char* argv[]) {
+    Options options;
+    options.ops = split("get,put,download,upload");
+    options.sizes = numbers("1024,65536,1048576,16777216");
+    options.concurrency = numbers("1,8,32");
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        std::string value((i + 1 < argc) ? argv[i + 1] : "");
+        if (arg == "--json") {
+            options.json = true;
+            continue;
+        } else if (arg == "--v4") {
+            options.v4 = true;
+            continue;
+        } else if (arg == "--metrics") {
+            options.metrics = true;
+            continue;
+        } else if (arg == "--tls") {
+            options.tls = true;
+            continue;
+        } else if (arg == "--http2") {
+            options.transport.http2 = true;
+            continue;
+        } else if (arg == "--fresh") {
+            options.transport.fresh = true;
+            continue;
+        } else if (arg == "--no-sessions") {
+            options.transport.sessions = false;
+            continue;
+        } else if (arg == "--seconds") {
+            options.seconds = std::atof(value.c_str());
+        } else if (arg == "--ops") {
+            options.ops = split(value);
+        } else if (arg == "--sizes") {
+            options.sizes = numbers(value);
+        } else if (arg == "--concurrency") {
+            options.concurrency = numbers(value);
+        } else if (arg == "--part") {
+            options.part = std::strtoull(value.c_str(), NULL, 10);
+        } else if (arg == "--latency") {
+            options.faults.latency = std::atof(value.c_str());
+        } else if (arg == "--errors") {
+            options.faults.errors = std::atof(value.c_str());
+        } else if (arg == "--truncate") {
+            options.faults.truncate = std::atof(value.c_str());
+        } else {
+            std::cerr << "Unknown argument " << arg << std::endl;
+            return 1;
+        }
+        ++i;
+    }
+
+    AWS::Loopback::Server server(options.tls, options.transport.http2);
+    options.transport.ca = server.ca();
+    std::shared_ptr<AWS::Curl::Pool> pool(new AWS::Curl::Pool(
+        *std::max_element(options.concurrency.begin(),
+            options.concurrency.end()) * 4));
+    AWS::S3::Connection conn("id", "secret", pool);
+    conn.setEndpoint(server.endpoint());
+    conn.setTransport(options.transport);
+    conn.setRetry(AWS::S3::Retry(10, AWS::S3::Backoff::Linear(0, 0.01)));
+    if (options.v4) {
+        conn.setRegion("us-east-1");
+    }
+    std::shared_ptr<AWS::Metrics::Recorder> recorder(
+        new AWS::Metrics::Recorder());
+    if (options.metrics) {
+        conn.setMetrics(AWS::Metrics::Recorder::sink(recorder));
+    }
+
+    if (!options.json) {
+        std::printf("%-8s %10s %4s %8s %6s %10s %9s %9s %9s %9s", "op",
+            "size", "conc", "ops", "errors", "ops/s", "MB/s", "p50 ms",
+            "p99 ms", "p999 ms");
+        if (options.tls) {
+            std::printf(" %10s %8s", "handshakes", "resumed");
+        }
+        std::printf("\n");
+    }
+    for (std::size_t s = 0; s < options.sizes.size(); ++s) {
+        std::size_t size = options.sizes[s];
+        std::string data(size, 'x');
+        std::string local("/tmp/awscpp-load-" + std::to_string(size));
+        {
+            std::ofstream out(local.c_str());
+            out << data;
+        }
+        server.store("load", "/object", data);
+
+        for (std::size_t c = 0; c < options.concurrency.size(); ++c) {
+            std::size_t concurrency = options.concurrency[c];
+            /* Everything a thread uses is its own */
+            std::vector<std::string> buffers(concurrency);
+            std::vector<std::string> paths(concurrency);
+            for (std::size_t i = 0; i < concurrency; ++i) {
+                paths[i] = local + "-" + std::to_string(i);
+            }
+
+            /* Faults only apply to what's being measured */
+            server.setFaults(options.faults);
+            for (std::size_t o = 0; o < options.ops.size(); ++o) {
+                const std::string& op(options.ops[o]);
+                if (op == "get") {
+                    run(options, server, op, size, concurrency,
+                        [&](std::size_t i) {
+                        buffers[i].clear();
+                        return conn.get("load", "/object", buffers[i]);
+                    });
+                } else if (op == "put") {
+                    run(options, server, op, size, concurrency,
+                        [&](std::size_t i) {
+                        AWS::Curl::Span span(data);
+                        buffers[i].clear();
+                        return conn.put("load", "/put-" + std::to_string(i),
+                            span, size, buffers[i]);
+                    });
+                } else if (op == "download") {
+                    run(options, server, op, size, concurrency,
+                        [&](std::size_t i) {
+                        return conn.download("load", "/object", paths[i],
+                            options.part, 8);
+                    });
+                } else if (op == "upload") {
+                    run(options, server, op, size, concurrency,
+                        [&](std::size_t i) {
+                        return conn.upload("load",
+                            "/upload-" + std::to_string(i), local,
+                            options.part, 8);
+                    });
+                } else {
+                    std::cerr << "Unknown op " << op << std::endl;
+                    return 1;
+                }
+                if (options.metrics) {
+                    recorder->report(std::cout);
+                    recorder->clear();
+                }
+            }
+            server.setFaults(AWS::Loopback::Faults());
+
+            for (std::size_t i = 0; i < concurrency; ++i) {
+                std::remove(paths[i].c_str());
+            }
+        }
+        std::remove(local.c_str());
+    }
+    return 0;
+}
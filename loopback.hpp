@@ -0,0 +1,2108 @@
+/******************************************************************************
+ * Copyright (c) 2013 SEOmoz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#ifndef AWSCPP__LOOPBACK_HPP
+#define AWSCPP__LOOPBACK_HPP
+
+/******************************************************************************
+ * A stand-in for S3 that runs in-process, on loopback. It keeps objects in
+ * memory, and speaks enough of S3 for everything this library does: GET (with
+ * ranges and conditions), HEAD, PUT (including aws-chunked payloads and their
+ * trailers), DELETE (including batches of keys), listing and multipart
+ * uploads. Content-MD5 and x-amz-checksum-crc32c are always checked, and
+ * Signature Version 4 is too, once it's given a signer with setSigner. Point
+ * a connection at it with its endpoint:
+ *
+ *     AWS::Loopback::Server server;
+ *     AWS::S3::Connection conn("id", "secret");
+ *     conn.setEndpoint(server.endpoint());
+ *
+ * It can also misbehave on purpose, with latency, 503s and truncated bodies,
+ * so that retries and resumption can be exercised, and transfers measured,
+ * without the real service.
+ *
+ * Made with `tls`, it speaks HTTPS with a certificate for 127.0.0.1 signed by
+ * a CA of its own, made up on the spot. Connections verify it with that CA:
+ *
+ *     AWS::Loopback::Server server(true);
+ *     conn.setEndpoint(server.endpoint());
+ *     conn.setTransport(AWS::Curl::Transport(server.ca()));
+ *
+ * Made with `http2` as well, it offers HTTP/2 to clients that ask for it, and
+ * answers the streams of each connection in turn as their requests arrive.
+ * It speaks just enough of it for curl: there's no server push, and it never
+ * adds to the client's header table.
+ *****************************************************************************/
+
+#include "s3.hpp"
+
+/* Standard includes */
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* For sockets */
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* For TLS, and the certificates it needs */
+#include <openssl/ec.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+namespace AWS {
+    namespace Loopback {
+        /* How the server misbehaves. Every request is delayed by `latency`
+         * seconds, and then answered with a 503 SlowDown with probability
+         * `errors`. Each key of a batch delete fails on its own with the same
+         * probability. With probability `truncate`, a response's body is cut
+         * off halfway and the connection is closed */
+        struct Faults {
+            Faults(double latency=0, double errors=0, double truncate=0)
+                :latency(latency)
+                ,errors(errors)
+                ,truncate(truncate) {}
+
+            double latency;
+            double errors;
+            double truncate;
+        };
+
+        /* An object, as it's stored */
+        struct Object {
+            Object(): data(), etag(), crc(), encryption(), modified(0) {}
+
+            std::shared_ptr<const std::string> data;
+            std::string                        etag;
+            std::string                        crc;
+            /* x-amz-server-side-encryption, which makes the ETag opaque */
+            std::string                        encryption;
+            std::time_t                        modified;
+        };
+
+        /* The server. It listens on a port of 127.0.0.1 chosen by the
+         * system, and serves each connection on its own thread until it's
+         * stopped or destroyed */
+        struct Server {
+            explicit Server(bool tls=false, bool http2=false);
+            ~Server();
+
+            /* The port it's listening on */
+            unsigned short port() const { return listening; }
+
+            /* Where to send requests, path-style */
+            AWS::S3::Endpoint endpoint() const {
+                return AWS::S3::Endpoint(
+                    "127.0.0.1:" + std::to_string(listening), true,
+                    context ? "https" : "http");
+            }
+
+            /* The path of a PEM file with the CA that signed our
+             * certificate, if we speak TLS */
+            const std::string& ca() const { return authority; }
+
+            /* How many TLS handshakes have been made, and how many of them
+             * resumed an earlier session rather than starting over */
+            std::size_t handshakes() const { return handshaken; }
+            std::size_t resumed() const { return resumptions; }
+
+            /* Change how the server misbehaves */
+            void setFaults(const Faults& faults);
+
+            /* Check requests signed with Signature Version 4 against a signer
+             * with the same credentials, refusing any that don't match with
+             * a 403. Other requests aren't checked */
+            void setSigner(const std::shared_ptr<const AWS::Auth::V4>& signer);
+
+            /* How many requests have been received, and how many of them
+             * came as HTTP/2 streams */
+            std::size_t requests() const { return count; }
+            std::size_t streams() const { return multiplexed; }
+
+            /* Store and fetch objects directly, without a request. Keys are
+             * given with their leading '/', as paths are elsewhere. An
+             * object may be stored as though it were encrypted and uploaded
+             * without a checksum, so that nothing but its ETag describes it */
+            void store(const std::string& bucket, const std::string& key,
+                const std::string& data, const std::string& encryption="");
+            bool fetch(const std::string& bucket, const std::string& key,
+                std::string& data) const;
+
+            /* Stop listening, and close every connection */
+            void stop();
+        private:
+            /* A parsed request */
+            struct Request {
+                Request()
+                    :verb(), target(), bucket(), key(), query(), headers()
+                    ,body() {}
+
+                std::string                        verb;
+                /* The path and query, as they were sent */
+                std::string                        target;
+                std::string                        bucket;
+                std::string                        key;
+                std::map<std::string, std::string> query;
+                AWS::Curl::Headers                 headers;
+                std::string                        body;
+            };
+
+            /* A response, whose body is either its own or part of an object */
+            struct Response {
+                Response()
+                    :status(200)
+                    ,headers()
+                    ,body()
+                    ,object()
+                    ,offset(0)
+                    ,length(0)
+                    ,truncate(false) {}
+
+                int                                status;
+                AWS::Curl::Headers                 headers;
+                std::string                        body;
+                std::shared_ptr<const std::string> object;
+                std::size_t                        offset;
+                std::size_t                        length;
+                bool                               truncate;
+            };
+
+            /* A connection, which may speak TLS */
+            struct Socket {
+                Socket(int fd, SSL* ssl): fd(fd), ssl(ssl) {}
+
+                /* Like recv() and send() */
+                long receive(char* data, std::size_t size);
+                long send(const char* data, std::size_t size);
+
+                int  fd;
+                SSL* ssl;
+            private:
+                /* Private, unimplemented to prevent use */
+                Socket(const Socket& other);
+                const Socket& operator=(const Socket& other);
+            };
+
+            /* Buffered reads from a connection */
+            struct Reader {
+                Reader(Socket& socket): socket(socket), buffer(), position(0) {}
+
+                /* Read a line, without its CRLF */
+                bool line(std::string& out);
+
+                /* Read exactly `size` bytes */
+                bool read(std::size_t size, std::string& out);
+            private:
+                /* Read more from the socket */
+                bool fill_();
+
+                Socket&     socket;
+                std::string buffer;
+                std::size_t position;
+            };
+
+            /* An HTTP/2 stream, whose request is arriving or has arrived */
+            struct Stream {
+                explicit Stream(long window)
+                    :request(), block(), window(window), ended(false) {}
+
+                Request     request;
+                /* Fragments of a header block, until the last of them */
+                std::string block;
+                /* How much of the response we may send yet */
+                long        window;
+                bool        ended;
+            };
+
+            /* An HTTP/2 connection */
+            struct Session {
+                Session(Socket& socket, Reader& reader)
+                    :socket(socket)
+                    ,reader(reader)
+                    ,streams()
+                    ,ready()
+                    ,table()
+                    ,size(0)
+                    ,capacity(4096)
+                    ,window(65535)
+                    ,initial(65535)
+                    ,frame(16384) {}
+
+                Socket&                    socket;
+                Reader&                    reader;
+                std::map<uint32_t, Stream> streams;
+                /* Streams whose requests have all arrived, in order */
+                std::deque<uint32_t>       ready;
+                /* The HPACK dynamic table, newest first, and its size */
+                std::deque<std::pair<std::string, std::string> > table;
+                std::size_t                size;
+                std::size_t                capacity;
+                /* How much we may send on the connection, how much a new
+                 * stream starts with, and the largest frame we may send */
+                long                       window;
+                long                       initial;
+                std::size_t                frame;
+            private:
+                /* Private, unimplemented to prevent use */
+                Session(const Session& other);
+                const Session& operator=(const Session& other);
+            };
+
+            /* A multipart upload in progress */
+            struct Upload {
+                Upload(): bucket(), key(), parts() {}
+
+                std::string                   bucket;
+                std::string                   key;
+                std::map<std::size_t, Object> parts;
+            };
+
+            typedef std::map<std::string, Object> Bucket;
+
+            /* Accept connections until stopped */
+            void accept_();
+
+            /* Serve requests on a connection until it's closed */
+            void serve_(int fd, std::size_t id);
+
+            /* Make the TLS handshake on a new connection, returning NULL if
+             * it failed */
+            SSL* handshake_(int fd);
+
+            /* Read a request, returning false if the connection is done */
+            bool read_(Reader& reader, Request& request, Socket& socket);
+
+            /* Serve HTTP/2 streams on a connection until it's closed */
+            void multiplex_(Socket& socket, Reader& reader);
+
+            /* Read a frame and act on it, returning false if the connection
+             * is done */
+            bool receive_(Session& session);
+
+            /* Send the response to a stream, returning false if the
+             * connection should be closed */
+            bool reply_(Session& session, uint32_t id, bool head,
+                Response& response);
+
+            /* Answer a request, misbehaving if we've been asked to */
+            void respond_(Request& request, Response& response);
+
+            /* Answer a request */
+            void handle_(Request& request, Response& response);
+            void get_(const Request& request, Response& response, bool head);
+            void put_(Request& request, Response& response);
+            void post_(const Request& request, Response& response);
+            void delete_(const Request& request, Response& response);
+            void deleteObjects_(const Request& request, Response& response);
+            void list_(const Request& request, Response& response);
+
+            /* Send a response, returning false if the connection should be
+             * closed */
+            bool send_(Socket& socket, const Request& request,
+                Response& response);
+
+            /* Join the threads of connections that have closed. The mutex
+             * must be held */
+            void reap_();
+
+            /* Whether a request is signed by our signer, if it needs to be */
+            bool signed_(const Request& request);
+
+            /* Fill in an error response */
+            static void error_(Response& response, int status,
+                const std::string& code, const std::string& message);
+
+            /* Make an object of some data, checking the checksums that came
+             * with it. Returns false if they don't match */
+            static bool object_(Request& request, Object& object);
+
+            /* Decode an aws-chunked payload, keeping its trailers */
+            static bool unchunk_(Request& request);
+
+            /* Fill in the bucket, key and query from a request's target */
+            static void target_(const std::string& target, Request& request);
+
+            /* Send an HTTP/2 frame */
+            static bool emit_(Socket& socket, int type, int flags, uint32_t id,
+                const char* data, std::size_t size);
+
+            /* Decode an HPACK header block into a request, returning false
+             * if it's malformed */
+            static bool decode_(Session& session, const std::string& block,
+                Request& request);
+
+            /* Look up a field in the static or dynamic table */
+            static bool field_(const Session& session, std::size_t index,
+                std::string& name, std::string& value);
+
+            /* Decode an HPACK integer with a `prefix`-bit prefix, a string
+             * and Huffman-coded text, advancing past them */
+            static bool unpack_(const std::string& block,
+                std::size_t& position, int prefix, std::size_t& value);
+            static bool string_(const std::string& block,
+                std::size_t& position, std::string& value);
+            static bool huffman_(const char* data, std::size_t size,
+                std::string& value);
+
+            /* Encode an HPACK string, without Huffman coding */
+            static void literal_(std::string& block, const std::string& text);
+
+            /* Get the text of the first element with the provided name */
+            static std::string element_(const std::string& xml,
+                const std::string& name);
+
+            /* Percent-decode, XML-escape, and format times */
+            static std::string unescape_(const std::string& value);
+            static std::string xml_(const std::string& value);
+            static std::string time_(std::time_t t, bool iso);
+
+            /* The time now, by a clock that files' modified times don't get
+             * ahead of, as they can of time()'s */
+            static std::time_t now_();
+
+            /* Write all of a buffer to a socket */
+            static bool write_(Socket& socket, const char* data,
+                std::size_t size);
+
+            /* Make up a CA and a certificate for 127.0.0.1 signed by it,
+             * writing the CA to a temporary file, and a TLS context that
+             * serves the certificate, and offers HTTP/2 if asked to */
+            static SSL_CTX* context_(std::string& ca, bool http2);
+
+            /* Make a P-256 key */
+            static EVP_PKEY* key_();
+
+            /* Choose HTTP/2 if the client offers it */
+            static int alpn_(SSL* ssl, const unsigned char** out,
+                unsigned char* size, const unsigned char* in,
+                unsigned int in_size, void* argument);
+
+            /* Make a certificate for a key, signed by an issuer, or by
+             * itself if there's no issuer */
+            static X509* certificate_(EVP_PKEY* key, const std::string& name,
+                X509* issuer, EVP_PKEY* signer, bool authority);
+
+            int                      listener;
+            unsigned short           listening;
+            std::atomic<std::size_t> count;
+            std::atomic<std::size_t> multiplexed;
+            std::atomic<bool>        running;
+
+            /* How we speak TLS, if we do */
+            SSL_CTX*                 context;
+            std::string              authority;
+            std::atomic<std::size_t> handshaken;
+            std::atomic<std::size_t> resumptions;
+
+            /* Our objects and uploads, and how we misbehave */
+            mutable std::mutex                  mutex;
+            std::map<std::string, Bucket>       buckets;
+            std::map<std::string, Upload>       uploads;
+            std::size_t                         ids;
+            Faults                              faults;
+            std::mt19937                        generator;
+            std::shared_ptr<const AWS::Auth::V4> signer;
+
+            /* Our threads, and the connections they're serving */
+            std::thread                         acceptor;
+            std::map<std::size_t, std::thread>  threads;
+            std::map<std::size_t, int>          connections;
+            std::vector<std::size_t>            finished;
+
+            /* Private, unimplemented to prevent use */
+            Server(const Server& other);
+            const Server& operator=(const Server& other);
+        };
+    }
+}
+
+/******************************************************************************
+ * Implementations
+ *****************************************************************************/
+inline AWS::Loopback::Server::Server(bool tls, bool http2)
+    :listener(socket(AF_INET, SOCK_STREAM, 0))
+    ,listening(0)
+    ,count(0)
+    ,multiplexed(0)
+    ,running(true)
+    ,context(NULL)
+    ,authority()
+    ,handshaken(0)
+    ,resumptions(0)
+    ,mutex()
+    ,buckets()
+    ,uploads()
+    ,ids(0)
+    ,faults()
+    ,generator(42)
+    ,signer()
+    ,acceptor()
+    ,threads()
+    ,connections()
+    ,finished() {
+    if (tls && !(context = context_(authority, http2))) {
+        std::cerr << "Failed to make a TLS context" << std::endl;
+    }
+
+    int one = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    sockaddr_in address;
+    std::memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = 0;
+    socklen_t length = sizeof(address);
+    if (bind(listener, reinterpret_cast<sockaddr*>(&address), length) != 0 ||
+        listen(listener, 128) != 0 || getsockname(listener,
+            reinterpret_cast<sockaddr*>(&address), &length) != 0) {
+        std::cerr << "Failed to listen on loopback" << std::endl;
+        close(listener);
+        running = false;
+        return;
+    }
+    listening = ntohs(address.sin_port);
+    acceptor = std::thread(&Server::accept_, this);
+}
+
+inline AWS::Loopback::Server::~Server() {
+    stop();
+    if (context) {
+        SSL_CTX_free(context);
+    }
+    if (!authority.empty()) {
+        unlink(authority.c_str());
+    }
+}
+
+inline void AWS::Loopback::Server::setFaults(const Faults& faults) {
+    std::lock_guard<std::mutex> lock(mutex);
+    this->faults = faults;
+}
+
+inline void AWS::Loopback::Server::setSigner(
+    const std::shared_ptr<const AWS::Auth::V4>& signer) {
+    std::lock_guard<std::mutex> lock(mutex);
+    this->signer = signer;
+}
+
+inline void AWS::Loopback::Server::store(const std::string& bucket,
+    const std::string& key, const std::string& data,
+    const std::string& encryption) {
+    Request request;
+    request.body = data;
+    if (!encryption.empty()) {
+        request.headers.add("x-amz-server-side-encryption", encryption);
+    }
+    Object object;
+    object_(request, object);
+    if (!encryption.empty()) {
+        object.crc.clear();
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    buckets[bucket][key.substr(key.find_first_not_of('/'))] = object;
+}
+
+inline bool AWS::Loopback::Server::fetch(const std::string& bucket,
+    const std::string& key, std::string& data) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::map<std::string, Bucket>::const_iterator it(buckets.find(bucket));
+    if (it == buckets.end()) {
+        return false;
+    }
+    Bucket::const_iterator object(
+        it->second.find(key.substr(key.find_first_not_of('/'))));
+    if (object == it->second.end()) {
+        return false;
+    }
+    data = *object->second.data;
+    return true;
+}
+
+inline void AWS::Loopback::Server::stop() {
+    if (!running.exchange(false)) {
+        return;
+    }
+
+    /* Shutting the sockets down wakes up whatever is blocked on them */
+    shutdown(listener, SHUT_RDWR);
+    close(listener);
+    acceptor.join();
+
+    std::map<std::size_t, std::thread> remaining;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::map<std::size_t, int>::iterator it(connections.begin());
+        for (; it != connections.end(); ++it) {
+            shutdown(it->second, SHUT_RDWR);
+        }
+        remaining.swap(threads);
+    }
+    std::map<std::size_t, std::thread>::iterator it(remaining.begin());
+    for (; it != remaining.end(); ++it) {
+        it->second.join();
+    }
+}
+
+inline void AWS::Loopback::Server::accept_() {
+    for (std::size_t id = 0; running; ++id) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        std::lock_guard<std::mutex> lock(mutex);
+        reap_();
+        if (!running) {
+            close(fd);
+            break;
+        }
+        connections[id] = fd;
+        threads[id] = std::thread(&Server::serve_, this, fd, id);
+    }
+}
+
+inline void AWS::Loopback::Server::reap_() {
+    std::vector<std::size_t>::iterator it(finished.begin());
+    for (; it != finished.end(); ++it) {
+        std::map<std::size_t, std::thread>::iterator thread(threads.find(*it));
+        if (thread != threads.end()) {
+            thread->second.join();
+            threads.erase(thread);
+        }
+    }
+    finished.clear();
+}
+
+inline void AWS::Loopback::Server::serve_(int fd, std::size_t id) {
+    SSL* ssl = context ? handshake_(fd) : NULL;
+    Socket socket(fd, ssl);
+    Reader reader(socket);
+
+    /* Clients that negotiated HTTP/2 speak it from the start */
+    const unsigned char* protocol = NULL;
+    unsigned int size = 0;
+    if (ssl) {
+        SSL_get0_alpn_selected(ssl, &protocol, &size);
+    }
+    bool http2 = (size == 2 && std::memcmp(protocol, "h2", 2) == 0);
+    if (http2) {
+        multiplex_(socket, reader);
+    }
+    while (running && !http2 && (ssl || !context)) {
+        Request request;
+        if (!read_(reader, request, socket)) {
+            break;
+        }
+        Response response;
+        respond_(request, response);
+        if (!send_(socket, request, response)) {
+            break;
+        }
+    }
+
+    if (ssl) {
+        SSL_shutdown(ssl);
+        SSL_free(ssl);
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    close(fd);
+    connections.erase(id);
+    finished.push_back(id);
+}
+
+inline void AWS::Loopback::Server::respond_(Request& request,
+    Response& response) {
+    ++count;
+    Faults faults;
+    double errors = 0;
+    double truncate = 0;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        faults = this->faults;
+        std::uniform_real_distribution<double> uniform(0, 1);
+        errors = uniform(generator);
+        truncate = uniform(generator);
+    }
+    if (faults.latency > 0) {
+        std::this_thread::sleep_for(
+            std::chrono::duration<double>(faults.latency));
+    }
+
+    if (errors < faults.errors) {
+        error_(response, 503, "SlowDown", "Please reduce your request rate.");
+    } else {
+        handle_(request, response);
+        response.truncate = truncate < faults.truncate;
+    }
+}
+
+inline bool AWS::Loopback::Server::Reader::fill_() {
+    /* Don't let what's been read pile up */
+    if (position > 65536) {
+        buffer.erase(0, position);
+        position = 0;
+    }
+    char chunk[65536];
+    long received = socket.receive(chunk, sizeof(chunk));
+    if (received <= 0) {
+        return false;
+    }
+    buffer.append(chunk, received);
+    return true;
+}
+
+inline bool AWS::Loopback::Server::Reader::line(std::string& out) {
+    std::size_t end;
+    while ((end = buffer.find("\r\n", position)) == std::string::npos) {
+        if (!fill_()) {
+            return false;
+        }
+    }
+    out.assign(buffer, position, end - position);
+    position = end + 2;
+    return true;
+}
+
+inline bool AWS::Loopback::Server::Reader::read(std::size_t size,
+    std::string& out) {
+    while (buffer.size() - position < size) {
+        if (!fill_()) {
+            return false;
+        }
+    }
+    out.append(buffer, position, size);
+    position += size;
+    return true;
+}
+
+inline SSL* AWS::Loopback::Server::handshake_(int fd) {
+    /* OpenSSL writes with write() rather than send(), so a client that has
+     * hung up would raise SIGPIPE. It's blocked on this thread alone */
+    sigset_t pipe;
+    sigemptyset(&pipe);
+    sigaddset(&pipe, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe, NULL);
+
+    SSL* ssl = SSL_new(context);
+    SSL_set_fd(ssl, fd);
+    if (SSL_accept(ssl) != 1) {
+        SSL_free(ssl);
+        return NULL;
+    }
+    ++handshaken;
+    if (SSL_session_reused(ssl)) {
+        ++resumptions;
+    }
+    return ssl;
+}
+
+inline long AWS::Loopback::Server::Socket::receive(char* data,
+    std::size_t size) {
+    if (ssl) {
+        return SSL_read(ssl, data, static_cast<int>(size));
+    }
+    return recv(fd, data, size, 0);
+}
+
+inline long AWS::Loopback::Server::Socket::send(const char* data,
+    std::size_t size) {
+    if (ssl) {
+        return SSL_write(ssl, data, static_cast<int>(
+            std::min<std::size_t>(size, 1 << 30)));
+    }
+    return ::send(fd, data, size, MSG_NOSIGNAL);
+}
+
+inline bool AWS::Loopback::Server::read_(Reader& reader, Request& request,
+    Socket& socket) {
+    /* The request line, like `GET /bucket/key?query HTTP/1.1` */
+    std::string line;
+    if (!reader.line(line)) {
+        return false;
+    }
+    std::size_t space = line.find(' ');
+    std::size_t end = line.rfind(' ');
+    if (space == std::string::npos || end == space) {
+        return false;
+    }
+    request.verb = line.substr(0, space);
+    target_(line.substr(space + 1, end - space - 1), request);
+
+    /* Then the headers, up to a blank line */
+    while (reader.line(line) && !line.empty()) {
+        std::size_t colon = line.find(':');
+        if (colon == std::string::npos) {
+            continue;
+        }
+        std::size_t value = line.find_first_not_of(' ', colon + 1);
+        request.headers.add(line.substr(0, colon), (value == std::string::npos)
+            ? "" : line.substr(value));
+    }
+
+    /* And then the body, however it's sent */
+    if (boost::iequals(request.headers.get("Expect"), "100-continue")) {
+        static const char proceed[] = "HTTP/1.1 100 Continue\r\n\r\n";
+        write_(socket, proceed, sizeof(proceed) - 1);
+    }
+    if (boost::iequals(request.headers.get("Transfer-Encoding"), "chunked")) {
+        while (reader.line(line)) {
+            std::size_t size = std::strtoul(line.c_str(), NULL, 16);
+            if (size == 0) {
+                /* Trailers, which we don't need */
+                while (reader.line(line) && !line.empty()) {}
+                break;
+            }
+            std::string crlf;
+            if (!reader.read(size, request.body) || !reader.read(2, crlf)) {
+                return false;
+            }
+        }
+    } else {
+        std::string length(request.headers.get("Content-Length"));
+        if (!length.empty() && !reader.read(
+            std::strtoul(length.c_str(), NULL, 10), request.body)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+inline void AWS::Loopback::Server::target_(const std::string& target,
+    Request& request) {
+    request.target = target;
+
+    /* Path-style, the bucket is the first part of the path */
+    std::size_t question = target.find('?');
+    std::string path(unescape_(target.substr(0, question)));
+    std::size_t slash = path.find('/', 1);
+    request.bucket = path.substr(1, slash == std::string::npos ?
+        std::string::npos : slash - 1);
+    if (slash != std::string::npos) {
+        request.key = path.substr(slash + 1);
+    }
+    if (question != std::string::npos) {
+        std::string query(target.substr(question + 1));
+        std::size_t start = 0;
+        while (start < query.size()) {
+            std::size_t amp = query.find('&', start);
+            std::string pair(query.substr(start, amp == std::string::npos ?
+                std::string::npos : amp - start));
+            std::size_t equals = pair.find('=');
+            request.query[unescape_(pair.substr(0, equals))] =
+                (equals == std::string::npos) ? "" :
+                unescape_(pair.substr(equals + 1));
+            start = (amp == std::string::npos) ? query.size() : amp + 1;
+        }
+    }
+}
+
+inline bool AWS::Loopback::Server::unchunk_(Request& request) {
+    /* Each chunk is `size;chunk-signature=...\r\n`, then its data and a CRLF,
+     * and the last is empty. Trailers may follow it */
+    std::string data;
+    std::size_t position = 0;
+    const std::string& body(request.body);
+    while (true) {
+        std::size_t end = body.find("\r\n", position);
+        if (end == std::string::npos) {
+            return false;
+        }
+        std::size_t size = std::strtoul(body.c_str() + position, NULL, 16);
+        position = end + 2;
+        if (size == 0) {
+            break;
+        }
+        if (position + size + 2 > body.size()) {
+            return false;
+        }
+        data.append(body, position, size);
+        position += size + 2;
+    }
+    while (position < body.size()) {
+        std::size_t end = body.find("\r\n", position);
+        if (end == std::string::npos || end == position) {
+            break;
+        }
+        std::string line(body.substr(position, end - position));
+        std::size_t colon = line.find(':');
+        if (colon != std::string::npos) {
+            request.headers.add(line.substr(0, colon), line.substr(colon + 1));
+        }
+        position = end + 2;
+    }
+    request.body.swap(data);
+    return true;
+}
+
+inline bool AWS::Loopback::Server::object_(Request& request, Object& object) {
+    AWS::Checksum::Md5 md5;
+    md5.update(request.body.data(), request.body.size());
+    AWS::Checksum::Crc32c crc;
+    crc.update(request.body.data(), request.body.size());
+
+    std::string expected(request.headers.get("Content-MD5"));
+    if (!expected.empty() && expected != md5.base64()) {
+        return false;
+    }
+    expected = request.headers.get("x-amz-checksum-crc32c");
+    if (!expected.empty() && expected != crc.base64()) {
+        return false;
+    }
+
+    /* Like S3, the ETag of an encrypted object isn't the MD5 of its data */
+    object.encryption = request.headers.get("x-amz-server-side-encryption");
+    if (!object.encryption.empty()) {
+        std::string hex(md5.hex());
+        md5.reset();
+        md5.update(hex.data(), hex.size());
+    }
+    object.etag = "\"" + md5.hex() + "\"";
+    object.crc = crc.base64();
+    object.modified = now_();
+    std::shared_ptr<std::string> data(new std::string());
+    data->swap(request.body);
+    object.data = data;
+    return true;
+}
+
+inline void AWS::Loopback::Server::handle_(Request& request,
+    Response& response) {
+    response.headers.add("x-amz-request-id", std::to_string(count));
+    response.headers.add("Server", "AmazonS3");
+
+    if (request.bucket.empty()) {
+        error_(response, 400, "InvalidRequest", "No bucket was named.");
+    } else if (!signed_(request)) {
+        error_(response, 403, "SignatureDoesNotMatch", "The request "
+            "signature we calculated does not match the signature you "
+            "provided.");
+    } else if (request.verb == "GET" && request.key.empty()) {
+        list_(request, response);
+    } else if (request.verb == "GET" || request.verb == "HEAD") {
+        get_(request, response, request.verb == "HEAD");
+    } else if (request.verb == "PUT") {
+        put_(request, response);
+    } else if (request.verb == "POST" && request.query.count("delete")) {
+        deleteObjects_(request, response);
+    } else if (request.verb == "POST") {
+        post_(request, response);
+    } else if (request.verb == "DELETE") {
+        delete_(request, response);
+    } else {
+        error_(response, 405, "MethodNotAllowed",
+            "The specified method is not allowed against this resource.");
+    }
+}
+
+inline bool AWS::Loopback::Server::signed_(const Request& request) {
+    std::shared_ptr<const AWS::Auth::V4> v4;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        v4 = signer;
+    }
+    static const std::string algorithm("AWS4-HMAC-SHA256");
+    std::string authorization(request.headers.get("Authorization"));
+    if (!v4 || authorization.compare(0, algorithm.size(), algorithm) != 0) {
+        return true;
+    }
+
+    /* Sign it again with the headers it says it signed, as they came */
+    std::size_t start = authorization.find("SignedHeaders=");
+    if (start == std::string::npos) {
+        return false;
+    }
+    start += 14;
+    std::size_t end = authorization.find(',', start);
+    std::string names(authorization.substr(start, end == std::string::npos ?
+        std::string::npos : end - start));
+    AWS::Curl::Headers headers;
+    for (std::size_t position = 0; position < names.size(); ) {
+        std::size_t semicolon = names.find(';', position);
+        std::string name(names.substr(position,
+            semicolon == std::string::npos ? std::string::npos :
+                semicolon - position));
+        headers.add(name, request.headers.get(name));
+        position = (semicolon == std::string::npos) ?
+            names.size() : semicolon + 1;
+    }
+    struct tm parts;
+    std::memset(&parts, 0, sizeof(parts));
+    if (!strptime(request.headers.get("x-amz-date").c_str(),
+        "%Y%m%dT%H%M%SZ", &parts)) {
+        return false;
+    }
+    std::size_t question = request.target.find('?');
+    return v4->sign(request.verb, request.target.substr(0, question),
+        (question == std::string::npos) ? "" :
+            request.target.substr(question + 1), headers,
+        request.headers.get("x-amz-content-sha256"),
+        timegm(&parts)).authorization == authorization;
+}
+
+inline void AWS::Loopback::Server::get_(const Request& request,
+    Response& response, bool head) {
+    Object object;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::map<std::string, Bucket>::iterator bucket(
+            buckets.find(request.bucket));
+        Bucket::iterator it;
+        if (bucket == buckets.end() ||
+            (it = bucket->second.find(request.key)) == bucket->second.end()) {
+            error_(response, 404, "NoSuchKey",
+                "The specified key does not exist.");
+            return;
+        }
+        object = it->second;
+    }
+
+    std::string match(request.headers.get("If-Match"));
+    if (!match.empty() && match != object.etag) {
+        error_(response, 412, "PreconditionFailed",
+            "At least one of the pre-conditions you specified did not hold.");
+        return;
+    }
+
+    /* Like S3, If-None-Match takes precedence over If-Modified-Since */
+    std::string none(request.headers.get("If-None-Match"));
+    std::time_t since = request.headers.date("If-Modified-Since");
+    if (none.empty() ? (since && object.modified <= since) :
+        (none == object.etag)) {
+        response.status = 304;
+        response.headers.add("Last-Modified", time_(object.modified, false));
+        response.headers.add("ETag", object.etag);
+        return;
+    }
+
+    /* Only a single range is supported, as `bytes=first-last`, `first-` or
+     * `-suffix` */
+    std::size_t size = object.data->size();
+    std::size_t first = 0;
+    std::size_t last = size ? size - 1 : 0;
+    std::string range(request.headers.get("Range"));
+    bool ranged = (range.compare(0, 6, "bytes=") == 0);
+    if (ranged) {
+        std::size_t dash = range.find('-', 6);
+        std::string from(range.substr(6, dash - 6));
+        std::string to(dash == std::string::npos ? "" : range.substr(dash + 1));
+        if (from.empty()) {
+            first = size - std::min(size,
+                static_cast<std::size_t>(std::strtoull(to.c_str(), NULL, 10)));
+        } else {
+            first = std::strtoull(from.c_str(), NULL, 10);
+            if (!to.empty()) {
+                last = std::min(last, static_cast<std::size_t>(
+                    std::strtoull(to.c_str(), NULL, 10)));
+            }
+        }
+        if (first >= size || first > last) {
+            error_(response, 416, "InvalidRange",
+                "The requested range is not satisfiable");
+            response.headers.add("Content-Range",
+                "bytes */" + std::to_string(size));
+            return;
+        }
+        response.status = 206;
+        response.headers.add("Content-Range", "bytes " +
+            std::to_string(first) + "-" + std::to_string(last) + "/" +
+            std::to_string(size));
+    }
+
+    response.headers.add("Last-Modified", time_(object.modified, false));
+    response.headers.add("ETag", object.etag);
+    response.headers.add("Accept-Ranges", "bytes");
+    response.headers.add("Content-Type", "application/octet-stream");
+    if (!object.encryption.empty()) {
+        response.headers.add("x-amz-server-side-encryption",
+            object.encryption);
+    }
+    if (!ranged && !object.crc.empty() && boost::iequals(
+        request.headers.get("x-amz-checksum-mode"), "ENABLED")) {
+        response.headers.add("x-amz-checksum-crc32c", object.crc);
+    }
+    response.object = object.data;
+    response.offset = first;
+    response.length = size ? last - first + 1 : 0;
+    if (head) {
+        /* The length is still sent, but not the body */
+        response.headers.add("Content-Length",
+            std::to_string(response.length));
+        response.object.reset();
+    }
+}
+
+inline void AWS::Loopback::Server::put_(Request& request, Response& response) {
+    if (request.headers.get("Content-Encoding").find("aws-chunked") !=
+        std::string::npos && !unchunk_(request)) {
+        error_(response, 400, "IncompleteBody",
+            "The request body terminated unexpectedly");
+        return;
+    }
+
+    Object object;
+    if (!object_(request, object)) {
+        error_(response, 400, "BadDigest",
+            "The Content-MD5 or checksum you specified did not match what we "
+            "received.");
+        return;
+    }
+    response.headers.add("ETag", object.etag);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    std::map<std::string, std::string>::const_iterator id(
+        request.query.find("uploadId"));
+    if (id == request.query.end()) {
+        buckets[request.bucket][request.key] = object;
+        return;
+    }
+
+    /* It's a part of a multipart upload */
+    std::map<std::string, Upload>::iterator upload(uploads.find(id->second));
+    if (upload == uploads.end()) {
+        error_(response, 404, "NoSuchUpload",
+            "The specified upload does not exist.");
+        return;
+    }
+    std::map<std::string, std::string>::const_iterator number(
+        request.query.find("partNumber"));
+    std::size_t part = (number == request.query.end()) ? 0 :
+        std::strtoul(number->second.c_str(), NULL, 10);
+    if (part < 1 || part > 10000) {
+        error_(response, 400, "InvalidArgument",
+            "Part number must be an integer between 1 and 10000, inclusive.");
+        return;
+    }
+    upload->second.parts[part] = object;
+}
+
+inline void AWS::Loopback::Server::post_(const Request& request,
+    Response& response) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (request.query.count("uploads")) {
+        /* Like S3's, ids have characters that must be escaped in a query */
+        char id[32];
+        std::snprintf(id, sizeof(id), "upload+%016zx/=", ++ids);
+        Upload& upload(uploads[id]);
+        upload.bucket = request.bucket;
+        upload.key = request.key;
+        response.body =
+            "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+            "<InitiateMultipartUploadResult><Bucket>" + xml_(request.bucket) +
+            "</Bucket><Key>" + xml_(request.key) + "</Key><UploadId>" + id +
+            "</UploadId></InitiateMultipartUploadResult>";
+        return;
+    }
+
+    std::map<std::string, std::string>::const_iterator id(
+        request.query.find("uploadId"));
+    if (id == request.query.end()) {
+        error_(response, 400, "InvalidRequest", "Unsupported POST.");
+        return;
+    }
+    std::map<std::string, Upload>::iterator upload(uploads.find(id->second));
+    if (upload == uploads.end()) {
+        error_(response, 404, "NoSuchUpload",
+            "The specified upload does not exist.");
+        return;
+    }
+
+    /* Stitch together the parts that were listed, which must match those
+     * that were uploaded. Like S3, the ETag is the MD5 of their MD5s, and the
+     * checksum is the CRC32C of their CRC32Cs, each with the count of parts */
+    std::shared_ptr<std::string> data(new std::string());
+    std::string md5s;
+    std::string crcs;
+    std::size_t parts = 0;
+    std::size_t position = 0;
+    while ((position = request.body.find("<Part>", position)) !=
+        std::string::npos) {
+        std::size_t end = request.body.find("</Part>", position);
+        std::string part(request.body.substr(position, end - position));
+        position = end;
+        std::string number(element_(part, "PartNumber"));
+        std::string etag(element_(part, "ETag"));
+        std::map<std::size_t, Object>::const_iterator it(
+            upload->second.parts.find(std::strtoul(number.c_str(), NULL, 10)));
+        if (it == upload->second.parts.end() || it->second.etag != etag) {
+            error_(response, 400, "InvalidPart",
+                "One or more of the specified parts could not be found.");
+            return;
+        }
+        data->append(*it->second.data);
+        for (std::size_t i = 1; i + 1 < etag.size(); i += 2) {
+            md5s.push_back(static_cast<char>(
+                std::strtoul(etag.substr(i, 2).c_str(), NULL, 16)));
+        }
+        std::string crc;
+        AWS::Base64::decode(it->second.crc, crc);
+        crcs.append(crc);
+        ++parts;
+    }
+    if (parts == 0) {
+        error_(response, 400, "MalformedXML", "No parts were listed.");
+        return;
+    }
+
+    Object object;
+    AWS::Checksum::Md5 md5;
+    md5.update(md5s.data(), md5s.size());
+    object.etag = "\"" + md5.hex() + "-" + std::to_string(parts) + "\"";
+    AWS::Checksum::Crc32c crc;
+    crc.update(crcs.data(), crcs.size());
+    object.crc = crc.base64() + "-" + std::to_string(parts);
+    object.modified = now_();
+    object.data = data;
+    buckets[upload->second.bucket][upload->second.key] = object;
+    uploads.erase(upload);
+
+    response.body =
+        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<CompleteMultipartUploadResult><Bucket>" + xml_(request.bucket) +
+        "</Bucket><Key>" + xml_(request.key) + "</Key><ETag>" +
+        xml_(object.etag) + "</ETag></CompleteMultipartUploadResult>";
+}
+
+inline void AWS::Loopback::Server::delete_(const Request& request,
+    Response& response) {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::map<std::string, std::string>::const_iterator id(
+        request.query.find("uploadId"));
+    if (id != request.query.end()) {
+        if (!uploads.erase(id->second)) {
+            error_(response, 404, "NoSuchUpload",
+                "The specified upload does not exist.");
+            return;
+        }
+    } else {
+        buckets[request.bucket].erase(request.key);
+    }
+    response.status = 204;
+}
+
+inline void AWS::Loopback::Server::deleteObjects_(const Request& request,
+    Response& response) {
+    /* S3 insists on a checksum of the list of keys */
+    AWS::Checksum::Md5 md5;
+    md5.update(request.body.data(), request.body.size());
+    std::string expected(request.headers.get("Content-MD5"));
+    if (expected.empty()) {
+        error_(response, 400, "InvalidRequest",
+            "Missing required header for this request: Content-Md5.");
+        return;
+    }
+    if (expected != md5.base64()) {
+        error_(response, 400, "BadDigest",
+            "The Content-MD5 you specified did not match what we received.");
+        return;
+    }
+
+    std::vector<std::string> keys;
+    std::size_t position = 0;
+    while ((position = request.body.find("<Object>", position)) !=
+        std::string::npos) {
+        std::size_t end = request.body.find("</Object>", position);
+        std::string key(element_(
+            request.body.substr(position, end - position), "Key"));
+        keys.push_back(std::string());
+        AWS::Xml::unescape(key.data(), key.size(), keys.back());
+        position = end;
+    }
+    if (keys.empty() || keys.size() > 1000) {
+        error_(response, 400, "MalformedXML",
+            "The XML you provided was not well-formed.");
+        return;
+    }
+    bool quiet = (element_(request.body, "Quiet") == "true");
+
+    std::string& body(response.body);
+    body = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<DeleteResult xmlns=\"http://s3.amazonaws.com/doc/2006-03-01/\">";
+    std::lock_guard<std::mutex> lock(mutex);
+    Bucket& bucket(buckets[request.bucket]);
+    std::uniform_real_distribution<double> uniform(0, 1);
+    std::vector<std::string>::const_iterator it(keys.begin());
+    for (; it != keys.end(); ++it) {
+        if (uniform(generator) < faults.errors) {
+            body += "<Error><Key>" + xml_(*it) + "</Key><Code>InternalError"
+                "</Code><Message>We encountered an internal error. Please "
+                "try again.</Message></Error>";
+            continue;
+        }
+        bucket.erase(*it);
+        if (!quiet) {
+            body += "<Deleted><Key>" + xml_(*it) + "</Key></Deleted>";
+        }
+    }
+    body += "</DeleteResult>";
+    response.headers.add("Content-Type", "application/xml");
+}
+
+inline void AWS::Loopback::Server::list_(const Request& request,
+    Response& response) {
+    std::map<std::string, std::string> query(request.query);
+    bool v2 = (query["list-type"] == "2");
+    std::string prefix(query["prefix"]);
+    std::string delimiter(query["delimiter"]);
+    std::size_t most = query.count("max-keys") ?
+        std::strtoul(query["max-keys"].c_str(), NULL, 10) : 1000;
+
+    /* Continuation tokens are opaque, but ours are just the last key */
+    std::string after(v2 ? query["start-after"] : query["marker"]);
+    std::string token(query["continuation-token"]);
+    if (v2 && !token.empty()) {
+        AWS::Base64::decode(token, after);
+    }
+
+    std::string contents;
+    std::string prefixes;
+    std::string last;
+    std::size_t keys = 0;
+    bool truncated = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Bucket& bucket(buckets[request.bucket]);
+        Bucket::const_iterator it(bucket.upper_bound(after));
+        for (; it != bucket.end(); ++it) {
+            const std::string& key(it->first);
+            if (key.compare(0, prefix.size(), prefix) != 0) {
+                if (key > prefix) {
+                    break;
+                }
+                continue;
+            }
+
+            /* Keys with the delimiter after the prefix are rolled up */
+            std::size_t found = delimiter.empty() ? std::string::npos :
+                key.find(delimiter, prefix.size());
+            std::string common;
+            if (found != std::string::npos) {
+                common = key.substr(0, found + delimiter.size());
+                if (common <= after || common == last) {
+                    continue;
+                }
+            }
+            if (keys == most) {
+                truncated = true;
+                break;
+            }
+            ++keys;
+            if (found != std::string::npos) {
+                last = common;
+                prefixes += "<CommonPrefixes><Prefix>" + xml_(common) +
+                    "</Prefix></CommonPrefixes>";
+            } else {
+                last = key;
+                contents += "<Contents><Key>" + xml_(key) +
+                    "</Key><LastModified>" +
+                    time_(it->second.modified, true) + "</LastModified><ETag>" +
+                    xml_(it->second.etag) + "</ETag><Size>" +
+                    std::to_string(it->second.data->size()) +
+                    "</Size><StorageClass>STANDARD</StorageClass></Contents>";
+            }
+        }
+    }
+
+    std::string& body(response.body);
+    body = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<ListBucketResult xmlns=\"http://s3.amazonaws.com/doc/2006-03-01/\">"
+        "<Name>" + xml_(request.bucket) + "</Name><Prefix>" + xml_(prefix) +
+        "</Prefix>";
+    if (v2) {
+        body += "<KeyCount>" + std::to_string(keys) + "</KeyCount>";
+        if (!token.empty()) {
+            body += "<ContinuationToken>" + xml_(token) +
+                "</ContinuationToken>";
+        }
+        if (truncated) {
+            body += "<NextContinuationToken>" +
+                xml_(AWS::Base64::encode(last)) + "</NextContinuationToken>";
+        }
+    } else {
+        body += "<Marker>" + xml_(after) + "</Marker>";
+        if (truncated) {
+            body += "<NextMarker>" + xml_(last) + "</NextMarker>";
+        }
+    }
+    body += "<MaxKeys>" + std::to_string(most) + "</MaxKeys>";
+    if (!delimiter.empty()) {
+        body += "<Delimiter>" + xml_(delimiter) + "</Delimiter>";
+    }
+    body += std::string("<IsTruncated>") + (truncated ? "true" : "false") +
+        "</IsTruncated>" + contents + prefixes + "</ListBucketResult>";
+    response.headers.add("Content-Type", "application/xml");
+}
+
+inline void AWS::Loopback::Server::error_(Response& response, int status,
+    const std::string& code, const std::string& message) {
+    response.status = status;
+    response.headers.add("Content-Type", "application/xml");
+    response.body = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<Error><Code>" + code + "</Code><Message>" + xml_(message) +
+        "</Message></Error>";
+}
+
+inline bool AWS::Loopback::Server::send_(Socket& socket,
+    const Request& request, Response& response) {
+    const char* reason = "OK";
+    switch (response.status) {
+        case 204: reason = "No Content"; break;
+        case 206: reason = "Partial Content"; break;
+        case 304: reason = "Not Modified"; break;
+        case 400: reason = "Bad Request"; break;
+        case 404: reason = "Not Found"; break;
+        case 405: reason = "Method Not Allowed"; break;
+        case 412: reason = "Precondition Failed"; break;
+        case 416: reason = "Requested Range Not Satisfiable"; break;
+        case 503: reason = "Service Unavailable"; break;
+    }
+
+    const char* data = response.object ?
+        response.object->data() + response.offset : response.body.data();
+    std::size_t length = response.object ?
+        response.length : response.body.size();
+    AWS::Curl::Headers::Field existing = AWS::Curl::Headers::Field();
+    if (!response.headers.find("Content-Length", existing)) {
+        response.headers.add("Content-Length", std::to_string(length));
+    }
+    if (request.verb == "HEAD") {
+        length = 0;
+    }
+
+    std::string head("HTTP/1.1 " + std::to_string(response.status) + " " +
+        reason + "\r\n");
+    for (std::size_t i = 0; i < response.headers.size(); ++i) {
+        AWS::Curl::Headers::Field field(response.headers.at(i));
+        head.append(field.key, field.key_size).append(": ");
+        head.append(field.value, field.value_size).append("\r\n");
+    }
+    head.append("\r\n");
+
+    /* A truncated response stops halfway through its body */
+    bool truncated = response.truncate && length > 1;
+    if (!write_(socket, head.data(), head.size()) ||
+        !write_(socket, data, truncated ? length / 2 : length)) {
+        return false;
+    }
+    return !truncated &&
+        !boost::iequals(request.headers.get("Connection"), "close");
+}
+
+inline bool AWS::Loopback::Server::write_(Socket& socket, const char* data,
+    std::size_t size) {
+    while (size) {
+        long sent = socket.send(data, size);
+        if (sent <= 0) {
+            return false;
+        }
+        data += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+/******************************************************************************
+ * Implementation of HTTP/2
+ *****************************************************************************/
+inline void AWS::Loopback::Server::multiplex_(Socket& socket, Reader& reader) {
+    /* The client's preface, and then our settings, which are the defaults */
+    static const char preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+    std::string received;
+    if (!reader.read(sizeof(preface) - 1, received) || received != preface ||
+        !emit_(socket, 4, 0, 0, NULL, 0)) {
+        return;
+    }
+
+    Session session(socket, reader);
+    while (running) {
+        if (session.ready.empty()) {
+            if (!receive_(session)) {
+                break;
+            }
+            continue;
+        }
+        uint32_t id = session.ready.front();
+        session.ready.pop_front();
+        std::map<uint32_t, Stream>::iterator stream(session.streams.find(id));
+        if (stream == session.streams.end()) {
+            continue;
+        }
+        /* Copied, since the stream may be reset while it's answered */
+        Request request(stream->second.request);
+        ++multiplexed;
+        Response response;
+        respond_(request, response);
+        if (!reply_(session, id, request.verb == "HEAD", response)) {
+            break;
+        }
+        session.streams.erase(id);
+    }
+}
+
+inline bool AWS::Loopback::Server::receive_(Session& session) {
+    /* Each frame has a length, a type, flags and a stream */
+    std::string header;
+    if (!session.reader.read(9, header)) {
+        return false;
+    }
+    const unsigned char* bytes =
+        reinterpret_cast<const unsigned char*>(header.data());
+    std::size_t length = (bytes[0] << 16) | (bytes[1] << 8) | bytes[2];
+    int type = bytes[3];
+    int flags = bytes[4];
+    uint32_t id = (static_cast<uint32_t>(bytes[5] & 0x7f) << 24) |
+        (bytes[6] << 16) | (bytes[7] << 8) | bytes[8];
+    std::string payload;
+    if (!session.reader.read(length, payload)) {
+        return false;
+    }
+
+    /* DATA and HEADERS may be padded, and HEADERS may carry a priority */
+    if ((type == 0 || type == 1) && (flags & 0x8)) {
+        std::size_t padding = payload.empty() ? 0 :
+            static_cast<unsigned char>(payload[0]);
+        if (padding + 1 > payload.size()) {
+            return false;
+        }
+        payload = payload.substr(1, payload.size() - padding - 1);
+    }
+    if (type == 1 && (flags & 0x20)) {
+        if (payload.size() < 5) {
+            return false;
+        }
+        payload.erase(0, 5);
+    }
+
+    std::map<uint32_t, Stream>::iterator stream(session.streams.find(id));
+    switch (type) {
+        case 0: {
+            /* DATA, which the client may send as much of again */
+            if (stream != session.streams.end()) {
+                stream->second.request.body.append(payload);
+                if (flags & 0x1) {
+                    stream->second.ended = true;
+                    session.ready.push_back(id);
+                }
+            }
+            if (length) {
+                char increment[4] = {
+                    static_cast<char>(length >> 24),
+                    static_cast<char>(length >> 16),
+                    static_cast<char>(length >> 8),
+                    static_cast<char>(length) };
+                if (!emit_(session.socket, 8, 0, 0, increment, 4)) {
+                    return false;
+                }
+                if (stream != session.streams.end() &&
+                    !stream->second.ended &&
+                    !emit_(session.socket, 8, 0, id, increment, 4)) {
+                    return false;
+                }
+            }
+            break;
+        }
+        case 1:
+        case 9: {
+            /* HEADERS starts a stream, or its trailers, and CONTINUATION
+             * carries on with its header block */
+            if (type == 1 && stream == session.streams.end()) {
+                stream = session.streams.insert(std::make_pair(id,
+                    Stream(session.initial))).first;
+            }
+            if (stream == session.streams.end()) {
+                return false;
+            }
+            stream->second.block.append(payload);
+            if (type == 1 && (flags & 0x1)) {
+                stream->second.ended = true;
+            }
+            if (flags & 0x4) {
+                if (!decode_(session, stream->second.block,
+                    stream->second.request)) {
+                    return false;
+                }
+                stream->second.block.clear();
+                if (stream->second.ended) {
+                    session.ready.push_back(id);
+                }
+            }
+            break;
+        }
+        case 3:
+            /* RST_STREAM */
+            if (stream != session.streams.end()) {
+                session.streams.erase(stream);
+            }
+            break;
+        case 4:
+            /* SETTINGS, of which only the window and frame sizes matter */
+            if (flags & 0x1) {
+                break;
+            }
+            for (std::size_t i = 0; i + 6 <= payload.size(); i += 6) {
+                const unsigned char* setting =
+                    reinterpret_cast<const unsigned char*>(payload.data() + i);
+                int key = (setting[0] << 8) | setting[1];
+                long value = (static_cast<long>(setting[2]) << 24) |
+                    (setting[3] << 16) | (setting[4] << 8) | setting[5];
+                if (key == 4) {
+                    std::map<uint32_t, Stream>::iterator it(
+                        session.streams.begin());
+                    for (; it != session.streams.end(); ++it) {
+                        it->second.window += value - session.initial;
+                    }
+                    session.initial = value;
+                } else if (key == 5) {
+                    session.frame = value;
+                }
+            }
+            return emit_(session.socket, 4, 0x1, 0, NULL, 0);
+        case 6:
+            /* PING */
+            if (!(flags & 0x1)) {
+                return emit_(session.socket, 6, 0x1, 0, payload.data(),
+                    payload.size());
+            }
+            break;
+        case 7:
+            /* GOAWAY */
+            return false;
+        case 8: {
+            /* WINDOW_UPDATE */
+            if (payload.size() != 4) {
+                return false;
+            }
+            const unsigned char* value =
+                reinterpret_cast<const unsigned char*>(payload.data());
+            long increment = (static_cast<long>(value[0] & 0x7f) << 24) |
+                (value[1] << 16) | (value[2] << 8) | value[3];
+            if (id == 0) {
+                session.window += increment;
+            } else if (stream != session.streams.end()) {
+                stream->second.window += increment;
+            }
+            break;
+        }
+    }
+    return true;
+}
+
+inline bool AWS::Loopback::Server::reply_(Session& session, uint32_t id,
+    bool head, Response& response) {
+    const char* data = response.object ?
+        response.object->data() + response.offset : response.body.data();
+    std::size_t length = response.object ?
+        response.length : response.body.size();
+    AWS::Curl::Headers::Field existing = AWS::Curl::Headers::Field();
+    if (!response.headers.find("Content-Length", existing)) {
+        response.headers.add("Content-Length", std::to_string(length));
+    }
+    if (head) {
+        length = 0;
+    }
+
+    /* The status has a name in the static table, and everything else is a
+     * literal that isn't indexed, named in lowercase */
+    std::string block(1, '\x08');
+    literal_(block, std::to_string(response.status));
+    for (std::size_t i = 0; i < response.headers.size(); ++i) {
+        AWS::Curl::Headers::Field field(response.headers.at(i));
+        std::string name(field.key, field.key_size);
+        boost::algorithm::to_lower(name);
+        if (name == "connection") {
+            continue;
+        }
+        block.push_back('\0');
+        literal_(block, name);
+        literal_(block, std::string(field.value, field.value_size));
+    }
+    for (std::size_t sent = 0; sent < block.size(); ) {
+        std::size_t size = std::min(block.size() - sent, session.frame);
+        int flags = (sent + size == block.size()) ?
+            (0x4 | (length ? 0 : 0x1)) : 0;
+        if (!emit_(session.socket, sent ? 9 : 1, flags, id,
+            block.data() + sent, size)) {
+            return false;
+        }
+        sent += size;
+    }
+
+    /* The body goes as fast as the client's windows let it. A truncated one
+     * stops halfway through, and the stream is reset */
+    bool truncated = response.truncate && length > 1;
+    std::size_t end = truncated ? length / 2 : length;
+    for (std::size_t sent = 0; sent < end; ) {
+        std::map<uint32_t, Stream>::iterator stream(session.streams.find(id));
+        if (stream == session.streams.end()) {
+            return true;
+        }
+        long allowed = std::min(session.window, stream->second.window);
+        if (allowed <= 0) {
+            if (!receive_(session)) {
+                return false;
+            }
+            continue;
+        }
+        std::size_t size = std::min(std::min(end - sent, session.frame),
+            static_cast<std::size_t>(allowed));
+        if (!emit_(session.socket, 0, (sent + size == length) ? 0x1 : 0, id,
+            data + sent, size)) {
+            return false;
+        }
+        session.window -= size;
+        stream->second.window -= size;
+        sent += size;
+    }
+    if (truncated) {
+        static const char error[] = { 0, 0, 0, 2 };
+        return emit_(session.socket, 3, 0, id, error, sizeof(error));
+    }
+    return true;
+}
+
+inline bool AWS::Loopback::Server::emit_(Socket& socket, int type, int flags,
+    uint32_t id, const char* data, std::size_t size) {
+    char header[9] = {
+        static_cast<char>(size >> 16),
+        static_cast<char>(size >> 8),
+        static_cast<char>(size),
+        static_cast<char>(type),
+        static_cast<char>(flags),
+        static_cast<char>(id >> 24),
+        static_cast<char>(id >> 16),
+        static_cast<char>(id >> 8),
+        static_cast<char>(id) };
+    return write_(socket, header, sizeof(header)) &&
+        write_(socket, data, size);
+}
+
+inline bool AWS::Loopback::Server::decode_(Session& session,
+    const std::string& block, Request& request) {
+    std::size_t position = 0;
+    while (position < block.size()) {
+        unsigned char byte = static_cast<unsigned char>(block[position]);
+        std::size_t index = 0;
+        std::string name;
+        std::string value;
+        bool indexing = false;
+        if (byte & 0x80) {
+            /* A field from one of the tables */
+            if (!unpack_(block, position, 7, index) ||
+                !field_(session, index, name, value)) {
+                return false;
+            }
+        } else if ((byte & 0xe0) == 0x20) {
+            /* A new size for the dynamic table */
+            if (!unpack_(block, position, 5, session.capacity)) {
+                return false;
+            }
+        } else {
+            /* A literal, whose name may be from one of the tables, and which
+             * may be added to the dynamic table */
+            indexing = (byte & 0x40) != 0;
+            std::string ignored;
+            if (!unpack_(block, position, indexing ? 6 : 4, index) ||
+                !(index ? field_(session, index, name, ignored) :
+                    string_(block, position, name)) ||
+                !string_(block, position, value)) {
+                return false;
+            }
+        }
+        if (indexing) {
+            session.table.push_front(std::make_pair(name, value));
+            session.size += name.size() + value.size() + 32;
+        }
+        while (session.size > session.capacity && !session.table.empty()) {
+            session.size -= session.table.back().first.size() +
+                session.table.back().second.size() + 32;
+            session.table.pop_back();
+        }
+
+        if (name == ":method") {
+            request.verb = value;
+        } else if (name == ":path") {
+            target_(value, request);
+        } else if (name == ":authority") {
+            request.headers.add("Host", value);
+        } else if (!name.empty() && name[0] != ':') {
+            request.headers.add(name, value);
+        }
+    }
+    return true;
+}
+
+inline bool AWS::Loopback::Server::field_(const Session& session,
+    std::size_t index, std::string& name, std::string& value) {
+    static const char* const fields[][2] = {
+        { ":authority", "" }, { ":method", "GET" }, { ":method", "POST" },
+        { ":path", "/" }, { ":path", "/index.html" }, { ":scheme", "http" },
+        { ":scheme", "https" }, { ":status", "200" }, { ":status", "204" },
+        { ":status", "206" }, { ":status", "304" }, { ":status", "400" },
+        { ":status", "404" }, { ":status", "500" }, { "accept-charset", "" },
+        { "accept-encoding", "gzip, deflate" }, { "accept-language", "" },
+        { "accept-ranges", "" }, { "accept", "" },
+        { "access-control-allow-origin", "" }, { "age", "" }, { "allow", "" },
+        { "authorization", "" }, { "cache-control", "" },
+        { "content-disposition", "" }, { "content-encoding", "" },
+        { "content-language", "" }, { "content-length", "" },
+        { "content-location", "" }, { "content-range", "" },
+        { "content-type", "" }, { "cookie", "" }, { "date", "" },
+        { "etag", "" }, { "expect", "" }, { "expires", "" }, { "from", "" },
+        { "host", "" }, { "if-match", "" }, { "if-modified-since", "" },
+        { "if-none-match", "" }, { "if-range", "" },
+        { "if-unmodified-since", "" }, { "last-modified", "" },
+        { "link", "" }, { "location", "" }, { "max-forwards", "" },
+        { "proxy-authenticate", "" }, { "proxy-authorization", "" },
+        { "range", "" }, { "referer", "" }, { "refresh", "" },
+        { "retry-after", "" }, { "server", "" }, { "set-cookie", "" },
+        { "strict-transport-security", "" }, { "transfer-encoding", "" },
+        { "user-agent", "" }, { "vary", "" }, { "via", "" },
+        { "www-authenticate", "" } };
+    static const std::size_t count = sizeof(fields) / sizeof(fields[0]);
+    if (index == 0) {
+        return false;
+    } else if (index <= count) {
+        name = fields[index - 1][0];
+        value = fields[index - 1][1];
+        return true;
+    } else if (index - count <= session.table.size()) {
+        name = session.table[index - count - 1].first;
+        value = session.table[index - count - 1].second;
+        return true;
+    }
+    return false;
+}
+
+inline bool AWS::Loopback::Server::unpack_(const std::string& block,
+    std::size_t& position, int prefix, std::size_t& value) {
+    if (position >= block.size()) {
+        return false;
+    }
+    std::size_t limit = (1 << prefix) - 1;
+    value = static_cast<unsigned char>(block[position++]) & limit;
+    if (value < limit) {
+        return true;
+    }
+    for (int shift = 0; position < block.size() && shift < 32; shift += 7) {
+        unsigned char byte = static_cast<unsigned char>(block[position++]);
+        value += static_cast<std::size_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+inline bool AWS::Loopback::Server::string_(const std::string& block,
+    std::size_t& position, std::string& value) {
+    std::size_t length = 0;
+    if (position >= block.size()) {
+        return false;
+    }
+    bool huffman = (block[position] & 0x80) != 0;
+    if (!unpack_(block, position, 7, length) ||
+        length > block.size() - position) {
+        return false;
+    }
+    const char* data = block.data() + position;
+    position += length;
+    if (huffman) {
+        return huffman_(data, length, value);
+    }
+    value.assign(data, length);
+    return true;
+}
+
+inline bool AWS::Loopback::Server::huffman_(const char* data,
+    std::size_t size, std::string& value) {
+    /* The lengths of the codes for each byte, and for the end of the string
+     * (RFC 7541, Appendix B). The code is canonical, so that's all it takes:
+     * the codes of each length count up from where the shorter ones left
+     * off, in the order of the symbols */
+    static const unsigned char lengths[257] = {
+        13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+        28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+        6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+        5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+        13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+        7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+        15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+        6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+        20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+        24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+        22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+        21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+        26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+        19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+        20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+        26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+        30 };
+
+    /* How many codes there are of each length, the first of them, and where
+     * their symbols start among those sorted by length */
+    uint32_t count[31] = { 0 };
+    uint32_t first[31] = { 0 };
+    uint32_t offset[31] = { 0 };
+    for (std::size_t i = 0; i < 257; ++i) {
+        ++count[lengths[i]];
+    }
+    uint32_t code = 0;
+    for (std::size_t length = 1; length <= 30; ++length) {
+        first[length] = code;
+        offset[length] = (length > 1) ?
+            offset[length - 1] + count[length - 1] : 0;
+        code = (code + count[length]) << 1;
+    }
+    uint16_t symbols[257];
+    uint32_t placed[31] = { 0 };
+    for (std::size_t i = 0; i < 257; ++i) {
+        symbols[offset[lengths[i]] + placed[lengths[i]]++] =
+            static_cast<uint16_t>(i);
+    }
+
+    code = 0;
+    std::size_t length = 0;
+    value.clear();
+    for (std::size_t i = 0; i < size * 8; ++i) {
+        code = (code << 1) | ((data[i / 8] >> (7 - i % 8)) & 1);
+        ++length;
+        if (code - first[length] < count[length]) {
+            uint16_t symbol = symbols[offset[length] + code - first[length]];
+            if (symbol == 256) {
+                return false;
+            }
+            value.push_back(static_cast<char>(symbol));
+            code = 0;
+            length = 0;
+        } else if (length == 30) {
+            return false;
+        }
+    }
+    /* What's left is padding, made of the start of the end's code */
+    return length < 8 && code == (1u << length) - 1;
+}
+
+inline void AWS::Loopback::Server::literal_(std::string& block,
+    const std::string& text) {
+    std::size_t length = text.size();
+    if (length < 0x7f) {
+        block.push_back(static_cast<char>(length));
+    } else {
+        block.push_back('\x7f');
+        for (length -= 0x7f; length >= 0x80; length >>= 7) {
+            block.push_back(static_cast<char>((length & 0x7f) | 0x80));
+        }
+        block.push_back(static_cast<char>(length));
+    }
+    block.append(text);
+}
+
+inline X509* AWS::Loopback::Server::certificate_(EVP_PKEY* key,
+    const std::string& name, X509* issuer, EVP_PKEY* signer, bool authority) {
+    static std::atomic<long> serial(1);
+    X509* certificate = X509_new();
+    X509_set_version(certificate, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(certificate), serial++);
+    X509_gmtime_adj(X509_getm_notBefore(certificate), -3600);
+    X509_gmtime_adj(X509_getm_notAfter(certificate), 86400);
+    X509_set_pubkey(certificate, key);
+    X509_NAME_add_entry_by_txt(X509_get_subject_name(certificate), "CN",
+        MBSTRING_ASC, reinterpret_cast<const unsigned char*>(name.c_str()),
+        -1, -1, 0);
+    X509_set_issuer_name(certificate,
+        X509_get_subject_name(issuer ? issuer : certificate));
+
+    /* What it's for, which verification insists on */
+    typedef std::pair<int, const char*> Extension;
+    std::vector<Extension> extensions;
+    if (authority) {
+        extensions.push_back(Extension(NID_basic_constraints,
+            "critical,CA:TRUE"));
+        extensions.push_back(Extension(NID_key_usage,
+            "critical,keyCertSign,cRLSign"));
+        extensions.push_back(Extension(NID_subject_key_identifier, "hash"));
+    } else {
+        extensions.push_back(Extension(NID_basic_constraints, "CA:FALSE"));
+        extensions.push_back(Extension(NID_key_usage,
+            "critical,digitalSignature"));
+        extensions.push_back(Extension(NID_ext_key_usage, "serverAuth"));
+        extensions.push_back(Extension(NID_subject_alt_name,
+            "IP:127.0.0.1,DNS:localhost"));
+        extensions.push_back(Extension(NID_authority_key_identifier,
+            "keyid"));
+    }
+    X509V3_CTX ctx;
+    X509V3_set_ctx_nodb(&ctx);
+    X509V3_set_ctx(&ctx, issuer ? issuer : certificate, certificate, NULL,
+        NULL, 0);
+    std::vector<Extension>::iterator it(extensions.begin());
+    for (; it != extensions.end(); ++it) {
+        X509_EXTENSION* extension = X509V3_EXT_conf_nid(
+            NULL, &ctx, it->first, it->second);
+        X509_add_ext(certificate, extension, -1);
+        X509_EXTENSION_free(extension);
+    }
+
+    X509_sign(certificate, signer, EVP_sha256());
+    return certificate;
+}
+
+inline EVP_PKEY* AWS::Loopback::Server::key_() {
+    /* EVP_EC_gen would do, but only from OpenSSL 3, and this works with 1.1
+     * as well */
+    EVP_PKEY* key = NULL;
+    EVP_PKEY_CTX* context = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+    if (context && EVP_PKEY_keygen_init(context) == 1 &&
+        EVP_PKEY_CTX_set_ec_paramgen_curve_nid(context,
+            NID_X9_62_prime256v1) == 1) {
+        EVP_PKEY_keygen(context, &key);
+    }
+    EVP_PKEY_CTX_free(context);
+    return key;
+}
+
+inline int AWS::Loopback::Server::alpn_(SSL* ssl, const unsigned char** out,
+    unsigned char* size, const unsigned char* in, unsigned int in_size,
+    void* argument) {
+    static const unsigned char protocols[] = "\x02h2\x08http/1.1";
+    unsigned char* selected = NULL;
+    if (SSL_select_next_proto(&selected, size, protocols,
+        sizeof(protocols) - 1, in, in_size) != OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+inline SSL_CTX* AWS::Loopback::Server::context_(std::string& ca, bool http2) {
+    EVP_PKEY* root = key_();
+    EVP_PKEY* key = key_();
+    if (!root || !key) {
+        EVP_PKEY_free(key);
+        EVP_PKEY_free(root);
+        return NULL;
+    }
+    X509* authority = certificate_(root, "awscpp loopback CA", NULL, root,
+        true);
+    X509* certificate = certificate_(key, "127.0.0.1", authority, root, false);
+
+    /* Clients need the CA in a file to verify us with */
+    char path[] = "/tmp/awscpp-loopback-XXXXXX";
+    int fd = mkstemp(path);
+    FILE* file = (fd < 0) ? NULL : fdopen(fd, "w");
+    SSL_CTX* context = NULL;
+    if (file && PEM_write_X509(file, authority) == 1) {
+        ca = path;
+        context = SSL_CTX_new(TLS_server_method());
+        SSL_CTX_use_certificate(context, certificate);
+        SSL_CTX_use_PrivateKey(context, key);
+
+        /* Sessions may be resumed, whether by ticket or by id */
+        static const unsigned char id[] = "awscpp";
+        SSL_CTX_set_session_id_context(context, id, sizeof(id) - 1);
+        if (http2) {
+            SSL_CTX_set_alpn_select_cb(context, Server::alpn_, NULL);
+        }
+    }
+    if (file) {
+        fclose(file);
+    } else if (fd >= 0) {
+        close(fd);
+    }
+    if (!context && fd >= 0) {
+        unlink(path);
+    }
+
+    X509_free(certificate);
+    X509_free(authority);
+    EVP_PKEY_free(key);
+    EVP_PKEY_free(root);
+    return context;
+}
+
+inline std::string AWS::Loopback::Server::unescape_(const std::string& value) {
+    std::string result;
+    result.reserve(value.size());
+    for (std::size_t i = 0; i < value.size(); ++i) {
+        if (value[i] == '%' && i + 2 < value.size() &&
+            std::isxdigit(value[i + 1]) && std::isxdigit(value[i + 2])) {
+            result.push_back(static_cast<char>(
+                std::strtoul(value.substr(i + 1, 2).c_str(), NULL, 16)));
+            i += 2;
+        } else {
+            result.push_back(value[i]);
+        }
+    }
+    return result;
+}
+
+inline std::string AWS::Loopback::Server::element_(const std::string& xml,
+    const std::string& name) {
+    std::size_t start = xml.find("<" + name + ">");
+    if (start == std::string::npos) {
+        return "";
+    }
+    start += name.size() + 2;
+    std::size_t end = xml.find("</" + name + ">", start);
+    return (end == std::string::npos) ? "" : xml.substr(start, end - start);
+}
+
+inline std::string AWS::Loopback::Server::xml_(const std::string& value) {
+    return AWS::Xml::escape(value);
+}
+
+inline std::time_t AWS::Loopback::Server::now_() {
+    return std::chrono::system_clock::to_time_t(
+        std::chrono::system_clock::now());
+}
+
+inline std::string AWS::Loopback::Server::time_(std::time_t t, bool iso) {
+    struct tm parts;
+    gmtime_r(&t, &parts);
+    char buffer[64];
+    std::strftime(buffer, sizeof(buffer), iso ?
+        "%Y-%m-%dT%H:%M:%S.000Z" : "%a, %d %b %Y %H:%M:%S GMT", &parts);
+    return buffer;
+}
+
+#endif
@@ -0,0 +1,339 @@
+/******************************************************************************
+ * Copyright (c) 2013 SEOmoz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#ifndef AWSCPP__METRICS_HPP
+#define AWSCPP__METRICS_HPP
+
+/******************************************************************************
+ * How requests went. Every request made by a Curl::Connection leaves behind a
+ * Stats with curl's timings, the bytes sent and received, and whether it
+ * reused a live connection or was a retry. These are handed to a metrics sink
+ * if one has been provided, like a Recorder, which keeps histograms cheap
+ * enough to update from every request on every thread:
+ *
+ *     std::shared_ptr<AWS::Metrics::Recorder> recorder(
+ *         new AWS::Metrics::Recorder());
+ *     s3.setMetrics(AWS::Metrics::Recorder::sink(recorder));
+ *     ...
+ *     recorder->report(std::cerr);
+ *****************************************************************************/
+
+#include <curl/curl.h>
+
+/* Standard includes */
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <functional>
+#include <iomanip>
+#include <memory>
+#include <ostream>
+#include <stdint.h>
+#include <string>
+
+namespace AWS {
+    namespace Curl {
+        /* The details of a completed request. Like curl's, the times are in
+         * seconds since the request began, so each includes the ones before
+         * it. Those of phases that didn't happen (like connecting, on a
+         * reused connection) are zero */
+        struct Stats {
+            Stats()
+                :verb()
+                ,response(0)
+                ,result(CURLE_OK)
+                ,namelookup(0)
+                ,connect(0)
+                ,tls(0)
+                ,pretransfer(0)
+                ,starttransfer(0)
+                ,total(0)
+                ,uploaded(0)
+                ,downloaded(0)
+                ,retries(0)
+                ,reused(false) {}
+
+            std::string verb;
+            /* The response code, or -1 if there was a curl error */
+            long        response;
+            CURLcode    result;
+
+            double      namelookup;
+            double      connect;
+            double      tls;
+            double      pretransfer;
+            double      starttransfer;
+            double      total;
+
+            std::size_t uploaded;
+            std::size_t downloaded;
+            /* How many attempts at this request came before this one */
+            std::size_t retries;
+            /* Whether it was made on a connection that was already open */
+            bool        reused;
+        };
+    }
+
+    namespace Metrics {
+        /* Where the stats of every completed request are sent. It's invoked
+         * on whichever thread made the request */
+        typedef std::function<void(const AWS::Curl::Stats&)> Sink;
+
+        /* A histogram of non-negative integers, with buckets that grow
+         * exponentially, eight to each power of two, so that any percentile
+         * is within 12.5% of the truth. Recording is a few relaxed atomic
+         * increments, and safe from any thread */
+        class Histogram {
+        public:
+            static const std::size_t buckets = 496;
+
+            Histogram(): counts(), total(0), sum(0), most(0) {}
+
+            /* Record a value */
+            void record(uint64_t value);
+
+            /* How many values, their sum and the largest of them */
+            uint64_t count() const { return total.load(); }
+            uint64_t summed() const { return sum.load(); }
+            uint64_t max() const { return most.load(); }
+
+            /* An upper bound on the value at a quantile, like 0.99 */
+            uint64_t percentile(double quantile) const;
+
+            /* Forget everything recorded */
+            void clear();
+
+            /* The bucket a value falls in, and the largest value in a
+             * bucket */
+            static std::size_t bucket(uint64_t value);
+            static uint64_t upper(std::size_t bucket);
+        private:
+            std::atomic<uint64_t> counts[buckets];
+            std::atomic<uint64_t> total;
+            std::atomic<uint64_t> sum;
+            std::atomic<uint64_t> most;
+
+            /* Private, unimplemented to prevent use */
+            Histogram(const Histogram& other);
+            const Histogram& operator=(const Histogram& other);
+        };
+
+        /* A metrics sink that keeps histograms of how long each phase of a
+         * request takes, in microseconds, and counts of how they turned
+         * out. Connecting and the TLS handshake are only recorded for new
+         * connections, so their counts say how many connections were made */
+        class Recorder {
+        public:
+            Recorder()
+                :namelookup()
+                ,connect()
+                ,tls()
+                ,firstbyte()
+                ,total()
+                ,requests(0)
+                ,errors(0)
+                ,retries(0)
+                ,reused(0)
+                ,uploaded(0)
+                ,downloaded(0)
+                ,responses() {}
+
+            /* Record the stats of a request */
+            void record(const AWS::Curl::Stats& stats);
+
+            /* A sink that records to this, which keeps it alive */
+            static Sink sink(const std::shared_ptr<Recorder>& recorder) {
+                return [recorder](const AWS::Curl::Stats& stats) {
+                    recorder->record(stats);
+                };
+            }
+
+            /* Write a summary of what's been recorded */
+            void report(std::ostream& stream) const;
+
+            /* Forget everything recorded */
+            void clear();
+
+            Histogram namelookup;
+            Histogram connect;
+            Histogram tls;
+            /* From the beginning of the request to the first byte of the
+             * response */
+            Histogram firstbyte;
+            Histogram total;
+
+            std::atomic<uint64_t> requests;
+            /* Requests that ended with a curl error */
+            std::atomic<uint64_t> errors;
+            std::atomic<uint64_t> retries;
+            std::atomic<uint64_t> reused;
+            std::atomic<uint64_t> uploaded;
+            std::atomic<uint64_t> downloaded;
+            /* Responses by their first digit, like 2 for 2xx, or 0 if
+             * there was none */
+            std::atomic<uint64_t> responses[6];
+        private:
+            /* Private, unimplemented to prevent use */
+            Recorder(const Recorder& other);
+            const Recorder& operator=(const Recorder& other);
+        };
+    }
+}
+
+/******************************************************************************
+ * Implementations
+ *****************************************************************************/
+inline std::size_t AWS::Metrics::Histogram::bucket(uint64_t value) {
+    /* Small values each get their own bucket. Past that, the bucket is
+     * chosen by the highest bit that's set, and the three bits after it */
+    if (value < 8) {
+        return static_cast<std::size_t>(value);
+    }
+    std::size_t exponent = 63 - __builtin_clzll(value);
+    std::size_t mantissa = (value >> (exponent - 3)) & 7;
+    return (exponent - 2) * 8 + mantissa;
+}
+
+inline uint64_t AWS::Metrics::Histogram::upper(std::size_t bucket) {
+    if (bucket < 8) {
+        return bucket;
+    }
+    std::size_t exponent = bucket / 8 + 2;
+    uint64_t width = static_cast<uint64_t>(1) << (exponent - 3);
+    return (8 + bucket % 8) * width + (width - 1);
+}
+
+inline void AWS::Metrics::Histogram::record(uint64_t value) {
+    counts[bucket(value)].fetch_add(1, std::memory_order_relaxed);
+    total.fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(value, std::memory_order_relaxed);
+    uint64_t previous = most.load(std::memory_order_relaxed);
+    while (value > previous && !most.compare_exchange_weak(previous, value,
+        std::memory_order_relaxed)) {}
+}
+
+inline uint64_t AWS::Metrics::Histogram::percentile(double quantile) const {
+    uint64_t count = total.load(std::memory_order_relaxed);
+    if (count == 0) {
+        return 0;
+    }
+    /* The rank of the value we're after, counting from one */
+    uint64_t rank = static_cast<uint64_t>(std::ceil(quantile * count));
+    rank = std::max(static_cast<uint64_t>(1), std::min(rank, count));
+    uint64_t seen = 0;
+    for (std::size_t i = 0; i < buckets; ++i) {
+        seen += counts[i].load(std::memory_order_relaxed);
+        if (seen >= rank) {
+            /* No bound is more useful than the largest value itself */
+            return std::min(upper(i), most.load(std::memory_order_relaxed));
+        }
+    }
+    return most.load(std::memory_order_relaxed);
+}
+
+inline void AWS::Metrics::Histogram::clear() {
+    for (std::size_t i = 0; i < buckets; ++i) {
+        counts[i] = 0;
+    }
+    total = 0;
+    sum = 0;
+    most = 0;
+}
+
+inline void AWS::Metrics::Recorder::record(const AWS::Curl::Stats& stats) {
+    requests.fetch_add(1, std::memory_order_relaxed);
+    if (stats.result != CURLE_OK) {
+        errors.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (stats.retries) {
+        retries.fetch_add(1, std::memory_order_relaxed);
+    }
+    uploaded.fetch_add(stats.uploaded, std::memory_order_relaxed);
+    downloaded.fetch_add(stats.downloaded, std::memory_order_relaxed);
+    std::size_t digit = (stats.response > 0 && stats.response < 600) ?
+        static_cast<std::size_t>(stats.response / 100) : 0;
+    responses[digit].fetch_add(1, std::memory_order_relaxed);
+
+    namelookup.record(static_cast<uint64_t>(stats.namelookup * 1e6));
+    if (stats.reused) {
+        reused.fetch_add(1, std::memory_order_relaxed);
+    } else if (stats.connect > 0) {
+        connect.record(static_cast<uint64_t>(
+            (stats.connect - stats.namelookup) * 1e6));
+        if (stats.tls > 0) {
+            tls.record(static_cast<uint64_t>(
+                (stats.tls - stats.connect) * 1e6));
+        }
+    }
+    if (stats.starttransfer > 0) {
+        firstbyte.record(static_cast<uint64_t>(stats.starttransfer * 1e6));
+    }
+    total.record(static_cast<uint64_t>(stats.total * 1e6));
+}
+
+inline void AWS::Metrics::Recorder::report(std::ostream& stream) const {
+    stream << "requests " << requests << " errors " << errors
+           << " retries " << retries << " reused " << reused
+           << " uploaded " << uploaded << " downloaded " << downloaded
+           << std::endl;
+    stream << "responses";
+    for (std::size_t i = 1; i < 6; ++i) {
+        stream << " " << i << "xx " << responses[i];
+    }
+    stream << std::endl;
+
+    const char* names[] = {
+        "namelookup", "connect", "tls", "firstbyte", "total"
+    };
+    const Histogram* histograms[] = {
+        &namelookup, &connect, &tls, &firstbyte, &total
+    };
+    for (std::size_t i = 0; i < 5; ++i) {
+        const Histogram& histogram(*histograms[i]);
+        stream << std::left << std::setw(11) << names[i] << std::right
+               << " count " << histogram.count()
+               << " p50 " << histogram.percentile(0.5) << "us"
+               << " p99 " << histogram.percentile(0.99) << "us"
+               << " p999 " << histogram.percentile(0.999) << "us"
+               << " max " << histogram.max() << "us" << std::endl;
+    }
+}
+
+inline void AWS::Metrics::Recorder::clear() {
+    namelookup.clear();
+    connect.clear();
+    tls.clear();
+    firstbyte.clear();
+    total.clear();
+    requests = 0;
+    errors = 0;
+    retries = 0;
+    reused = 0;
+    uploaded = 0;
+    downloaded = 0;
+    for (std::size_t i = 0; i < 6; ++i) {
+        responses[i] = 0;
+    }
+}
+
+#endif
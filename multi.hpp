@@ -0,0 +1,399 @@
+/******************************************************************************
+ * Copyright (c) 2013 SEOmoz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#ifndef AWSCPP__MULTI_HPP
+#define AWSCPP__MULTI_HPP
+
+/******************************************************************************
+ * An event loop around a curl multi handle, so that many requests may be in
+ * flight at once from a single thread
+ *****************************************************************************/
+
+/* Internal utilities */
+#include "util.hpp"
+#include "pool.hpp"
+
+/* Standard includes */
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <deque>
+#include <map>
+
+namespace AWS {
+    namespace Curl {
+        /* Requests are handed to the event loop, which runs them all
+         * concurrently on its own thread. Each request is made with a
+         * connection checked out of a pool */
+        struct Multi {
+            /* Set up a request on the provided connection. This is invoked
+             * on the event loop thread, once for every attempt. If it (or
+             * Complete) throws, the request is abandoned and the exception
+             * is rethrown by wait() */
+            typedef std::function<void(Connection&)> Prepare;
+
+            /* Invoked on the event loop thread with the response code, or -1
+             * on a curl error, once a request completes. If it returns true,
+             * the request is prepared and made again */
+            typedef std::function<bool(Connection&, long)> Complete;
+
+            /* Given how many times a request has been retried, how many
+             * seconds to wait before retrying it again */
+            typedef std::function<double(std::size_t)> Delay;
+
+            /* Run at most `concurrency` requests at a time */
+            Multi(const std::shared_ptr<Pool>& pool,
+                std::size_t concurrency=256);
+
+            /* Waits for all outstanding requests to complete */
+            ~Multi();
+
+            /* Add a request to be made. If a delay is provided, retries wait
+             * as long as it says before being made */
+            void add(const Prepare& prepare, const Complete& complete,
+                const Delay& delay=Delay());
+
+            /* Block until all outstanding requests have completed. If any
+             * request's callbacks threw, the first exception is rethrown */
+            void wait();
+
+            /* How many requests are outstanding */
+            std::size_t outstanding();
+        private:
+            /* A request that is waiting to be made or is being made */
+            struct Request {
+                Request(const Prepare& prepare, const Complete& complete,
+                    const Delay& delay)
+                    :prepare(prepare)
+                    ,complete(complete)
+                    ,delay(delay)
+                    ,connection(NULL)
+                    ,tries(0)
+                    ,error() {}
+
+                Prepare     prepare;
+                Complete    complete;
+                Delay       delay;
+                Connection* connection;
+                std::size_t tries;
+                /* What its callbacks threw, if anything */
+                std::exception_ptr error;
+            private:
+                /* Private, unimplemented to prevent use */
+                Request(const Request& other);
+                const Request& operator=(const Request& other);
+            };
+
+            /* The event loop itself */
+            void run_();
+
+            /* Move pending requests into the multi handle. The mutex must
+             * not be held */
+            void start_();
+
+            /* Deal with any completed transfers */
+            void finish_();
+
+            /* Abandon a request whose callbacks threw, keeping the exception
+             * for wait() */
+            void fail_(Request* request);
+
+            /* Block until all outstanding requests have completed */
+            void drain_();
+
+            /* Move delayed retries that are due into pending, returning how
+             * many milliseconds until the next one is due */
+            int wake_();
+
+            /* Unpause transfers that the limiter paused and that are due,
+             * returning how many milliseconds until the next one is */
+            int resume_();
+
+            typedef std::chrono::steady_clock Clock;
+
+            std::shared_ptr<Pool>      pool;
+            CURLM*                     multi;
+            std::size_t                concurrency;
+            std::mutex                 mutex;
+            std::condition_variable    idle;
+            std::deque<Request*>       pending;
+            std::map<CURL*, Request*>  active;
+            /* Only the event loop touches these */
+            std::multimap<Clock::time_point, Request*> delayed;
+            std::size_t                count;
+            std::exception_ptr         error;
+            bool                       stopping;
+            std::thread                thread;
+
+            /* Private, unimplemented to prevent use */
+            Multi(const Multi& other);
+            const Multi& operator=(const Multi& other);
+        };
+    }
+}
+
+/******************************************************************************
+ * Implementations
+ *****************************************************************************/
+inline AWS::Curl::Multi::Multi(const std::shared_ptr<Pool>& pool,
+    std::size_t concurrency)
+    :pool(pool)
+    ,multi(curl_multi_init())
+    ,concurrency(concurrency)
+    ,mutex()
+    ,idle()
+    ,pending()
+    ,active()
+    ,delayed()
+    ,count(0)
+    ,error()
+    ,stopping(false)
+    ,thread() {
+    /* Requests that are waiting on a connection to the same host should
+     * wait for it rather than open another one */
+    curl_multi_setopt(multi, CURLMOPT_MAX_TOTAL_CONNECTIONS,
+        static_cast<long>(concurrency));
+    /* And with HTTP/2 (see Transport in util.hpp), they're multiplexed
+     * over the connections there are */
+    curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+}
+
+inline AWS::Curl::Multi::~Multi() {
+    /* A destructor mustn't throw, so what was thrown goes unseen */
+    drain_();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    curl_multi_wakeup(multi);
+    if (thread.joinable()) {
+        thread.join();
+    }
+    curl_multi_cleanup(multi);
+}
+
+inline void AWS::Curl::Multi::add(const Prepare& prepare,
+    const Complete& complete, const Delay& delay) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.push_back(new Request(prepare, complete, delay));
+        ++count;
+        /* The event loop is started the first time it's needed */
+        if (!thread.joinable()) {
+            thread = std::thread(&Multi::run_, this);
+        }
+    }
+    curl_multi_wakeup(multi);
+}
+
+inline void AWS::Curl::Multi::drain_() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (count) {
+        idle.wait(lock);
+    }
+}
+
+inline void AWS::Curl::Multi::wait() {
+    drain_();
+    std::exception_ptr thrown;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        thrown.swap(error);
+    }
+    if (thrown) {
+        std::rethrow_exception(thrown);
+    }
+}
+
+inline void AWS::Curl::Multi::fail_(Request* request) {
+    if (request->connection) {
+        pool->checkin(request->connection);
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!error) {
+        error = request->error;
+    }
+    delete request;
+    if (--count == 0) {
+        idle.notify_all();
+    }
+}
+
+inline std::size_t AWS::Curl::Multi::outstanding() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return count;
+}
+
+inline void AWS::Curl::Multi::start_() {
+    while (active.size() < concurrency) {
+        Request* request = NULL;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (pending.empty()) {
+                return;
+            }
+            request = pending.front();
+            pending.pop_front();
+        }
+
+        /* Those held back by the limiter are already prepared */
+        if (request->connection == NULL) {
+            request->connection = pool->checkout();
+            try {
+                request->prepare(*request->connection);
+            } catch (...) {
+                request->error = std::current_exception();
+                fail_(request);
+                continue;
+            }
+            request->connection->setRetries(request->tries);
+        }
+        double wait = request->connection->admit();
+        if (wait > 0) {
+            delayed.insert(std::make_pair(Clock::now() +
+                std::chrono::microseconds(
+                    static_cast<long long>(wait * 1e6)), request));
+            continue;
+        }
+        CURL* handle = request->connection->handle();
+        active[handle] = request;
+        curl_multi_add_handle(multi, handle);
+    }
+}
+
+inline void AWS::Curl::Multi::finish_() {
+    int queued = 0;
+    CURLMsg* message = NULL;
+    while ((message = curl_multi_info_read(multi, &queued)) != NULL) {
+        if (message->msg != CURLMSG_DONE) {
+            continue;
+        }
+
+        CURL* handle = message->easy_handle;
+        CURLcode result = message->data.result;
+        curl_multi_remove_handle(multi, handle);
+
+        std::map<CURL*, Request*>::iterator it(active.find(handle));
+        Request* request = it->second;
+        active.erase(it);
+
+        request->connection->complete(result);
+        long response = request->connection->stats().response;
+        bool again = false;
+        try {
+            again = request->complete(*request->connection, response);
+        } catch (...) {
+            request->error = std::current_exception();
+            fail_(request);
+            continue;
+        }
+        if (again) {
+            /* Try it again, though behind anything already waiting, and
+             * perhaps after waiting a while */
+            pool->checkin(request->connection);
+            request->connection = NULL;
+            ++request->tries;
+            double wait = request->delay ? request->delay(request->tries) : 0;
+            if (wait > 0) {
+                delayed.insert(std::make_pair(Clock::now() +
+                    std::chrono::microseconds(
+                        static_cast<long long>(wait * 1e6)), request));
+            } else {
+                std::lock_guard<std::mutex> lock(mutex);
+                pending.push_back(request);
+            }
+            continue;
+        }
+
+        pool->checkin(request->connection);
+        delete request;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--count == 0) {
+            idle.notify_all();
+        }
+    }
+}
+
+inline int AWS::Curl::Multi::wake_() {
+    Clock::time_point now = Clock::now();
+    while (!delayed.empty() && delayed.begin()->first <= now) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending.push_back(delayed.begin()->second);
+        }
+        delayed.erase(delayed.begin());
+    }
+
+    if (delayed.empty()) {
+        return 1000;
+    }
+    long long wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+        delayed.begin()->first - now).count() + 1;
+    return static_cast<int>(std::min(wait, 1000LL));
+}
+
+inline int AWS::Curl::Multi::resume_() {
+    double soonest = 1;
+    std::map<CURL*, Request*>::iterator it(active.begin());
+    for (; it != active.end(); ++it) {
+        double wait = it->second->connection->resume();
+        if (wait > 0) {
+            soonest = std::min(soonest, wait);
+        }
+    }
+    return static_cast<int>(soonest * 1000) + 1;
+}
+
+inline void AWS::Curl::Multi::run_() {
+    int running = 0;
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (stopping && !count) {
+                return;
+            }
+        }
+
+        start_();
+        curl_multi_perform(multi, &running);
+        finish_();
+        int timeout = std::min(wake_(), resume_());
+
+        /* Anything waiting on a free slot should start right away */
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!pending.empty() && active.size() < concurrency) {
+                continue;
+            }
+        }
+        curl_multi_poll(multi, NULL, 0, timeout, NULL);
+    }
+}
+
+#endif
@@ -0,0 +1,278 @@
+/******************************************************************************
+ * Copyright (c) 2013 SEOmoz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#ifndef AWSCPP__POOL_HPP
+#define AWSCPP__POOL_HPP
+
+/******************************************************************************
+ * A pool of curl handles, so that connections may be kept alive and reused
+ * between requests, and across threads
+ *****************************************************************************/
+
+/* Internal utilities */
+#include "util.hpp"
+
+/* Standard includes */
+#include <memory>
+#include <mutex>
+#include <ctime>
+#include <vector>
+
+namespace AWS {
+    namespace Curl {
+        /* A curl share object. Handles that use it share their DNS cache
+         * and their TLS sessions. Curl requires that we provide the locking
+         * when it's used from many threads. Connections aren't shared, as
+         * curl doesn't support sharing them between threads; instead, each
+         * handle keeps its own live connections */
+        struct Share {
+            Share();
+            ~Share();
+
+            /* Return the underlying curl share handle */
+            CURLSH* share() { return impl; }
+
+            /* These are for use by curl, and are not meant to be used */
+            static void lock_(CURL* handle, curl_lock_data data,
+                curl_lock_access access, void* userptr);
+            static void unlock_(CURL* handle, curl_lock_data data,
+                void* userptr);
+        private:
+            CURLSH*    impl;
+            std::mutex locks[CURL_LOCK_DATA_LAST];
+
+            /* Private, unimplemented to prevent use */
+            Share(const Share& other);
+            const Share& operator=(const Share& other);
+        };
+
+        /* A pool of connections. Connections are checked out, used for a
+         * single request, and then returned so that the next request may use
+         * its live connection. It's safe to use from many threads */
+        struct Pool {
+            /* The pool keeps at most `size` idle connections around, and
+             * throws away any that have been idle for more than `idle`
+             * seconds. Connections themselves are not reused by curl after
+             * they've been idle for `idle` seconds. Each keeps up to `size`
+             * live connections, one for each host it's talked to */
+            Pool(std::size_t size=16, long idle=60)
+                :share()
+                ,mutex()
+                ,idle()
+                ,size(size)
+                ,timeout(idle)
+                ,metrics()
+                ,limiter()
+                ,transport() {}
+
+            ~Pool();
+
+            /* Check out a connection, making a new one if need be */
+            Connection* checkout();
+
+            /* Return a connection to the pool */
+            void checkin(Connection* connection);
+
+            /* How many idle connections are in the pool */
+            std::size_t available();
+
+            /* Send the stats of every request made with this pool's
+             * connections to a metrics sink (see metrics.hpp). Connections
+             * that are checked out pick it up when they're next checked out */
+            void setMetrics(const AWS::Metrics::Sink& sink);
+
+            /* Share flow control (see limiter.hpp) between every connection
+             * in the pool, picked up as they're checked out */
+            void setLimiter(const std::shared_ptr<Limiter>& limiter);
+
+            /* Talk to the server as described (see Transport in util.hpp),
+             * picked up as connections are checked out. TLS sessions live in
+             * the pool, so every connection resumes them */
+            void setTransport(const Transport& transport);
+
+            /* Check out a connection for the lifetime of this object */
+            struct Handle {
+                Handle(Pool& pool): pool(pool), connection(pool.checkout()) {}
+                ~Handle() { pool.checkin(connection); }
+
+                Connection& operator*() { return *connection; }
+                Connection* operator->() { return connection; }
+            private:
+                Pool&       pool;
+                Connection* connection;
+
+                /* Private, unimplemented to prevent use */
+                Handle(const Handle& other);
+                const Handle& operator=(const Handle& other);
+            };
+        private:
+            /* An idle connection, and when it was returned */
+            typedef std::pair<Connection*, std::time_t> Idle;
+
+            /* Take out connections that have been idle too long, to be
+             * deleted once the mutex, which must be held, is released */
+            void expire_(std::time_t now, std::vector<Connection*>& expired);
+
+            Share             share;
+            std::mutex        mutex;
+            std::vector<Idle> idle;
+            std::size_t       size;
+            long              timeout;
+            std::shared_ptr<const AWS::Metrics::Sink> metrics;
+            std::shared_ptr<Limiter> limiter;
+            std::shared_ptr<const Transport> transport;
+
+            /* Private, unimplemented to prevent use */
+            Pool(const Pool& other);
+            const Pool& operator=(const Pool& other);
+        };
+    }
+}
+
+/******************************************************************************
+ * Implementations
+ *****************************************************************************/
+inline AWS::Curl::Share::Share(): impl(NULL), locks() {
+    /* Global initialization isn't safe to run concurrently with other curl
+     * calls, so we make sure it's happened exactly once before we begin */
+    static const CURLcode initialized = curl_global_init(CURL_GLOBAL_ALL);
+    (void)initialized;
+
+    impl = curl_share_init();
+    curl_share_setopt(impl, CURLSHOPT_LOCKFUNC, AWS::Curl::Share::lock_);
+    curl_share_setopt(impl, CURLSHOPT_UNLOCKFUNC, AWS::Curl::Share::unlock_);
+    curl_share_setopt(impl, CURLSHOPT_USERDATA, reinterpret_cast<void*>(this));
+    curl_share_setopt(impl, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(impl, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+}
+
+inline AWS::Curl::Share::~Share() {
+    curl_share_cleanup(impl);
+}
+
+inline void AWS::Curl::Share::lock_(CURL* handle, curl_lock_data data,
+    curl_lock_access access, void* userptr) {
+    reinterpret_cast<Share*>(userptr)->locks[data].lock();
+}
+
+inline void AWS::Curl::Share::unlock_(CURL* handle, curl_lock_data data,
+    void* userptr) {
+    reinterpret_cast<Share*>(userptr)->locks[data].unlock();
+}
+
+inline AWS::Curl::Pool::~Pool() {
+    /* Connections must go before the share they use */
+    std::vector<Idle>::iterator it(idle.begin());
+    for (; it != idle.end(); ++it) {
+        delete it->first;
+    }
+}
+
+inline void AWS::Curl::Pool::expire_(std::time_t now,
+    std::vector<Connection*>& expired) {
+    /* The oldest connections are at the front */
+    std::vector<Idle>::iterator it(idle.begin());
+    for (; it != idle.end() && (now - it->second) > timeout; ++it) {
+        expired.push_back(it->first);
+    }
+    idle.erase(idle.begin(), it);
+}
+
+inline AWS::Curl::Connection* AWS::Curl::Pool::checkout() {
+    std::vector<Connection*> expired;
+    Connection* connection = NULL;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        expire_(std::time(NULL), expired);
+        /* The most recently used connection is the most likely to still
+         * have a live connection to go with it */
+        if (!idle.empty()) {
+            connection = idle.back().first;
+            idle.pop_back();
+            connection->setMetrics(metrics);
+            connection->setLimiter(limiter);
+            connection->setTransport(transport);
+        }
+    }
+    /* Cleanup may close a socket, so do it outside of the lock */
+    for (std::size_t i = 0; i < expired.size(); ++i) {
+        delete expired[i];
+    }
+    if (connection) {
+        return connection;
+    }
+    connection = new Connection(share.share(), timeout,
+        static_cast<long>(size));
+    std::lock_guard<std::mutex> lock(mutex);
+    connection->setMetrics(metrics);
+    connection->setLimiter(limiter);
+    connection->setTransport(transport);
+    return connection;
+}
+
+inline void AWS::Curl::Pool::setMetrics(const AWS::Metrics::Sink& sink) {
+    std::shared_ptr<const AWS::Metrics::Sink> shared;
+    if (sink) {
+        shared = std::make_shared<const AWS::Metrics::Sink>(sink);
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    metrics = shared;
+}
+
+inline void AWS::Curl::Pool::setLimiter(
+    const std::shared_ptr<Limiter>& limiter) {
+    std::lock_guard<std::mutex> lock(mutex);
+    this->limiter = limiter;
+}
+
+inline void AWS::Curl::Pool::setTransport(const Transport& transport) {
+    std::shared_ptr<const Transport> shared(
+        std::make_shared<const Transport>(transport));
+    std::lock_guard<std::mutex> lock(mutex);
+    this->transport = shared;
+}
+
+inline void AWS::Curl::Pool::checkin(Connection* connection) {
+    std::vector<Connection*> extra;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::time_t now = std::time(NULL);
+        expire_(now, extra);
+        idle.push_back(Idle(connection, now));
+        if (idle.size() > size) {
+            extra.push_back(idle.front().first);
+            idle.erase(idle.begin());
+        }
+    }
+    /* Cleanup may close a socket, so do it outside of the lock */
+    for (std::size_t i = 0; i < extra.size(); ++i) {
+        delete extra[i];
+    }
+}
+
+inline std::size_t AWS::Curl::Pool::available() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return idle.size();
+}
+
+#endif
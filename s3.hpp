@@ -30,17 +30,36 @@
 
 /* Internal utilities */
 #include "util.hpp"
+#include "pool.hpp"
+#include "multi.hpp"
+#include "async.hpp"
+#include "sigv4.hpp"
+#include "xml.hpp"
 
 /* We use apathy for all path manipulations */
 #include <apathy/path.hpp>
 
 /* Standard includes */
 #include <iostream>
+#include <sstream>
 #include <cstdlib>
 #include <string>
 #include <locale>
+#include <cstring>
 #include <ctime>
 #include <cmath>
+#include <memory>
+#include <future>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <thread>
+
+/* For preallocating and writing to local files */
+#include <fcntl.h>
+#include <unistd.h>
 
 namespace AWS {
     namespace S3 {
@@ -83,27 +102,317 @@ namespace AWS {
             };
         }
 
+        /* A policy for retrying failed requests. Curl errors, throttling
+         * (429) and server errors (500, 502, 503 and 504, which includes
+         * SlowDown) are worth retrying, but other client errors will never
+         * succeed, and so are fatal. Retries back off according to one of the
+         * backoff policies, with jitter, and stop once there have been
+         * `attempts` attempts or `deadline` seconds have passed since the
+         * first. Each request of a batch or part of a transfer has its own
+         * deadline, so that one made late in a long operation may still be
+         * retried */
+        struct Retry {
+            /* Given a number of tries, how many seconds to back off */
+            typedef std::function<float(std::size_t)> Policy;
+            typedef std::chrono::steady_clock         Clock;
+
+            Retry(std::size_t attempts=5,
+                const Policy& backoff=Backoff::Exponential(),
+                double deadline=300, double cap=30)
+                :attempts(attempts)
+                ,backoff(backoff)
+                ,deadline(deadline)
+                ,cap(cap) {}
+
+            /* Whether or not a response is worth retrying. A response of -1
+             * means there was a curl error */
+            static bool retryable(long response);
+
+            /* Whether or not an error code that S3 gives for a single key of
+             * a batch is worth retrying */
+            static bool retryable(const std::string& code);
+
+            /* How long to wait after the `tries`th failed attempt. This is
+             * chosen at random up to what the backoff policy says, or `cap`
+             * seconds, whichever is smaller */
+            double delay(std::size_t tries) const;
+
+            /* Whether another attempt should be made after `tries` attempts,
+             * the last of which got `response`, of a request whose first
+             * attempt began at `start`. This doesn't wait */
+            bool allowed(std::size_t tries, long response,
+                const Clock::time_point& start) const;
+
+            /* Like allowed, but waits out the backoff before returning true */
+            bool again(std::size_t tries, long response,
+                const Clock::time_point& start) const;
+
+            std::size_t attempts;
+            Policy      backoff;
+            double      deadline;
+            double      cap;
+        };
+
+        /* Where requests are sent. By default, that's Amazon, with the
+         * bucket named in the host. With `path_style`, the bucket is the
+         * first part of the path instead, which is what most S3-compatible
+         * services (and our loopback server, see loopback.hpp) expect. The
+         * address may include a port */
+        struct Endpoint {
+            Endpoint(const std::string& address="s3.amazonaws.com",
+                bool path_style=false, const std::string& scheme="http")
+                :address(address)
+                ,path_style(path_style)
+                ,scheme(scheme) {}
+
+            /* The host that requests for a bucket are sent to */
+            std::string host(const std::string& bucket) const {
+                return path_style ? address : (bucket + "." + address);
+            }
+
+            /* The scheme and host that requests for a bucket are sent to */
+            std::string url(const std::string& bucket) const {
+                return scheme + "://" + host(bucket);
+            }
+
+            /* The path of an object in a bucket, as it's requested, and
+             * signed: each part of the key is percent-encoded, so that keys
+             * with spaces or characters like '+', '?' and '#' survive */
+            Path path(const std::string& bucket, const Path& object) const {
+                return Path(AWS::Curl::escape(path_style ?
+                    ("/" + bucket + object.string()) : object.string(),
+                    false));
+            }
+
+            std::string address;
+            bool        path_style;
+            std::string scheme;
+        };
+
+        /* What's needed to sign requests. It's kept apart from Connection
+         * so that requests run on an event loop may be signed after the
+         * Connection that made them has gone */
+        struct Signer {
+            Signer(const std::string& access_id,
+                const std::string& secret_key)
+                :access_id(access_id)
+                ,secret_key(secret_key)
+                ,user_agent("awscpp-bot")
+                ,endpoint()
+                ,v4() {}
+
+            /* Reset a connection and add the headers needed to make a signed
+             * request. Any subresources in the query are signed, too, as are
+             * any `extra` headers. With Signature Version 4, the payload isn't
+             * signed */
+            void authorize(AWS::Curl::Connection& curl,
+                const std::string& verb, const std::string& bucket,
+                const Path& object, const std::string& query="",
+                const std::string& content_type="",
+                const std::string& md5="",
+                const AWS::Curl::Headers* extra=NULL) const;
+
+            /* Like authorize, but for an upload of `size` bytes whose payload
+             * is signed chunk by chunk. The result is what's needed to begin
+             * an AWS::Auth::Chunked source, which with `trailer` sends its
+             * CRC32C in a trailer. This requires Signature Version 4 */
+            AWS::Auth::V4::Signature authorizeStreaming(
+                AWS::Curl::Connection& curl, const std::string& verb,
+                const std::string& bucket, const Path& object,
+                std::size_t size, const std::string& query="",
+                const std::string& content_type="", bool trailer=false,
+                const AWS::Curl::Headers* extra=NULL) const;
+
+            std::string access_id;
+            std::string secret_key;
+            std::string user_agent;
+
+            /* Where the requests that are signed will be sent */
+            Endpoint endpoint;
+
+            /* When set, requests are signed with Signature Version 4 */
+            std::shared_ptr<const AWS::Auth::V4> v4;
+        };
+
+        /* An entry in a listing. With a delimiter, keys that share a prefix
+         * up to it are rolled up into a single entry for that prefix */
+        struct Entry {
+            Entry(): key(), etag(), modified(), size(0), prefix(false) {}
+
+            std::string key;
+            std::string etag;
+            std::string modified;
+            std::size_t size;
+            bool        prefix;
+        };
+
+        /* A page of a listing, parsed as it arrives (see xml.hpp) */
+        struct Page {
+            Page()
+                :entries()
+                ,token()
+                ,truncated(false)
+                ,entry()
+                ,depth(0)
+                ,contents(false)
+                ,prefixes(false)
+                ,element() {}
+
+            /* For the parser */
+            void open(const std::string& name);
+            void close(const std::string& name);
+            void text(const std::string& text);
+            void reset();
+
+            std::vector<Entry> entries;
+            /* Where the next page begins, if there is one */
+            std::string        token;
+            bool               truncated;
+        private:
+            Entry       entry;
+            std::size_t depth;
+            bool        contents;
+            bool        prefixes;
+            std::string element;
+        };
+
+        /* Why a key couldn't be deleted */
+        struct Failure {
+            Failure(): key(), code(), message() {}
+
+            std::string key;
+            std::string code;
+            std::string message;
+        };
+
+        /* The result of a DeleteObjects request, parsed as it arrives. When
+         * the whole request failed, `code` has why */
+        struct Deletion {
+            Deletion()
+                :failures()
+                ,code()
+                ,failure()
+                ,depth(0)
+                ,error(false)
+                ,element() {}
+
+            /* For the parser */
+            void open(const std::string& name);
+            void close(const std::string& name);
+            void text(const std::string& text);
+            void reset();
+
+            std::vector<Failure> failures;
+            std::string          code;
+        private:
+            Failure     failure;
+            std::size_t depth;
+            bool        error;
+            std::string element;
+        };
+
         /* A S3 Connection object. When you connect, you provide all your
-         * authentication credintials */
+         * authentication credintials. Requests are made with connections
+         * from a pool, which copies of this object share */
         struct Connection {
             /* Otherwise, you can provide them explicitly */
             Connection(
                 const std::string& access_id,
                 const std::string& secret_key)
-                :access_id(access_id)
-                ,secret_key(secret_key)
-                ,user_agent("awscpp-bot") {}
+                :signer(access_id, secret_key)
+                ,pool(new AWS::Curl::Pool())
+                ,multi(new AWS::Curl::Multi(pool))
+                ,retry()
+                ,checksum(AWS::Checksum::None) {}
+
+            /* Provide your own pool, to size it or to share it */
+            Connection(
+                const std::string& access_id,
+                const std::string& secret_key,
+                const std::shared_ptr<AWS::Curl::Pool>& pool)
+                :signer(access_id, secret_key)
+                ,pool(pool)
+                ,multi(new AWS::Curl::Multi(pool))
+                ,retry()
+                ,checksum(AWS::Checksum::None) {}
 
-            /* Download a S3 resource to a local file */
+            /* Download a S3 resource to a local file, or to any other kind
+             * of sink (see sink.hpp) */
             template <typename T>
             bool get(const std::string& bucket, const Path& object,
                 T& stream, std::size_t retries=5) const;
 
+            /* Download a S3 resource unless it's still the one described by
+             * `entry`, as found by head, a listing or an earlier call, whose
+             * ETag and last modified time are sent as If-None-Match and
+             * If-Modified-Since. Returns 200 if it was downloaded, in which
+             * case `entry` is updated to describe it, 304 if it hadn't
+             * changed, and otherwise the response it failed with */
+            template <typename T>
+            long getIfChanged(const std::string& bucket, const Path& object,
+                T& stream, Entry& entry, std::size_t retries=5) const;
+
             /* Download a S3 resource to a string and return it */
             std::string get(const std::string& bucket, const Path& object,
                 std::size_t retries=5) const;
 
-            /* Post the contents of a stream to a location on S3 */
+            /* Find the size, ETag and last modified time of a S3 resource,
+             * without fetching it. Returns false if it couldn't be found */
+            bool head(const std::string& bucket, const Path& object,
+                Entry& entry, std::size_t retries=5) const;
+
+            /* Like head, for many S3 resources at once, `parallelism` at a
+             * time. `entries` is filled in the same order as `objects`, and
+             * those that couldn't be found are left with an empty key.
+             * Returns whether every one of them was found */
+            bool headMany(const std::string& bucket,
+                const std::vector<Path>& objects, std::vector<Entry>& entries,
+                std::size_t parallelism=64, std::size_t retries=5) const;
+
+            /* Delete a S3 resource */
+            bool del(const std::string& bucket, const Path& object,
+                std::size_t retries=5) const;
+
+            /* Delete many S3 resources with DeleteObjects, `batch` keys (at
+             * most 1000) to a request and `parallelism` requests at a time.
+             * Keys that fail on their own with an error that may go away,
+             * like InternalError, are tried again. Returns the keys that
+             * couldn't be deleted and why, including every key of a request
+             * that failed outright */
+            std::vector<Failure> delMany(const std::string& bucket,
+                const std::vector<Path>& objects, std::size_t batch=1000,
+                std::size_t parallelism=8, std::size_t retries=5) const;
+
+            /* Download a S3 resource to a local file, fetching it as byte
+             * ranges of `part_size` bytes, `parallelism` at a time, each of
+             * which is written directly to its place in the file. It's
+             * written alongside and renamed into place once it's whole, so
+             * a failed download leaves whatever was there before */
+            bool download(const std::string& bucket, const Path& object,
+                const Path& local, std::size_t part_size=8 * 1024 * 1024,
+                std::size_t parallelism=8, std::size_t retries=5) const;
+
+            /* Upload a local file to S3 as a multipart upload. The file is
+             * mapped into memory and parts of `part_size` bytes are sent
+             * directly from it, `parallelism` at a time. Failed parts are
+             * retried on their own, and if any part ultimately fails, the
+             * whole upload is aborted. S3 requires that every part but the
+             * last be at least 5MB, and that there be at most 10,000 parts,
+             * so parts of large files are made bigger (see partSize) */
+            bool upload(const std::string& bucket, const Path& object,
+                const Path& local, std::size_t part_size=8 * 1024 * 1024,
+                std::size_t parallelism=8, std::size_t retries=5);
+
+            /* The most parts a multipart upload may have */
+            static const std::size_t max_parts = 10000;
+
+            /* The size of the parts an upload of `size` bytes is made of:
+             * `part_size`, unless that would take more than max_parts */
+            static std::size_t partSize(std::size_t size,
+                std::size_t part_size);
+
+            /* Post the contents of a stream, or any other kind of source (see
+             * source.hpp), to a location on S3 */
             template <typename T, typename S>
             bool put(const std::string& bucket, const Path& object,
                 T& istream, std::size_t size, S& ostream=std::cerr,
@@ -111,18 +420,165 @@ namespace AWS {
 
             /* Post the contents of a string to a location on S3. This is /not/
              * a specialization of the template put method because here the
-             * stream is a const ref */
+             * stream is a const ref. The string is sent without a copy */
             std::string put(const std::string& bucket, const Path& object,
                 const std::string& stream, std::size_t retries=5);
 
+            /* Invoked from the event loop thread with each object and
+             * whether or not it succeeded as batched requests complete */
+            typedef std::function<void(const Path&, bool)> Callback;
+
+            /* Download many S3 resources concurrently. For each object,
+             * `factory(object)` returns a std::shared_ptr to the sink it
+             * should be downloaded to, which is kept alive until it's done.
+             * Returns a future for each object, in the same order */
+            template <typename Factory>
+            std::vector<std::future<bool> > getMany(const std::string& bucket,
+                const std::vector<Path>& objects, Factory factory,
+                const Callback& callback=Callback(),
+                std::size_t retries=5) const;
+
+            /* Upload many S3 resources concurrently. For each object,
+             * `factory(object)` returns a std::shared_ptr to the source whose
+             * contents should be uploaded (see source.hpp) */
+            template <typename Factory>
+            std::vector<std::future<bool> > putMany(const std::string& bucket,
+                const std::vector<Path>& objects, Factory factory,
+                const Callback& callback=Callback(),
+                std::size_t retries=5);
+
+#ifdef AWSCPP_ASYNC
+            /* Download a S3 resource to a sink, or upload one from a source,
+             * as a coroutine on a reactor (see async.hpp). The connection
+             * and the stream must outlive it */
+            template <typename T>
+            AWS::Async::Task<bool> getAsync(std::string bucket, Path object,
+                T& stream,
+                AWS::Async::Options options=AWS::Async::Options()) const;
+
+            template <typename T>
+            AWS::Async::Task<bool> putAsync(std::string bucket, Path object,
+                T& istream,
+                AWS::Async::Options options=AWS::Async::Options()) const;
+#endif
+
+            /* Invoked with each entry of a listing, in order. If it returns
+             * false, the listing stops */
+            typedef std::function<bool(const Entry&)> Visitor;
+
+            /* List the objects in a bucket whose keys begin with `prefix`
+             * with ListObjectsV2, `page` at a time. Each page is parsed as
+             * it's received, and the next is fetched while the visitor is
+             * going through this one. Returns false if a page couldn't be
+             * fetched, but true if the visitor stopped it */
+            bool list(const std::string& bucket, const Visitor& visitor,
+                const std::string& prefix="", const std::string& delimiter="",
+                std::size_t page=1000, std::size_t retries=5) const;
+
+            /* The query for a page of a ListObjectsV2 listing, beginning
+             * after the key `after`, or where `token` says to */
+            static std::string listQuery(const std::string& prefix,
+                const std::string& delimiter, std::size_t page,
+                const std::string& after="", const std::string& token="");
+
+            /* Fetch a single page of a listing into `page` on the event loop,
+             * for the query made by listQuery */
+            std::future<bool> listPage(const std::string& bucket,
+                const std::string& query, const std::shared_ptr<Page>& page,
+                std::size_t retries=5) const;
+
+            /* Use a different policy for retrying failed requests. How many
+             * attempts are made is still up to each call's `retries` */
+            void setRetry(const Retry& policy) { retry = policy; }
+
+            /* Check the integrity of transfers. Uploads send a checksum for
+             * S3 to check: a Content-MD5, or an x-amz-checksum-crc32c (in a
+             * trailer, with Signature Version 4). Downloads are checked
+             * against the object's CRC32C if it was uploaded with one, or
+             * else its ETag, unless it's encrypted with SSE-KMS or SSE-C.
+             * A mismatch is retried */
+            void setChecksum(AWS::Checksum::Algorithm algorithm) {
+                checksum = algorithm;
+            }
+
+            /* Send requests somewhere other than Amazon, like a
+             * S3-compatible service */
+            void setEndpoint(const Endpoint& endpoint) {
+                signer.endpoint = endpoint;
+            }
+
+            /* Send the stats of every request, including each retry, to a
+             * metrics sink (see metrics.hpp). This applies to every
+             * connection that shares this one's pool */
+            void setMetrics(const AWS::Metrics::Sink& sink) {
+                pool->setMetrics(sink);
+            }
+
+            /* Limit the bytes and requests sent, and how many requests are in
+             * flight to each part of S3 (see limiter.hpp). Like metrics, this
+             * applies to every connection that shares this one's pool, and a
+             * limiter may be shared between pools */
+            void setLimiter(
+                const std::shared_ptr<AWS::Curl::Limiter>& limiter) {
+                pool->setLimiter(limiter);
+            }
+
+            /* Verify servers against a CA bundle, offer HTTP/2 and so on
+             * (see Transport in util.hpp), for every connection that shares
+             * this one's pool. It matters once the endpoint is https */
+            void setTransport(const AWS::Curl::Transport& transport) {
+                pool->setTransport(transport);
+            }
+
+            /* Sign requests with Signature Version 4 for the provided region,
+             * which newer regions require. Otherwise, requests are signed with
+             * the legacy signatures */
+            void setRegion(const std::string& region) {
+                signer.v4 = std::make_shared<const AWS::Auth::V4>(
+                    signer.access_id, signer.secret_key, region);
+            }
+
             /* Do some S3 authentication y'all */
             bool auth(const std::string& url, const std::string& verb,
                 const std::string& contentMD5, const Headers& headers) const;
         private:
             /* We need to know a little bit about the auth here */
-            std::string access_id;
-            std::string secret_key;
-            std::string user_agent;
+            Signer signer;
+
+            /* Where our curl connections come from */
+            std::shared_ptr<AWS::Curl::Pool> pool;
+
+            /* Runs our batched requests */
+            std::shared_ptr<AWS::Curl::Multi> multi;
+
+            /* How we retry failed requests */
+            Retry retry;
+
+            /* How we check the integrity of what we transfer */
+            AWS::Checksum::Algorithm checksum;
+
+            /* Our retry policy, allowing the provided number of attempts */
+            Retry policy_(std::size_t retries) const {
+                Retry policy(retry);
+                policy.attempts = retries;
+                return policy;
+            }
+
+            /* Download a S3 resource, unless it's still `entry` if one is
+             * provided. See getIfChanged */
+            template <typename T>
+            long get_(const std::string& bucket, const Path& object,
+                T& stream, Entry* entry, std::size_t retries) const;
+
+            /* Fill in an entry from the response to a HEAD */
+            static void entry_(const AWS::Curl::Connection& curl,
+                const Path& object, Entry& entry);
+
+            /* Get the text of the first element with the provided name in an
+             * XML response, or an empty string if there is none */
+            static std::string element_(const std::string& xml,
+                const std::string& name);
+
         };
     }
 }
@@ -130,47 +586,205 @@ namespace AWS {
 /******************************************************************************
  * Implementation of S3
  *****************************************************************************/
+inline bool AWS::S3::Retry::retryable(long response) {
+    switch (response) {
+        case -1:
+        case 429:
+        case 500:
+        case 502:
+        case 503:
+        case 504:
+            return true;
+        default:
+            return false;
+    }
+}
+
+inline bool AWS::S3::Retry::retryable(const std::string& code) {
+    return code == "InternalError" || code == "SlowDown" ||
+        code == "ServiceUnavailable";
+}
+
+inline double AWS::S3::Retry::delay(std::size_t tries) const {
+    double most = std::min(static_cast<double>(backoff(tries)), cap);
+    if (most <= 0) {
+        return 0;
+    }
+    /* Spreading retries out keeps many clients from retrying in lockstep */
+    static thread_local std::mt19937 generator((std::random_device())());
+    return std::uniform_real_distribution<double>(0, most)(generator);
+}
+
+inline bool AWS::S3::Retry::allowed(std::size_t tries, long response,
+    const Clock::time_point& start) const {
+    if (tries >= attempts || !retryable(response)) {
+        return false;
+    }
+    return std::chrono::duration<double>(
+        Clock::now() - start).count() < deadline;
+}
+
+inline bool AWS::S3::Retry::again(std::size_t tries, long response,
+    const Clock::time_point& start) const {
+    if (!allowed(tries, response, start)) {
+        return false;
+    }
+    /* Don't sleep past the deadline */
+    double remaining = deadline - std::chrono::duration<double>(
+        Clock::now() - start).count();
+    double wait = std::min(delay(tries), remaining);
+    if (wait > 0) {
+        std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+    }
+    return true;
+}
+
 template <typename T>
 inline bool AWS::S3::Connection::get(const std::string& bucket,
     const Path& object, T& stream, std::size_t retries) const {
+    return get_(bucket, object, stream, NULL, retries) == 200;
+}
+
+template <typename T>
+inline long AWS::S3::Connection::getIfChanged(const std::string& bucket,
+    const Path& object, T& stream, Entry& entry, std::size_t retries) const {
+    return get_(bucket, object, stream, &entry, retries);
+}
+
+template <typename T>
+inline long AWS::S3::Connection::get_(const std::string& bucket,
+    const Path& object, T& stream, Entry* entry, std::size_t retries) const {
     /* Check the original size of the file so that we can rewind if need be */
-    std::streampos position = stream.tellp();
+    typedef AWS::Curl::Sink<T> Sink;
+    typename Sink::Position position = Sink::tell(stream);
 
-    /* Begin forming our request */
-    std::string date = AWS::Auth::date();
-    AWS::Curl::Connection curl;
-    /* And compute our signature */
-    std::string signature = AWS::Auth::signature("GET", "", "", date,
-        curl.get_request_headers(), "/" + bucket + object.string(),
-        secret_key);
+    /* Everything that's written is checked as it's written */
+    AWS::Checksum::Digest digest(checksum);
+    typedef AWS::Checksum::Hashed<T, AWS::Checksum::Digest> Hashed;
+    Hashed hashed(stream, digest);
+    AWS::Curl::Headers extra;
+    if (checksum != AWS::Checksum::None) {
+        extra.add("x-amz-checksum-mode", "ENABLED");
+    }
+    if (entry && !entry->etag.empty()) {
+        extra.add("If-None-Match", entry->etag);
+    }
+    if (entry && !entry->modified.empty()) {
+        /* Listings give times as ISO 8601, but HTTP wants its own */
+        struct tm parts;
+        std::memset(&parts, 0, sizeof(parts));
+        char date[64];
+        if (strptime(entry->modified.c_str(), "%Y-%m-%dT%H:%M:%S", &parts) &&
+            std::strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT",
+                &parts)) {
+            extra.add("If-Modified-Since", date);
+        }
+    }
+
+    /* If a transfer is interrupted partway through, we'll pick up where it
+     * left off, provided the object hasn't changed in the meantime */
+    AWS::Curl::Counted<Hashed> counted(hashed);
+    std::size_t received = 0;
+    std::string etag;
+    std::string crc;
+    bool plain = true;
 
     /* Begin our attempt to fetch */
-    long response=0;
-    for (std::size_t i = 0; (response != 200) && (i < retries); ++i) {
-        stream.seekp(position);
-        curl.reset();
-        curl.addHeader("User-Agent", user_agent);
-        curl.addHeader("Date", date);
-        curl.addHeader("Authorization", "AWS " + access_id + ":" + signature);
-        response = curl.get(
-            bucket + ".s3.amazonaws.com", object.string(), "", stream);
+    std::string host(signer.endpoint.url(bucket));
+    Path path(signer.endpoint.path(bucket, object));
+    Retry policy(policy_(retries));
+    Retry::Clock::time_point start = Retry::Clock::now();
+    AWS::Curl::Pool::Handle curl(*pool);
+    long response = 0;
+    bool corrupt = false;
+
+    /* Once there's something to resume, only the body of a partial response
+     * is any of it, and anything else, like a 503's XML, must be kept out of
+     * both the stream and the digest */
+    CURL* handle = curl->handle();
+    AWS::Curl::Writer writer = [&](const char* data, std::size_t size) {
+        long code = 0;
+        curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &code);
+        if (received && code != 206) {
+            return size;
+        }
+        return AWS::Curl::Sink<AWS::Curl::Counted<Hashed> >::write(counted,
+            data, size);
+    };
+    for (std::size_t tries = 1; ; ++tries) {
+        counted.count = 0;
+        signer.authorize(*curl, "GET", bucket, object, "", "", "", &extra);
+        if (received) {
+            curl->addHeader("Range", "bytes=" + std::to_string(received) + "-");
+            curl->addHeader("If-Match", etag);
+        }
+        response = curl->get(host, path, "", writer);
+
+        /* Only a whole response says what the whole object should be */
+        long status = curl->response();
+        if (status == 200) {
+            etag = curl->responseHeaders().etag();
+            crc = curl->responseHeader("x-amz-checksum-crc32c");
+            plain = AWS::Checksum::Digest::plainEtag(curl->responseHeaders());
+            if (entry) {
+                entry_(*curl, object, *entry);
+            }
+        } else if (status == 304) {
+            return 304;
+        }
+
+        bool restart = false;
+        corrupt = false;
+        if (received ? (response == 206) : (response == 200)) {
+            if (digest.matches(etag, crc, plain)) {
+                break;
+            }
+            std::cerr << "Checksum mismatch fetching " << object.string()
+                      << std::endl;
+            corrupt = restart = true;
+            received = 0;
+        } else if (response == -1 && status == 200 && !received) {
+            /* A curl error after we'd begun getting the body can be resumed */
+            received = etag.empty() ? 0 : counted.count;
+        } else if (response == -1 && status == 206 && received) {
+            received += counted.count;
+        } else if (received && (status == 200 || status == 412)) {
+            /* If the object changed, or the server ignored our range, then
+             * the only thing to do is start again from the top */
+            received = 0;
+            restart = true;
+        } else if (received) {
+            /* Any other failure keeps what was received before it, and
+             * nothing else. The digest has only ever seen those bytes */
+            Sink::seek(stream, position +
+                static_cast<std::streamoff>(received));
+        }
+
+        if (!received) {
+            AWS::Curl::Sink<Hashed>::seek(hashed, position);
+        }
+        if (!policy.again(tries, restart ? -1 : response, start)) {
+            break;
+        }
     }
 
-    if (response != 200) {
-        std::cerr << curl.error() << std::endl;
+    bool success = !corrupt &&
+        ((response == 200) || (received && response == 206));
+    if (!success) {
+        std::cerr << curl->error() << std::endl;
     }
-    
-    stream.flush();
-    return response == 200;
+
+    Sink::flush(stream);
+    return success ? 200 : (corrupt ? -1 : response);
 }
 
 inline std::string AWS::S3::Connection::get(const std::string& bucket,
     const Path& object, std::size_t retries) const {
-    std::ostringstream stream;
-    if (get(bucket, object, stream, retries)) {
-        return stream.str();
+    std::string result;
+    if (get(bucket, object, result, retries)) {
+        return result;
     } else {
-        return "Error: " + stream.str();
+        return "Error: " + result;
     }
 }
 
@@ -179,41 +793,1104 @@ inline bool AWS::S3::Connection::put(const std::string& bucket,
     const Path& object, T& istream, std::size_t size, S& ostream,
     std::size_t retries) {
     /* Check the original read position of the stream so we can seek back */
-    std::streampos iposition = istream.tellg();
-    std::streampos oposition = ostream.tellp();
-
-    /* Begin forming our request */
-    std::string date = AWS::Auth::date();
-    AWS::Curl::Connection curl;
-    /* Compute our signature */
-    std::string signature = AWS::Auth::signature("PUT", "", "", date,
-        curl.get_request_headers(), "/" + bucket + object.string(),
-        secret_key);
+    typedef AWS::Curl::Source<T> Source;
+    typename Source::Position iposition = Source::tell(istream);
+    typedef AWS::Curl::Sink<S> Sink;
+    typename Sink::Position oposition = Sink::tell(ostream);
 
     /* Begin our attempts to upload */
+    std::string host(signer.endpoint.url(bucket));
+    Path path(signer.endpoint.path(bucket, object));
+    Retry policy(policy_(retries));
+    Retry::Clock::time_point start = Retry::Clock::now();
+    AWS::Curl::Pool::Handle curl(*pool);
     long response = 0;
-    for (std::size_t i = 0; (response != 200) && (i < retries); ++i) {
-        istream.seekg(iposition);
-        ostream.seekp(oposition);
-        curl.reset();
-        curl.addHeader("User-Agent", user_agent);
-        curl.addHeader("Date", date);
-        curl.addHeader("Authorization", "AWS " + access_id + ":" + signature);
-        response = curl.put(
-            bucket + ".s3.amazonaws.com", object.string(), "", istream, size,
-            ostream);
-    }
-
-    ostream.flush();
+
+    /* A checksum that must be sent before the payload takes a pass over it
+     * first. With Signature Version 4, a CRC32C can follow the payload
+     * instead, computed as it's sent */
+    bool trailer = signer.v4 && (checksum == AWS::Checksum::CRC32C);
+    std::string md5;
+    AWS::Curl::Headers extra;
+    if (checksum == AWS::Checksum::MD5) {
+        AWS::Checksum::Md5 hash;
+        AWS::Checksum::hashAll(istream, hash);
+        md5 = hash.base64();
+    } else if (checksum == AWS::Checksum::CRC32C && !trailer) {
+        AWS::Checksum::Crc32c hash;
+        AWS::Checksum::hashAll(istream, hash);
+        extra.add("x-amz-checksum-crc32c", hash.base64());
+    }
+
+    /* With Signature Version 4, the payload is signed as it's sent, rather
+     * than making a pass over it first */
+    AWS::Auth::Chunked<T> chunked(istream, size,
+        AWS::Auth::Chunked<T>::default_chunk, trailer);
+    AWS::Curl::Headers streaming(extra);
+    if (!md5.empty()) {
+        streaming.add("Content-MD5", md5);
+    }
+    for (std::size_t tries = 1; ; ++tries) {
+        Source::seek(istream, iposition);
+        Sink::seek(ostream, oposition);
+        if (signer.v4) {
+            chunked.begin(signer.authorizeStreaming(*curl, "PUT", bucket,
+                object, size, "", "", trailer, &streaming));
+            response = curl->put(host, path, "", chunked, chunked.size(),
+                ostream);
+        } else {
+            signer.authorize(*curl, "PUT", bucket, object, "", "", md5, &extra);
+            response = curl->put(host, path, "", istream, size, ostream);
+        }
+        if (response == 200 || !policy.again(tries, response, start)) {
+            break;
+        }
+    }
+
+    Sink::flush(ostream);
     return response == 200;
 }
 
 inline std::string AWS::S3::Connection::put(const std::string& bucket,
     const Path& object, const std::string& input, std::size_t retries) {
-    std::istringstream istream(input);
-    std::ostringstream ostream;
+    /* Curl reads straight out of the string */
+    AWS::Curl::Span istream(input);
+    std::string ostream;
     put(bucket, object, istream, input.size(), ostream, retries);
-    return ostream.str();
+    return ostream;
 }
 
+inline bool AWS::S3::Connection::head(const std::string& bucket,
+    const Path& object, Entry& entry, std::size_t retries) const {
+    std::string host(signer.endpoint.url(bucket));
+    Path path(signer.endpoint.path(bucket, object));
+    Retry policy(policy_(retries));
+    Retry::Clock::time_point start = Retry::Clock::now();
+    AWS::Curl::Pool::Handle curl(*pool);
+    long response = 0;
+    for (std::size_t tries = 1; ; ++tries) {
+        signer.authorize(*curl, "HEAD", bucket, object);
+        response = curl->head(host, path, "");
+        if (response == 200 || !policy.again(tries, response, start)) {
+            break;
+        }
+    }
+    if (response != 200) {
+        std::cerr << "Failed to HEAD " << object.string() << ": "
+                  << curl->error() << std::endl;
+        return false;
+    }
+    entry_(*curl, object, entry);
+    return true;
+}
+
+inline bool AWS::S3::Connection::headMany(const std::string& bucket,
+    const std::vector<Path>& objects, std::vector<Entry>& entries,
+    std::size_t parallelism, std::size_t retries) const {
+    entries.assign(objects.size(), Entry());
+    std::shared_ptr<std::atomic<std::size_t> > failures(
+        new std::atomic<std::size_t>(0));
+    Retry policy(policy_(retries));
+    {
+        /* The entries outlive the engine, which finishes everything first */
+        AWS::Curl::Multi engine(pool, std::max(parallelism,
+            static_cast<std::size_t>(1)));
+        for (std::size_t i = 0; i < objects.size(); ++i) {
+            Path object(objects[i]);
+            std::string host(signer.endpoint.url(bucket));
+            Path path(signer.endpoint.path(bucket, object));
+            Entry* entry = &entries[i];
+            std::shared_ptr<std::size_t> tries(new std::size_t(0));
+            std::shared_ptr<Retry::Clock::time_point> begun(
+                new Retry::Clock::time_point());
+
+            Signer signer(this->signer);
+            engine.add(
+                [=](AWS::Curl::Connection& curl) {
+                    if (*tries == 0) {
+                        *begun = Retry::Clock::now();
+                    }
+                    signer.authorize(curl, "HEAD", bucket, object);
+                    curl.prepareHead(host, path, "");
+                },
+                [=](AWS::Curl::Connection& curl, long response) {
+                    if (response == 200) {
+                        entry_(curl, object, *entry);
+                        return false;
+                    }
+                    if (policy.allowed(++(*tries), response, *begun)) {
+                        return true;
+                    }
+                    /* Those that don't exist aren't worth mentioning */
+                    if (response != 404) {
+                        std::cerr << "Failed to HEAD " << object.string()
+                                  << ": " << curl.error() << std::endl;
+                    }
+                    ++(*failures);
+                    return false;
+                },
+                [=](std::size_t tries) { return policy.delay(tries); });
+        }
+        engine.wait();
+    }
+    return *failures == 0;
+}
+
+inline bool AWS::S3::Connection::del(const std::string& bucket,
+    const Path& object, std::size_t retries) const {
+    std::string host(signer.endpoint.url(bucket));
+    Path path(signer.endpoint.path(bucket, object));
+    Retry policy(policy_(retries));
+    Retry::Clock::time_point start = Retry::Clock::now();
+    AWS::Curl::Pool::Handle curl(*pool);
+    long response = 0;
+    for (std::size_t tries = 1; ; ++tries) {
+        std::string ostream;
+        signer.authorize(*curl, "DELETE", bucket, object);
+        response = curl->del(host, path, "", ostream);
+        if (response == 204 || response == 200 ||
+            !policy.again(tries, response, start)) {
+            break;
+        }
+    }
+    if (response != 204 && response != 200) {
+        std::cerr << "Failed to DELETE " << object.string() << ": "
+                  << curl->error() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+inline std::vector<AWS::S3::Failure> AWS::S3::Connection::delMany(
+    const std::string& bucket, const std::vector<Path>& objects,
+    std::size_t batch, std::size_t parallelism, std::size_t retries) const {
+    batch = std::min(std::max(batch, static_cast<std::size_t>(1)),
+        static_cast<std::size_t>(1000));
+    std::shared_ptr<std::vector<Failure> > failures(
+        new std::vector<Failure>());
+    std::string host(signer.endpoint.url(bucket));
+    Path path(signer.endpoint.path(bucket, Path("/")));
+    Retry policy(policy_(retries));
+    {
+        /* Completions all run on the engine's thread, one at a time */
+        AWS::Curl::Multi engine(pool, std::max(parallelism,
+            static_cast<std::size_t>(1)));
+        for (std::size_t first = 0; first < objects.size(); first += batch) {
+            std::shared_ptr<std::vector<std::string> > keys(
+                new std::vector<std::string>());
+            std::size_t last = std::min(first + batch, objects.size());
+            for (std::size_t i = first; i < last; ++i) {
+                const std::string& key(objects[i].string());
+                keys->push_back(key.substr(std::min(
+                    key.find_first_not_of('/'), key.size())));
+            }
+            std::shared_ptr<std::string> body(new std::string());
+            std::shared_ptr<AWS::Curl::Span> span(new AWS::Curl::Span(*body));
+            std::shared_ptr<Deletion> deletion(new Deletion());
+            std::shared_ptr<AWS::Xml::Parser<Deletion> > parser(
+                new AWS::Xml::Parser<Deletion>(*deletion),
+                [deletion](AWS::Xml::Parser<Deletion>* parser) {
+                    delete parser;
+                });
+            std::shared_ptr<std::size_t> tries(new std::size_t(0));
+            std::shared_ptr<Retry::Clock::time_point> begun(
+                new Retry::Clock::time_point());
+
+            Signer signer(this->signer);
+            engine.add(
+                [=](AWS::Curl::Connection& curl) {
+                    if (*tries == 0) {
+                        *begun = Retry::Clock::now();
+                    }
+                    /* Only the keys that are left are sent again. Errors
+                     * are all we need to hear about */
+                    if (body->empty()) {
+                        *body = "<Delete><Quiet>true</Quiet>";
+                        std::vector<std::string>::const_iterator it(
+                            keys->begin());
+                        for (; it != keys->end(); ++it) {
+                            *body += "<Object><Key>" +
+                                AWS::Xml::escape(*it) + "</Key></Object>";
+                        }
+                        *body += "</Delete>";
+                    }
+                    *span = AWS::Curl::Span(*body);
+                    parser->reset();
+                    AWS::Checksum::Md5 md5;
+                    md5.update(body->data(), body->size());
+                    signer.authorize(curl, "POST", bucket, Path("/"),
+                        "delete", "application/xml", md5.base64());
+                    curl.preparePost(host, path, "delete", *span,
+                        body->size(), *parser);
+                },
+                [=](AWS::Curl::Connection& curl, long response) {
+                    if (response == 200 && parser->good() &&
+                        deletion->code.empty()) {
+                        std::vector<std::string> again;
+                        std::vector<Failure>::const_iterator it(
+                            deletion->failures.begin());
+                        for (; it != deletion->failures.end(); ++it) {
+                            if (Retry::retryable(it->code)) {
+                                again.push_back(it->key);
+                            } else {
+                                failures->push_back(*it);
+                            }
+                        }
+                        if (again.empty()) {
+                            return false;
+                        }
+                        if (policy.allowed(++(*tries), 503, *begun)) {
+                            keys->swap(again);
+                            body->clear();
+                            return true;
+                        }
+                        for (it = deletion->failures.begin();
+                            it != deletion->failures.end(); ++it) {
+                            if (Retry::retryable(it->code)) {
+                                failures->push_back(*it);
+                            }
+                        }
+                        return false;
+                    }
+
+                    /* An error may come with a 200, too */
+                    if (policy.allowed(++(*tries),
+                        (response == 200) ? 500 : response, *begun)) {
+                        return true;
+                    }
+                    std::cerr << "Failed to delete " << keys->size()
+                              << " objects from " << bucket << ": "
+                              << curl.error() << std::endl;
+                    Failure failure;
+                    failure.code = deletion->code.empty() ?
+                        "RequestFailed" : deletion->code;
+                    failure.message = curl.error();
+                    std::vector<std::string>::const_iterator it(
+                        keys->begin());
+                    for (; it != keys->end(); ++it) {
+                        failure.key = *it;
+                        failures->push_back(failure);
+                    }
+                    return false;
+                },
+                [=](std::size_t tries) { return policy.delay(tries); });
+        }
+        engine.wait();
+    }
+    return *failures;
+}
+
+inline void AWS::S3::Connection::entry_(const AWS::Curl::Connection& curl,
+    const Path& object, Entry& entry) {
+    const std::string& key(object.string());
+    entry.key = key.substr(std::min(key.find_first_not_of('/'), key.size()));
+    const AWS::Curl::Headers& headers(curl.responseHeaders());
+    entry.etag = headers.etag();
+    entry.size = 0;
+    headers.contentLength(entry.size);
+    entry.prefix = false;
+
+    /* Formatted like the times in listings */
+    std::time_t modified = headers.lastModified();
+    struct tm parts;
+    char buffer[32];
+    entry.modified.clear();
+    if (modified && gmtime_r(&modified, &parts) && std::strftime(buffer,
+        sizeof(buffer), "%Y-%m-%dT%H:%M:%S.000Z", &parts)) {
+        entry.modified = buffer;
+    }
+}
+
+inline bool AWS::S3::Connection::download(const std::string& bucket,
+    const Path& object, const Path& local, std::size_t part_size,
+    std::size_t parallelism, std::size_t retries) const {
+    /* First, we need to know how big the object is */
+    std::string host(signer.endpoint.url(bucket));
+    Path path(signer.endpoint.path(bucket, object));
+    Entry entry;
+    if (!head(bucket, object, entry, retries)) {
+        return false;
+    }
+    std::size_t size = entry.size;
+    std::string etag(entry.etag);
+
+    /* Now allocate the whole file up front, so that each range may be
+     * written directly to where it belongs */
+    std::string name;
+    int fd = AWS::Curl::temporary(local.string(), name);
+    if (fd < 0) {
+        std::cerr << "Failed to open " << local.string() << std::endl;
+        return false;
+    }
+    if (size && posix_fallocate(fd, 0, size) != 0 && ftruncate(fd, size) != 0) {
+        std::cerr << "Failed to allocate " << local.string() << std::endl;
+        close(fd);
+        unlink(name.c_str());
+        return false;
+    }
+
+    /* Each range gets its own request, run on an engine that's limited to
+     * the parallelism we were asked for. Every range must come from the same
+     * version of the object */
+    part_size = std::max(part_size, static_cast<std::size_t>(1));
+    std::shared_ptr<std::atomic<std::size_t> > failures(
+        new std::atomic<std::size_t>(0));
+    Retry policy(policy_(retries));
+    {
+        AWS::Curl::Multi engine(pool, std::max(parallelism,
+            static_cast<std::size_t>(1)));
+        for (std::size_t start = 0; start < size; start += part_size) {
+            std::size_t end = std::min(start + part_size, size) - 1;
+            bool whole = (start == 0) && (end + 1 == size);
+            /* Nothing may be written past the end of the range, where it
+             * would overwrite the next one */
+            std::shared_ptr<AWS::Curl::Positional> sink(
+                new AWS::Curl::Positional(fd, start, end + 1));
+            std::shared_ptr<AWS::Curl::Writer> writer(
+                new AWS::Curl::Writer());
+            /* Where the current attempt began writing */
+            std::shared_ptr<off_t> from(new off_t(start));
+            std::shared_ptr<std::size_t> tries(new std::size_t(0));
+            std::shared_ptr<Retry::Clock::time_point> begun(
+                new Retry::Clock::time_point());
+
+            Signer signer(this->signer);
+            engine.add(
+                [=](AWS::Curl::Connection& curl) {
+                    if (*tries == 0) {
+                        *begun = Retry::Clock::now();
+                    }
+                    /* A retry picks up wherever the last attempt left off */
+                    *from = sink->offset;
+                    signer.authorize(curl, "GET", bucket, object);
+                    curl.addHeader("Range", "bytes=" +
+                        std::to_string(sink->offset) + "-" +
+                        std::to_string(end));
+                    if (!etag.empty()) {
+                        curl.addHeader("If-Match", etag);
+                    }
+
+                    /* Only the body of a partial response belongs in the
+                     * file, and not that of an error, like a 503's XML */
+                    CURL* handle = curl.handle();
+                    *writer = [sink, handle, whole](const char* data,
+                        std::size_t size) {
+                        long code = 0;
+                        curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE,
+                            &code);
+                        if (code != 206 && !(whole && code == 200)) {
+                            return size;
+                        }
+                        return AWS::Curl::Sink<AWS::Curl::Positional>::write(
+                            *sink, data, size);
+                    };
+                    curl.prepareGet(host, path, "", *writer);
+                },
+                [=](AWS::Curl::Connection& curl, long response) {
+                    /* A server that ignores our range would send it all */
+                    bool complete =
+                        static_cast<std::size_t>(sink->offset) == end + 1;
+                    if (complete && ((response == 206) ||
+                        (whole && response == 200))) {
+                        return false;
+                    }
+
+                    /* Only the body of a partial response is worth keeping */
+                    if (curl.response() != 206) {
+                        sink->offset = *from;
+                    }
+                    if (policy.allowed(++(*tries),
+                        complete ? response : -1, *begun)) {
+                        return true;
+                    }
+                    std::cerr << "Failed to fetch bytes " << start << "-"
+                              << end << " of " << object.string() << ": "
+                              << curl.error() << std::endl;
+                    ++(*failures);
+                    return false;
+                },
+                [=](std::size_t tries) { return policy.delay(tries); });
+        }
+        engine.wait();
+    }
+
+    bool ok = (close(fd) == 0) && (*failures == 0);
+    if (!ok || rename(name.c_str(), local.string().c_str()) != 0) {
+        unlink(name.c_str());
+        return false;
+    }
+    return true;
+}
+
+inline std::size_t AWS::S3::Connection::partSize(std::size_t size,
+    std::size_t part_size) {
+    return std::max(std::max(part_size, static_cast<std::size_t>(1)),
+        (size + max_parts - 1) / max_parts);
+}
+
+inline bool AWS::S3::Connection::upload(const std::string& bucket,
+    const Path& object, const Path& local, std::size_t part_size,
+    std::size_t parallelism, std::size_t retries) {
+    AWS::Curl::Mapping mapping(local);
+    if (!mapping.good()) {
+        std::cerr << "Failed to map " << local.string() << std::endl;
+        return false;
+    }
+
+    /* First, initiate the upload to get its id */
+    std::string host(signer.endpoint.url(bucket));
+    Path path(signer.endpoint.path(bucket, object));
+    std::string upload_id;
+    Retry policy(policy_(retries));
+    Retry::Clock::time_point start = Retry::Clock::now();
+    {
+        /* Part checksums other than MD5 must be declared up front */
+        AWS::Curl::Headers initiate;
+        if (checksum == AWS::Checksum::CRC32C) {
+            initiate.add("x-amz-checksum-algorithm", "CRC32C");
+        }
+        AWS::Curl::Pool::Handle curl(*pool);
+        long response = 0;
+        for (std::size_t tries = 1; ; ++tries) {
+            std::string ostream;
+            AWS::Curl::Span empty(NULL, 0);
+            signer.authorize(*curl, "POST", bucket, object, "uploads",
+                "application/octet-stream", "", &initiate);
+            response = curl->post(
+                host, path, "uploads", empty, 0, ostream);
+            upload_id = element_(ostream, "UploadId");
+            if (response == 200 || !policy.again(tries, response, start)) {
+                break;
+            }
+        }
+        if (response != 200 || upload_id.empty()) {
+            std::cerr << "Failed to initiate upload of " << object.string()
+                      << ": " << curl->error() << std::endl;
+            return false;
+        }
+    }
+    std::string escaped_id(AWS::Curl::escape(upload_id));
+
+    /* Now upload each of the parts, at most `parallelism` at a time. There
+     * is always at least one part, even if it's empty */
+    part_size = partSize(mapping.size(), part_size);
+    std::size_t count = std::max(static_cast<std::size_t>(1),
+        (mapping.size() + part_size - 1) / part_size);
+    std::shared_ptr<std::vector<std::string> > etags(
+        new std::vector<std::string>(count));
+    std::shared_ptr<std::vector<std::string> > sums(
+        new std::vector<std::string>(count));
+    std::shared_ptr<std::atomic<std::size_t> > failures(
+        new std::atomic<std::size_t>(0));
+    AWS::Checksum::Algorithm algorithm(checksum);
+    {
+        AWS::Curl::Multi engine(pool, std::max(parallelism,
+            static_cast<std::size_t>(1)));
+        for (std::size_t i = 0; i < count; ++i) {
+            std::size_t offset = i * part_size;
+            std::size_t length = std::min(part_size, mapping.size() - offset);
+            std::string number(std::to_string(i + 1));
+            /* Signature Version 4 signs the query as it's sent, but the
+             * legacy signatures sign subresources as they are */
+            std::string escaped("partNumber=" + number + "&uploadId=" +
+                escaped_id);
+            std::string query(signer.v4 ? escaped :
+                "partNumber=" + number + "&uploadId=" + upload_id);
+            std::shared_ptr<AWS::Curl::Span> span(new AWS::Curl::Span(
+                mapping.data() + offset, length));
+            std::shared_ptr<std::string> ostream(new std::string());
+            std::shared_ptr<std::size_t> tries(new std::size_t(0));
+            std::shared_ptr<Retry::Clock::time_point> begun(
+                new Retry::Clock::time_point());
+
+            Signer signer(this->signer);
+            engine.add(
+                [=](AWS::Curl::Connection& curl) {
+                    if (*tries == 0) {
+                        *begun = Retry::Clock::now();
+                    }
+                    /* Retrying a part just means starting from its top */
+                    span->offset = 0;
+                    ostream->clear();
+
+                    /* A part's checksum is computed on its first attempt */
+                    std::string& sum((*sums)[i]);
+                    if (sum.empty() && algorithm == AWS::Checksum::MD5) {
+                        AWS::Checksum::Md5 hash;
+                        hash.update(span->data, span->size);
+                        sum = hash.base64();
+                    } else if (sum.empty() &&
+                        algorithm == AWS::Checksum::CRC32C) {
+                        AWS::Checksum::Crc32c hash;
+                        hash.update(span->data, span->size);
+                        sum = hash.base64();
+                    }
+                    AWS::Curl::Headers extra;
+                    if (algorithm == AWS::Checksum::CRC32C) {
+                        extra.add("x-amz-checksum-crc32c", sum);
+                    }
+                    signer.authorize(curl, "PUT", bucket, object, query, "",
+                        (algorithm == AWS::Checksum::MD5) ? sum : "", &extra);
+                    curl.preparePut(host, path, escaped, *span, span->size,
+                        *ostream);
+                },
+                [=](AWS::Curl::Connection& curl, long response) {
+                    std::string etag(curl.responseHeaders().etag());
+                    if (response == 200 && !etag.empty()) {
+                        (*etags)[i] = etag;
+                        return false;
+                    }
+                    /* A success without an ETag is of no use to us */
+                    if (policy.allowed(++(*tries),
+                        (response == 200) ? -1 : response, *begun)) {
+                        return true;
+                    }
+                    std::cerr << "Failed to upload part " << number << " of "
+                              << object.string() << ": " << curl.error()
+                              << std::endl;
+                    ++(*failures);
+                    return false;
+                },
+                [=](std::size_t tries) { return policy.delay(tries); });
+        }
+        engine.wait();
+    }
+
+    AWS::Curl::Pool::Handle curl(*pool);
+    std::string escaped("uploadId=" + escaped_id);
+    std::string query(signer.v4 ? escaped : "uploadId=" + upload_id);
+    if (*failures == 0) {
+        /* Complete the upload by listing all the parts */
+        std::string body("<CompleteMultipartUpload>");
+        for (std::size_t i = 0; i < count; ++i) {
+            body += "<Part><PartNumber>" + std::to_string(i + 1) +
+                "</PartNumber><ETag>" + (*etags)[i] + "</ETag>";
+            if (checksum == AWS::Checksum::CRC32C) {
+                body += "<ChecksumCRC32C>" + (*sums)[i] + "</ChecksumCRC32C>";
+            }
+            body += "</Part>";
+        }
+        body += "</CompleteMultipartUpload>";
+
+        /* However long the parts took, completing gets its own deadline */
+        long response = 0;
+        start = Retry::Clock::now();
+        for (std::size_t tries = 1; ; ++tries) {
+            std::string ostream;
+            AWS::Curl::Span span(body);
+            signer.authorize(*curl, "POST", bucket, object, query,
+                "application/xml");
+            response = curl->post(
+                host, path, escaped, span, body.size(), ostream);
+            /* This may fail even after responding with a 200, in which case
+             * it's worth trying again */
+            if (response == 200) {
+                if (ostream.find("<Error>") == std::string::npos) {
+                    return true;
+                }
+                response = 500;
+            }
+            if (!policy.again(tries, response, start)) {
+                break;
+            }
+        }
+        std::cerr << "Failed to complete upload of " << object.string()
+                  << ": " << curl->error() << std::endl;
+    }
+
+    /* Something failed, so clean up the parts that were uploaded */
+    long response = 0;
+    start = Retry::Clock::now();
+    for (std::size_t tries = 1; ; ++tries) {
+        std::string ostream;
+        signer.authorize(*curl, "DELETE", bucket, object, query);
+        response = curl->del(host, path, escaped, ostream);
+        if (response == 204 || !policy.again(tries, response, start)) {
+            break;
+        }
+    }
+    return false;
+}
+
+inline void AWS::S3::Page::open(const std::string& name) {
+    ++depth;
+    if (depth == 2 && name == "Contents") {
+        contents = true;
+        entry = Entry();
+    } else if (depth == 2 && name == "CommonPrefixes") {
+        prefixes = true;
+        entry = Entry();
+        entry.prefix = true;
+    }
+    element = name;
+}
+
+inline void AWS::S3::Page::close(const std::string& name) {
+    if (depth == 2 && (contents || prefixes)) {
+        entries.push_back(std::move(entry));
+        contents = prefixes = false;
+    }
+    --depth;
+    element.clear();
+}
+
+inline void AWS::S3::Page::text(const std::string& text) {
+    if (contents) {
+        if (element == "Key") {
+            entry.key = text;
+        } else if (element == "ETag") {
+            entry.etag = text;
+        } else if (element == "Size") {
+            entry.size = std::strtoull(text.c_str(), NULL, 10);
+        } else if (element == "LastModified") {
+            entry.modified = text;
+        }
+    } else if (prefixes) {
+        if (element == "Prefix") {
+            entry.key = text;
+        }
+    } else if (depth == 2) {
+        if (element == "NextContinuationToken") {
+            token = text;
+        } else if (element == "IsTruncated") {
+            truncated = (text == "true");
+        }
+    }
+}
+
+inline void AWS::S3::Page::reset() {
+    entries.clear();
+    token.clear();
+    truncated = false;
+    depth = 0;
+    contents = prefixes = false;
+    element.clear();
+}
+
+inline void AWS::S3::Deletion::open(const std::string& name) {
+    ++depth;
+    element = name;
+    /* Errors are either of the whole request, or of one key */
+    if (name == "Error" && depth <= 2) {
+        error = true;
+        failure = Failure();
+    }
+}
+
+inline void AWS::S3::Deletion::close(const std::string& name) {
+    if (error && name == "Error" && depth <= 2) {
+        error = false;
+        if (depth == 2) {
+            failures.push_back(failure);
+        } else if (code.empty()) {
+            code = failure.code.empty() ? "InternalError" : failure.code;
+        }
+    }
+    element.clear();
+    --depth;
+}
+
+inline void AWS::S3::Deletion::text(const std::string& text) {
+    if (!error) {
+        return;
+    }
+    if (element == "Key") {
+        failure.key = text;
+    } else if (element == "Code") {
+        failure.code = text;
+    } else if (element == "Message") {
+        failure.message = text;
+    }
+}
+
+inline void AWS::S3::Deletion::reset() {
+    failures.clear();
+    code.clear();
+    failure = Failure();
+    depth = 0;
+    error = false;
+    element.clear();
+}
+
+inline bool AWS::S3::Connection::list(const std::string& bucket,
+    const Visitor& visitor, const std::string& prefix,
+    const std::string& delimiter, std::size_t page,
+    std::size_t retries) const {
+    /* While one page is visited, the next is fetched into the other */
+    std::shared_ptr<Page> current(new Page());
+    std::shared_ptr<Page> next(new Page());
+    std::future<bool> pending(listPage(bucket,
+        listQuery(prefix, delimiter, page), current, retries));
+    while (true) {
+        if (!pending.get()) {
+            return false;
+        }
+        bool more = current->truncated && !current->token.empty();
+        if (more) {
+            pending = listPage(bucket, listQuery(prefix, delimiter, page, "",
+                current->token), next, retries);
+        }
+
+        /* If we stop early, the page being fetched keeps itself alive */
+        std::vector<Entry>::const_iterator it(current->entries.begin());
+        for (; it != current->entries.end(); ++it) {
+            if (!visitor(*it)) {
+                return true;
+            }
+        }
+        if (!more) {
+            return true;
+        }
+        std::swap(current, next);
+    }
+}
+
+inline std::string AWS::S3::Connection::listQuery(const std::string& prefix,
+    const std::string& delimiter, std::size_t page, const std::string& after,
+    const std::string& token) {
+    std::string query("list-type=2&max-keys=" + std::to_string(page));
+    if (!prefix.empty()) {
+        query += "&prefix=" + AWS::Curl::escape(prefix);
+    }
+    if (!delimiter.empty()) {
+        query += "&delimiter=" + AWS::Curl::escape(delimiter);
+    }
+    if (!token.empty()) {
+        query += "&continuation-token=" + AWS::Curl::escape(token);
+    } else if (!after.empty()) {
+        query += "&start-after=" + AWS::Curl::escape(after);
+    }
+    return query;
+}
+
+inline std::future<bool> AWS::S3::Connection::listPage(
+    const std::string& bucket, const std::string& query,
+    const std::shared_ptr<Page>& page, std::size_t retries) const {
+    Retry policy(policy_(retries));
+    /* The parser keeps the page it fills alive */
+    std::shared_ptr<AWS::Xml::Parser<Page> > parser(
+        new AWS::Xml::Parser<Page>(*page),
+        [page](AWS::Xml::Parser<Page>* parser) { delete parser; });
+    std::shared_ptr<std::promise<bool> > promise(new std::promise<bool>());
+    std::shared_ptr<std::size_t> tries(new std::size_t(0));
+    std::shared_ptr<Retry::Clock::time_point> begun(
+        new Retry::Clock::time_point());
+
+    Signer signer(this->signer);
+    std::string host(signer.endpoint.url(bucket));
+    Path path(signer.endpoint.path(bucket, Path("/")));
+    multi->add(
+        [=](AWS::Curl::Connection& curl) {
+            if (*tries == 0) {
+                *begun = Retry::Clock::now();
+            }
+            /* Each attempt starts the page over */
+            parser->reset();
+            signer.authorize(curl, "GET", bucket, Path("/"), query);
+            curl.prepareGet(host, path, query, *parser);
+        },
+        [=](AWS::Curl::Connection& curl, long response) {
+            if (response == 200 && parser->good()) {
+                promise->set_value(true);
+                return false;
+            }
+            if (policy.allowed(++(*tries), response, *begun)) {
+                return true;
+            }
+            std::cerr << "Failed to list " << bucket << ": " << curl.error()
+                      << std::endl;
+            promise->set_value(false);
+            return false;
+        },
+        [=](std::size_t tries) { return policy.delay(tries); });
+    return promise->get_future();
+}
+
+inline std::string AWS::S3::Connection::element_(const std::string& xml,
+    const std::string& name) {
+    std::string open("<" + name + ">");
+    std::size_t start = xml.find(open);
+    if (start == std::string::npos) {
+        return "";
+    }
+    start += open.size();
+    std::size_t end = xml.find("</" + name + ">", start);
+    if (end == std::string::npos) {
+        return "";
+    }
+    return xml.substr(start, end - start);
+}
+
+inline void AWS::S3::Signer::authorize(AWS::Curl::Connection& curl,
+    const std::string& verb, const std::string& bucket, const Path& object,
+    const std::string& query, const std::string& content_type,
+    const std::string& md5, const AWS::Curl::Headers* extra) const {
+    curl.reset();
+    curl.setBucket(endpoint.url(bucket) +
+        (endpoint.path_style ? "/" + bucket : ""));
+    curl.addHeader("User-Agent", user_agent);
+    if (v4) {
+        time_t now = time(NULL);
+        AWS::Curl::Headers headers;
+        headers["Host"].push_back(endpoint.host(bucket));
+        headers["x-amz-date"].push_back(AWS::Auth::V4::timestamp(now));
+        headers["x-amz-content-sha256"].push_back(
+            AWS::Auth::unsigned_payload);
+        if (!content_type.empty()) {
+            headers["Content-Type"].push_back(content_type);
+        }
+        if (!md5.empty()) {
+            headers["Content-MD5"].push_back(md5);
+        }
+        for (std::size_t i = 0; extra && i < extra->size(); ++i) {
+            AWS::Curl::Headers::Field field(extra->at(i));
+            headers.add(field.key, field.key_size, field.value,
+                field.value_size);
+        }
+
+        AWS::Auth::V4::Signature signature(v4->sign(verb,
+            endpoint.path(bucket, object).string(), query, headers,
+            AWS::Auth::unsigned_payload, now));
+        /* Curl provides the host itself */
+        headers.erase("Host");
+        for (std::size_t i = 0; i < headers.size(); ++i) {
+            AWS::Curl::Headers::Field field(headers.at(i));
+            curl.addHeader(field.name(), field.text());
+        }
+        curl.addHeader("Authorization", signature.authorization);
+        return;
+    }
+
+    for (std::size_t i = 0; extra && i < extra->size(); ++i) {
+        AWS::Curl::Headers::Field field(extra->at(i));
+        curl.addHeader(field.name(), field.text());
+    }
+    std::string date = AWS::Auth::date();
+    std::string signature = AWS::Auth::signature(verb, md5, content_type,
+        date, curl.get_request_headers(), "/" + bucket +
+        AWS::Curl::escape(object.string(), false) +
+        AWS::Auth::canonicalizedQueryString(query), secret_key);
+    curl.addHeader("Date", date);
+    if (!content_type.empty()) {
+        curl.addHeader("Content-Type", content_type);
+    }
+    if (!md5.empty()) {
+        curl.addHeader("Content-MD5", md5);
+    }
+    curl.addHeader("Authorization", "AWS " + access_id + ":" + signature);
+}
+
+inline AWS::Auth::V4::Signature AWS::S3::Signer::authorizeStreaming(
+    AWS::Curl::Connection& curl, const std::string& verb,
+    const std::string& bucket, const Path& object, std::size_t size,
+    const std::string& query, const std::string& content_type, bool trailer,
+    const AWS::Curl::Headers* extra) const {
+    curl.reset();
+    curl.setBucket(endpoint.url(bucket) +
+        (endpoint.path_style ? "/" + bucket : ""));
+    curl.addHeader("User-Agent", user_agent);
+
+    time_t now = time(NULL);
+    AWS::Curl::Headers headers;
+    headers["Host"].push_back(endpoint.host(bucket));
+    headers["Content-Encoding"].push_back("aws-chunked");
+    headers["x-amz-date"].push_back(AWS::Auth::V4::timestamp(now));
+    const char* payload = trailer ?
+        AWS::Auth::streaming_trailer_payload : AWS::Auth::streaming_payload;
+    headers["x-amz-content-sha256"].push_back(payload);
+    headers["x-amz-decoded-content-length"].push_back(std::to_string(size));
+    if (trailer) {
+        headers["x-amz-trailer"].push_back("x-amz-checksum-crc32c");
+    }
+    if (!content_type.empty()) {
+        headers["Content-Type"].push_back(content_type);
+    }
+    for (std::size_t i = 0; extra && i < extra->size(); ++i) {
+        AWS::Curl::Headers::Field field(extra->at(i));
+        headers.add(field.key, field.key_size, field.value, field.value_size);
+    }
+
+    AWS::Auth::V4::Signature signature(v4->sign(verb,
+        endpoint.path(bucket, object).string(), query, headers, payload, now));
+    headers.erase("Host");
+    for (std::size_t i = 0; i < headers.size(); ++i) {
+        AWS::Curl::Headers::Field field(headers.at(i));
+        curl.addHeader(field.name(), field.text());
+    }
+    curl.addHeader("Authorization", signature.authorization);
+    return signature;
+}
+
+template <typename Factory>
+inline std::vector<std::future<bool> > AWS::S3::Connection::getMany(
+    const std::string& bucket, const std::vector<Path>& objects,
+    Factory factory, const Callback& callback, std::size_t retries) const {
+    std::vector<std::future<bool> > results;
+    results.reserve(objects.size());
+    Retry policy(policy_(retries));
+
+    std::vector<Path>::const_iterator it(objects.begin());
+    for (; it != objects.end(); ++it) {
+        auto stream = factory(*it);
+        typedef AWS::Curl::Sink<
+            typename std::decay<decltype(*stream)>::type> Sink;
+        typename Sink::Position position = Sink::tell(*stream);
+        std::shared_ptr<std::promise<bool> > promise(
+            new std::promise<bool>());
+        std::shared_ptr<std::size_t> tries(new std::size_t(0));
+        std::shared_ptr<Retry::Clock::time_point> begun(
+            new Retry::Clock::time_point());
+        results.push_back(promise->get_future());
+
+        /* Everything here is captured by value, since the event loop may
+         * run these after we've returned */
+        Path object(*it);
+        Signer signer(this->signer);
+        std::string host(signer.endpoint.url(bucket));
+        Path path(signer.endpoint.path(bucket, object));
+        multi->add(
+            [=](AWS::Curl::Connection& curl) {
+                if (*tries == 0) {
+                    *begun = Retry::Clock::now();
+                }
+                Sink::seek(*stream, position);
+                signer.authorize(curl, "GET", bucket, object);
+                curl.prepareGet(host, path, "", *stream);
+            },
+            [=](AWS::Curl::Connection& curl, long response) {
+                if (response != 200 &&
+                    policy.allowed(++(*tries), response, *begun)) {
+                    return true;
+                }
+                Sink::flush(*stream);
+                if (callback) {
+                    callback(object, response == 200);
+                }
+                promise->set_value(response == 200);
+                return false;
+            },
+            [=](std::size_t tries) { return policy.delay(tries); });
+    }
+    return results;
+}
+
+template <typename Factory>
+inline std::vector<std::future<bool> > AWS::S3::Connection::putMany(
+    const std::string& bucket, const std::vector<Path>& objects,
+    Factory factory, const Callback& callback, std::size_t retries) {
+    std::vector<std::future<bool> > results;
+    results.reserve(objects.size());
+    Retry policy(policy_(retries));
+
+    std::vector<Path>::const_iterator it(objects.begin());
+    for (; it != objects.end(); ++it) {
+        auto istream = factory(*it);
+        typedef AWS::Curl::Source<
+            typename std::decay<decltype(*istream)>::type> Source;
+        /* Figure out how much of the source remains to be sent */
+        typename Source::Position position = Source::tell(*istream);
+        std::size_t size = Source::remaining(*istream);
+
+        std::shared_ptr<std::string> ostream(new std::string());
+        std::shared_ptr<std::promise<bool> > promise(
+            new std::promise<bool>());
+        std::shared_ptr<std::size_t> tries(new std::size_t(0));
+        std::shared_ptr<Retry::Clock::time_point> begun(
+            new Retry::Clock::time_point());
+        results.push_back(promise->get_future());
+
+        Path object(*it);
+        Signer signer(this->signer);
+        std::string host(signer.endpoint.url(bucket));
+        Path path(signer.endpoint.path(bucket, object));
+        multi->add(
+            [=](AWS::Curl::Connection& curl) {
+                if (*tries == 0) {
+                    *begun = Retry::Clock::now();
+                }
+                Source::seek(*istream, position);
+                ostream->clear();
+                signer.authorize(curl, "PUT", bucket, object);
+                curl.preparePut(host, path, "", *istream, size, *ostream);
+            },
+            [=](AWS::Curl::Connection& curl, long response) {
+                if (response != 200 &&
+                    policy.allowed(++(*tries), response, *begun)) {
+                    return true;
+                }
+                if (callback) {
+                    callback(object, response == 200);
+                }
+                promise->set_value(response == 200);
+                return false;
+            },
+            [=](std::size_t tries) { return policy.delay(tries); });
+    }
+    return results;
+}
+
+#ifdef AWSCPP_ASYNC
+template <typename T>
+inline AWS::Async::Task<bool> AWS::S3::Connection::getAsync(
+    std::string bucket, Path object, T& stream,
+    AWS::Async::Options options) const {
+    typedef AWS::Curl::Sink<T> Sink;
+    typename Sink::Position position = Sink::tell(stream);
+    Retry policy(policy_(options.retries));
+    Retry::Clock::time_point start = Retry::Clock::now();
+    std::string host(signer.endpoint.url(bucket));
+    Path path(signer.endpoint.path(bucket, object));
+    long response = 0;
+    for (std::size_t tries = 1; ; ++tries) {
+        {
+            AWS::Curl::Pool::Handle curl(*pool);
+            Sink::seek(stream, position);
+            signer.authorize(*curl, "GET", bucket, object);
+            curl->prepareGet(host, path, "", stream);
+            /* Each attempt may get a different handle from the pool */
+            curl->setRetries(tries - 1);
+            response = co_await AWS::Async::Perform(*curl, options);
+        }
+        if (response == 200 || options.stop.stop_requested() ||
+            !policy.allowed(tries, response, start) ||
+            co_await AWS::Async::Sleep(policy.delay(tries), options) < 0) {
+            break;
+        }
+    }
+    Sink::flush(stream);
+    co_return response == 200;
+}
+
+template <typename T>
+inline AWS::Async::Task<bool> AWS::S3::Connection::putAsync(
+    std::string bucket, Path object, T& istream,
+    AWS::Async::Options options) const {
+    typedef AWS::Curl::Source<T> Source;
+    typename Source::Position position = Source::tell(istream);
+    std::size_t size = Source::remaining(istream);
+    Retry policy(policy_(options.retries));
+    Retry::Clock::time_point start = Retry::Clock::now();
+    std::string host(signer.endpoint.url(bucket));
+    Path path(signer.endpoint.path(bucket, object));
+    long response = 0;
+    for (std::size_t tries = 1; ; ++tries) {
+        {
+            AWS::Curl::Pool::Handle curl(*pool);
+            std::string ostream;
+            Source::seek(istream, position);
+            signer.authorize(*curl, "PUT", bucket, object);
+            curl->preparePut(host, path, "", istream, size, ostream);
+            curl->setRetries(tries - 1);
+            response = co_await AWS::Async::Perform(*curl, options);
+        }
+        if (response == 200 || options.stop.stop_requested() ||
+            !policy.allowed(tries, response, start) ||
+            co_await AWS::Async::Sleep(policy.delay(tries), options) < 0) {
+            break;
+        }
+    }
+    co_return response == 200;
+}
+#endif
+
 #endif
@@ -0,0 +1,676 @@
+/******************************************************************************
+ * Copyright (c) 2013 SEOmoz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+/******************************************************************************
+ * Signature Version 4. Unlike the legacy signatures, the key used to sign is
+ * derived from the secret key, the date, the region and the service. So we
+ * derive it only once a day, and keep the HMAC state after hashing its pads,
+ * so signing a request costs just a few SHA-256 blocks.
+ *
+ * Uploads may be signed chunk-by-chunk as they're sent (the streaming
+ * payload), rather than hashing the whole payload before the request.
+ *****************************************************************************/
+
+#ifndef AWSCPP__SIGV4_HPP
+#define AWSCPP__SIGV4_HPP
+
+#include "util.hpp"
+#include "checksum.hpp"
+
+/* Standard includes */
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace AWS {
+    namespace Auth {
+        /* An incremental SHA-256, whose state may be copied from another */
+        class Sha256 {
+        public:
+            static const std::size_t length = 32;
+
+            Sha256();
+            ~Sha256();
+
+            /* Hash some more data */
+            Sha256& update(const void* data, std::size_t size);
+
+            /* Finish the hash, after which this must be reset or assigned */
+            void final(unsigned char out[length]);
+
+            /* Start over */
+            void reset();
+
+            /* Pick up the state of another hash */
+            void assign(const Sha256& other);
+        private:
+#if defined(__APPLE__) && defined(__MACH__)
+            CC_SHA256_CTX context;
+#else
+            EVP_MD_CTX* context;
+#endif
+
+            /* Private, unimplemented to prevent use */
+            Sha256(const Sha256& other);
+            const Sha256& operator=(const Sha256& other);
+        };
+
+        /* HMAC-SHA256 with a fixed key. The key's inner and outer pads are
+         * hashed once up front, and each signature starts from copies of
+         * those states. It's safe to sign from many threads at once */
+        class Hmac {
+        public:
+            Hmac(const void* key, std::size_t size);
+
+            void sign(const void* data, std::size_t size,
+                unsigned char out[Sha256::length]) const;
+        private:
+            Sha256 inner;
+            Sha256 outer;
+
+            /* Private, unimplemented to prevent use */
+            Hmac(const Hmac& other);
+            const Hmac& operator=(const Hmac& other);
+        };
+
+        /* Write the lowercase hex of some data; out must fit twice the size */
+        void hex(const unsigned char* data, std::size_t size, char* out);
+
+        /* The lowercase hex SHA-256 of some data */
+        std::string sha256(const char* data, std::size_t size);
+
+        /* The payload hash to use when the payload isn't signed */
+        static const char unsigned_payload[] = "UNSIGNED-PAYLOAD";
+
+        /* The payload hash to use when the payload is signed in chunks */
+        static const char streaming_payload[] =
+            "STREAMING-AWS4-HMAC-SHA256-PAYLOAD";
+
+        /* The same, but followed by a signed trailer with a checksum */
+        static const char streaming_trailer_payload[] =
+            "STREAMING-AWS4-HMAC-SHA256-PAYLOAD-TRAILER";
+
+        /* Signs requests for a region and service. One signer may be shared
+         * by many threads */
+        class V4 {
+        public:
+            /* All that comes out of signing a request, which is also all
+             * that's needed to go on to sign its chunks */
+            struct Signature {
+                Signature(): timestamp(), scope(), signature(),
+                    authorization(), key() {}
+
+                std::string timestamp;
+                std::string scope;
+                std::string signature;
+                std::string authorization;
+                std::shared_ptr<const Hmac> key;
+            };
+
+            V4(const std::string& access_id, const std::string& secret_key,
+                const std::string& region, const std::string& service="s3")
+                :access_id(access_id)
+                ,secret_key(secret_key)
+                ,region(region)
+                ,service(service)
+                ,mutex()
+                ,day()
+                ,key() {}
+
+            /* Sign a request. The path and query are taken as they'll be
+             * sent, which is to say already escaped. Every header provided
+             * is signed, and they must include the host, x-amz-date and
+             * x-amz-content-sha256 */
+            Signature sign(const std::string& verb, const std::string& path,
+                const std::string& query, const AWS::Curl::Headers& headers,
+                const std::string& payload, time_t when) const;
+
+            /* The signature of the next chunk of a streaming payload, given
+             * the signature that came before it */
+            static std::string chunk(const Signature& seed,
+                const std::string& previous, const char* data,
+                std::size_t size);
+
+            /* The signature of the trailing headers of a streaming payload,
+             * each of which is followed by a newline */
+            static std::string trailer(const Signature& seed,
+                const std::string& previous, const std::string& trailers);
+
+            /* The x-amz-date format of a time */
+            static std::string timestamp(time_t when);
+
+            const std::string& region_name() const { return region; }
+            const std::string& access() const { return access_id; }
+        private:
+            std::string access_id;
+            std::string secret_key;
+            std::string region;
+            std::string service;
+
+            /* The derived key, for the day it was derived for */
+            mutable std::mutex mutex;
+            mutable std::string day;
+            mutable std::shared_ptr<const Hmac> key;
+
+            /* The signing key for a day (in YYYYMMDD form) */
+            std::shared_ptr<const Hmac> key_(const std::string& day) const;
+
+            /* Whether one `key=value` parameter sorts before another, by key
+             * and then by value, as the canonical query requires */
+            static bool before_(const std::string& a, const std::string& b);
+
+            /* Private, unimplemented to prevent use */
+            V4(const V4& other);
+            const V4& operator=(const V4& other);
+        };
+
+        /* A source that frames another source into signed chunks, for use
+         * with a streaming payload. The size of the underlying data must be
+         * known, so that the framed size is known, too. With `trailer`, a
+         * CRC32C of the data is computed as it's framed, and sent after it in
+         * a signed trailer */
+        template <typename T>
+        class Chunked {
+        public:
+            /* The size of each chunk, which S3 requires to be at least 8KB
+             * for all but the last chunk */
+            static const std::size_t default_chunk = 64 * 1024;
+
+            Chunked(T& source, std::size_t size,
+                std::size_t chunk=default_chunk, bool trailer=false)
+                :source(source)
+                ,decoded(size)
+                ,chunk(chunk)
+                ,trailing(trailer)
+                ,crc()
+                ,seed()
+                ,previous()
+                ,buffer()
+                ,offset(0)
+                ,length(0)
+                ,sent(0)
+                ,finished(false) {}
+
+            /* Start framing with the signature of a new request */
+            void begin(const V4::Signature& signature);
+
+            /* Start over with the same signature, once the source has been
+             * rewound */
+            void restart();
+
+            /* The size once framed, which is the request's content length */
+            std::size_t size() const;
+
+            /* How much of the framed data is yet to be read */
+            std::size_t remaining() const { return size() - sent; }
+
+            std::size_t read(char* data, std::size_t size);
+
+            /* The checksum of what's been framed so far */
+            const AWS::Checksum::Crc32c& checksum() const { return crc; }
+
+            T& source;
+        private:
+            /* The room left in front of a chunk for its header */
+            static const std::size_t header = 128;
+
+            /* The size of the trailer: the checksum and its signature */
+            static const std::size_t trailer_size =
+                22 + 8 + 2 + 24 + 64 + 2;
+
+            std::size_t       decoded;
+            std::size_t       chunk;
+            bool              trailing;
+            AWS::Checksum::Crc32c crc;
+            V4::Signature     seed;
+            std::string       previous;
+            std::vector<char> buffer;
+            std::size_t       offset;
+            std::size_t       length;
+            std::size_t       sent;
+            bool              finished;
+
+            /* Read and frame the next chunk */
+            void next_();
+
+            /* The framed size of a chunk */
+            static std::size_t framed_(std::size_t size);
+
+            /* Private, unimplemented to prevent use */
+            Chunked(const Chunked& other);
+            const Chunked& operator=(const Chunked& other);
+        };
+    }
+
+    namespace Curl {
+        template <typename T>
+        struct Source<AWS::Auth::Chunked<T> > {
+            typedef typename Source<T>::Position Position;
+
+            static std::size_t read(AWS::Auth::Chunked<T>& source, char* data,
+                std::size_t size) {
+                return source.read(data, size);
+            }
+
+            static Position tell(AWS::Auth::Chunked<T>& source) {
+                return Source<T>::tell(source.source);
+            }
+
+            /* Going back can only mean going back to the start */
+            static void seek(AWS::Auth::Chunked<T>& source,
+                const Position& position) {
+                Source<T>::seek(source.source, position);
+                source.restart();
+            }
+
+            static std::size_t remaining(AWS::Auth::Chunked<T>& source) {
+                return source.remaining();
+            }
+        };
+    }
+}
+
+/******************************************************************************
+ * Implementations
+ *****************************************************************************/
+#if defined(__APPLE__) && defined(__MACH__)
+inline AWS::Auth::Sha256::Sha256(): context() { reset(); }
+
+inline AWS::Auth::Sha256::~Sha256() {}
+
+inline AWS::Auth::Sha256& AWS::Auth::Sha256::update(const void* data,
+    std::size_t size) {
+    CC_SHA256_Update(&context, data, static_cast<CC_LONG>(size));
+    return *this;
+}
+
+inline void AWS::Auth::Sha256::final(unsigned char out[length]) {
+    CC_SHA256_Final(out, &context);
+}
+
+inline void AWS::Auth::Sha256::reset() { CC_SHA256_Init(&context); }
+
+inline void AWS::Auth::Sha256::assign(const Sha256& other) {
+    context = other.context;
+}
+#else
+inline AWS::Auth::Sha256::Sha256(): context(EVP_MD_CTX_new()) { reset(); }
+
+inline AWS::Auth::Sha256::~Sha256() { EVP_MD_CTX_free(context); }
+
+inline AWS::Auth::Sha256& AWS::Auth::Sha256::update(const void* data,
+    std::size_t size) {
+    EVP_DigestUpdate(context, data, size);
+    return *this;
+}
+
+inline void AWS::Auth::Sha256::final(unsigned char out[length]) {
+    EVP_DigestFinal_ex(context, out, NULL);
+}
+
+inline void AWS::Auth::Sha256::reset() {
+    EVP_DigestInit_ex(context, EVP_sha256(), NULL);
+}
+
+inline void AWS::Auth::Sha256::assign(const Sha256& other) {
+    EVP_MD_CTX_copy_ex(context, other.context);
+}
+#endif
+
+inline AWS::Auth::Hmac::Hmac(const void* key, std::size_t size)
+    :inner(), outer() {
+    /* Keys longer than a block are hashed first */
+    unsigned char block[64] = { 0 };
+    if (size > sizeof(block)) {
+        Sha256 hash;
+        hash.update(key, size).final(block);
+    } else {
+        std::memcpy(block, key, size);
+    }
+
+    unsigned char pad[sizeof(block)];
+    for (std::size_t i = 0; i < sizeof(block); ++i) {
+        pad[i] = block[i] ^ 0x36;
+    }
+    inner.update(pad, sizeof(pad));
+    for (std::size_t i = 0; i < sizeof(block); ++i) {
+        pad[i] = block[i] ^ 0x5c;
+    }
+    outer.update(pad, sizeof(pad));
+}
+
+inline void AWS::Auth::Hmac::sign(const void* data, std::size_t size,
+    unsigned char out[Sha256::length]) const {
+    /* Each thread keeps its own scratch state to copy into */
+    static thread_local Sha256 scratch;
+    unsigned char digest[Sha256::length];
+    scratch.assign(inner);
+    scratch.update(data, size).final(digest);
+    scratch.assign(outer);
+    scratch.update(digest, sizeof(digest)).final(out);
+}
+
+inline void AWS::Auth::hex(const unsigned char* data, std::size_t size,
+    char* out) {
+    static const char digits[] = "0123456789abcdef";
+    for (std::size_t i = 0; i < size; ++i) {
+        *out++ = digits[data[i] >> 4];
+        *out++ = digits[data[i] & 0x0f];
+    }
+}
+
+inline std::string AWS::Auth::sha256(const char* data, std::size_t size) {
+    static thread_local Sha256 hash;
+    unsigned char digest[Sha256::length];
+    hash.reset();
+    hash.update(data, size).final(digest);
+    std::string result(2 * sizeof(digest), '0');
+    hex(digest, sizeof(digest), &result[0]);
+    return result;
+}
+
+inline std::string AWS::Auth::V4::timestamp(time_t when) {
+    char result[17];
+    struct tm timeinfo;
+    std::strftime(result, sizeof(result), "%Y%m%dT%H%M%SZ",
+        gmtime_r(&when, &timeinfo));
+    return std::string(result);
+}
+
+inline std::shared_ptr<const AWS::Auth::Hmac> AWS::Auth::V4::key_(
+    const std::string& date) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (key && date == day) {
+        return key;
+    }
+
+    /* Each step of the derivation is keyed by the last */
+    std::string secret("AWS4" + secret_key);
+    unsigned char derived[Sha256::length];
+    Hmac(secret.data(), secret.size()).sign(date.data(), date.size(), derived);
+    Hmac(derived, sizeof(derived)).sign(region.data(), region.size(), derived);
+    Hmac(derived, sizeof(derived)).sign(
+        service.data(), service.size(), derived);
+    Hmac(derived, sizeof(derived)).sign("aws4_request", 12, derived);
+
+    day = date;
+    key = std::make_shared<const Hmac>(derived, sizeof(derived));
+    return key;
+}
+
+inline bool AWS::Auth::V4::before_(const std::string& a,
+    const std::string& b) {
+    /* Sorting whole strings would put `a-b=1` before `a=2`, since '-' sorts
+     * before '=' */
+    std::size_t a_key = a.find('=');
+    std::size_t b_key = b.find('=');
+    int order = a.compare(0, a_key, b, 0, b_key);
+    if (order) {
+        return order < 0;
+    }
+    return a.compare(a_key + 1, std::string::npos,
+        b, b_key + 1, std::string::npos) < 0;
+}
+
+inline AWS::Auth::V4::Signature AWS::Auth::V4::sign(const std::string& verb,
+    const std::string& path, const std::string& query,
+    const AWS::Curl::Headers& headers, const std::string& payload,
+    time_t when) const {
+    /* These are reused between requests, so that once they've grown to fit
+     * a request, signing doesn't allocate for them again */
+    static thread_local std::string canonical;
+    static thread_local std::vector<std::size_t> order;
+    static thread_local std::vector<std::string> params;
+
+    Signature result;
+    result.timestamp = timestamp(when);
+    std::string date(result.timestamp, 0, 8);
+    result.scope = date + "/" + region + "/" + service + "/aws4_request";
+    result.key = key_(date);
+
+    /* The method and path come as they are */
+    canonical.clear();
+    canonical.append(verb).append(1, '\n');
+    canonical.append(path.empty() ? "/" : path).append(1, '\n');
+
+    /* Query parameters are sorted, and each must have a value */
+    params.clear();
+    std::size_t start = 0;
+    while (start < query.size()) {
+        std::size_t end = query.find('&', start);
+        end = (end == std::string::npos) ? query.size() : end;
+        if (end > start) {
+            params.push_back(query.substr(start, end - start));
+            if (params.back().find('=') == std::string::npos) {
+                params.back().push_back('=');
+            }
+        }
+        start = end + 1;
+    }
+    std::sort(params.begin(), params.end(), before_);
+    for (std::size_t i = 0; i < params.size(); ++i) {
+        if (i) {
+            canonical.push_back('&');
+        }
+        canonical.append(params[i]);
+    }
+    canonical.push_back('\n');
+
+    /* Headers are lowercased and sorted, and their values are trimmed with
+     * runs of spaces squeezed into one. Values for the same key are joined */
+    headers.sorted(order);
+    std::string signed_headers;
+    for (std::size_t i = 0; i < order.size(); ++i) {
+        AWS::Curl::Headers::Field field(headers.at(order[i]));
+        if (i) {
+            AWS::Curl::Headers::Field last(headers.at(order[i - 1]));
+            if (AWS::Curl::Headers::equal(
+                field.key, field.key_size, last.key, last.key_size)) {
+                canonical[canonical.size() - 1] = ',';
+            } else {
+                signed_headers.push_back(';');
+            }
+        }
+        if (canonical[canonical.size() - 1] != ',') {
+            std::size_t start = canonical.size();
+            for (std::size_t j = 0; j < field.key_size; ++j) {
+                canonical.push_back(static_cast<char>(
+                    std::tolower(static_cast<unsigned char>(field.key[j]))));
+            }
+            signed_headers.append(canonical, start, field.key_size);
+            canonical.push_back(':');
+        }
+
+        const char* value = field.value;
+        const char* end = field.value + field.value_size;
+        while (value < end && std::isspace(static_cast<unsigned char>(*value))) {
+            ++value;
+        }
+        while (end > value && std::isspace(static_cast<unsigned char>(end[-1]))) {
+            --end;
+        }
+        for (; value < end; ++value) {
+            if (*value != ' ' || canonical[canonical.size() - 1] != ' ') {
+                canonical.push_back(*value);
+            }
+        }
+        canonical.push_back('\n');
+    }
+    canonical.push_back('\n');
+    canonical.append(signed_headers).append(1, '\n');
+    canonical.append(payload);
+
+    /* The canonical request is hashed, and the hash is what's signed */
+    std::string hashed(sha256(canonical.data(), canonical.size()));
+    canonical.clear();
+    canonical.append("AWS4-HMAC-SHA256\n");
+    canonical.append(result.timestamp).append(1, '\n');
+    canonical.append(result.scope).append(1, '\n');
+    canonical.append(hashed);
+
+    unsigned char digest[Sha256::length];
+    result.key->sign(canonical.data(), canonical.size(), digest);
+    result.signature.assign(2 * sizeof(digest), '0');
+    hex(digest, sizeof(digest), &result.signature[0]);
+
+    result.authorization = "AWS4-HMAC-SHA256 Credential=" + access_id + "/" +
+        result.scope + ", SignedHeaders=" + signed_headers + ", Signature=" +
+        result.signature;
+    return result;
+}
+
+inline std::string AWS::Auth::V4::trailer(const Signature& seed,
+    const std::string& previous, const std::string& trailers) {
+    std::string toSign("AWS4-HMAC-SHA256-TRAILER\n");
+    toSign.append(seed.timestamp).append(1, '\n');
+    toSign.append(seed.scope).append(1, '\n');
+    toSign.append(previous).append(1, '\n');
+    toSign.append(sha256(trailers.data(), trailers.size()));
+
+    unsigned char digest[Sha256::length];
+    seed.key->sign(toSign.data(), toSign.size(), digest);
+    std::string result(2 * sizeof(digest), '0');
+    hex(digest, sizeof(digest), &result[0]);
+    return result;
+}
+
+inline std::string AWS::Auth::V4::chunk(const Signature& seed,
+    const std::string& previous, const char* data, std::size_t size) {
+    static thread_local std::string toSign;
+    static const std::string empty(sha256("", 0));
+
+    toSign.clear();
+    toSign.append("AWS4-HMAC-SHA256-PAYLOAD\n");
+    toSign.append(seed.timestamp).append(1, '\n');
+    toSign.append(seed.scope).append(1, '\n');
+    toSign.append(previous).append(1, '\n');
+    toSign.append(empty).append(1, '\n');
+    toSign.append(sha256(data, size));
+
+    unsigned char digest[Sha256::length];
+    seed.key->sign(toSign.data(), toSign.size(), digest);
+    std::string result(2 * sizeof(digest), '0');
+    hex(digest, sizeof(digest), &result[0]);
+    return result;
+}
+
+template <typename T>
+inline void AWS::Auth::Chunked<T>::begin(const V4::Signature& signature) {
+    seed = signature;
+    restart();
+}
+
+template <typename T>
+inline void AWS::Auth::Chunked<T>::restart() {
+    previous = seed.signature;
+    offset = length = sent = 0;
+    finished = false;
+    crc.reset();
+}
+
+template <typename T>
+inline std::size_t AWS::Auth::Chunked<T>::framed_(std::size_t size) {
+    /* The hex size, the signature and two line endings around the data */
+    std::size_t digits = 1;
+    for (std::size_t rest = size >> 4; rest; rest >>= 4) {
+        ++digits;
+    }
+    return digits + 17 + 64 + 2 + size + 2;
+}
+
+template <typename T>
+inline std::size_t AWS::Auth::Chunked<T>::size() const {
+    std::size_t result = (decoded / chunk) * framed_(chunk);
+    if (decoded % chunk) {
+        result += framed_(decoded % chunk);
+    }
+    /* And there's always an empty chunk at the end */
+    return result + framed_(0) + (trailing ? trailer_size : 0);
+}
+
+template <typename T>
+inline void AWS::Auth::Chunked<T>::next_() {
+    buffer.resize(header + std::max(chunk, trailer_size) + 2);
+
+    /* The data goes after the room for its header, so the header may be
+     * written in front of it once the data's been signed */
+    char* data = &buffer[header];
+    std::size_t size = 0;
+    while (size < chunk) {
+        std::size_t count = AWS::Curl::Source<T>::read(
+            source, data + size, chunk - size);
+        if (!count) {
+            break;
+        }
+        size += count;
+    }
+
+    previous = V4::chunk(seed, previous, data, size);
+    char line[header];
+    int written = std::snprintf(line, sizeof(line),
+        "%zx;chunk-signature=%s\r\n", size, previous.c_str());
+    offset = header - written;
+    std::memcpy(&buffer[offset], line, written);
+    finished = (size == 0);
+
+    /* The trailer goes between the last chunk and the final line ending */
+    if (trailing && finished) {
+        std::string trailers("x-amz-checksum-crc32c:" + crc.base64());
+        std::string signature(V4::trailer(seed, previous, trailers + "\n"));
+        trailers.append("\r\nx-amz-trailer-signature:");
+        trailers.append(signature).append("\r\n");
+        std::memcpy(data, trailers.data(), trailers.size());
+        size = trailers.size();
+    } else if (trailing) {
+        crc.update(data, size);
+    }
+    std::memcpy(data + size, "\r\n", 2);
+    length = header + size + 2;
+}
+
+template <typename T>
+inline std::size_t AWS::Auth::Chunked<T>::read(char* data, std::size_t size) {
+    std::size_t count = 0;
+    while (count < size) {
+        if (offset == length) {
+            if (finished) {
+                break;
+            }
+            next_();
+        }
+        std::size_t available = std::min(size - count, length - offset);
+        std::memcpy(data + count, &buffer[offset], available);
+        offset += available;
+        count += available;
+    }
+    sent += count;
+    return count;
+}
+
+#endif
@@ -0,0 +1,328 @@
+/******************************************************************************
+ * Copyright (c) 2013 SEOmoz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#ifndef AWSCPP__SINK_HPP
+#define AWSCPP__SINK_HPP
+
+/******************************************************************************
+ * Sinks are the things that response data is written to. Data is handed to a
+ * sink straight out of curl's buffer, and the Sink template describes how to
+ * write to each kind of sink. The default is for ostreams, but there are
+ * specializations for writing to file descriptors, strings, vectors, fixed
+ * buffers and callbacks. To write to your own type, just specialize Sink.
+ *****************************************************************************/
+
+/* Standard includes */
+#include <functional>
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <vector>
+#include <string>
+
+/* For writing directly to file descriptors */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+namespace AWS {
+    namespace Curl {
+        /* How to write to a sink of type T. Sinks also have to be able to
+         * report where they are, and to go back there, so that a request
+         * that fails partway through can be retried */
+        template <typename T>
+        struct Sink {
+            /* Something that represents where the sink currently is */
+            typedef std::streampos Position;
+
+            /* Write data to the sink, returning how much was written. If it
+             * doesn't write it all, curl aborts the transfer */
+            static std::size_t write(T& sink, const char* data,
+                std::size_t size) {
+                sink.write(data, size);
+                return sink.good() ? size : 0;
+            }
+
+            /* Where the sink is now */
+            static Position tell(T& sink) { return sink.tellp(); }
+
+            /* Go back to a previous position, discarding what came after */
+            static void seek(T& sink, const Position& position) {
+                sink.seekp(position);
+            }
+
+            /* Make sure all that's been written is where it belongs */
+            static void flush(T& sink) { sink.flush(); }
+        };
+
+        /* Write to a file descriptor */
+        struct Descriptor {
+            explicit Descriptor(int fd): fd(fd) {}
+
+            int fd;
+        };
+
+        /* A place to write response data directly, without going through a
+         * stream. Data is written with pwrite to a file descriptor starting
+         * at the provided offset, which advances as data is written. If
+         * `end` isn't negative, a write that would go past it fails */
+        struct Positional {
+            Positional(int fd, off_t offset, off_t end=-1)
+                :fd(fd), offset(offset), end(end) {}
+
+            int   fd;
+            off_t offset;
+            off_t end;
+        };
+
+        /* Write into a fixed, caller-supplied buffer. If the response is
+         * larger than the buffer, the transfer fails */
+        struct Buffer {
+            Buffer(char* data, std::size_t capacity)
+                :data(data), capacity(capacity), size(0) {}
+
+            char*       data;
+            std::size_t capacity;
+            std::size_t size;
+        private:
+            /* Private, unimplemented to prevent use */
+            Buffer(const Buffer& other);
+            const Buffer& operator=(const Buffer& other);
+        };
+
+        /* Wraps another sink, keeping track of how much has been written to
+         * it. This is how we know where to resume an interrupted download */
+        template <typename T>
+        struct Counted {
+            explicit Counted(T& sink): sink(sink), count(0) {}
+
+            T&          sink;
+            std::size_t count;
+        private:
+            /* Private, unimplemented to prevent use */
+            const Counted& operator=(const Counted& other);
+        };
+
+        /* Hand data to a function, which returns how much it consumed */
+        typedef std::function<std::size_t(const char*, std::size_t)> Writer;
+
+        /* Write all of a buffer to a file descriptor, either at its current
+         * position or, if offset isn't negative, at that offset */
+        inline bool writeAll(int fd, const char* data, std::size_t size,
+            off_t offset=-1) {
+            while (size) {
+                ssize_t written = (offset < 0) ?
+                    ::write(fd, data, size) : pwrite(fd, data, size, offset);
+                if (written < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    return false;
+                }
+                data += written;
+                size -= written;
+                if (offset >= 0) {
+                    offset += written;
+                }
+            }
+            return true;
+        }
+
+        /* Make a new file alongside `path`, to be written and then renamed
+         * over it once it's whole, so that a failure never leaves a partial
+         * file where a good one was. Its name is left in `name`, and like
+         * any other file, its mode is `mode` less the umask. Returns its
+         * descriptor, or -1 */
+        inline int temporary(const std::string& path, std::string& name,
+            mode_t mode=0644) {
+            static std::atomic<unsigned long> count(0);
+            for (std::size_t attempt = 0; attempt < 100; ++attempt) {
+                name = path + ".awscpp-" + std::to_string(getpid()) + "-" +
+                    std::to_string(count++);
+                int fd = open(name.c_str(),
+                    O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+                if (fd >= 0 || errno != EEXIST) {
+                    return fd;
+                }
+            }
+            return -1;
+        }
+
+        template <>
+        struct Sink<Descriptor> {
+            typedef off_t Position;
+
+            static std::size_t write(Descriptor& sink, const char* data,
+                std::size_t size) {
+                return writeAll(sink.fd, data, size) ? size : 0;
+            }
+
+            /* Pipes and sockets can't be rewound, but files can */
+            static Position tell(Descriptor& sink) {
+                return lseek(sink.fd, 0, SEEK_CUR);
+            }
+
+            static void seek(Descriptor& sink, const Position& position) {
+                if (position >= 0 && lseek(sink.fd, position, SEEK_SET) >= 0) {
+                    if (ftruncate(sink.fd, position) != 0) {
+                        return;
+                    }
+                }
+            }
+
+            static void flush(Descriptor& sink) {}
+        };
+
+        template <>
+        struct Sink<Positional> {
+            typedef off_t Position;
+
+            static std::size_t write(Positional& sink, const char* data,
+                std::size_t size) {
+                if ((sink.end >= 0 &&
+                    sink.offset + static_cast<off_t>(size) > sink.end) ||
+                    !writeAll(sink.fd, data, size, sink.offset)) {
+                    return 0;
+                }
+                sink.offset += size;
+                return size;
+            }
+
+            static Position tell(Positional& sink) { return sink.offset; }
+
+            static void seek(Positional& sink, const Position& position) {
+                sink.offset = position;
+            }
+
+            static void flush(Positional& sink) {}
+        };
+
+        /* Strings and vectors should be reserved ahead of time by anyone who
+         * knows how big the response will be */
+        template <>
+        struct Sink<std::string> {
+            typedef std::size_t Position;
+
+            static std::size_t write(std::string& sink, const char* data,
+                std::size_t size) {
+                sink.append(data, size);
+                return size;
+            }
+
+            static Position tell(std::string& sink) { return sink.size(); }
+
+            static void seek(std::string& sink, const Position& position) {
+                sink.resize(position);
+            }
+
+            static void flush(std::string& sink) {}
+        };
+
+        template <>
+        struct Sink<std::vector<char> > {
+            typedef std::size_t Position;
+
+            static std::size_t write(std::vector<char>& sink,
+                const char* data, std::size_t size) {
+                sink.insert(sink.end(), data, data + size);
+                return size;
+            }
+
+            static Position tell(std::vector<char>& sink) {
+                return sink.size();
+            }
+
+            static void seek(std::vector<char>& sink,
+                const Position& position) {
+                sink.resize(position);
+            }
+
+            static void flush(std::vector<char>& sink) {}
+        };
+
+        template <>
+        struct Sink<Buffer> {
+            typedef std::size_t Position;
+
+            static std::size_t write(Buffer& sink, const char* data,
+                std::size_t size) {
+                if (size > sink.capacity - sink.size) {
+                    return 0;
+                }
+                std::copy(data, data + size, sink.data + sink.size);
+                sink.size += size;
+                return size;
+            }
+
+            static Position tell(Buffer& sink) { return sink.size; }
+
+            static void seek(Buffer& sink, const Position& position) {
+                sink.size = position;
+            }
+
+            static void flush(Buffer& sink) {}
+        };
+
+        /* Data handed to a function can't be taken back, so a retried
+         * request will hand it the data again from the beginning */
+        template <>
+        struct Sink<Writer> {
+            typedef int Position;
+
+            static std::size_t write(Writer& sink, const char* data,
+                std::size_t size) {
+                return sink(data, size);
+            }
+
+            static Position tell(Writer& sink) { return 0; }
+            static void seek(Writer& sink, const Position& position) {}
+            static void flush(Writer& sink) {}
+        };
+
+        template <typename T>
+        struct Sink<Counted<T> > {
+            typedef typename Sink<T>::Position Position;
+
+            static std::size_t write(Counted<T>& sink, const char* data,
+                std::size_t size) {
+                std::size_t written = Sink<T>::write(sink.sink, data, size);
+                sink.count += written;
+                return written;
+            }
+
+            static Position tell(Counted<T>& sink) {
+                return Sink<T>::tell(sink.sink);
+            }
+
+            static void seek(Counted<T>& sink, const Position& position) {
+                Sink<T>::seek(sink.sink, position);
+            }
+
+            static void flush(Counted<T>& sink) { Sink<T>::flush(sink.sink); }
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,235 @@
+/******************************************************************************
+ * Copyright (c) 2013 SEOmoz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#ifndef AWSCPP__SOURCE_HPP
+#define AWSCPP__SOURCE_HPP
+
+/******************************************************************************
+ * Sources are the things that request data is read from. The Source template
+ * describes how to read from each kind of source. The default is for
+ * istreams, but contiguous memory (spans, string_views and mapped files) is
+ * handed to curl directly, and rewinding it for a retry is just a matter of
+ * resetting an offset. To read from your own type, just specialize Source.
+ *****************************************************************************/
+
+/* We use apathy for all path manipulations */
+#include <apathy/path.hpp>
+
+/* Standard includes */
+#include <algorithm>
+#include <iostream>
+#include <cstring>
+#include <string>
+#if __cplusplus >= 201703L
+    #include <string_view>
+#endif
+
+/* For mapping files */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+namespace AWS {
+    namespace Curl {
+        /* How to read from a source of type T. Like sinks, sources have to
+         * be able to report where they are and go back there, so that a
+         * request that fails partway through can be retried */
+        template <typename T>
+        struct Source {
+            /* Something that represents where the source currently is */
+            typedef std::streampos Position;
+
+            /* Read up to `size` bytes, returning how much was read */
+            static std::size_t read(T& source, char* data, std::size_t size) {
+                /* Apparently istream::read doesn't return the number of bytes
+                 * read, and so to find out how much has been read, we'll use
+                 * gcount */
+                source.read(data, size);
+                return source.gcount();
+            }
+
+            /* Where the source is now */
+            static Position tell(T& source) { return source.tellg(); }
+
+            /* Go back to a previous position */
+            static void seek(T& source, const Position& position) {
+                source.clear();
+                source.seekg(position);
+            }
+
+            /* How much is left to be read */
+            static std::size_t remaining(T& source) {
+                Position position = source.tellg();
+                source.seekg(0, std::ios::end);
+                std::size_t result = source.tellg() - position;
+                source.seekg(position);
+                return result;
+            }
+        };
+
+        /* A place to read request data from directly, without going through
+         * a stream. The memory must outlive the request, and reading begins
+         * at `offset` */
+        struct Span {
+            Span(const char* data, std::size_t size)
+                :data(data), size(size), offset(0) {}
+
+            /* The string must outlive the span */
+            explicit Span(const std::string& str)
+                :data(str.data()), size(str.size()), offset(0) {}
+
+            const char* data;
+            std::size_t size;
+            std::size_t offset;
+        };
+
+        /* A read-only memory mapping of a whole file */
+        struct Mapping {
+            Mapping(const apathy::Path& path);
+            ~Mapping();
+
+            /* Whether or not the file was successfully mapped */
+            bool good() const { return fd >= 0; }
+
+            /* The contents of the file */
+            const char* data() const { return impl; }
+            std::size_t size() const { return length; }
+
+            /* A span of the file's contents */
+            Span span(std::size_t offset, std::size_t count) const {
+                return Span(impl + offset, count);
+            }
+
+            /* A span of the whole file */
+            Span span() const { return Span(impl, length); }
+        private:
+            int         fd;
+            const char* impl;
+            std::size_t length;
+
+            /* Private, unimplemented to prevent use */
+            Mapping(const Mapping& other);
+            const Mapping& operator=(const Mapping& other);
+        };
+
+        template <>
+        struct Source<Span> {
+            typedef std::size_t Position;
+
+            static std::size_t read(Span& source, char* data,
+                std::size_t size) {
+                std::size_t count = std::min(size,
+                    source.size - source.offset);
+                if (count) {
+                    std::memcpy(data, source.data + source.offset, count);
+                }
+                source.offset += count;
+                return count;
+            }
+
+            static Position tell(Span& source) { return source.offset; }
+
+            static void seek(Span& source, const Position& position) {
+                source.offset = position;
+            }
+
+            static std::size_t remaining(Span& source) {
+                return source.size - source.offset;
+            }
+        };
+
+#if __cplusplus >= 201703L
+        /* Reading from a string_view consumes it from the front, so its
+         * position is just what's left of it */
+        template <>
+        struct Source<std::string_view> {
+            typedef std::string_view Position;
+
+            static std::size_t read(std::string_view& source, char* data,
+                std::size_t size) {
+                std::size_t count = source.copy(data, size);
+                source.remove_prefix(count);
+                return count;
+            }
+
+            static Position tell(std::string_view& source) { return source; }
+
+            static void seek(std::string_view& source,
+                const Position& position) {
+                source = position;
+            }
+
+            static std::size_t remaining(std::string_view& source) {
+                return source.size();
+            }
+        };
+#endif
+    }
+}
+
+/******************************************************************************
+ * Implementations
+ *****************************************************************************/
+inline AWS::Curl::Mapping::Mapping(const apathy::Path& path)
+    :fd(open(path.string().c_str(), O_RDONLY))
+    ,impl(NULL)
+    ,length(0) {
+    struct stat info;
+    if (fd < 0) {
+        return;
+    }
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        fd = -1;
+        return;
+    }
+
+    /* Empty files can't be mapped, but are perfectly good files */
+    length = info.st_size;
+    if (length == 0) {
+        return;
+    }
+
+    void* mapped = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped == MAP_FAILED) {
+        close(fd);
+        fd = -1;
+        length = 0;
+        return;
+    }
+    /* We generally read these front to back */
+    madvise(mapped, length, MADV_SEQUENTIAL);
+    impl = reinterpret_cast<const char*>(mapped);
+}
+
+inline AWS::Curl::Mapping::~Mapping() {
+    if (impl != NULL) {
+        munmap(const_cast<char*>(impl), length);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+#endif
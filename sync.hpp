@@ -0,0 +1,478 @@
+/******************************************************************************
+ * Copyright (c) 2013 SEOmoz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#ifndef AWSCPP__SYNC_HPP
+#define AWSCPP__SYNC_HPP
+
+/******************************************************************************
+ * Mirroring a local directory tree to S3, or a prefix of a bucket to a local
+ * directory, sending only the files that have changed. The remote side is
+ * listed, the local side is walked, and each file is compared with the object
+ * of the same name: it's sent if it's missing, if the sizes differ, or if the
+ * source is newer than the destination. With `checksum`, a file of the same
+ * size is instead compared by its MD5, wherever the ETag is one (it isn't
+ * for multipart uploads). Downloaded files are given the object's last
+ * modified time, so that a second run finds nothing to do.
+ *
+ * Files are compared and sent by a fixed number of worker threads. A dry run
+ * does the comparisons, but sends nothing:
+ *
+ *     AWS::S3::Sync sync(s3, 16);
+ *     AWS::S3::Sync::Summary summary(
+ *         sync.upload("local/directory", "bucket", "some/prefix/"));
+ *     summary.report(std::cerr);
+ *
+ * Keys are the prefix followed by each file's path relative to the directory,
+ * so a prefix that names a directory should end with '/'. Only regular files
+ * are synced, and symbolic links aren't followed. Large files are sent as
+ * multipart uploads (see setMultipart).
+ *****************************************************************************/
+
+#include "s3.hpp"
+
+#include <apathy/path.hpp>
+
+/* Standard includes */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* For files */
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace AWS {
+    namespace S3 {
+        class Sync {
+        public:
+            /* Why a file was sent */
+            enum Reason { Missing, Size, Checksum, Newer };
+
+            /* What a run did, or in a dry run, would have done */
+            struct Summary {
+                Summary()
+                    :files(0)
+                    ,transferred(0)
+                    ,skipped(0)
+                    ,failed(0)
+                    ,bytes(0)
+                    ,seconds(0) {}
+
+                /* Whether everything that needed sending was sent */
+                bool good() const { return failed == 0; }
+
+                /* Bytes sent per second */
+                double throughput() const {
+                    return seconds > 0 ? bytes / seconds : 0;
+                }
+
+                /* Write it out on a line */
+                void report(std::ostream& stream) const;
+
+                /* Files on the source side, and of those, the ones sent, the
+                 * ones already up to date and the ones that couldn't be sent.
+                 * A listing that fails counts as a failure */
+                std::size_t files;
+                std::size_t transferred;
+                std::size_t skipped;
+                std::size_t failed;
+                uint64_t    bytes;
+                double      seconds;
+            };
+
+            /* Invoked with each file sent (or, in a dry run, that would
+             * be), its key, why and whether it worked. Calls are made from
+             * the worker threads, but one at a time */
+            typedef std::function<void(const Path& local,
+                const std::string& key, Reason reason, bool ok)> Observer;
+
+            /* Sync with up to `parallelism` files in flight */
+            Sync(const Connection& connection, std::size_t parallelism=16,
+                bool checksum=false, bool dryrun=false, std::size_t retries=5);
+
+            /* Send the files under `local` that have changed to the keys
+             * beginning with `prefix` */
+            Summary upload(const Path& local, const std::string& bucket,
+                const std::string& prefix="");
+
+            /* Fetch the objects under `prefix` that have changed to the
+             * directory `local`, which is made if need be. Keys with a ".."
+             * part, which would land outside it, are counted as failed */
+            Summary download(const std::string& bucket,
+                const std::string& prefix, const Path& local);
+
+            void setObserver(const Observer& observer) {
+                this->observer = observer;
+            }
+
+            /* Send files of at least `threshold` bytes as multipart uploads,
+             * in parts of `part_size` bytes, `parallelism` at a time. A file
+             * over 5GB can't be sent in one piece, and a part that fails is
+             * retried without sending the rest again */
+            void setMultipart(std::size_t threshold,
+                std::size_t part_size=8 * 1024 * 1024,
+                std::size_t parallelism=4) {
+                multipart = threshold;
+                this->part_size = part_size;
+                part_parallelism = parallelism;
+            }
+
+            /* The name of a reason */
+            static const char* name(Reason reason);
+        private:
+            /* A file and the object it goes with, either of which may be
+             * missing */
+            struct Pair {
+                Pair(): local(), key(), entry(), size(0), mtime(0),
+                    exists(false), remote(false) {}
+
+                Path        local;
+                std::string key;
+                Entry       entry;
+                std::size_t size;
+                std::time_t mtime;
+                bool        exists;
+                bool        remote;
+            };
+
+            Connection  connection;
+            std::size_t parallelism;
+            bool        checksum;
+            bool        dryrun;
+            std::size_t retries;
+            Observer    observer;
+            std::size_t multipart;
+            std::size_t part_size;
+            std::size_t part_parallelism;
+
+            /* List the objects under a prefix, by key */
+            bool list_(const std::string& bucket, const std::string& prefix,
+                std::map<std::string, Entry>& entries) const;
+
+            /* Find the regular files under a directory, by their relative
+             * path, without following links */
+            static void walk_(const Path& root, const std::string& relative,
+                std::map<std::string, Pair>& files);
+
+            /* Whether a pair needs sending, and if so why */
+            bool changed_(const Pair& pair, bool upload, Reason& reason) const;
+
+            /* Send a pair in one direction or the other */
+            bool upload_(Connection& connection, const std::string& bucket,
+                const Pair& pair) const;
+            bool download_(Connection& connection, const std::string& bucket,
+                const Pair& pair) const;
+
+            /* Compare and send each pair on the worker threads */
+            void run_(const std::string& bucket, std::vector<Pair>& pairs,
+                bool upload, Summary& summary);
+
+            /* Seconds since the epoch of a listing's ISO 8601 time */
+            static std::time_t time_(const std::string& modified);
+        };
+    }
+}
+
+/******************************************************************************
+ * Implementation of Sync
+ *****************************************************************************/
+inline AWS::S3::Sync::Sync(const Connection& connection,
+    std::size_t parallelism, bool checksum, bool dryrun, std::size_t retries)
+    :connection(connection)
+    ,parallelism(std::max(parallelism, std::size_t(1)))
+    ,checksum(checksum)
+    ,dryrun(dryrun)
+    ,retries(retries)
+    ,observer()
+    ,multipart(64 * 1024 * 1024)
+    ,part_size(8 * 1024 * 1024)
+    ,part_parallelism(4) {}
+
+inline AWS::S3::Sync::Summary AWS::S3::Sync::upload(const Path& local,
+    const std::string& bucket, const std::string& prefix) {
+    Retry::Clock::time_point start = Retry::Clock::now();
+    Summary summary;
+    std::map<std::string, Entry> entries;
+    if (!list_(bucket, prefix, entries)) {
+        summary.failed = 1;
+        return summary;
+    }
+
+    std::map<std::string, Pair> files;
+    walk_(local, "", files);
+    std::vector<Pair> pairs;
+    pairs.reserve(files.size());
+    std::map<std::string, Pair>::iterator it(files.begin());
+    for (; it != files.end(); ++it) {
+        pairs.push_back(it->second);
+        Pair& pair(pairs.back());
+        pair.key = prefix + it->first;
+        std::map<std::string, Entry>::const_iterator found(
+            entries.find(pair.key));
+        if (found != entries.end()) {
+            pair.entry = found->second;
+            pair.remote = true;
+        }
+    }
+
+    run_(bucket, pairs, true, summary);
+    summary.seconds = std::chrono::duration<double>(
+        Retry::Clock::now() - start).count();
+    return summary;
+}
+
+inline AWS::S3::Sync::Summary AWS::S3::Sync::download(
+    const std::string& bucket, const std::string& prefix, const Path& local) {
+    Retry::Clock::time_point start = Retry::Clock::now();
+    Summary summary;
+    std::map<std::string, Entry> entries;
+    if (!list_(bucket, prefix, entries)) {
+        summary.failed = 1;
+        return summary;
+    }
+
+    std::map<std::string, Pair> files;
+    walk_(local, "", files);
+    std::vector<Pair> pairs;
+    pairs.reserve(entries.size());
+    std::string root(local.string());
+    while (root.size() > 1 && root[root.size() - 1] == '/') {
+        root.erase(root.size() - 1);
+    }
+    std::map<std::string, Entry>::const_iterator it(entries.begin());
+    for (; it != entries.end(); ++it) {
+        std::string relative(it->first.substr(prefix.size()));
+        /* Keys like "dir/" are how consoles make folders */
+        if (relative.empty() || relative[relative.size() - 1] == '/') {
+            continue;
+        }
+        std::string padded("/" + relative + "/");
+        if (relative[0] == '/' || padded.find("/../") != std::string::npos) {
+            std::cerr << "Refusing to download " << it->first
+                      << " outside of " << root << std::endl;
+            ++summary.files;
+            ++summary.failed;
+            continue;
+        }
+
+        std::map<std::string, Pair>::const_iterator found(
+            files.find(relative));
+        pairs.push_back(found != files.end() ? found->second : Pair());
+        Pair& pair(pairs.back());
+        pair.local = Path(root + "/" + relative);
+        pair.key = it->first;
+        pair.entry = it->second;
+        pair.remote = true;
+    }
+
+    run_(bucket, pairs, false, summary);
+    summary.seconds = std::chrono::duration<double>(
+        Retry::Clock::now() - start).count();
+    return summary;
+}
+
+inline const char* AWS::S3::Sync::name(Reason reason) {
+    switch (reason) {
+        case Missing:  return "missing";
+        case Size:     return "size";
+        case Checksum: return "checksum";
+        case Newer:    return "newer";
+    }
+    return "unknown";
+}
+
+inline void AWS::S3::Sync::Summary::report(std::ostream& stream) const {
+    stream << "files " << files << " transferred " << transferred
+           << " skipped " << skipped << " failed " << failed
+           << " bytes " << bytes << " seconds " << seconds
+           << " throughput " << static_cast<uint64_t>(throughput()) << "B/s"
+           << std::endl;
+}
+
+inline bool AWS::S3::Sync::list_(const std::string& bucket,
+    const std::string& prefix, std::map<std::string, Entry>& entries) const {
+    return connection.list(bucket, [&](const Entry& entry) {
+        entries[entry.key] = entry;
+        return true;
+    }, prefix, "", 1000, retries);
+}
+
+inline void AWS::S3::Sync::walk_(const Path& root,
+    const std::string& relative, std::map<std::string, Pair>& files) {
+    std::vector<Path> children(Path::listdir(root));
+    for (std::size_t i = 0; i < children.size(); ++i) {
+        struct stat info;
+        if (lstat(children[i].string().c_str(), &info) != 0) {
+            continue;
+        }
+        std::string name(relative + children[i].filename());
+        if (S_ISDIR(info.st_mode)) {
+            walk_(children[i], name + "/", files);
+        } else if (S_ISREG(info.st_mode)) {
+            Pair& pair(files[name]);
+            pair.local = children[i];
+            pair.size = info.st_size;
+            pair.mtime = info.st_mtime;
+            pair.exists = true;
+        }
+    }
+}
+
+inline bool AWS::S3::Sync::changed_(const Pair& pair, bool upload,
+    Reason& reason) const {
+    if (!pair.exists || !pair.remote) {
+        reason = Missing;
+        return true;
+    }
+    if (pair.size != pair.entry.size) {
+        reason = Size;
+        return true;
+    }
+
+    /* The ETag of a multipart upload is a hash of hashes, with a '-' */
+    std::string etag(pair.entry.etag);
+    etag.erase(std::remove(etag.begin(), etag.end(), '"'), etag.end());
+    if (checksum && etag.size() == 32) {
+        AWS::Curl::Mapping mapping(pair.local);
+        AWS::Checksum::Md5 md5;
+        md5.update(mapping.data(), mapping.size());
+        reason = Checksum;
+        return !mapping.good() || md5.hex() != etag;
+    }
+
+    std::time_t modified(time_(pair.entry.modified));
+    reason = Newer;
+    return upload ? pair.mtime > modified : modified > pair.mtime;
+}
+
+inline bool AWS::S3::Sync::upload_(Connection& connection,
+    const std::string& bucket, const Pair& pair) const {
+    if (pair.size >= multipart) {
+        return connection.upload(bucket, Path("/" + pair.key), pair.local,
+            part_size, part_parallelism, retries);
+    }
+
+    AWS::Curl::Mapping mapping(pair.local);
+    if (!mapping.good()) {
+        std::cerr << "Failed to map " << pair.local.string() << std::endl;
+        return false;
+    }
+    AWS::Curl::Span span(mapping.span());
+    std::string response;
+    return connection.put(bucket, Path("/" + pair.key), span, span.size,
+        response, retries);
+}
+
+inline bool AWS::S3::Sync::download_(Connection& connection,
+    const std::string& bucket, const Pair& pair) const {
+    /* Written alongside, and renamed into place once it's whole */
+    std::string name(pair.local.string());
+    Path::makedirs(name.substr(0, name.rfind('/')));
+    name += ".awscpp-XXXXXX";
+    int fd = mkstemp(&name[0]);
+    if (fd < 0) {
+        std::cerr << "Failed to make a file for " << pair.local.string()
+                  << std::endl;
+        return false;
+    }
+    AWS::Curl::Positional sink(fd, 0);
+    bool ok = connection.get(bucket, Path("/" + pair.key), sink, retries) &&
+        ftruncate(fd, sink.offset) == 0 && fchmod(fd, 0644) == 0;
+
+    /* Given the object's time, so it isn't fetched again */
+    struct timespec times[2];
+    times[0].tv_sec = times[1].tv_sec = time_(pair.entry.modified);
+    times[0].tv_nsec = times[1].tv_nsec = 0;
+    ok = ok && futimens(fd, times) == 0;
+    ok = close(fd) == 0 && ok;
+    if (!ok || rename(name.c_str(), pair.local.string().c_str()) != 0) {
+        unlink(name.c_str());
+        return false;
+    }
+    return true;
+}
+
+inline void AWS::S3::Sync::run_(const std::string& bucket,
+    std::vector<Pair>& pairs, bool upload, Summary& summary) {
+    std::mutex mutex;
+    std::atomic<std::size_t> next(0);
+    summary.files += pairs.size();
+    auto work = [&]() {
+        /* Copies share the pool, but nothing else */
+        Connection connection(this->connection);
+        for (std::size_t i = next++; i < pairs.size(); i = next++) {
+            const Pair& pair(pairs[i]);
+            Reason reason(Missing);
+            if (!changed_(pair, upload, reason)) {
+                std::lock_guard<std::mutex> lock(mutex);
+                ++summary.skipped;
+                continue;
+            }
+
+            bool ok = dryrun || (upload ? upload_(connection, bucket, pair) :
+                download_(connection, bucket, pair));
+            std::lock_guard<std::mutex> lock(mutex);
+            if (ok) {
+                ++summary.transferred;
+                summary.bytes += upload ? pair.size : pair.entry.size;
+            } else {
+                ++summary.failed;
+            }
+            if (observer) {
+                observer(pair.local, pair.key, reason, ok);
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (std::size_t i = 1; i < std::min(parallelism, pairs.size()); ++i) {
+        workers.push_back(std::thread(work));
+    }
+    work();
+    for (std::size_t i = 0; i < workers.size(); ++i) {
+        workers[i].join();
+    }
+}
+
+inline std::time_t AWS::S3::Sync::time_(const std::string& modified) {
+    struct tm parts;
+    std::memset(&parts, 0, sizeof(parts));
+    if (!strptime(modified.c_str(), "%Y-%m-%dT%H:%M:%S", &parts)) {
+        return 0;
+    }
+    return timegm(&parts);
+}
+
+#endif
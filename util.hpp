@@ -32,6 +32,17 @@
 #include <curl/curl.h>
 /* Some path manipulation */
 #include <apathy/path.hpp>
+/* Where response data gets written, and request data is read from */
+#include "sink.hpp"
+#include "source.hpp"
+#include "compress.hpp"
+/* Request and response headers */
+#include "headers.hpp"
+#include "metrics.hpp"
+/* Flow control shared between connections */
+#include "limiter.hpp"
+/* Base64, for signatures and checksums */
+#include "base64.hpp"
 /* Boost headers! */
 #include <boost/algorithm/string.hpp>
 /* You know, for hash functions */
@@ -52,6 +63,13 @@
 #include <vector>
 #include <string>
 #include <map>
+#include <chrono>
+#include <memory>
+#include <thread>
+
+#include <cctype>
+#include <cstring>
+#include <algorithm>
 
 namespace AWS {
     namespace Curl {
@@ -59,43 +77,87 @@ namespace AWS {
         typedef apathy::Path Path;
 
         /* The stuff of headers */
-        typedef std::vector<std::string>           HeaderValues;
-        typedef std::map<std::string,HeaderValues> Headers;
+        typedef std::vector<std::string> HeaderValues;
 
-        /* Because curl-provided headers must be freed, wrapping this */
+        /* Header lines in the form curl wants them. Rather than having curl
+         * copy each line into a list it allocates, the lines are kept in one
+         * buffer and the list's nodes point into it. Both are reused once
+         * they've grown to fit */
         struct Slist {
             /* Default constructor */
-            Slist(): impl(NULL) {}
+            Slist(): lines(), starts(), nodes() {}
 
             /* Fill it with the contents of a headers object */
-            Slist(const Headers& headers): impl(NULL) {
-                typename Headers::const_iterator hit(headers.begin());
-                typename HeaderValues::const_iterator vit;
-                for (; hit != headers.end(); ++hit) {
-                    for (vit = hit->second.begin();
-                         vit != hit->second.end();
-                         ++vit) {
-                        append(hit->first + ": " + *vit);
-                    }
+            Slist(const Headers& headers): lines(), starts(), nodes() {
+                assign(headers);
+            }
+
+            /* Replace the contents with those of a headers object */
+            void assign(const Headers& headers) {
+                clear();
+                for (std::size_t i = 0; i < headers.size(); ++i) {
+                    Headers::Field field(headers.at(i));
+                    starts.push_back(lines.size());
+                    lines.append(field.key, field.key_size);
+                    lines.append(": ", 2);
+                    lines.append(field.value, field.value_size);
+                    lines.push_back('\0');
                 }
             }
 
-            ~Slist() { curl_slist_free_all(impl); }
+            /* Empty it */
+            void clear() {
+                lines.clear();
+                starts.clear();
+            }
 
             /* Append to it */
             void append(const std::string& line) {
-                impl = curl_slist_append(impl, line.c_str());
+                starts.push_back(lines.size());
+                lines.append(line).push_back('\0');
             }
 
-            curl_slist* slist() { return impl; }
+            /* The list to hand to curl, which lasts until this is changed */
+            curl_slist* slist();
         private:
-            curl_slist *impl;
+            std::string              lines;
+            std::vector<std::size_t> starts;
+            std::vector<curl_slist>  nodes;
 
             /* Private, unimplemented to prevent use */
             Slist(const Slist& other);
             const Slist& operator=(const Slist& other);
         };
 
+        /* Percent-encode a string for use in a url. If `slashes` is false,
+         * then '/' is left as it is */
+        std::string escape(const std::string& value, bool slashes=true);
+
+        /* How connections talk to the server, once the endpoint's scheme is
+         * https. Peers are verified against the CA bundle at `ca`, or the
+         * system's if it's empty. TLS sessions are kept in the pool's share
+         * and resumed by new connections, so only the first connection to a
+         * host pays for a full handshake, unless `sessions` is false. With
+         * `http2`, HTTP/2 is offered and the requests of a batch or event
+         * loop are multiplexed over as few connections as they can be,
+         * falling back on HTTP/1.1 if the server doesn't speak it. `fresh`
+         * makes a new connection for every request, which is only useful
+         * for measuring what handshakes cost */
+        struct Transport {
+            Transport(const std::string& ca="", bool http2=false)
+                :ca(ca)
+                ,http2(http2)
+                ,verify(true)
+                ,sessions(true)
+                ,fresh(false) {}
+
+            std::string ca;
+            bool        http2;
+            bool        verify;
+            bool        sessions;
+            bool        fresh;
+        };
+
         /* This is just a way to be able to make a nice wrapper around a curl
          * connection that takes care of all the initialization and so forth.
          * A curl connection is only capable of servicing one request at a
@@ -105,13 +167,79 @@ namespace AWS {
                 :curl(curl_easy_init())
                 ,curl_error()
                 ,request_headers()
-                ,response_headers() {}
+                ,response_headers()
+                ,share(NULL)
+                ,maxage(0)
+                ,maxconnects(0)
+                ,url()
+                ,previous()
+                ,slist()
+                ,metrics()
+                ,statistics()
+                ,limiter()
+                ,transport()
+                ,partition()
+                ,bucket()
+                ,admitted(false)
+                ,started()
+                ,counted(0)
+                ,performing(false)
+                ,paused(false)
+                ,resumes() { init_(); }
+
+            /* Create a connection whose DNS and TLS session caches live in
+             * the provided curl share object. Curl keeps only a handful of
+             * live connections unless it's told otherwise by `maxconnects`,
+             * and with a host per bucket, that quickly means a new
+             * connection (and handshake) per request */
+            explicit Connection(CURLSH* share, long maxage=0,
+                long maxconnects=0)
+                :curl(curl_easy_init())
+                ,curl_error()
+                ,request_headers()
+                ,response_headers()
+                ,share(share)
+                ,maxage(maxage)
+                ,maxconnects(maxconnects)
+                ,url()
+                ,previous()
+                ,slist()
+                ,metrics()
+                ,statistics()
+                ,limiter()
+                ,transport()
+                ,partition()
+                ,bucket()
+                ,admitted(false)
+                ,started()
+                ,counted(0)
+                ,performing(false)
+                ,paused(false)
+                ,resumes() { init_(); }
 
             Connection(const Connection& other)
                 :curl(curl_easy_init())
                 ,curl_error()
                 ,request_headers(other.request_headers)
-                ,response_headers() {}
+                ,response_headers()
+                ,share(other.share)
+                ,maxage(other.maxage)
+                ,maxconnects(other.maxconnects)
+                ,url()
+                ,previous()
+                ,slist()
+                ,metrics(other.metrics)
+                ,statistics()
+                ,limiter(other.limiter)
+                ,transport(other.transport)
+                ,partition()
+                ,bucket()
+                ,admitted(false)
+                ,started()
+                ,counted(0)
+                ,performing(false)
+                ,paused(false)
+                ,resumes() { init_(); }
 
             ~Connection() {
                 curl_easy_cleanup(curl);
@@ -122,10 +250,12 @@ namespace AWS {
                 return *this;
             }
 
-            /* Reset the request */
+            /* Reset the request. Live connections and caches are kept, so
+             * that the next request can reuse them */
             void reset();
 
-            /* Return how much data has been downloaded */
+            /* Return the size of the response body, as reported by the
+             * server. This is how one learns an object's size from HEAD */
             std::size_t downloaded();
 
             /* Add a header to our request */
@@ -142,9 +272,126 @@ namespace AWS {
                 const std::string& query, T& istream, std::size_t size,
                 S& ostream);
 
+            /* Perform a HEAD request */
+            long head(const std::string& host, const Path& path,
+                const std::string& query);
+
+            /* Set up a HEAD request without performing it */
+            void prepareHead(const std::string& host, const Path& path,
+                const std::string& query);
+
+            /* Perform a POST request, sending the contents of istream */
+            template <typename T, typename S>
+            long post(const std::string& host, const Path& path,
+                const std::string& query, T& istream, std::size_t size,
+                S& ostream);
+
+            /* Perform a DELETE request */
+            template <typename S>
+            long del(const std::string& host, const Path& path,
+                const std::string& query, S& ostream);
+
+            /* Set up a POST request without performing it */
+            template <typename T, typename S>
+            void preparePost(const std::string& host, const Path& path,
+                const std::string& query, T& istream, std::size_t size,
+                S& ostream);
+
+            /* Set up a DELETE request without performing it */
+            template <typename S>
+            void prepareDelete(const std::string& host, const Path& path,
+                const std::string& query, S& ostream);
+
+            /* Set up a GET request without performing it, so that it may be
+             * performed later, or by a curl multi handle */
+            template <typename T>
+            void prepareGet(const std::string& host, const Path& path,
+                const std::string& query, T& stream);
+
+            /* Set up a PUT request without performing it */
+            template <typename T, typename S>
+            void preparePut(const std::string& host, const Path& path,
+                const std::string& query, T& istream, std::size_t size,
+                S& ostream);
+
+            /* Perform a prepared request, returning the response code, or -1
+             * if there was a curl error */
+            long perform();
+
+            /* Record how a request went once it has completed, and hand its
+             * stats to the metrics sink. perform() does this itself, but
+             * requests performed elsewhere (see multi.hpp) must do it */
+            void complete(CURLcode result);
+
+            /* The stats of the last completed request */
+            const Stats& stats() const { return statistics; }
+
+            /* Send the stats of every request to a metrics sink, or to none
+             * if it's empty. This survives a reset */
+            void setMetrics(
+                const std::shared_ptr<const AWS::Metrics::Sink>& sink) {
+                if (metrics != sink) {
+                    metrics = sink;
+                }
+            }
+
+            /* Share flow control with other connections (see limiter.hpp), or
+             * none if it's empty. This survives a reset */
+            void setLimiter(const std::shared_ptr<Limiter>& limiter) {
+                if (this->limiter != limiter) {
+                    this->limiter = limiter;
+                }
+            }
+
+            /* Say that the next request is to a bucket whose url (all of
+             * the request's url up to the key) is `url`, so that the limiter
+             * can group requests by bucket. A reset forgets it, and without
+             * it, requests are grouped by host */
+            void setBucket(const std::string& url) { bucket = url; }
+
+            /* Talk to the server as described (see Transport), or as a
+             * default Transport would if it's empty. This survives a reset,
+             * and changing it resets the request */
+            void setTransport(
+                const std::shared_ptr<const Transport>& transport);
+
+            /* Take what the prepared request needs from the limiter, if
+             * there is one. Returns how many seconds to wait before it may
+             * be made, and asking again until it's zero. perform() does this
+             * itself, but requests performed elsewhere must do it */
+            double admit();
+
+            /* On an event loop, a transfer whose bytes have to wait on the
+             * limiter is paused, rather than holding up every other transfer
+             * on the loop. Unpause it if it's due, returning how many seconds
+             * until it is, or zero if it isn't paused. Only the thread
+             * running the transfer may call this */
+            double resume();
+
+            /* Say how many attempts came before the prepared request. Another
+             * attempt at the same request as one that just failed is taken
+             * to be a retry, but otherwise it's up to the caller */
+            void setRetries(std::size_t retries) {
+                statistics.retries = retries;
+            }
+
+            /* The response code of the last completed request */
+            long response();
+
+            /* The underlying curl easy handle */
+            CURL* handle() { return curl; }
+
             /* Get the request headers */
             const Headers& get_request_headers() { return request_headers; }
 
+            /* Get the first value of a response header, or an empty string
+             * if there was no such header. Keys are not case-sensitive */
+            std::string responseHeader(const std::string& key) const;
+
+            /* The headers of the last response, which have accessors for
+             * the ones S3 sends (see headers.hpp) */
+            const Headers& responseHeaders() const { return response_headers; }
+
             /* Get the error message */
             std::string error() { return curl_error; }
 
@@ -154,21 +401,62 @@ namespace AWS {
                 std::size_t nmemb, void *stream);
 
             /* This is for use with curl when reading response data and pumping
-             * it out to a stream */
+             * it out to a sink. See sink.hpp for the types of sinks */
             template <typename T>
             static std::size_t appendData_(void* ptr, std::size_t size,
                 std::size_t nmemb, void *stream);
 
-            /* This is for use with curl when reading input data from a stream
-             * and pumping it out to the server */
+            /* This is for use with curl when reading input data from a source
+             * and pumping it out to the server. See source.hpp */
             template <typename T>
             static std::size_t readData_(void* ptr, std::size_t size,
                 std::size_t nmemb, void *stream);
+
+            /* This is for use with curl as the transfer progresses, to take
+             * the bytes sent and received from the limiter */
+            static int progress_(void* connection, curl_off_t dltotal,
+                curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow);
         private:
+            /* Apply the options that should survive a reset */
+            void init_();
+
+            /* Apply the options of our transport */
+            void transport_();
+
+            /* Apply the options common to every request */
+            void prepare_(const std::string& verb, const std::string& host,
+                const Path& path, const std::string& query);
+
             CURL*   curl;
             char    curl_error[CURL_ERROR_SIZE];
             Headers request_headers;
             Headers response_headers;
+            CURLSH* share;
+            long    maxage;
+            long    maxconnects;
+            /* These must outlive a prepared request */
+            std::string url;
+            std::string previous;
+            Slist       slist;
+            /* Where the stats of each request go */
+            std::shared_ptr<const AWS::Metrics::Sink> metrics;
+            Stats       statistics;
+            /* Flow control, the key of the prepared request, whether it holds
+             * a slot, when it may start and how many bytes have been taken */
+            std::shared_ptr<Limiter> limiter;
+            /* How to talk to the server */
+            std::shared_ptr<const Transport> transport;
+            std::string              partition;
+            std::string              bucket;
+            bool                     admitted;
+            Limiter::Clock::time_point started;
+            curl_off_t               counted;
+            /* Whether perform() is running the transfer on this thread, and
+             * if it isn't, whether it's paused for the limiter and until
+             * when */
+            bool                     performing;
+            bool                     paused;
+            Limiter::Clock::time_point resumes;
         };
     }
 
@@ -179,6 +467,10 @@ namespace AWS {
         /* Return a string representative of the canonicalized headers */
         std::string canonicalizedAmzHeaders(const Headers& headers);
 
+        /* Append the canonicalized headers to a buffer, which doesn't
+         * allocate if the buffer already has room */
+        void canonicalizedAmzHeaders(const Headers& headers, std::string& out);
+
         /* Return a string representative of the canonicalized query */
         std::string canonicalizedQueryString(const std::string& query);
 
@@ -191,7 +483,8 @@ namespace AWS {
         /* Return a date in the correct format */
         std::string date();
 
-        /* Base-64 encoding */
+        /* Base-64 encoding. See base64.hpp for decoding, and for encoding
+         * whole buffers at a time */
         void b64_enblock(unsigned char in[3], unsigned char out[4], int len);
         void b64_encode(unsigned char *input, size_t inlen,
             unsigned char *output);
@@ -203,35 +496,134 @@ namespace AWS {
 /******************************************************************************
  * Implementations
  *****************************************************************************/
+inline std::string AWS::Curl::escape(const std::string& value, bool slashes) {
+    static const char hex[] = "0123456789ABCDEF";
+    std::string result;
+    result.reserve(value.size());
+    std::string::const_iterator it(value.begin());
+    for (; it != value.end(); ++it) {
+        unsigned char c = static_cast<unsigned char>(*it);
+        if (std::isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~' ||
+            (c == '/' && !slashes)) {
+            result.push_back(c);
+        } else {
+            result.push_back('%');
+            result.push_back(hex[c >> 4]);
+            result.push_back(hex[c & 0x0f]);
+        }
+    }
+    return result;
+}
+
+inline curl_slist* AWS::Curl::Slist::slist() {
+    if (starts.empty()) {
+        return NULL;
+    }
+
+    /* The lines may have moved since they were appended, so the nodes are
+     * only linked up now */
+    nodes.resize(starts.size());
+    for (std::size_t i = 0; i < starts.size(); ++i) {
+        nodes[i].data = &lines[starts[i]];
+        nodes[i].next = (i + 1 < starts.size()) ? &nodes[i + 1] : NULL;
+    }
+    return &nodes[0];
+}
+
+inline void AWS::Curl::Connection::init_() {
+    /* Keep our connections alive between requests so that they may be
+     * reused, rather than paying for a new handshake each time */
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPIDLE, 30L);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPINTVL, 15L);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    if (maxage > 0) {
+        curl_easy_setopt(curl, CURLOPT_MAXAGE_CONN, maxage);
+    }
+    if (maxconnects > 0) {
+        curl_easy_setopt(curl, CURLOPT_MAXCONNECTS, maxconnects);
+    }
+    if (share != NULL) {
+        curl_easy_setopt(curl, CURLOPT_SHARE, share);
+    }
+    transport_();
+}
+
+inline void AWS::Curl::Connection::transport_() {
+    Transport defaults;
+    const Transport& options(transport ? *transport : defaults);
+    if (!options.ca.empty()) {
+        curl_easy_setopt(curl, CURLOPT_CAINFO, options.ca.c_str());
+    }
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, options.verify ? 1L : 0L);
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, options.verify ? 2L : 0L);
+    curl_easy_setopt(curl, CURLOPT_SSL_SESSIONID_CACHE,
+        options.sessions ? 1L : 0L);
+    curl_easy_setopt(curl, CURLOPT_FRESH_CONNECT, options.fresh ? 1L : 0L);
+    curl_easy_setopt(curl, CURLOPT_FORBID_REUSE, options.fresh ? 1L : 0L);
+
+    /* Without the HTTP/2 option, HTTP/1.1 is all that's offered. With it,
+     * a request waits to learn whether a connection that's being made can
+     * be multiplexed, rather than making one of its own */
+    curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, options.http2 ?
+        CURL_HTTP_VERSION_2TLS : CURL_HTTP_VERSION_1_1);
+    curl_easy_setopt(curl, CURLOPT_PIPEWAIT, options.http2 ? 1L : 0L);
+}
+
+inline void AWS::Curl::Connection::setTransport(
+    const std::shared_ptr<const Transport>& transport) {
+    /* Resetting is the only way back to curl's own CA bundle */
+    if (this->transport != transport) {
+        this->transport = transport;
+        curl_easy_reset(curl);
+        init_();
+    }
+}
+
 inline void AWS::Curl::Connection::reset() {
     /* Reset the curl connection */
     curl_easy_reset(curl);
+    init_();
     /* At this point, just reset the request headers */
     request_headers.clear();
     response_headers.clear();
+    bucket.clear();
 }
 
 inline void AWS::Curl::Connection::addHeader(const std::string& key,
     const std::string& value) {
-    request_headers[key].push_back(value);
+    request_headers.add(key, value);
 }
 
-template <typename T>
-inline long AWS::Curl::Connection::get(const std::string& host,
-    const Path& path, const std::string& query, T& stream) {
+inline void AWS::Curl::Connection::prepare_(const std::string& verb,
+    const std::string& host, const Path& path, const std::string& query) {
     /* Let's begin by putting together some headers */
-    Slist slist(request_headers);
-
-    /* With our headers together, we can begin to make a request */
-    std::string url = "http://" + host + path.string();
+    slist.assign(request_headers);
+
+    /* With our headers together, we can begin to make a request. The host
+     * may name its own scheme, and otherwise it's plain http */
+    previous.swap(url);
+    url.clear();
+    if (host.find("://") == std::string::npos) {
+        url = "http://";
+    }
+    url += host;
+    url += path.string();
     if (query != "") {
         url += "?" + query;
     }
 
-    /* Set the urls, headers, verb, error buffer and file to write to */
+    /* Making the same request again right after it failed is a retry */
+    bool failed = (statistics.response == -1) ||
+        (statistics.response == 429) || (statistics.response >= 500);
+    statistics.retries = (failed && url == previous && verb == statistics.verb)
+        ? statistics.retries + 1 : 0;
+    statistics.verb = verb;
+
+    /* Set the urls, headers, verb and error buffer */
     curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
     curl_easy_setopt(curl, CURLOPT_HTTPHEADER, slist.slist());
-    curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "GET");
+    curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, verb.c_str());
     curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, curl_error);
 
     /* These came right out of the original code */
@@ -243,49 +635,51 @@ inline long AWS::Curl::Connection::get(const std::string& host,
     curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION,
         AWS::Curl::Connection::appendHeader_);
     curl_easy_setopt(curl, CURLOPT_HEADERDATA, reinterpret_cast<void*>(this));
+
+    /* Bytes are only counted as they go if they're limited */
+    if (limiter) {
+        partition = Limiter::key(url, bucket, limiter->depth());
+        counted = 0;
+        if (limiter->limitsBytes()) {
+            curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION,
+                AWS::Curl::Connection::progress_);
+            curl_easy_setopt(curl, CURLOPT_XFERINFODATA,
+                reinterpret_cast<void*>(this));
+            curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+        }
+    }
+}
+
+inline void AWS::Curl::Connection::prepareHead(const std::string& host,
+    const Path& path, const std::string& query) {
+    prepare_("HEAD", host, path, query);
+    /* Otherwise curl waits around for a body that will never come */
+    curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+}
+
+inline long AWS::Curl::Connection::head(const std::string& host,
+    const Path& path, const std::string& query) {
+    prepareHead(host, path, query);
+    return perform();
+}
+
+template <typename T>
+inline void AWS::Curl::Connection::prepareGet(const std::string& host,
+    const Path& path, const std::string& query, T& stream) {
+    prepare_("GET", host, path, query);
+
     /* And how we'll write the data */
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION,
         AWS::Curl::Connection::appendData_<T>);
     curl_easy_setopt(curl, CURLOPT_WRITEDATA, reinterpret_cast<void*>(&stream));
-    
-    /* If there was an error, return something to indicate that */
-    if (curl_easy_perform(curl) != CURLE_OK) {
-        return -1;
-    }
-
-    /* Now check the status code and return it */
-    long response;
-    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response);
-    return response;
 }
 
 template <typename T, typename S>
-inline long AWS::Curl::Connection::put(const std::string& host,
+inline void AWS::Curl::Connection::preparePut(const std::string& host,
     const Path& path, const std::string& query, T& istream, std::size_t size,
     S& ostream) {
-    /* Let's begin by putting together some headers */
-    Slist slist(request_headers);
-
-    std::string url = "http://" + host + path.string();
-    if (query != "") {
-        url += "?" + query;
-    }
+    prepare_("PUT", host, path, query);
 
-    /* Set the url, headers, verb, erro buff, etc. */
-    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, slist.slist());
-    curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "PUT");
-    curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, curl_error);
-
-    /* These came right out of the original code */
-    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1024);
-    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 30);
-    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 3);
-
-    /* Now we'll set up to recieve the header */
-    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION,
-        AWS::Curl::Connection::appendHeader_);
-    curl_easy_setopt(curl, CURLOPT_HEADERDATA, reinterpret_cast<void*>(this));
     /* And how we'll write the data. */
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION,
         AWS::Curl::Connection::appendData_<S>);
@@ -295,114 +689,352 @@ inline long AWS::Curl::Connection::put(const std::string& host,
         AWS::Curl::Connection::readData_<T>);
     curl_easy_setopt(curl, CURLOPT_READDATA, reinterpret_cast<void*>(&istream));
     curl_easy_setopt(curl, CURLOPT_UPLOAD, 1);
-    curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE, size);
+    curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE,
+        static_cast<curl_off_t>(size));
+}
 
-    /* If there was an error, return something to say so */
-    if (curl_easy_perform(curl) != CURLE_OK) {
-        std::cerr << "Curl error: " << curl_error << std::endl;
-        return -1;
+template <typename T, typename S>
+inline void AWS::Curl::Connection::preparePost(const std::string& host,
+    const Path& path, const std::string& query, T& istream, std::size_t size,
+    S& ostream) {
+    prepare_("POST", host, path, query);
+
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION,
+        AWS::Curl::Connection::appendData_<S>);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, reinterpret_cast<void*>(&ostream));
+    /* Without any post fields, curl reads the body with our read function */
+    curl_easy_setopt(curl, CURLOPT_POST, 1L);
+    curl_easy_setopt(curl, CURLOPT_READFUNCTION,
+        AWS::Curl::Connection::readData_<T>);
+    curl_easy_setopt(curl, CURLOPT_READDATA, reinterpret_cast<void*>(&istream));
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE,
+        static_cast<curl_off_t>(size));
+}
+
+template <typename S>
+inline void AWS::Curl::Connection::prepareDelete(const std::string& host,
+    const Path& path, const std::string& query, S& ostream) {
+    prepare_("DELETE", host, path, query);
+
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION,
+        AWS::Curl::Connection::appendData_<S>);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, reinterpret_cast<void*>(&ostream));
+}
+
+template <typename T, typename S>
+inline long AWS::Curl::Connection::post(const std::string& host,
+    const Path& path, const std::string& query, T& istream, std::size_t size,
+    S& ostream) {
+    preparePost(host, path, query, istream, size, ostream);
+    return perform();
+}
+
+template <typename S>
+inline long AWS::Curl::Connection::del(const std::string& host,
+    const Path& path, const std::string& query, S& ostream) {
+    prepareDelete(host, path, query, ostream);
+    return perform();
+}
+
+inline long AWS::Curl::Connection::perform() {
+    for (double wait = admit(); wait > 0; wait = admit()) {
+        /* Waiting on a slot means waiting for another request to leave */
+        if (!admitted) {
+            limiter->wait(partition);
+            continue;
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(
+            static_cast<long long>(wait * 1e6)));
+    }
+    /* If there was an error, the response is -1 to indicate that */
+    performing = true;
+    CURLcode result = curl_easy_perform(curl);
+    performing = false;
+    complete(result);
+    return statistics.response;
+}
+
+inline void AWS::Curl::Connection::complete(CURLcode result) {
+    Stats& stats(statistics);
+    stats.result = result;
+    stats.response = (result == CURLE_OK) ? response() : -1;
+
+    /* Curl keeps its times in microseconds */
+    curl_off_t value = 0;
+    curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &value);
+    stats.namelookup = value / 1e6;
+    curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &value);
+    stats.connect = value / 1e6;
+    curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &value);
+    stats.tls = value / 1e6;
+    curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME_T, &value);
+    stats.pretransfer = value / 1e6;
+    curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &value);
+    stats.starttransfer = value / 1e6;
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &value);
+    stats.total = value / 1e6;
+    curl_easy_getinfo(curl, CURLINFO_SIZE_UPLOAD_T, &value);
+    stats.uploaded = static_cast<std::size_t>(value);
+    curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &value);
+    stats.downloaded = static_cast<std::size_t>(value);
+
+    /* If no new connection was made, an open one was reused */
+    long connects = 0;
+    curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+    stats.reused = (connects == 0) && (result == CURLE_OK);
+
+    if (admitted) {
+        limiter->leave(partition, stats.response, started);
+        admitted = false;
+    }
+    paused = false;
+    if (metrics && *metrics) {
+        (*metrics)(stats);
+    }
+}
+
+inline double AWS::Curl::Connection::admit() {
+    if (!limiter) {
+        return 0;
+    }
+    Limiter::Clock::time_point now = Limiter::Clock::now();
+    if (!admitted) {
+        /* Slots free up as other requests complete, so check back soon, or
+         * in perform(), wait for one to */
+        if (!limiter->admit(partition)) {
+            return 0.01;
+        }
+        admitted = true;
+        started = now + std::chrono::duration_cast<Limiter::Clock::duration>(
+            std::chrono::duration<double>(limiter->request()));
+    }
+    double wait = std::chrono::duration<double>(started - now).count();
+    return wait > 0 ? wait : 0;
+}
+
+inline int AWS::Curl::Connection::progress_(void* connection,
+    curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal,
+    curl_off_t ulnow) {
+    Connection* self = reinterpret_cast<Connection*>(connection);
+    curl_off_t delta = dlnow + ulnow - self->counted;
+    if (delta > 0) {
+        self->counted += delta;
+        double wait = self->limiter->transfer(static_cast<std::size_t>(delta));
+        if (wait > 0 && self->performing) {
+            std::this_thread::sleep_for(std::chrono::microseconds(
+                static_cast<long long>(wait * 1e6)));
+        } else if (wait > 0) {
+            /* The event loop unpauses it once it's due (see resume) */
+            self->paused = true;
+            self->resumes = Limiter::Clock::now() +
+                std::chrono::duration_cast<Limiter::Clock::duration>(
+                    std::chrono::duration<double>(wait));
+            curl_easy_pause(self->curl, CURLPAUSE_ALL);
+        }
     }
+    return 0;
+}
 
-    /* Get and return the response */
-    long response;
+inline double AWS::Curl::Connection::resume() {
+    if (!paused) {
+        return 0;
+    }
+    double wait = std::chrono::duration<double>(
+        resumes - Limiter::Clock::now()).count();
+    if (wait > 0) {
+        return wait;
+    }
+    paused = false;
+    curl_easy_pause(curl, CURLPAUSE_CONT);
+    return 0;
+}
+
+inline long AWS::Curl::Connection::response() {
+    long response = 0;
     curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response);
     return response;
 }
 
+template <typename T>
+inline long AWS::Curl::Connection::get(const std::string& host,
+    const Path& path, const std::string& query, T& stream) {
+    prepareGet(host, path, query, stream);
+    return perform();
+}
+
+template <typename T, typename S>
+inline long AWS::Curl::Connection::put(const std::string& host,
+    const Path& path, const std::string& query, T& istream, std::size_t size,
+    S& ostream) {
+    preparePut(host, path, query, istream, size, ostream);
+
+    /* If there was an error, return something to say so */
+    long response = perform();
+    if (response == -1) {
+        std::cerr << "Curl error: " << curl_error << std::endl;
+    }
+    return response;
+}
+
 inline std::size_t AWS::Curl::Connection::downloaded() {
-    double down;
-    curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &down);
-    return static_cast<std::size_t>(down);
+    curl_off_t down = 0;
+    curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &down);
+    return (down < 0) ? 0 : static_cast<std::size_t>(down);
 }
 
 inline std::size_t AWS::Curl::Connection::appendHeader_(void *ptr, std::size_t size,
     std::size_t nmemb, void *stream) {
     /* Our user data is a Connection object */
     Connection* conn = reinterpret_cast<Connection*>(stream);
-    /* Make a string object and strip off the last CR/LF */
-    std::string line(reinterpret_cast<char*>(ptr), size * nmemb);
-    line = line.substr(0, line.length() - 2);
-    /* Find the ': ' in the line if there is one for our key, value */
-    std::size_t pos = line.find(": ");
-    if (pos != std::string::npos) {
-        std::string key(line.substr(0, pos));
-        std::string value(line.substr(pos + 2));
-        conn->response_headers[key].push_back(value);
+    const char* line = reinterpret_cast<const char*>(ptr);
+    std::size_t length = size * nmemb;
+    /* A status line starts a new response (after a 100 Continue or a
+     * redirect, for instance), and only the last one's headers are kept */
+    if (length >= 5 && std::memcmp(line, "HTTP/", 5) == 0) {
+        conn->response_headers.clear();
+        return length;
     }
-    return size * nmemb;
+
+    /* The key and value are copied straight out of curl's buffer, without
+     * the CR/LF or the whitespace around the value */
+    const char* end = line + length;
+    while (end > line && (end[-1] == '\n' || end[-1] == '\r' ||
+        end[-1] == ' ' || end[-1] == '\t')) {
+        --end;
+    }
+    const char* colon = std::find(line, end, ':');
+    if (colon != end && colon != line) {
+        const char* value = colon + 1;
+        while (value < end && (*value == ' ' || *value == '\t')) {
+            ++value;
+        }
+        conn->response_headers.add(line, colon - line, value, end - value);
+    }
+    return length;
 }
 
-/* A couple of instantiations */
-template std::size_t AWS::Curl::Connection::appendData_<std::ostream>(
-    void* ptr, std::size_t size, std::size_t nmemb, void *stream);
-template std::size_t AWS::Curl::Connection::appendData_<std::ofstream>(
-    void* ptr, std::size_t size, std::size_t nmemb, void *stream);
-template std::size_t AWS::Curl::Connection::appendData_<std::stringstream>(
-    void* ptr, std::size_t size, std::size_t nmemb, void *stream);
-template std::size_t AWS::Curl::Connection::appendData_<std::ostringstream>(
-    void* ptr, std::size_t size, std::size_t nmemb, void *stream);
+inline std::string AWS::Curl::Connection::responseHeader(
+    const std::string& key) const {
+    return response_headers.get(key);
+}
 
 template <typename T>
 inline std::size_t AWS::Curl::Connection::appendData_(void* ptr,
     std::size_t size, std::size_t nmemb, void *stream) {
-    (*reinterpret_cast<T*>(stream)) << std::string(
-        reinterpret_cast<char*>(ptr), size * nmemb);
-    return size * nmemb;
+    /* Hand the data over directly from curl's buffer */
+    return Sink<T>::write(*reinterpret_cast<T*>(stream),
+        reinterpret_cast<const char*>(ptr), size * nmemb);
 }
 
-/* A couple of instantiations */
-template std::size_t AWS::Curl::Connection::readData_<std::istream>(
-    void* ptr, std::size_t size, std::size_t nmemb, void *stream);
-template std::size_t AWS::Curl::Connection::readData_<std::ifstream>(
-    void* ptr, std::size_t size, std::size_t nmemb, void *stream);
-template std::size_t AWS::Curl::Connection::readData_<std::stringstream>(
-    void* ptr, std::size_t size, std::size_t nmemb, void *stream);
-template std::size_t AWS::Curl::Connection::readData_<std::istringstream>(
-    void* ptr, std::size_t size, std::size_t nmemb, void *stream);
-
 template <typename T>
 inline std::size_t AWS::Curl::Connection::readData_(void* ptr,
     std::size_t size, std::size_t nmemb, void *stream) {
-    /* Apparently istream::read doesn't return the number of bytes read, and so
-     * to find out how much has been read, we'll use the get pointer */
-    T* istream = reinterpret_cast<T*>(stream);
-    istream->read(reinterpret_cast<char*>(ptr), size * nmemb);
-    return istream->gcount();
+    return Source<T>::read(*reinterpret_cast<T*>(stream),
+        reinterpret_cast<char*>(ptr), size * nmemb);
 }
 
 /******************************************************************************
  * Auth Implementation
  *****************************************************************************/
 inline std::string AWS::Auth::canonicalizedAmzHeaders(const Headers& headers) {
-    /* We're copying each header over, because we have to do some manipulation
-     * of them. In particular, of the keys */
-    std::string key;
-    Headers canonical;
-    typename Headers::const_iterator it(headers.begin());
-    for (; it != headers.end(); ++it) {
-        /* Lowercase each of the key names */
-        key = boost::algorithm::to_lower_copy(it->first);
-
-        /* Filter out all headers that belong to Amazon */
-        if (key.find("x-amz-") == 0) {
-            /* It's important to merge these, not replace */
-            canonical[key].insert(
-                canonical[key].end(), it->second.begin(), it->second.end());
+    std::string result;
+    canonicalizedAmzHeaders(headers, result);
+    return result;
+}
+
+inline void AWS::Auth::canonicalizedAmzHeaders(const Headers& headers,
+    std::string& out) {
+    /* Go through the headers in alphabetical order, so that all the values
+     * for a key are next to one another */
+    static thread_local std::vector<std::size_t> order;
+    headers.sorted(order);
+
+    bool first = true;
+    Headers::Field last = { NULL, 0, NULL, 0 };
+    for (std::size_t i = 0; i < order.size(); ++i) {
+        Headers::Field field(headers.at(order[i]));
+
+        /* Filter out all headers that don't belong to Amazon */
+        if (field.key_size < 6 ||
+            !Headers::equal(field.key, 6, "x-amz-", 6)) {
+            continue;
+        }
+
+        /* It's important to merge these, not replace */
+        bool same = !first &&
+            Headers::equal(field.key, field.key_size, last.key, last.key_size);
+        if (!same) {
+            if (!first) {
+                /* Strip the trailing whitespace of the last line */
+                while (!out.empty() && std::isspace(
+                    static_cast<unsigned char>(out[out.size() - 1]))) {
+                    out.resize(out.size() - 1);
+                }
+                out.push_back('\n');
+            }
+            /* Lowercase each of the key names */
+            for (std::size_t j = 0; j < field.key_size; ++j) {
+                out.push_back(static_cast<char>(
+                    std::tolower(static_cast<unsigned char>(field.key[j]))));
+            }
+            out.push_back(':');
+        } else {
+            out.push_back(',');
+        }
+
+        /* Replace all the newlines with spaces, and strip all the leading
+         * whitespace of the line */
+        for (std::size_t j = 0; j < field.value_size; ++j) {
+            char c = (field.value[j] == '\n') ? ' ' : field.value[j];
+            if (out[out.size() - 1] == ':' &&
+                std::isspace(static_cast<unsigned char>(c))) {
+                continue;
+            }
+            out.push_back(c);
+        }
+        first = false;
+        last = field;
+    }
+
+    while (!first && std::isspace(
+        static_cast<unsigned char>(out[out.size() - 1]))) {
+        out.resize(out.size() - 1);
+    }
+}
+
+inline std::string AWS::Auth::canonicalizedQueryString(
+    const std::string& query) {
+    /* Only these subresources are included when signing */
+    static const char* subresources[] = {
+        "acl", "cors", "delete", "lifecycle", "location", "logging",
+        "notification", "partNumber", "policy", "requestPayment",
+        "response-cache-control", "response-content-disposition",
+        "response-content-encoding", "response-content-language",
+        "response-content-type", "response-expires", "restore", "tagging",
+        "torrent", "uploadId", "uploads", "versionId", "versioning",
+        "versions", "website"
+    };
+    static const std::size_t count =
+        sizeof(subresources) / sizeof(subresources[0]);
+
+    std::vector<std::string> params;
+    boost::algorithm::split(params, query, boost::algorithm::is_any_of("&"));
+
+    std::vector<std::string> kept;
+    std::vector<std::string>::const_iterator it(params.begin());
+    for (; it != params.end(); ++it) {
+        std::string key(it->substr(0, it->find('=')));
+        if (std::find(subresources, subresources + count, key) !=
+            subresources + count) {
+            kept.push_back(*it);
         }
     }
 
-    /* Now go through these lowercased headers in alphabetical order */
-    std::string line;
-    std::vector<std::string> lines;
-    for (it = canonical.begin(); it != canonical.end(); ++it) {
-        line = boost::algorithm::join(it->second, ",");
-        /* Replace all the newlines in this, and then strip all the leading
-         * and trailing whiespace */
-        boost::algorithm::replace_all(line, "\n", " ");
-        boost::algorithm::trim(line);
-        lines.push_back(it->first + ":" + line);
+    if (kept.empty()) {
+        return "";
     }
-    return boost::algorithm::join(lines, "\n");
+    std::sort(kept.begin(), kept.end());
+    return "?" + boost::algorithm::join(kept, "&");
 }
 
 inline std::string AWS::Auth::date() {
@@ -421,9 +1053,15 @@ inline std::string AWS::Auth::signature(const std::string& verb,
     const std::string& md5, const std::string& content_type,
     const std::string& date, const Headers& headers, const std::string& url,
     const std::string& secret_key) {
-    /* Generate the string that we have to sign */
-    std::string toSign = verb + "\n" + md5 + "\n" + content_type + "\n"
-        + date + "\n" + AWS::Auth::canonicalizedAmzHeaders(headers) + url;
+    /* Generate the string that we have to sign, in a buffer that's reused */
+    static thread_local std::string toSign;
+    toSign.clear();
+    toSign.append(verb).append(1, '\n');
+    toSign.append(md5).append(1, '\n');
+    toSign.append(content_type).append(1, '\n');
+    toSign.append(date).append(1, '\n');
+    AWS::Auth::canonicalizedAmzHeaders(headers, toSign);
+    toSign.append(url);
 
     /* And now we'll begin the signing */
     unsigned char processed[21];
@@ -460,14 +1098,7 @@ inline void AWS::Auth::b64_enblock(
 
 inline void AWS::Auth::b64_encode(
     unsigned char *input, size_t inlen, unsigned char *output) {
-    size_t inindex = 0;
-    while(inindex < inlen)
-    {
-        AWS::Auth::b64_enblock(input+inindex, output, inlen-inindex);
-        //printf("%c%c%c -> %c%c%c%c\n", input[inindex], input[inindex+1], input[inindex+2], output[0], output[1], output[2], output[3]);
-        inindex += 3;
-        output += 4;
-    }
+    AWS::Base64::encode(input, inlen, reinterpret_cast<char*>(output));
 }
 
 #endif
@@ -0,0 +1,331 @@
+/******************************************************************************
+ * Copyright (c) 2013 SEOmoz
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#ifndef AWSCPP__XML_HPP
+#define AWSCPP__XML_HPP
+
+/******************************************************************************
+ * An incremental XML parser, for the responses S3 sends. It's fed a document
+ * a piece at a time, as curl hands it over, and calls its handler as elements
+ * open and close and their text is complete, so that nothing has to hold on
+ * to the whole document. A handler looks like:
+ *
+ *     struct Handler {
+ *         void open(const std::string& name);
+ *         void close(const std::string& name);
+ *         void text(const std::string& text);
+ *         void reset();
+ *     };
+ *
+ * Text has its entities decoded. Whitespace between elements is skipped, but
+ * an element's own text is kept whole, even if it's only spaces. Attributes, comments, processing instructions and doctypes are skipped,
+ * too. A parser can be used as a sink (see sink.hpp), and a retried request
+ * starts it, and its handler, over.
+ *****************************************************************************/
+
+#include "sink.hpp"
+
+/* Standard includes */
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+namespace AWS {
+    namespace Xml {
+        /* Decode the entities in some text, appending it to `out` */
+        void unescape(const char* data, std::size_t size, std::string& out);
+
+        /* Encode the characters that can't appear as they are in text */
+        std::string escape(const std::string& text);
+
+        /* Calls a handler as a document is parsed. See above */
+        template <typename Handler>
+        class Parser {
+        public:
+            explicit Parser(Handler& handler)
+                :handler(handler)
+                ,inside(false)
+                ,failed(false)
+                ,leaf(false)
+                ,raw()
+                ,text()
+                ,tag()
+                ,name() {}
+
+            /* Parse the next piece of the document. Returns false if it's
+             * not well-formed enough to parse */
+            bool feed(const char* data, std::size_t size);
+
+            /* Start over with a new document */
+            void reset();
+
+            /* Whether everything so far has parsed */
+            bool good() const { return !failed; }
+
+            Handler& handler;
+        private:
+            /* Deal with a whole tag, without its brackets */
+            void tag_(const char* start, std::size_t length);
+
+            /* Whether we're in a tag, whether parsing failed and whether
+             * the last tag opened an element that has nothing in it yet */
+            bool        inside;
+            bool        failed;
+            bool        leaf;
+            /* Text that's yet to have its entities decoded, and text that
+             * has, the tag we're in and the name of the element */
+            std::string raw;
+            std::string text;
+            std::string tag;
+            std::string name;
+
+            /* Private, unimplemented to prevent use */
+            Parser(const Parser& other);
+            const Parser& operator=(const Parser& other);
+        };
+    }
+
+    namespace Curl {
+        /* Documents are parsed as they're received */
+        template <typename Handler>
+        struct Sink<AWS::Xml::Parser<Handler> > {
+            typedef int Position;
+
+            static std::size_t write(AWS::Xml::Parser<Handler>& sink,
+                const char* data, std::size_t size) {
+                return sink.feed(data, size) ? size : 0;
+            }
+
+            static Position tell(AWS::Xml::Parser<Handler>& sink) {
+                return 0;
+            }
+
+            static void seek(AWS::Xml::Parser<Handler>& sink,
+                const Position& position) {
+                sink.reset();
+            }
+
+            static void flush(AWS::Xml::Parser<Handler>& sink) {}
+        };
+    }
+}
+
+/******************************************************************************
+ * Implementations
+ *****************************************************************************/
+inline std::string AWS::Xml::escape(const std::string& text) {
+    std::string result;
+    result.reserve(text.size());
+    for (std::size_t i = 0; i < text.size(); ++i) {
+        switch (text[i]) {
+            case '&': result += "&amp;"; break;
+            case '<': result += "&lt;"; break;
+            case '>': result += "&gt;"; break;
+            case '"': result += "&quot;"; break;
+            case '\'': result += "&apos;"; break;
+            default: result.push_back(text[i]);
+        }
+    }
+    return result;
+}
+
+inline void AWS::Xml::unescape(const char* data, std::size_t size,
+    std::string& out) {
+    const char* end = data + size;
+    while (data < end) {
+        const char* amp = static_cast<const char*>(
+            std::memchr(data, '&', end - data));
+        if (amp == NULL) {
+            out.append(data, end);
+            return;
+        }
+        out.append(data, amp);
+        const char* semi = static_cast<const char*>(
+            std::memchr(amp, ';', end - amp));
+        if (semi == NULL) {
+            out.append(amp, end);
+            return;
+        }
+
+        std::string entity(amp + 1, semi);
+        if (entity == "amp") {
+            out.push_back('&');
+        } else if (entity == "lt") {
+            out.push_back('<');
+        } else if (entity == "gt") {
+            out.push_back('>');
+        } else if (entity == "quot") {
+            out.push_back('"');
+        } else if (entity == "apos") {
+            out.push_back('\'');
+        } else if (entity.size() > 1 && entity[0] == '#') {
+            /* A character reference, which we encode as UTF-8 */
+            unsigned long code = (entity[1] == 'x') ?
+                std::strtoul(entity.c_str() + 2, NULL, 16) :
+                std::strtoul(entity.c_str() + 1, NULL, 10);
+            if (code < 0x80) {
+                out.push_back(static_cast<char>(code));
+            } else if (code < 0x800) {
+                out.push_back(static_cast<char>(0xC0 | (code >> 6)));
+                out.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+            } else if (code < 0x10000) {
+                out.push_back(static_cast<char>(0xE0 | (code >> 12)));
+                out.push_back(static_cast<char>(0x80 | ((code >> 6) & 0x3F)));
+                out.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+            } else {
+                out.push_back(static_cast<char>(0xF0 | (code >> 18)));
+                out.push_back(static_cast<char>(0x80 | ((code >> 12) & 0x3F)));
+                out.push_back(static_cast<char>(0x80 | ((code >> 6) & 0x3F)));
+                out.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+            }
+        } else {
+            /* Not an entity we know, so it's left alone */
+            out.append(amp, semi + 1);
+        }
+        data = semi + 1;
+    }
+}
+
+template <typename Handler>
+inline bool AWS::Xml::Parser<Handler>::feed(const char* data,
+    std::size_t size) {
+    /* Text and tags are only copied aside when they're split between pieces
+     * of the document. Otherwise, they're dealt with where they are */
+    const char* end = data + size;
+    while (data < end && !failed) {
+        if (!inside) {
+            const char* open = static_cast<const char*>(
+                std::memchr(data, '<', end - data));
+            if (open == NULL) {
+                raw.append(data, end);
+                break;
+            }
+            if (raw.empty()) {
+                unescape(data, open - data, text);
+            } else {
+                raw.append(data, open);
+                unescape(raw.data(), raw.size(), text);
+                raw.clear();
+            }
+            inside = true;
+            data = open + 1;
+        } else {
+            const char* close = static_cast<const char*>(
+                std::memchr(data, '>', end - data));
+            if (close == NULL) {
+                tag.append(data, end);
+                break;
+            }
+            const char* start = data;
+            std::size_t length = close - data;
+            if (!tag.empty()) {
+                tag.append(data, close);
+                start = tag.data();
+                length = tag.size();
+            }
+            data = close + 1;
+
+            /* A '>' in a comment or CDATA doesn't end it */
+            if (length && start[0] == '!' && ((length >= 3 &&
+                std::memcmp(start, "!--", 3) == 0 && (length < 5 ||
+                std::memcmp(start + length - 2, "--", 2) != 0)) ||
+                (length >= 8 && std::memcmp(start, "![CDATA[", 8) == 0 &&
+                (length < 10 ||
+                std::memcmp(start + length - 2, "]]", 2) != 0)))) {
+                if (tag.empty()) {
+                    tag.append(start, length);
+                }
+                tag.push_back('>');
+                continue;
+            }
+            tag_(start, length);
+            tag.clear();
+            inside = false;
+        }
+    }
+    return !failed;
+}
+
+template <typename Handler>
+inline void AWS::Xml::Parser<Handler>::tag_(const char* start,
+    std::size_t length) {
+    if (length == 0) {
+        failed = true;
+        return;
+    }
+
+    if (start[0] == '!') {
+        /* CDATA is text that's taken as it is */
+        if (length >= 10 && std::memcmp(start, "![CDATA[", 8) == 0) {
+            text.append(start + 8, length - 10);
+        }
+        /* Otherwise, it's a doctype or a comment */
+        return;
+    }
+    if (start[0] == '?') {
+        return;
+    }
+
+    /* Any text that came before belongs to whatever element we're in. If
+     * it's only whitespace, it's kept only when it's all the element has */
+    bool closing = (start[0] == '/');
+    bool empty = !closing && (start[length - 1] == '/');
+    if (!text.empty() && ((leaf && closing) ||
+        text.find_first_not_of(" \t\r\n") != std::string::npos)) {
+        handler.text(text);
+    }
+    text.clear();
+    leaf = !closing && !empty;
+
+    const char* end = start + length;
+    const char* begin = closing ? start + 1 : start;
+    const char* stop = begin;
+    while (stop < end && *stop != ' ' && *stop != '/' && *stop != '\t' &&
+        *stop != '\r' && *stop != '\n') {
+        ++stop;
+    }
+    name.assign(begin, stop);
+    if (name.empty()) {
+        failed = true;
+    } else if (closing) {
+        handler.close(name);
+    } else {
+        handler.open(name);
+        if (empty) {
+            handler.close(name);
+        }
+    }
+}
+
+template <typename Handler>
+inline void AWS::Xml::Parser<Handler>::reset() {
+    inside = false;
+    failed = false;
+    leaf = false;
+    raw.clear();
+    text.clear();
+    tag.clear();
+    handler.reset();
+}
+
+#endif